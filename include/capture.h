@@ -0,0 +1,42 @@
+#ifndef __CAPTURE_H
+#define __CAPTURE_H
+
+#include <stdio.h>
+
+/*
+  Air-traffic capture files, as written by fakecsmaradio (every transmitted
+  frame) and by lbard (every frame handed to saw_packet()), and read back by
+  "lbard replay".
+
+  A capture is an 8-byte "LBARDCAP" magic, a 16-bit version and 6 reserved
+  bytes, followed by one record per frame:
+
+    64-bit timestamp (usec since the epoch, or of the virtual clock)
+    16-bit sender (radio number in fakecsmaradio, -1 if unknown)
+    16-bit RSSI (-1 if unknown)
+    16-bit frame length
+    16-bit flags (reserved, zero)
+    the raw frame, including FEC bytes, exactly as it was on the air
+
+  All integers are little-endian.
+*/
+
+#define CAPTURE_MAGIC "LBARDCAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_MAX_FRAME 4096
+
+struct capture_record {
+  long long timestamp_us;
+  int sender;
+  int rssi;
+  int length;
+  unsigned char frame[CAPTURE_MAX_FRAME];
+};
+
+FILE *capture_open_write(char *filename);
+int capture_write(FILE *f,long long timestamp_us,int sender,int rssi,
+		  unsigned char *frame,int length);
+FILE *capture_open_read(char *filename);
+int capture_read(FILE *f,struct capture_record *r);
+
+#endif
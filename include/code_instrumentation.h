@@ -89,7 +89,7 @@
 
 #define LOG_ENTRY_PREFIX \
   { \
-    static int __entranceSentinel##__FUNCTION__ = 0; \
+    static __thread int __entranceSentinel##__FUNCTION__ = 0; /* (per thread) */ \
     if (__entranceSentinel##__FUNCTION__ > 0) \
       LOG_WARN("Recursive call level %d", __entranceSentinel##__FUNCTION__ + 1); \
     ++__entranceSentinel##__FUNCTION__; \
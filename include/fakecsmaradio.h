@@ -15,6 +15,8 @@
 
 int filter_and_enqueue_packet_for_client(int from,int to, long long delivery_time,
 					 uint8_t *packet_in,int packet_len);
+int transmit_packet(int from,long long delivery_time,int transmission_time,
+		    uint8_t *packet,int packet_len);
 long long gettime_ms();
 
 #include "fec-3.0.1/fixed.h"
@@ -32,6 +34,29 @@ extern long long first_transmission_time;
 #define RADIO_HFBARRETT 3
 #define RADIO_REAL 99
 
+// Largest frame after FEC and envelope have been added
+#define RX_PACKET_MAX 320
+
+struct rx_packet {
+  long long start_time;     // when the first bit arrives
+  long long delivery_time;  // when the last bit arrives
+  int colliding;
+  int dropped;
+  int local;                // a response from the radio itself, not off the air
+  int len;
+  unsigned char bytes[RX_PACKET_MAX];
+};
+
+/*
+  Per-pair link properties.  Without a topology file every radio hears every
+  other radio with no delay, and the global packet loss probability.
+*/
+struct link {
+  int reachable;
+  int drop_threshold;   // compared with random(), as for packet_drop_threshold
+  int delay_ms;
+};
+
 struct client {
   int socket;
   int radio_type;
@@ -44,21 +69,48 @@ struct client {
   unsigned char buffer[CLIENT_BUFFER_SIZE];
   int buffer_count;
 
-  // Buffer holding received packet ready for sending when transmission
-  // time actually expires.
-  unsigned char rx_queue[CLIENT_BUFFER_SIZE];
+  // Packets on their way to this radio, held until their transmission
+  // (plus any link delay) has completed.  Kept in no particular order.
+#define RX_QUEUE_DEPTH 32
+  struct rx_packet rx_queue[RX_QUEUE_DEPTH];
   int rx_queue_len;
-  long long rx_embargo;
-  int rx_colission;
-  
+
+  // Radios that can hear this one, from the topology file (or all of them)
+  int *neighbours;
+  int neighbour_count;
+
+  // HF radios are half-duplex: anything arriving before this is lost
+  long long tx_until;
 };
 
 #define MAX_CLIENTS 1024
 extern struct client clients[MAX_CLIENTS];
 extern int client_count;
 
+extern int filter_verbose;
+
 int rfd900_setbitrate(char *b);
+int register_client(int client_socket, int radio_type);
 int release_pending_packets(int i);
+long long next_delivery_time(void);
+long long gettime_us_real();
+int topology_load(char *filename);
+int topology_setup(void);
+extern char *topology_file;
+extern long long rx_delivered_packets;
+extern long long rx_lost_packets;
+extern int (*rx_delivered_hook)(int to,uint8_t *packet,int packet_len);
+int channel_simulation(int radio_count,int seconds,int packetrate,char *topology);
+int enqueue_packet_for_client(int from,int to,long long delivery_time,
+			      uint8_t *packet,int packet_len);
+int enqueue_response_for_client(int to,long long delivery_time,
+				uint8_t *bytes,int len);
+
+extern float hf_airtime_scale;
+extern long long hf_amd_messages_sent;
+int hf_amd_airtime_ms(int chars);
+int hf_start_transmitting(int from,long long until);
+int codan_receive_amd(int from,int to,long long when,char *message);
 
 int rfd900_read_byte(int client,unsigned char byte);
 int hfcodan_read_byte(int client,unsigned char c);
@@ -30,6 +30,15 @@ struct hf_station {
   // (used to condition the selection of which station to talk to.  Basically if we
   // keep failing to connect, then we will be more likely to try other stations first)
   int consecutive_connection_failures;
+
+  // What the call scheduler has learned about this station (see schedule.c):
+  // the SID prefix of the lbard we heard over the last link with it, and how
+  // many bytes per second those links carried.
+  int sid_known;
+  unsigned char sid_prefix_bin[4];
+  float throughput;
+  time_t last_link_time;
+  time_t last_call_time;
 };
 
 #define MAX_HF_STATIONS 1024
@@ -52,6 +61,7 @@ extern int hf_station_count;
 extern struct hf_station self_hf_station;
 
 extern int has_hf_plan;
+extern time_t timeout_call_a_radio_again;
 
 extern time_t last_ready_report_time;
 
@@ -65,8 +75,41 @@ extern int hf_message_sequence_number;
 int hf_radio_check_if_ready(void);
 int hf_radio_mark_ready(void);
 int hf_next_station_to_call(void);
+int hf_schedule_track_link(void);
+int hf_schedule_heard(unsigned char *packet,int len);
+int hf_schedule_sent(int len);
+int hf_schedule_dump(FILE *f);
 int hf_radio_pause_for_turnaround(void);
-int hf_process_fragment(char *fragment);
+int hf_process_fragment(int sender,char *fragment);
+int hf_reassembly_expire(void);
+
+// AMD messages carry at most this many characters, and ALE 3G large blocks
+// this many 8-bit characters
+#define HF_ALE_MESSAGE_CHARS 90
+#define HF_ALE3G_MESSAGE_CHARS 255
+#define HF_FRAGMENT_HEADER_CHARS 3
+#define HF_HEX_FRAGMENT_BYTES 43
+#define HF_MAX_FRAGMENTS 9
+// The pieces of a frame, and perhaps a block ACK in front of them
+#define HF_MAX_MESSAGES (HF_MAX_FRAGMENTS+1)
+int hf_link_has_capability(int capability);
+int hf_use_ascii64(void);
+int hf_use_large_blocks(void);
+int hf_encode_fragments(unsigned char *packet,int len,int radio_type,
+			char fragments[HF_MAX_MESSAGES][HF_ALE3G_MESSAGE_CHARS+1]);
+
+#define HF_FRAME_SINGLE 0
+#define HF_FRAME_MORE 1
+#define HF_FRAME_LAST 2
+int hf_use_burst(void);
+int hf_burst_next_frame(int sequence);
+int hf_burst_take_ack(char *out);
+int hf_radio_frame_sent(void);
+int hf_burst_saw_fragment(void);
+int hf_burst_saw_ack(char *fragment);
+int hf_burst_saw_unacknowledged_frame(void);
+int hf_burst_saw_frame(int sequence);
+int hf_burst_response_timeout(void);
 char *radio_type_name(int radio_type);
 char *radio_type_description(int radio_type);
 char *hf_state_name(int state);
@@ -0,0 +1,55 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2018 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef __IDS_H__
+#define __IDS_H__
+
+/*
+  Interned SIDs and BIDs (see src/rhizome/ids.c).  An ID, or a prefix of one,
+  is interned as binary, and stood for by a small positive integer handle for
+  as long as anyone holds it.  The handle 0 stands for no ID, so that zeroed
+  records hold none.
+*/
+
+#define ID_MAX_BYTES 32
+// The prefixes that go over the air
+#define ID_SID_PREFIX_BYTES 6
+#define ID_BID_PREFIX_BYTES 8
+
+// What a handle can be bound to, with id_bind()
+#define ID_BUNDLE 0  // bundle number, for a BID or BID prefix we hold
+#define ID_PEER 1    // index in peer_records[], for a peer's SID prefix
+#define ID_SENDER 2  // index in sender_names[], for a MeshMB sender
+#define ID_BINDINGS 3
+
+int id_intern(unsigned char *bin,int len);
+int id_find(unsigned char *bin,int len);
+int id_intern_hex(char *hex,int len);
+int id_find_hex(char *hex,int len);
+int id_hold(int id);
+void id_release(int id);
+int id_prefix(int id,int len);
+int id_len(int id);
+unsigned char *id_bin(int id);
+char *id_hex(int id);
+int id_bind(int id,int binding,int value);
+int id_bound(int id,int binding);
+int id_count(void);
+
+#endif
@@ -0,0 +1,74 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2018 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef __INTERFACE_H__
+#define __INTERFACE_H__
+
+#include "rate_control.h"
+
+/*
+  One radio that lbard drives.  The drivers and the transmit path work on
+  the globals of the same names (serialfd, radio_mode, message_update_interval
+  and so on), which radio_interface_select() swaps in and out, so that each
+  radio has its own copy.  MAX_RADIO_INTERFACES is in lbard.h.
+*/
+struct radio_interface {
+  int index;
+  char *port;
+  int fd;
+  int type;
+  int features;
+
+  // What it takes to send a bundle this way (see radio_interface_carries_bundle())
+  int bytes_per_second;
+  long long max_bundle_bytes;
+
+  int message_counter;
+  int message_update_interval;
+  int message_update_interval_randomness;
+  long long next_message_update_time;
+  long long congestion_update_time;
+
+  int transmissions_seen;
+  int transmissions_byus;
+  int frames_missed;
+  long long bytes_sent;
+  long long bytes_heard;
+  int silence_count;
+  int serial_errors;
+
+  // CSMA radios only
+  struct rate_control rate_control;
+  int rate_control_ready;
+};
+
+extern struct radio_interface radio_interfaces[];
+extern int radio_interface_count;
+// The one being worked with, whose state is in the globals
+extern struct radio_interface *radio_interface;
+
+struct peer_state;
+
+int radio_interface_add_ports(char *ports);
+int radio_interface_select(int n);
+int radio_interface_detected(void);
+int radio_interface_send_frame(unsigned char *msg_out);
+int radio_interface_carries_bundle(struct peer_state *p,int bundle);
+
+#endif
@@ -1,4 +1,5 @@
 #include <sys/time.h>
+#include <stdint.h>
 
 #define SYNC_MSG_HEADER_LEN 2
 
@@ -7,8 +8,14 @@
 // and when we implement a better analog modem down the track.
 #define LINK_MTU 200
 
+// Radios driven at once (see src/xfer/interface.c)
+#define MAX_RADIO_INTERFACES 4
+
 extern struct sync_state *sync_state;
 #define SYNC_SALT_LEN 8
+// Memory for the sync trees of all peers, and how long before we evict an idle peer's tree
+#define SYNC_DEFAULT_PEER_BUDGET_KB 4096
+#define SYNC_PEER_IDLE_SECONDS 600
 
 #define SERVALD_STOP "/usr/bin/servald stop"
 #define DEFAULT_BROADCAST_ADDRESSES "10.255.255.255","192.168.2.255","192.168.2.1"
@@ -20,21 +27,15 @@ extern struct sync_state *sync_state;
 #define INITIAL_AVG_PACKET_TX_INTERVAL 1000
 #define INITIAL_PACKET_TX_INTERVAL_RANDOMNESS 250
 
-/* Ideal number of packets per 4 second period.
-   128K air interface with 256 byte (=2K bit) packets = 64 packets per second.
-   But we don't want to go that high for a few reasons:
-   1. It would crash the FTDI serial drivers on Macs (and I develop on one)
-   2. With a simple CSMA protocol, we should aim to keep below 30% channel
-      utilisation to minimise colissions.
-   3. We are likely to have hidden sender problems.
-   4. We don't want to suck too much power.
-
-   So we will aim to keep channel utilisation down around 10%.
-   64 * 10% * 4 seconds = 26 packets per 4 seconds.
+/* How often we transmit on CSMA radios is worked out by rate_control.c,
+   from how busy the channel is.  packetrate=<n> instead aims for n packets
+   per 4 seconds from everyone, as we used to: 128K air interface with
+   256 byte (=2K bit) packets = 64 packets per second, so 26 is around 10%
+   channel utilisation.  channeltarget=<percent> sets the utilisation the
+   controller aims for.
  */
-// 52 = target 20% channel utilisation
-#define TARGET_TRANSMISSIONS_PER_4SECONDS 26
 extern int target_transmissions_per_4seconds;
+extern int target_channel_occupancy;
 
 // BAR consists of:
 // 8 bytes : BID prefix
@@ -60,8 +61,20 @@ struct recent_senders {
   struct recent_sender r[MAX_RECENT_SENDERS];
 };
 
+/* Progress through a bundle body, one bit per 64 byte block, covering the
+   whole body.  A set bit means that block is held.  first_missing is a cursor:
+   every block before it is known to be held. */
+#define PROGRESS_BLOCK_SIZE 64
+struct progress_bitmap {
+  int blocks;
+  int first_missing;
+  uint64_t *words;
+};
+
 struct partial_bundle {
-  // Data from the piece headers for keeping track
+  // Data from the piece headers for keeping track.  bid_prefix is the hex of
+  // the interned prefix, bid_id, or NULL if this slot is free.
+  int bid_id;
   char *bid_prefix;
   long long bundle_version;
 
@@ -72,32 +85,75 @@ struct partial_bundle {
 
   struct segment_list *body_segments;
   int body_length;
+  // For a new version of a journal bundle we already have an older version of,
+  // the length of that older version.  We never ask for, or keep, those bytes:
+  // the body segments start here.
+  int journal_base;
+  // How the body is being sent to us (BODY_CODEC_*).  The body segments and
+  // body_length are of the bytes as sent.
+  int body_codec;
 
   struct recent_senders senders;
 
-  // Request bitmap for body and for manifest
-  int request_bitmap_start;
-  unsigned char request_bitmap[32];
+  // Request bitmap for body (whole bundle) and for manifest
+  struct progress_bitmap body_progress;
   unsigned char request_manifest_bitmap[2];
 };
 
 #define DEFAULT_PEER_KEEPALIVE_INTERVAL 20
 extern int peer_keepalive_interval;
 
+/*
+  A short ID a peer has bound to one (recipient, bundle, version) it is
+  sending, so that its pieces need not repeat the 21 bytes that say which
+  bundle they belong to (see src/messages/piece_slot.c).  The version
+  includes the body codec in its top byte, as for body pieces.
+*/
+struct piece_slot {
+  unsigned char id;
+  unsigned char recipient[2];
+  unsigned char bid_bin[8];
+  long long version;
+};
+#define PIECE_SLOTS_PER_PEER 4
+// 'K' slot binding, and the header of a compact ('h'/'i') and full ('p'/'q')
+// piece below 1MB.  Pieces beyond 1MB carry 2 more offset bytes.
+#define PIECE_SLOT_BINDING_LEN (1+1+2+8+8)
+#define COMPACT_PIECE_HEADER_LEN (1+1+4)
+#define PIECE_HEADER_LEN (1+2+8+8+4)
+
 struct peer_state {
   char *sid_prefix;
   unsigned char sid_prefix_bin[4];
+  // The interned SID prefix, bound (ID_PEER) to our index in peer_records[]
+  int sid_id;
 
   // random 32 bit instance ID, used to work out when LBARD has died and restarted
   // on a peer, so that we can restart the sync process.
   unsigned int instance_id;
+
+  // CAPABILITY_* bits from the peer's last 'C' message
+  unsigned char capabilities;
+
+  // Piece slot we have bound to the bundle we are sending them (0 if none),
+  // and whether they have told us they know it.
+  unsigned char tx_piece_slot;
+  unsigned char tx_piece_slot_bid_bin[8];
+  long long tx_piece_slot_version;
+  int tx_piece_slot_acked;
+  // Piece slots they have bound for the bundles they are sending
+  struct piece_slot rx_piece_slots[PIECE_SLOTS_PER_PEER];
+  int rx_piece_slot_next;
   
   unsigned char *last_message;
   time_t last_message_time;
   // if last_message_time is more than this many seconds ago, then they aren't
   // considered an active peer, and are excluded from rhizome rank calculations
   // and various other things.
-  int last_message_number;
+  // Each of our radios hears a peer separately, and peers number the frames
+  // they send over each radio separately.
+  time_t interface_last_message_time[MAX_RADIO_INTERFACES];
+  int last_message_number[MAX_RADIO_INTERFACES];
 
   time_t last_timestamp_received;
 
@@ -159,10 +215,14 @@ struct peer_state {
      We mark off blocks as we send them, or as we see them TXd by others,
      or as we get an explicit bitmap state sent by the receiver.
      
-     A set bit means that we have received that 64 byte piece. */
+     A set bit means that we have received that 64 byte piece.
+     request_progress_acked is the number of leading blocks the receiver
+     itself has told us it holds, which is where we resume if we run out
+     of blocks we believe are missing. */
   int request_bitmap_bundle;
-  int request_bitmap_offset;
-  unsigned char request_bitmap[32];
+  long long request_bitmap_version;
+  struct progress_bitmap request_progress;
+  int request_progress_acked;
   unsigned char request_manifest_bitmap[2];
 };
 
@@ -179,7 +239,7 @@ struct peer_state {
 struct partial_bundle partials[MAX_BUNDLES_IN_FLIGHT];  
 
 struct recent_bundle {
-  char *bid_prefix;
+  int bid_id;
   long long bundle_version;
   time_t timeout;
 };
@@ -201,6 +261,9 @@ extern long long start_time;
 extern int my_time_stratum;
 extern int radio_transmissions_byus;
 extern int radio_transmissions_seen;
+extern int radio_frames_missed;
+extern long long radio_bytes_sent;
+extern long long radio_bytes_heard;
 extern long long last_message_update_time;
 extern long long next_message_update_time;
 extern long long congestion_update_time;
@@ -221,6 +284,10 @@ struct bundle_record {
   int index; // position in array of bundles
   
   char *service;
+  // The interned BID, and its prefix, both bound (ID_BUNDLE) to index.
+  // bid_hex, sender and recipient are the hex of the interned IDs.
+  int bid_id;
+  int bid_prefix_id;
   char *bid_hex;
   unsigned char bid_bin[32];
   long long version;
@@ -235,6 +302,10 @@ struct bundle_record {
 #endif
   long long length;
   char *filehash;
+  int sender_id;
+  int recipient_id;
+  // The recipient's SID prefix, to compare with peers' sid_id
+  int recipient_prefix_id;
   char *sender;
   char *recipient;
 
@@ -251,6 +322,12 @@ struct bundle_record {
   
   long long last_priority;
   int num_peers_that_dont_have_it;
+
+  // How we send the body of this version, once it has been in the bundle
+  // cache (see bundle_cache_choose_body_codec()).
+  long long wire_version;
+  int wire_length;
+  int body_codec;
 };
 
 // New unified BAR + optional bundle record for BAR tree structure
@@ -321,7 +398,7 @@ extern int bundle_count;
 extern int fresh_bundles[MAX_BUNDLES];
 extern int fresh_bundle_count;
 
-extern char *bid_of_cached_bundle;
+extern int cached_bid_id;
 extern long long cached_version;
 // extern int cached_manifest_len;
 // extern unsigned char *cached_manifest;
@@ -329,12 +406,52 @@ extern int cached_manifest_encoded_len;
 extern unsigned char *cached_manifest_encoded;
 extern int cached_body_len;
 extern unsigned char *cached_body;
+// The body as we send it: either cached_body itself, or compressed
+extern int cached_body_codec;
+extern int cached_body_wire_len;
+extern unsigned char *cached_body_wire;
+
+/*
+  Bundle bodies may be sent compressed.  The codec travels in the top byte of
+  the version field of body pieces and 'L' messages (real versions are never
+  that large), so that pieces of the same bundle sent different ways are never
+  mixed up.  Peers say which codecs they can decode with a 'C' message, and we
+  only compress if every active peer can.
+*/
+#define BODY_CODEC_NONE 0
+#define BODY_CODEC_DEFLATE 1
+#define BODY_CODEC_SHIFT 56
+#define BUNDLE_VERSION_MASK 0x00ffffffffffffffLL
+
+// The largest body we will decompress (the most the bundle cache will hold)
+#define MAX_DECOMPRESSED_BODY_LEN (5*1024*1024)
+
+#define CAPABILITY_BODY_DEFLATE 0x01
+#define CAPABILITY_COMPACT_PIECES 0x02
+#define CAPABILITY_HF_ASCII64 0x04
+#define CAPABILITY_HF_BURST 0x08
+// Only announced when our radio can carry ALE 3G large blocks
+#define CAPABILITY_HF_LARGE_BLOCKS 0x10
+// Understands run-length progress reports ('m'), not just 'M'
+#define CAPABILITY_PROGRESS_RUNS 0x20
+// Can decode second generation binary manifests
+#define CAPABILITY_MANIFEST_V2 0x40
+// Understands journal length reports ('J')
+#define CAPABILITY_JOURNAL_REPORT 0x80
+#define MY_CAPABILITIES (CAPABILITY_BODY_DEFLATE|CAPABILITY_COMPACT_PIECES|CAPABILITY_HF_ASCII64|CAPABILITY_HF_BURST|CAPABILITY_PROGRESS_RUNS|CAPABILITY_MANIFEST_V2|CAPABILITY_JOURNAL_REPORT)
+#define CAPABILITIES_LEN 2
 
 extern unsigned int option_flags;
 #define FLAG_NO_RANDOMIZE_REDIRECT_OFFSET 1
 #define FLAG_NO_RANDOMIZE_START_OFFSET 2
 #define FLAG_NO_BITMAP_PROGRESS 4
 #define FLAG_NO_HARD_LOWER 8
+#define FLAG_NO_MANIFEST_V2 16
+#define FLAG_NO_BODY_COMPRESSION 32
+#define FLAG_NO_COMPACT_PIECES 64
+#define FLAG_NO_HF_ASCII64 128
+#define FLAG_NO_HF_BURST 256
+#define FLAG_NO_HF_LARGE_BLOCKS 512
 
 extern FILE *debug_file;
 extern int debug_bundles;
@@ -376,13 +493,13 @@ extern long long last_servald_contact;
 
 int saw_piece(char *peer_prefix,int for_me,
 	      char *bid_prefix, unsigned char *bid_prefix_bin,
-	      long long version,
+	      long long version,int body_codec,
 	      long long piece_offset,int piece_bytes,int is_end_piece,
 	      int is_manifest_piece,unsigned char *piece,
 
 	      char *prefix, char *servald_server, char *credential);
 int saw_length(char *peer_prefix,char *bid_prefix,long long version,
-	       int body_length);
+	       int body_codec,int body_length);
 int saw_message(unsigned char *msg,int len,int rssi,char *my_sid,
 		char *prefix, char *servald_server,char *credential);
 int load_rhizome_db(int timeout,
@@ -392,13 +509,37 @@ int parse_json_line(char *line,char fields[][8192],int num_fields);
 int rhizome_update_bundle(unsigned char *manifest_data,int manifest_length,
 			  unsigned char *body_data,int body_length,
 			  char *servald_server,char *credential);
+int rhizome_update_bundle_given(unsigned char *manifest_data,int manifest_length,
+				unsigned char *body_data,int body_length,
+				void (*release)(void *context),void *context,
+				char *servald_server,char *credential);
+int rhizome_update_bundle_parts(unsigned char *manifest_data,int manifest_length,
+				unsigned char *body_head,int head_length,
+				unsigned char *body_tail,int tail_length,
+				char *servald_server,char *credential);
+int rhizome_append_journal(unsigned char *manifest_data,int manifest_length,
+			   char *bid_hex,int old_length,
+			   unsigned char *new_bytes,int new_length,
+			   char *servald_server,char *credential);
 int prime_bundle_cache(int bundle_number,char *prefix,
 		       char *servald_server, char *credential);
+int prime_bundle_cache_now(int bundle_number,char *prefix,
+			   char *servald_server, char *credential);
+int bundle_cache_choose_body_codec(int bundle_number);
+int bundle_body_codec(int bundle_number);
+int bundle_wire_length(int bundle_number);
+int body_compress(unsigned char *body,int body_len,
+		  unsigned char **compressed,int *compressed_len);
+int body_decompress(int codec,unsigned char *in,int in_len,
+		    unsigned char *out,int out_len);
 int hex_byte_value(char *hexstring);
 int find_highest_priority_bundle(void);
 int find_highest_priority_bar(void);
 int find_peer_by_prefix(char *peer_prefix);
+int find_peer_by_id(int sid_id);
+int peer_set_record(int i,struct peer_state *p);
 int clear_partial(struct partial_bundle *p);
+int partial_accept_body_codec(struct partial_bundle *p,int body_codec);
 int dump_partial(struct partial_bundle *p);
 int merge_segments(struct segment_list **s);
 int free_peer(struct peer_state *p);
@@ -427,8 +568,21 @@ int http_post_bundle(char *server_and_port, char *auth_token,
 		     unsigned char *manifest_data, int manifest_length,
 		     unsigned char *body_data, int body_length,
 		     int timeout_ms);
+int http_post_bundle_parts(char *server_and_port, char *auth_token,
+			   char *path,
+			   unsigned char *manifest_data, int manifest_length,
+			   unsigned char *body_head, int head_length,
+			   unsigned char *body_tail, int tail_length,
+			   int timeout_ms);
+int http_post_bundle_file_parts(char *server_and_port, char *auth_token,
+				char *path,
+				unsigned char *manifest_data, int manifest_length,
+				FILE *head_file, int head_length,
+				unsigned char *body_tail, int tail_length,
+				int timeout_ms);
 long long gettime_ms(void);
 long long gettime_us(void);
+time_t gettime_s(void);
 int generate_progress_string(struct partial_bundle *partial,
 			     char *progress,int progress_size);
 int show_progress(FILE *f,int verbose);
@@ -449,11 +603,13 @@ long long calculate_bundle_intrinsic_priority(char *bid,
 					      long long length,
 					      long long version,
 					      char *service,
-					      char *recipient,
+					      int recipient_prefix_id,
 					      int insert_failures);
 int bid_to_peer_bundle_index(int peer,char *bid_hex);
 int manifest_extract_bid(unsigned char *manifest_data,char *bid_hex);
 int we_have_this_bundle_or_newer(char *bid_prefix, long long version);
+int bundle_by_id(int bid_id);
+int bundle_by_bid_prefix_hex(char *bid_prefix);
 int register_bundle(char *service,
 		    char *bid,
 		    char *version,
@@ -478,6 +634,9 @@ int rhizome_log(char *service,
 		char *message);
 int manifest_text_to_binary(unsigned char *text_in, int len_in,
 			    unsigned char *bin_out, int *len_out);
+int manifest_text_to_binary_generation(unsigned char *text_in, int len_in,
+				       unsigned char *bin_out, int *len_out,
+				       int max_generation);
 int manifest_binary_to_text(unsigned char *bin_in, int len_in,
 			    unsigned char *text_out, int *len_out);
 int manifest_get_field(unsigned char *manifest, int manifest_len,
@@ -486,6 +645,7 @@ int manifest_get_field(unsigned char *manifest, int manifest_len,
 int monitor_log(char *sender_prefix, char *recipient_prefix,char *msg);
 int bytes_to_prefix(unsigned char *bytes_in,char *prefix_out);
 int saw_timestamp(char *sender_prefix,int stratum, struct timeval *tv);
+struct sockaddr;
 int http_process(struct sockaddr *cliaddr,
 		 char *servald_server,char *credential,
 		 char *my_sid_hex,
@@ -494,6 +654,7 @@ int chartohex(int c);
 int random_active_peer(void);
 int append_bytes(int *offset,int mtu,unsigned char *msg_out,
 		 unsigned char *data,int count);
+int log2ish(int value);
 int sync_tree_receive_message(struct peer_state *p, unsigned char *msg);
 int lookup_bundle_by_sync_key(uint8_t bundle_sync_key[KEY_LEN]);
 int peer_queue_bundle_tx(struct peer_state *p,struct bundle_record *b, int priority);
@@ -525,9 +686,15 @@ int http_meshmb_read(char *server_and_port,
 		     char *id_hex,int timeout_ms);
 
 int sync_setup(void);
+int sync_evict_idle_peers(void);
+int sync_memory_benchmark(int peers,int keys,int missing_percent,int budget_kb);
 int sync_by_tree_stuff_packet(int *offset,int mtu, unsigned char *msg_out,
 			      char *sid_prefix_hex,
 			      char *servald_server,char *credential);
+int sync_announce_bundle_piece(int peer,int *offset,int mtu,
+			       unsigned char *msg,
+			       char *sid_prefix_hex,
+			       char *servald_server, char *credential);
 int sync_tell_peer_we_have_this_bundle(int peer, int bundle);
 int sync_tell_peer_we_have_the_bundle_of_this_partial(int peer, int partial);
 int sync_queue_bundle(struct peer_state *p,int bundle);
@@ -542,6 +709,8 @@ int bundle_calculate_tree_key(sync_key_t *sync_key,
 int dump_bytes(FILE *f,char *msg,unsigned char *bytes,int length);
 int urandombytes(unsigned char *buf, size_t len);
 int active_peer_count(void);
+int peer_is_active(struct peer_state *p);
+int active_peers_have_capability(int capability);
 int sync_dequeue_bundle(struct peer_state *p,int bundle);
 int meshms_parse_command(int argc,char **argv);
 int meshmb_parse_command(int argc,char **argv);
@@ -554,11 +723,10 @@ int http_send_meshms_message(char *server_and_port, char *auth_token,
 			     int timeout_ms);
 int hextochar(int h);
 int peer_queue_list_dump(struct peer_state *p);
-int sync_remember_recently_received_bundle(char *bid_prefix, long long version);
-int sync_is_bundle_recently_received(char *bid_prefix, long long version);
+int sync_remember_recently_received_bundle(int bid_id, long long version);
+int sync_is_bundle_recently_received(int bid_id, long long version);
 int sync_tell_peer_we_have_bundle_by_id(int peer,unsigned char *bid_bin,
 					long long version);
-unsigned char *bid_prefix_hex_to_bin(char *hex);
 int progress_report_bundle_receipts(FILE *f);
 int progress_log_bundle_receipt(char *bid_prefix, long long version);
 
@@ -574,6 +742,7 @@ int lookup_bundle_by_prefix_bin_and_version_or_newer(unsigned char *prefix, long
 
 int radio_set_type(int radio_type);
 int radio_set_feature(int bitmask);
+int radio_has_feature(int bitmask);
 int radio_get_type(void);
 
 int uhf_rfd900_setup(int fd);
@@ -588,9 +757,16 @@ int radio_send_message_codanhf(int serialfd,unsigned char *out, int len);
 int hf_barrett_receive_bytes(unsigned char *bytes,int count);
 int radio_send_message_barretthf(int serialfd,unsigned char *out, int len);
 
+extern FILE *capture_file;
+int replay_capture(char *filename,int passes);
+int rx_benchmark(int iterations);
+int xfer_benchmark(int body_len,int loss_percent,int runs,int journal_held);
 int saw_packet(unsigned char *packet_data,int packet_bytes,int rssi,
 	       char *my_sid_hex,char *prefix,
 	       char *servald_server,char *credential);
+int saw_decoded_packet(unsigned char *packet_data,int packet_bytes,int rssi,
+		       int rs_error_count,char *my_sid_hex,char *prefix,
+		       char *servald_server,char *credential);
 int radio_ready(void);
 int hf_radio_ready(void);
 int hf_radio_pause_for_turnaround(void);
@@ -612,20 +788,35 @@ int partial_update_request_bitmap(struct partial_bundle *p);
 int partial_find_missing_byte(struct segment_list *s,int *isFirstMissingByte);
 int hex_to_val(int c);
 int sync_parse_progress_bitmap(struct peer_state *p,unsigned char *msg,int *offset);
-int dump_progress_bitmap(FILE *f, unsigned char *b,int blocks);
+int progress_bitmap_resize(struct progress_bitmap *b,int blocks);
+int progress_bitmap_free(struct progress_bitmap *b);
+int progress_bitmap_set_range(struct progress_bitmap *b,int first,int count);
+int progress_bitmap_clear_range(struct progress_bitmap *b,int first,int count);
+int progress_bitmap_test(struct progress_bitmap *b,int block);
+int progress_bitmap_next_missing(struct progress_bitmap *b,int from);
+int progress_bitmap_encode(struct progress_bitmap *b,unsigned char *out,int max_len);
+int progress_bitmap_decode(struct progress_bitmap *b,int first_missing,
+			   unsigned char *in,int len);
+int dump_progress_bitmap(FILE *f,struct progress_bitmap *b);
 int peer_update_request_bitmaps_due_to_transmitted_piece(int bundle_number,
 							 int is_manifest,
 							 int start_offset,
 							 int bytes);
 int peer_update_send_point(int peer);
+int peer_reset_request_progress(struct peer_state *p,int bundle_number);
+int peer_request_progress_is_current(struct peer_state *p,int bundle_number);
 int process_ota_bundle(char *bid,char *version);
 int setup_periodic_requests(char *filename);
 int make_periodic_requests(void);
 int lookup_bundle_by_prefix(const unsigned char *prefix,int len);
-int progress_bitmap_translate(struct peer_state *p,int new_body_offset);
 int dump_peer_tx_bitmap(int peer);
+int sync_schedule_journal_report(int peer,int partial);
+int piece_slot_choose(int peer,unsigned char *bid_bin,long long version,int *bind);
+int append_piece_slot_binding(int peer,unsigned char *msg,int *offset);
+int sync_schedule_piece_slot_report(int peer,unsigned char slot,int known);
 int announce_bundle_length(int mtu, unsigned char *msg,int *offset,
-			   unsigned char *bid_bin,long long version,unsigned int length);
+			   unsigned char *bid_bin,long long version,int body_codec,
+			   unsigned int length);
 int append_timestamp(unsigned char *msg_out,int *offset);
 int sync_append_some_bundle_bytes(int bundle_number,int start_offset,int len,
 				  unsigned char *p, int is_manifest,
@@ -635,11 +826,31 @@ int sync_tree_send_message(int *offset,int mtu, unsigned char *msg_out);
 int sync_build_bar_in_slot(int slot,unsigned char *bid_bin,
 			   long long bundle_version);
 int append_generationid(unsigned char *msg_out,int *offset);
+int append_capabilities(unsigned char *msg_out,int *offset);
+
+/* Log-bucketed latency histogram, used to keep per-section timing in
+   timeaccount.c.  Values are in microseconds. */
+#define LATENCY_HISTOGRAM_LINEAR 16
+#define LATENCY_HISTOGRAM_SUBBUCKETS 4
+#define LATENCY_HISTOGRAM_BUCKETS (LATENCY_HISTOGRAM_LINEAR+36*LATENCY_HISTOGRAM_SUBBUCKETS)
+struct latency_histogram {
+  long long count;
+  long long sum;
+  long long max;
+  unsigned int buckets[LATENCY_HISTOGRAM_BUCKETS];
+};
+int latency_histogram_bucket(long long value);
+long long latency_histogram_bucket_limit(int bucket);
+int latency_histogram_record(struct latency_histogram *h, long long value);
+long long latency_histogram_percentile(struct latency_histogram *h, int percent);
 
 int account_time_pause();
 int account_time_resume();
 int account_time(char *source);
 int show_time_accounting(FILE *f);
+int show_time_accounting_json(FILE *f);
+int show_time_accounting_text(FILE *f);
+int http_report_time_accounting(int socket,int json);
 
 int log_rssi(struct peer_state *p,int rssi);
 int log_rssi_timewarp(long long delta);
@@ -653,6 +864,12 @@ int stun_serviceloop(void);
 int autodetect_radio_type(int fd);
 int outernet_rx_setup(char *socket_filename);
 int outernet_rx_serviceloop(void);
+extern unsigned int outernet_rx_spill_bytes;
+extern char *outernet_rx_spill_dir;
 int set_nonblock(int fd);
 
 #include "util.h"
+#include "line_codec.h"
+#include "interface.h"
+#include "threads.h"
+#include "ids.h"
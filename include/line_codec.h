@@ -0,0 +1,45 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2018 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef __LINE_CODEC_H__
+#define __LINE_CODEC_H__
+
+// Encoders NUL-terminate their output and return its length in characters.
+// Decoders return the number of bytes decoded, or -1 if the input is bad
+// or would not fit in out_len bytes.
+int hex_encode(unsigned char *in, char *out, int in_len, int radio_type);
+int hex_decode(char *in, unsigned char *out, int out_len,int radio_type);
+
+char *ascii64_escapes(int radio_type);
+int ascii64_encode(unsigned char *in, char *out, int in_len, int radio_type);
+int ascii64_decode(char *in, unsigned char *out, int out_len,int radio_type);
+
+// Bytes as themselves, except a few that are escaped (for 8-bit ALE messages)
+#define ESCAPE8_CHAR 0x1b
+int escape8_encode(unsigned char *in, char *out, int in_len);
+int escape8_decode(char *in, unsigned char *out, int out_len);
+
+// 7 bytes in 8, with bit 6 of every encoded byte set (for Clover modems)
+#define CLOVER78_ENCODED_LEN(len) (8*(((len)+6)/7))
+int clover78_encode(unsigned char *in, unsigned char *out, int in_len);
+int clover78_decode(unsigned char *in, unsigned char *out, int out_len);
+
+int codec_benchmark(int frame_bytes);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef __METRICS_H
+#define __METRICS_H
+
+#include <stdio.h>
+
+/*
+  Registry of counters, gauges and histograms that the various LBARD modules
+  update, and that is served in plain-text exposition format from /metrics.
+
+  A metric is identified by its name and a label string, e.g.,
+    metric_counter_add("lbard_peer_frames_received_total","peer=\"abcd12\"",1);
+  Labels are passed pre-formatted (or NULL for none), so that the registry
+  does not need to know anything about peers or radios.
+*/
+
+#define METRIC_COUNTER 1
+#define METRIC_GAUGE 2
+#define METRIC_HISTOGRAM 3
+
+#define MAX_METRIC_FAMILIES 64
+#define MAX_METRIC_SERIES 4096
+#define MAX_METRIC_LABELS_LEN 96
+
+int metric_describe(char *name,int type,char *help);
+int metric_counter_add(char *name,char *labels,long long delta);
+int metric_counter_set(char *name,char *labels,long long value);
+int metric_gauge_set(char *name,char *labels,long long value);
+int metric_histogram_observe(char *name,char *labels,long long value);
+int metrics_forget_labels(char *labels);
+
+char *metric_radio_label(void);
+char *metric_peer_label(char *sid_prefix);
+
+int metrics_write_text(FILE *f);
+int http_report_metrics(int socket);
+
+#endif
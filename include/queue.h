@@ -0,0 +1,64 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2018 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef __QUEUE_H__
+#define __QUEUE_H__
+
+/*
+  Bounded lock-free queues, for handing work between lbard's threads (see
+  src/xfer/threads.c).  Each has a power of two number of slots of a fixed
+  size, allocated up front, and items are copied in and out.  Nothing
+  blocks: pushing to a full queue, or popping from an empty one, returns -1.
+*/
+
+#define QUEUE_CACHE_LINE 64
+
+// One thread pushes, one other thread pops
+struct spsc_queue {
+  unsigned int mask;
+  int item_bytes;
+  unsigned char *items;
+  // Each end's index on a cache line of its own
+  unsigned int head __attribute__((aligned(QUEUE_CACHE_LINE)));
+  unsigned int tail __attribute__((aligned(QUEUE_CACHE_LINE)));
+};
+
+// Any number of threads push, one pops
+struct mpsc_queue {
+  unsigned int mask;
+  int item_bytes;
+  unsigned char *items;
+  // Which lap of the ring each slot is ready for
+  unsigned int *sequence;
+  unsigned int head __attribute__((aligned(QUEUE_CACHE_LINE)));
+  unsigned int tail __attribute__((aligned(QUEUE_CACHE_LINE)));
+};
+
+int spsc_queue_init(struct spsc_queue *q,int slots,int item_bytes);
+int spsc_queue_free(struct spsc_queue *q);
+int spsc_queue_push(struct spsc_queue *q,void *item);
+int spsc_queue_pop(struct spsc_queue *q,void *item);
+int spsc_queue_length(struct spsc_queue *q);
+
+int mpsc_queue_init(struct mpsc_queue *q,int slots,int item_bytes);
+int mpsc_queue_free(struct mpsc_queue *q);
+int mpsc_queue_push(struct mpsc_queue *q,void *item);
+int mpsc_queue_pop(struct mpsc_queue *q,void *item);
+
+#endif
@@ -0,0 +1,57 @@
+/*
+Serval Low-Bandwidth Rhizome Transport
+Copyright (C) 2015 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef __RATE_CONTROL_H__
+#define __RATE_CONTROL_H__
+
+// How often the rate is revised
+#define RATE_CONTROL_WINDOW_MS 4000
+
+// What a CSMA radio saw in one window
+struct rate_control_window {
+  int window_ms;
+  int frames_sent;
+  int frames_heard;
+  // Gaps in the message numbers of the peers we heard
+  int frames_missed;
+  long long bytes_sent;
+  long long bytes_heard;
+  int active_peers;
+};
+
+struct rate_control {
+  // packetrate=: aim for this many frames per 4 seconds on the channel, as
+  // we used to, rather than adapting.  0 to adapt.
+  int fixed_target;
+  // Share of airtime to aim for, in percent
+  int target_occupancy;
+
+  double rate;
+  double occupancy;
+  double loss;
+
+  // What to wait between frames: interval_ms + random()%randomness_ms
+  int interval_ms;
+  int randomness_ms;
+};
+
+int rate_control_init(struct rate_control *rc,int fixed_target,int target_occupancy);
+int rate_control_update(struct rate_control *rc,struct rate_control_window *w);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef __RS_ERASURE_H
+#define __RS_ERASURE_H
+
+/*
+  Systematic Reed-Solomon erasure code over GF(2^8).
+
+  A zone of k equal-sized data shards is protected by m parity shards, and
+  any k of the k+m shards are enough to recover the data.  The parity rows
+  of the generator matrix form a Cauchy matrix, so every k x k selection of
+  the rows of [I;C] is invertible.
+
+  Shards are numbered 0..k-1 for data, then k..k+m-1 for parity.
+*/
+
+#define RS_ERASURE_MAX_SHARDS 64
+
+struct rs_erasure {
+  int k;
+  int m;
+  // parity[i][j] is the coefficient of data shard j in parity shard i
+  unsigned char parity[RS_ERASURE_MAX_SHARDS][RS_ERASURE_MAX_SHARDS];
+};
+
+int rs_erasure_init(struct rs_erasure *c,int k,int m);
+int rs_erasure_encode(struct rs_erasure *c,unsigned char **data,
+		      unsigned char **parity,int len);
+int rs_erasure_decode(struct rs_erasure *c,unsigned char **shards,
+		      unsigned long long present,int len);
+
+// dst ^= c * src, over len bytes
+void gf256_mul_add_region(unsigned char *dst,unsigned char *src,
+			  unsigned char c,int len);
+
+int fec_benchmark(int k,int m,int shard_bytes);
+
+#endif
@@ -2,6 +2,7 @@
 #define __SYNC_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 /*
 Synchronize two sets of keys, which are likely to contain many common values
@@ -26,6 +27,10 @@ void sync_free_state(struct sync_state *state);
 
 // throw away all state related to peer
 void sync_free_peer_state(struct sync_state *state, void *peer_context);
+// throw away the state of every peer for which evict() returns true, returns how many
+unsigned sync_evict_peers(struct sync_state *state, int (*evict)(void *peer_context));
+// cap the bytes used by all peer trees, evicting the peers we heard from longest ago (0 for no cap)
+void sync_set_peer_budget(struct sync_state *state, size_t bytes);
 
 // tell the sync process that we now have key, with callback context
 // if the key is already present, the context will be updated
@@ -39,5 +44,21 @@ size_t sync_build_message(struct sync_state *state, uint8_t *buff, size_t len);
 // process a message received from a peer.
 int sync_recv_message(struct sync_state *state, void *peer_context, const uint8_t *buff, size_t len);
 
+// counters describing how the sync process is going, for monitoring
+struct sync_stats{
+  unsigned key_count;
+  unsigned peer_count;
+  unsigned sent_root;
+  unsigned sent_messages;
+  unsigned sent_record_count;
+  unsigned received_record_count;
+  unsigned received_uninteresting;
+  // bytes held for all peers, and for the peer with the most
+  size_t peer_bytes;
+  size_t peer_bytes_max;
+  unsigned peer_evictions;
+};
+void sync_get_stats(const struct sync_state *state, struct sync_stats *stats);
+
 
 #endif
@@ -0,0 +1,59 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2018 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef __THREADS_H__
+#define __THREADS_H__
+
+// Servald workers in threaded mode, or 0 to do everything in the main loop
+extern int lbard_threads;
+
+#define THREADS_DEFAULT_SERVALD_WORKERS 2
+#define THREADS_MAX_SERVALD_WORKERS 16
+
+/*
+  A request to servald, made on one of the workers.  run() is called on the
+  worker, and then done() back on the main loop, which owns the job and
+  must free it.  Jobs embed this as their first member.
+*/
+struct servald_job {
+  int (*run)(struct servald_job *job);
+  int (*done)(struct servald_job *job);
+  int result;
+};
+
+int threads_start(int servald_workers);
+int threads_stop(void);
+int threads_on_radio_thread(void);
+int threads_reading_radio(void);
+int threads_on_servald_worker(void);
+int threads_servald_async(void);
+
+int radio_lock(void);
+int radio_unlock(void);
+
+int threads_queue_frame(unsigned char *packet,int len,int rssi,int rs_errors);
+int threads_poll(void);
+int threads_wait_us(long long duration_us);
+int servald_submit(struct servald_job *job);
+
+long long threads_frames_dropped(void);
+
+int thread_benchmark(int frames,int servald_delay_ms,int servald_workers);
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef __VIRTUALTIME_H
+#define __VIRTUALTIME_H
+
+/*
+  Shared virtual clock for discrete-event simulation runs.
+
+  fakecsmaradio creates the clock in a small shared file (named by the
+  LBARD_VIRTUAL_CLOCK environment variable), and every lbard instance that
+  sees the same variable attaches to it as a participant.  While attached,
+  gettime_ms(), gettime_us() and gettime_s() return virtual time.
+
+  Participants never sleep in real time.  Instead they announce the virtual
+  time at which they next want to run, and block until either that time
+  arrives or one of their radios has input waiting.  The controller (fakecsmaradio)
+  only moves the clock forward when every participant is waiting, and it has
+  itself seen no activity since they started waiting.  It then jumps straight
+  to the earliest pending wake-up or packet delivery.
+
+  The epoch counter is bumped by the controller whenever it writes to a
+  radio.  A participant records the epoch at which it went idle, so an idle
+  declaration made before a delivery is never mistaken for real idleness.
+*/
+
+#define VIRTUAL_CLOCK_MAGIC 0x4c425654
+#define VIRTUAL_CLOCK_MAX_PARTICIPANTS 256
+
+// All runs begin at 2020-01-01 00:00:00 UTC, so that logs and protocol
+// timestamps are identical from one run to the next.
+#define VIRTUAL_CLOCK_START_US (1577836800LL*1000000LL)
+
+struct virtual_clock_participant {
+  volatile int pid;
+  volatile int idle;
+  volatile unsigned int idle_epoch;
+  volatile long long wake_time_us;
+};
+
+struct virtual_clock {
+  unsigned int magic;
+  unsigned int seed;
+  volatile long long now_us;
+  volatile unsigned int epoch;
+  int expected_participants;
+  struct virtual_clock_participant participants[VIRTUAL_CLOCK_MAX_PARTICIPANTS];
+};
+
+extern struct virtual_clock *virtual_clock;
+
+// Controller side
+int virtual_clock_create(char *path,int expected_participants,unsigned int seed);
+int virtual_clock_note_activity(void);
+int virtual_clock_all_idle(long long *next_wake_us);
+int virtual_clock_advance_to(long long when_us);
+
+// Participant side
+int virtual_clock_attach(char *path,char *identity);
+void virtual_clock_detach(void);
+int virtual_clock_sleep_us(long long duration_us,int *fds,int fd_count);
+
+long long virtual_clock_now_us(void);
+
+#endif
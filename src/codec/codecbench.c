@@ -0,0 +1,211 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2018 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Line codec test and benchmark.  First every codec is fed random frames of
+  every length up to 256 bytes, with runs of the bytes most likely to need
+  escaping mixed in, and each must decode to what went in, using only the
+  characters it is allowed to send.  Clover 7:8 is also checked bit for bit
+  against a simple implementation of the layout.  Then each codec encodes
+  and decodes frames of the given size for half a second each way, and the
+  throughput is reported in MB of unencoded data per second.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "sync.h"
+#include "lbard.h"
+#include "radios.h"
+#include "line_codec.h"
+
+#define CODECBENCH_MAX_FRAME 256
+#define CODECBENCH_FUZZ_ROUNDS 200
+
+struct codecbench_codec {
+  char *name;
+  int radio_type;
+  // Encoded form of in_len bytes, as NUL-terminated text, except for 7:8
+  int (*encode)(struct codecbench_codec *c,unsigned char *in,unsigned char *out,int in_len);
+  int (*decode)(struct codecbench_codec *c,unsigned char *in,int in_len,
+		unsigned char *out,int out_len);
+  // Characters it may send
+  int (*allowed)(struct codecbench_codec *c,unsigned char ch);
+};
+
+static int codecbench_hex_encode(struct codecbench_codec *c,unsigned char *in,
+				 unsigned char *out,int in_len)
+{ return hex_encode(in,(char *)out,in_len,c->radio_type); }
+static int codecbench_hex_decode(struct codecbench_codec *c,unsigned char *in,int in_len,
+				 unsigned char *out,int out_len)
+{ return hex_decode((char *)in,out,out_len,c->radio_type); }
+static int codecbench_hex_allowed(struct codecbench_codec *c,unsigned char ch)
+{ return (ch>='0'&&ch<='9')||(ch>='A'&&ch<='F'); }
+
+static int codecbench_ascii64_encode(struct codecbench_codec *c,unsigned char *in,
+				     unsigned char *out,int in_len)
+{ return ascii64_encode(in,(char *)out,in_len,c->radio_type); }
+static int codecbench_ascii64_decode(struct codecbench_codec *c,unsigned char *in,int in_len,
+				     unsigned char *out,int out_len)
+{ return ascii64_decode((char *)in,out,out_len,c->radio_type); }
+static int codecbench_ascii64_allowed(struct codecbench_codec *c,unsigned char ch)
+{
+  if (ch=='\\') return 1;
+  if (strchr(ascii64_escapes(c->radio_type),ch)) return 0;
+  return (ch>=0x20)&&(ch<=0x5f);
+}
+
+static int codecbench_escape8_encode(struct codecbench_codec *c,unsigned char *in,
+				     unsigned char *out,int in_len)
+{ return escape8_encode(in,(char *)out,in_len); }
+static int codecbench_escape8_decode(struct codecbench_codec *c,unsigned char *in,int in_len,
+				     unsigned char *out,int out_len)
+{ return escape8_decode((char *)in,out,out_len); }
+static int codecbench_escape8_allowed(struct codecbench_codec *c,unsigned char ch)
+{ return !strchr("\x08\n\r\x11\x13\x15\"\x7f",ch); }
+
+static int codecbench_clover78_encode(struct codecbench_codec *c,unsigned char *in,
+				      unsigned char *out,int in_len)
+{ return clover78_encode(in,out,in_len); }
+static int codecbench_clover78_decode(struct codecbench_codec *c,unsigned char *in,int in_len,
+				      unsigned char *out,int out_len)
+{ return clover78_decode(in,out,out_len); }
+static int codecbench_clover78_allowed(struct codecbench_codec *c,unsigned char ch)
+{ return ch&0x40; }
+
+struct codecbench_codec codecbench_codecs[]={
+  {"hex",RADIOTYPE_HFCODAN,
+   codecbench_hex_encode,codecbench_hex_decode,codecbench_hex_allowed},
+  {"ASCII-64 (Codan)",RADIOTYPE_HFCODAN,
+   codecbench_ascii64_encode,codecbench_ascii64_decode,codecbench_ascii64_allowed},
+  {"ASCII-64 (Barrett)",RADIOTYPE_HFBARRETT,
+   codecbench_ascii64_encode,codecbench_ascii64_decode,codecbench_ascii64_allowed},
+  {"8-bit escaped",RADIOTYPE_HFCODAN,
+   codecbench_escape8_encode,codecbench_escape8_decode,codecbench_escape8_allowed},
+  {"Clover 7:8",RADIOTYPE_HF2020,
+   codecbench_clover78_encode,codecbench_clover78_decode,codecbench_clover78_allowed},
+  {NULL}
+};
+
+static long long codecbench_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1000000000LL+ts.tv_nsec;
+}
+
+static void codecbench_random_frame(unsigned char *frame,int len)
+{
+  const unsigned char awkward[]={0x00,0x0a,0x0d,0x1b,0x20,0x22,0x5c,0x7f,0x80,0x91,0xff};
+  for(int i=0;i<len;i++)
+    frame[i]=(random()&3)?random():awkward[random()%sizeof(awkward)];
+}
+
+// 7:8 as the comment in line_codec.c describes it, one bit at a time
+static void codecbench_clover78_reference(unsigned char *in,unsigned char *out,int in_len)
+{
+  for(int i=0;i<in_len;i+=7,out+=8) {
+    unsigned char group[7]={0};
+    for(int j=0;j<7&&i+j<in_len;j++) group[j]=in[i+j];
+    for(int k=0;k<8;k++) {
+      out[k]=0x40;
+      for(int j=0;j<6;j++) out[k]|=((group[j]>>k)&1)<<j;
+      out[k]|=((group[6]>>k)&1)<<7;
+    }
+  }
+}
+
+static int codecbench_fuzz(struct codecbench_codec *c)
+{
+  unsigned char frame[CODECBENCH_MAX_FRAME];
+  unsigned char encoded[CODECBENCH_MAX_FRAME*4+1];
+  unsigned char decoded[CODECBENCH_MAX_FRAME+1];
+  unsigned char reference[CODECBENCH_MAX_FRAME*2];
+  int failures=0;
+
+  for(int round=0;round<CODECBENCH_FUZZ_ROUNDS;round++)
+    for(int len=0;len<=CODECBENCH_MAX_FRAME;len++) {
+      int failed=0;
+      codecbench_random_frame(frame,len);
+      int elen=c->encode(c,frame,encoded,len);
+      for(int i=0;i<elen;i++)
+	if (!c->allowed(c,encoded[i])) failed=1;
+      if (c->encode==codecbench_clover78_encode) {
+	codecbench_clover78_reference(frame,reference,len);
+	if ((elen!=CLOVER78_ENCODED_LEN(len))||memcmp(reference,encoded,elen)) failed=1;
+      }
+      int dlen=c->decode(c,encoded,elen,decoded,len);
+      if ((dlen!=len)||memcmp(frame,decoded,len)) failed=1;
+      // Decoders must not write past the space they are given
+      if (len&&(c->decode(c,encoded,elen,decoded,len-1)>=len)) failed=1;
+      if (failed&&!failures)
+	printf("FAIL: %s does not round-trip a %d byte frame\n",c->name,len);
+      failures+=failed;
+    }
+  return failures;
+}
+
+int codec_benchmark(int frame_bytes)
+{
+  if (frame_bytes<1||frame_bytes>CODECBENCH_MAX_FRAME) {
+    fprintf(stderr,"Frames must be 1 to %d bytes\n",CODECBENCH_MAX_FRAME);
+    return -1;
+  }
+
+  unsigned char frame[CODECBENCH_MAX_FRAME];
+  unsigned char encoded[CODECBENCH_MAX_FRAME*4+1];
+  unsigned char decoded[CODECBENCH_MAX_FRAME+1];
+  int failures=0;
+  srandom(1);
+
+  printf("Line codecs, %d byte frames\n",frame_bytes);
+  for(struct codecbench_codec *c=codecbench_codecs;c->name;c++) {
+    failures+=codecbench_fuzz(c);
+
+    codecbench_random_frame(frame,frame_bytes);
+    int elen=0;
+    long long frames=0;
+    long long start=codecbench_ns(),elapsed;
+    do {
+      for(int i=0;i<1000;i++) elen=c->encode(c,frame,encoded,frame_bytes);
+      frames+=1000;
+      elapsed=codecbench_ns()-start;
+    } while(elapsed<500000000LL);
+    double encode_rate=frames*frame_bytes*1000.0/elapsed;
+
+    frames=0;
+    start=codecbench_ns();
+    do {
+      for(int i=0;i<1000;i++)
+	if (c->decode(c,encoded,elen,decoded,frame_bytes)!=frame_bytes) failures++;
+      frames+=1000;
+      elapsed=codecbench_ns()-start;
+    } while(elapsed<500000000LL);
+    double decode_rate=frames*frame_bytes*1000.0/elapsed;
+
+    printf("%-20s encode: %8.1f MB/s, decode: %8.1f MB/s, %5.1f%% larger\n",
+	   c->name,encode_rate,decode_rate,(elen-frame_bytes)*100.0/frame_bytes);
+  }
+
+  if (failures) printf("FAIL: %d frames did not round-trip correctly\n",failures);
+  return failures?-1:0;
+}
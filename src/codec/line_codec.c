@@ -0,0 +1,282 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2018 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  The encodings used to get packets through radios that can't carry
+  arbitrary bytes: hex and ASCII-64 for HF ALE messages, escaped 8-bit for
+  ALE 3G messages, and 7:8 for Clover modems.  Everything is done by table
+  lookup, or for 7:8 by shuffling bits a 64-bit word at a time, as these
+  sit on the path of every packet.  They are checked, and timed, by
+  `lbard codecbench` (see codecbench.c).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+
+#include "sync.h"
+#include "lbard.h"
+#include "radios.h"
+#include "line_codec.h"
+
+static char hex_pairs[256][2];
+// Value of each hex digit, or 0xff
+static unsigned char hex_values[256];
+
+/*
+  ASCII-64 value of each character, or 0xff, and for each set of escapes,
+  1 + the position of each character in it, or 0 if it goes as itself.
+*/
+static unsigned char ascii64_values[256];
+static unsigned char ascii64_escape_codan[256];
+static unsigned char ascii64_escape_other[256];
+
+static unsigned char escape8_needed[256];
+
+static int line_codec_ready=0;
+
+static void line_codec_init(void)
+{
+  const char *digits="0123456789ABCDEF";
+  for(int b=0;b<256;b++) {
+    hex_pairs[b][0]=digits[b>>4];
+    hex_pairs[b][1]=digits[b&0xf];
+  }
+  memset(hex_values,0xff,sizeof(hex_values));
+  for(int v=0;v<16;v++) {
+    hex_values[(unsigned char)digits[v]]=v;
+    if (v>=10) hex_values['a'+v-10]=v;
+  }
+
+  memset(ascii64_values,0xff,sizeof(ascii64_values));
+  for(int c=0x20;c<=0x5f;c++) ascii64_values[c]=c-0x20;
+  char *e=ascii64_escapes(RADIOTYPE_HFCODAN);
+  for(int i=0;e[i];i++) ascii64_escape_codan[(unsigned char)e[i]]=i+1;
+  e=ascii64_escapes(RADIOTYPE_HFBARRETT);
+  for(int i=0;e[i];i++) ascii64_escape_other[(unsigned char)e[i]]=i+1;
+
+  const unsigned char escaped8[]={0x00,0x08,'\n','\r',0x11,0x13,0x15,ESCAPE8_CHAR,'"',0x7f};
+  for(int i=0;i<sizeof(escaped8);i++) escape8_needed[escaped8[i]]=1;
+
+  line_codec_ready=1;
+}
+
+int hex_encode(unsigned char *in, char *out, int in_len, int radio_type)
+{
+  if (!line_codec_ready) line_codec_init();
+  for(int i=0;i<in_len;i++) memcpy(&out[i*2],hex_pairs[in[i]],2);
+  out[in_len*2]=0;
+  return in_len*2;
+}
+
+// Stops at the end of the string, or at an odd character left over
+int hex_decode(char *in, unsigned char *out, int out_len, int radio_type)
+{
+  if (!line_codec_ready) line_codec_init();
+  int n=0;
+  for(;in[0]&&in[1];in+=2) {
+    unsigned char hi=hex_values[(unsigned char)in[0]];
+    unsigned char lo=hex_values[(unsigned char)in[1]];
+    if ((hi|lo)&0xf0) return -1;
+    if (n>=out_len) return -1;
+    out[n++]=(hi<<4)|lo;
+  }
+  if (n<out_len) out[n]=0;
+  return n;
+}
+
+/*
+  ASCII-64 is used by HF ALE radio links.  It is just ASCII codes 0x20 - 0x5f,
+  so we can carry 6 bits per character, i.e., 3 bytes in 4 characters, where
+  hex needs 6.  A final group of 1 or 2 bytes takes 2 or 3 characters.
+
+  Some characters can't be sent, or can't be told apart when received, by
+  some vendors' radios.  These are escaped as '\\' followed by '0' + the
+  position of the character in the escape list for the sending radio type.
+  A Codan receiver can't take '"' or spaces in an AMD message, whatever
+  radio sent it, and '\\' is our escape character, so every radio type
+  escapes all three.  Barrett keeps its list in the order it had before it
+  escaped spaces, so that '\\0' and '\\1' mean what they always have.
+*/
+char *ascii64_escapes(int radio_type)
+{
+  if (radio_type==RADIOTYPE_HFCODAN) return " \"\\";
+  return "\"\\ ";
+}
+
+int ascii64_encode(unsigned char *in, char *out, int in_len, int radio_type)
+{
+  if (!line_codec_ready) line_codec_init();
+  unsigned char *escape=(radio_type==RADIOTYPE_HFCODAN)?
+    ascii64_escape_codan:ascii64_escape_other;
+  int out_ofs=0;
+  for(int i=0;i<in_len;i+=3) {
+    // Encode 3 bytes using 4 characters (or fewer at the end)
+    uint32_t v=in[i];
+    int chars=4;
+    if (i+2<in_len) v|=(in[i+1]<<8)|(in[i+2]<<16);
+    else if (i+1<in_len) { v|=in[i+1]<<8; chars=3; }
+    else chars=2;
+    for(int j=0;j<chars;j++,v>>=6) {
+      unsigned char c=0x20+(v&0x3f);
+      if (escape[c]) {
+	out[out_ofs++]='\\';
+	out[out_ofs++]='0'+escape[c]-1;
+      } else
+	out[out_ofs++]=c;
+    }
+  }
+  out[out_ofs]=0;
+  return out_ofs;
+}
+
+int ascii64_decode(char *in, unsigned char *out, int out_len, int radio_type)
+{
+  if (!line_codec_ready) line_codec_init();
+  char *escapes=ascii64_escapes(radio_type);
+  int escape_count=strlen(escapes);
+  int out_ofs=0;
+  uint32_t v=0;
+  int n=0;
+
+  while (*in) {
+    unsigned char c=*in++;
+    if (c=='\\') {
+      if ((*in<'0')||(*in>='0'+escape_count)) return -1;
+      c=escapes[*in++-'0'];
+    }
+    unsigned char value=ascii64_values[c];
+    if (value==0xff) return -1;
+    v|=value<<(6*n);
+    if (++n==4) {
+      if (out_ofs+3>out_len) return -1;
+      out[out_ofs++]=v;
+      out[out_ofs++]=v>>8;
+      out[out_ofs++]=v>>16;
+      v=0; n=0;
+    }
+  }
+
+  // Partial group at the end
+  if (n==1) return -1;
+  if (n&&(out_ofs+n-1>out_len)) return -1;
+  if (n>=2) out[out_ofs++]=v;
+  if (n==3) out[out_ofs++]=v>>8;
+  return out_ofs;
+}
+
+/*
+  Bytes go as themselves in 8-bit messages, except for those that end or
+  edit a line, or stop the serial port, or end the quoted message in the
+  radio's report of it.  Those are sent as ESCAPE8_CHAR and the byte XOR 0x40.
+  Random bytes grow by about 4%.
+*/
+int escape8_encode(unsigned char *in, char *out, int in_len)
+{
+  if (!line_codec_ready) line_codec_init();
+  int out_ofs=0;
+  for(int i=0;i<in_len;i++) {
+    if (escape8_needed[in[i]]) {
+      out[out_ofs++]=ESCAPE8_CHAR;
+      out[out_ofs++]=in[i]^0x40;
+    } else
+      out[out_ofs++]=in[i];
+  }
+  out[out_ofs]=0;
+  return out_ofs;
+}
+
+int escape8_decode(char *in, unsigned char *out, int out_len)
+{
+  int n=0;
+  for(int i=0;in[i];i++) {
+    if (n>=out_len) return -1;
+    if (in[i]==ESCAPE8_CHAR) {
+      if (!in[i+1]) return -1;
+      out[n++]=in[++i]^0x40;
+    } else out[n++]=in[i];
+  }
+  return n;
+}
+
+/*
+  Clover 7:8 encoding: each group of 7 bytes b0..b6 is sent as 8 bytes, of
+  which byte k holds bit k of b0..b5 in bits 0-5, a 1 in bit 6, and bit k of
+  b6 in bit 7.  Bit 6 being set keeps every byte clear of the modem's
+  escape characters (0x80 and 0x91), and means data can't be mistaken for
+  the trailer of our envelope, whose 0xAA and length bytes have it clear.
+  A final group of fewer than 7 bytes is padded with zeroes.
+
+  That is the transpose of the 8x8 bit matrix whose rows are b0..b5, 0xFF
+  and b6, and as transposing twice gives back what you started with,
+  decoding is the same operation.  It is done with three rounds of swapping
+  bits within a 64-bit word (Hacker's Delight, 7-3).
+*/
+static uint64_t clover78_transpose(uint64_t x)
+{
+  uint64_t t;
+  t=(x^(x>>7))&0x00AA00AA00AA00AAULL;  x^=t^(t<<7);
+  t=(x^(x>>14))&0x0000CCCC0000CCCCULL; x^=t^(t<<14);
+  t=(x^(x>>28))&0x00000000F0F0F0F0ULL; x^=t^(t<<28);
+  return x;
+}
+
+static uint64_t clover78_load(unsigned char *p)
+{
+  // Rows 0-7 are bytes 0-7 of the word, whatever the host byte order
+  uint64_t x=0;
+  for(int r=7;r>=0;r--) x=(x<<8)|p[r];
+  return x;
+}
+
+static void clover78_store(uint64_t x,unsigned char *p)
+{
+  for(int r=0;r<8;r++,x>>=8) p[r]=x;
+}
+
+int clover78_encode(unsigned char *in, unsigned char *out, int in_len)
+{
+  int out_ofs=0;
+  for(int i=0;i<in_len;i+=7) {
+    unsigned char rows[8]={0,0,0,0,0,0,0xff,0};
+    int bytes=(in_len-i<7)?in_len-i:7;
+    memcpy(rows,&in[i],bytes<6?bytes:6);
+    if (bytes==7) rows[7]=in[i+6];
+    clover78_store(clover78_transpose(clover78_load(rows)),&out[out_ofs]);
+    out_ofs+=8;
+  }
+  return out_ofs;
+}
+
+// Decodes out_len bytes from CLOVER78_ENCODED_LEN(out_len) bytes at in
+int clover78_decode(unsigned char *in, unsigned char *out, int out_len)
+{
+  for(int i=0;i<out_len;i+=7,in+=8) {
+    unsigned char rows[8];
+    clover78_store(clover78_transpose(clover78_load(in)),rows);
+    // Bit 6 of every byte, i.e., row 6, must be set
+    if (rows[6]!=0xff) return -1;
+    int bytes=(out_len-i<7)?out_len-i:7;
+    memcpy(&out[i],rows,bytes<6?bytes:6);
+    if (bytes==7) out[i+6]=rows[7];
+  }
+  return out_len;
+}
@@ -184,7 +184,7 @@ int hf2020_process_barrett_line(int serialfd,char *l)
   if ((!strcmp(l,"EV00"))&&(hf_state==HF_CALLREQUESTED)) {
     // Syntax error in our request to call.
     printf("Saw EV00 response. Marking call disconnected.\n");
-    hf_next_call_time=time(0); //AXLINK failed, no call have been tried
+    hf_next_call_time=gettime_s(); //AXLINK failed, no call have been tried
     hf_may_defer=1;
     hf_link_partner=-1;
     hf_state = HF_DISCONNECTED;
@@ -193,7 +193,7 @@ int hf2020_process_barrett_line(int serialfd,char *l)
   if ((!strcmp(l,"E0"))&&(hf_state==HF_CALLREQUESTED)) {
     // Syntax error in our request to call.
     printf("Saw E0 response. Marking call disconnected.\n");
-    hf_next_call_time=time(0); //AXLINK failed, no call have been tried
+    hf_next_call_time=gettime_s(); //AXLINK failed, no call have been tried
     hf_may_defer=1;
     hf_link_partner=-1;
     hf_state = HF_DISCONNECTED;
@@ -266,7 +266,7 @@ int hf2020_process_barrett_line(int serialfd,char *l)
 	  // So mark us as connecting, so we can time out, and don't try to call anyone else just yet.
 
 	  hf_state=HF_CONNECTING;
-	  hf_connecting_timeout=time(0)+30+(random()%30);
+	  hf_connecting_timeout=gettime_s()+30+(random()%30);
 	}
 	break; 
       }
@@ -277,14 +277,14 @@ int hf2020_process_barrett_line(int serialfd,char *l)
       // We leave it connected for a while, to allow the other side to establish a
       // Clover call.
       hf_state=HF_CONNECTING;
-      hf_connecting_timeout=time(0)+30+(random()%30);
+      hf_connecting_timeout=gettime_s()+30+(random()%30);
     } 
 
     if ((hf_link_partner!=-1)&&(!clover_connect_time)) {
       
       printf("Requesting clover call now that ALE link established.\n");
 
-      clover_connect_time=time(0)+random()%10;
+      clover_connect_time=gettime_s()+random()%10;
       
     }    
   }
@@ -347,7 +347,7 @@ int hf2020_serviceloop(int serialfd)
     }
     
     // Wait until we are allowed our first call before doing so
-    if (time(0)<last_outbound_call)
+    if (gettime_s()<last_outbound_call)
       {
 	printf("Not yet allowed to call out.\n");
 	return 0;
@@ -357,7 +357,7 @@ int hf2020_serviceloop(int serialfd)
     // If the radio is not receiving a message
     // call-out time, then pick a hf station to call
 
-    if ((hf_link_partner==-1)&&(hf_station_count>0)&&(time(0)>=hf_next_call_time)) {
+    if ((hf_link_partner==-1)&&(hf_station_count>0)&&(gettime_s()>=hf_next_call_time)) {
       printf("It would be good to call another station.\n");
       int next_station = hf_next_station_to_call();
       if (next_station>-1) {
@@ -375,7 +375,7 @@ int hf2020_serviceloop(int serialfd)
 	// Allow enough time for the clover link to be established
 	// 1 minute should be enough.
 	// (add randomness to prevent lock-step)
-	hf_next_call_time=time(0)+30+(random()%30);
+	hf_next_call_time=gettime_s()+30+(random()%30);
 	hf_may_defer=1;
       }
     }
@@ -384,9 +384,9 @@ int hf2020_serviceloop(int serialfd)
       // XXX This probably needs to change for the 2020
       // hf_state=HF_ALELINK;
     }
-    else if (time(0)!=last_link_probe_time) { //once a second
+    else if (gettime_s()!=last_link_probe_time) { //once a second
       // XXX - Probe to see if we are still connected
-      last_link_probe_time=time(0);
+      last_link_probe_time=gettime_s();
     }
   
     break;
@@ -394,16 +394,16 @@ int hf2020_serviceloop(int serialfd)
   case HF_CALLREQUESTED: //2
     // Probe periodically with AILTBL to get link table, because the modem doesn't
     // preemptively tell us when we get a link established
-    if (time(0)!=last_link_probe_time)  { //once a second
+    if (gettime_s()!=last_link_probe_time)  { //once a second
       //write(serialfd,"AILTBL\r\n",8);
-      last_link_probe_time=time(0);
+      last_link_probe_time=gettime_s();
     }
-    if (time(0)>=hf_next_call_time){ //no reply from the called station
+    if (gettime_s()>=hf_next_call_time){ //no reply from the called station
       hf_state = HF_DISCONNECTED;
       hf_link_partner=-1;
       printf("Make the call disconnected because of no reply\n");
     }
-    if (clover_connect_time&&(time(0)>=clover_connect_time))
+    if (clover_connect_time&&(gettime_s()>=clover_connect_time))
       {
 	printf("Sending command to establish clover link now.\n");
 	clover_connect_time=0;
@@ -423,7 +423,7 @@ int hf2020_serviceloop(int serialfd)
     break;
     
   case HF_CONNECTING: //3
-    if (time(0)>hf_connecting_timeout) {
+    if (gettime_s()>hf_connecting_timeout) {
       hf_state=HF_DISCONNECTED;
       clover_connect_time=0;
       hf_link_partner=-1;
@@ -432,15 +432,15 @@ int hf2020_serviceloop(int serialfd)
 
   case HF_ALELINK: //4
 		
-    if (time(0)!=last_link_probe_time)  { //once a second
+    if (gettime_s()!=last_link_probe_time)  { //once a second
       // XXX - Probe to check that we are still connected
-      last_link_probe_time=time(0);
+      last_link_probe_time=gettime_s();
     }
     
     if (previous_state!=HF_ALELINK){
       fprintf(stderr,"Radio linked with %s (station #%d), I will send a packet in %ld seconds\n",
 	      "(XXX unknown)",hf_link_partner,
-      hf_next_packet_time-time(0));
+      hf_next_packet_time-gettime_s());
     }
 
     if (clover_tx_buffer_space>512) {
@@ -488,17 +488,17 @@ int hf2020_serviceloop(int serialfd)
 
   if (previous_state!=hf_state){
     fprintf(stdout,"\nClover 2020 modem changed to state %s (next call in %lld seconds)\n",
-	    hf_state_name(hf_state),(long long)(hf_next_call_time-time(0)));
+	    hf_state_name(hf_state),(long long)(hf_next_call_time-gettime_s()));
     previous_state=hf_state;
   } else {
     static int last_state_report_time=0;    
-    if (time(0)>last_state_report_time) {
+    if (gettime_s()>last_state_report_time) {
       fprintf(stdout,"Link state is %s (next call in %lld seconds, HF_CONNECTING timeout = %lld, link partner=%d, hf_station_count=%d)\n",
 	      hf_state_name(hf_state),
-	      (long long)(hf_next_call_time-time(0)),
-	      (long long)(hf_connecting_timeout-time(0)),
+	      (long long)(hf_next_call_time-gettime_s()),
+	      (long long)(hf_connecting_timeout-gettime_s()),
 	      hf_link_partner,hf_station_count);
-      last_state_report_time=time(0)+9;
+      last_state_report_time=gettime_s()+9;
     }
   }
   
@@ -566,7 +566,7 @@ int hf2020_parse_reply(unsigned char *m,int len)
 	// So extend the wait exactly one time only.
 	if (hf_may_defer) {
 	  printf("Deferring trying to make a call, incase this is an incoming call for us.\n");
-	  hf_next_call_time=time(0)+20+(random()%20);
+	  hf_next_call_time=gettime_s()+20+(random()%20);
 	  hf_may_defer=0;
 	}
       }
@@ -785,52 +785,31 @@ int hf2020_received_byte(unsigned char b)
 
     printf("Envelope for a %d byte packet found\n",candidate_len);
     
+    int encoded_length=CLOVER78_ENCODED_LEN(candidate_len);
+
     // Now see if the start of packet marker preceeds the
     // expected packet
-    if ((hf2020_rx_buffer[511-7-candidate_len-1]==0x91)&&
-	(hf2020_rx_buffer[511-7-candidate_len-0]==0x90)) {
+    if ((hf2020_rx_buffer[511-7-encoded_length-1]==0x91)&&
+	(hf2020_rx_buffer[511-7-encoded_length-0]==0x90)) {
       printf("We have found a possible packet of %d bytes\n",
 	     candidate_len);
       // We encode 7 bytes in 8, keeping bit 6 high to avoid all the
-      // annoying character escaping dramas of the clover modems.
-      // The envelope indicates how many decoded bytes we have.
-      // Where the packet is not a multiple of 7 bytes, we still use
-      // a full 8-byte data frame to carry those remaining bytes, as
-      // this just keeps things simple.
-      // So the first offset we have to look at is 511 - 6 - encoded_length
-      // encoded_length = 8*(decoded_length/7) + decoded_length%7 ? 8 : 0
+      // annoying character escaping dramas of the clover modems
+      // (see clover78_encode()).  The envelope indicates how many decoded
+      // bytes we have.
       // (We should eventually support packets with > 255 bytes, but for
       // now do not.)
       unsigned char decoded_packet[256];
       int decoded_len=candidate_len;
-      int encoded_length = 8 * (decoded_len/7) + (decoded_len%7)?8:0;
-      printf("Encoded length should be %d bytes\n",encoded_length);
-      int o;
-      int consumed=0;
-      for(o=0;o<decoded_len;o+=7) {
-	unsigned char *encoded_dataframe=&hf2020_rx_buffer[511-6-encoded_length+consumed];
-	consumed+=8;
-	// Encoding uses one bit from each byte, so that we can just shift the bytes around
-	for(int j=0;j<7;j++) {
-	  // Read out lowest bits from each byte
-	  decoded_packet[o+j] =
-	    (encoded_dataframe[0]<<0)
-	    |(encoded_dataframe[1]<<1)	    
-	    |(encoded_dataframe[2]<<2)	    
-	    |(encoded_dataframe[3]<<3)	    
-	    |(encoded_dataframe[4]<<4)	    
-	    |(encoded_dataframe[5]<<5)	    
-	    |(encoded_dataframe[6]<<6)	    
-	    |(encoded_dataframe[7]<<7);
-	  // shift all bytes down
-	  for(int k=0;k<8;k++) encoded_dataframe[k]>>=1;
-	  // And skip bit 6
-	  if (j==5) for(int k=0;k<8;k++) encoded_dataframe[k]>>=1;
-	}
+      if (clover78_decode(&hf2020_rx_buffer[511-6-encoded_length],
+			  decoded_packet,decoded_len)<0) {
+	printf("Packet is not 7:8 encoded, ignoring it\n");
+	return 0;
       }
       
       dump_bytes(stdout,"The encoded packet:",&hf2020_rx_buffer[511-6-encoded_length],encoded_length);
       dump_bytes(stdout,"The decoded packet:",decoded_packet,decoded_len);
+      hf_schedule_heard(decoded_packet,decoded_len);
       saw_packet(decoded_packet,decoded_len,
 		 last_rx_rssi,
 		 my_sid_hex,prefix,servald_server,credential);
@@ -861,32 +840,10 @@ int hf2020_send_packet(int serialfd,unsigned char *out, int len)
   
   // Write packet body using 7:8 encoding with bit 6 set.
   // This avoids the complications of the escape characters completely.
-  for(int i=0;i<len;i+=7) {
-    // Clear out the encoded bytes
-    for(int j=0;j<8;j++) escaped[elen+j]=0x00;
-
-    // Now shift each new byte in
-    for(int j=6;j>-1;j--) {
-      if (out[i+6-j]&0x01) escaped[elen+0]|=0x01;
-      if (out[i+6-j]&0x02) escaped[elen+1]|=0x01;
-      if (out[i+6-j]&0x04) escaped[elen+2]|=0x01;
-      if (out[i+6-j]&0x08) escaped[elen+3]|=0x01;
-      if (out[i+6-j]&0x10) escaped[elen+4]|=0x01;
-      if (out[i+6-j]&0x20) escaped[elen+5]|=0x01;
-      if (out[i+6-j]&0x40) escaped[elen+6]|=0x01;
-      if (out[i+6-j]&0x80) escaped[elen+7]|=0x01;
-
-      // skip and set bit 6 if required
-      if (j==5) for(int k=0;k<8;k++)
-		  escaped[elen+k]=1+(escaped[elen+k]<<1);
-      // Shift up to make room for the next byte
-      for(int k=0;k<8;k++) escaped[elen+k]<<=1;            
-    }
-    
-    elen+=8;
-    clover_tx_buffer_space-=8;
-    if (clover_tx_buffer_space<0) clover_tx_buffer_space=0;
-  }
+  int encoded_length=clover78_encode(out,&escaped[elen],len);
+  elen+=encoded_length;
+  clover_tx_buffer_space-=encoded_length;
+  if (clover_tx_buffer_space<0) clover_tx_buffer_space=0;
 
   // Add evenlope to the end, so that we know when we have a packet
   // (The odd false positive from matching part of the envelope with
@@ -905,6 +862,7 @@ int hf2020_send_packet(int serialfd,unsigned char *out, int len)
     
   dump_bytes(stdout,"Escaped packet for Clover TX",escaped,elen);
   write_all(serialfd,escaped,elen);
+  hf_schedule_sent(len);
 
   return 0;
 }
@@ -120,16 +120,19 @@ int hfbarrett_serviceloop(int serialfd)
     }
     
     // Wait until we are allowed our first call before doing so
-    if (time(0)<last_outbound_call) return 0;
+    if (gettime_s()<last_outbound_call) return 0;
     
     
     // Currently disconnected. If the current time is later than the next scheduled
     // If the radio is not receiving a message
     // call-out time, then pick a hf station to call
 
-    if ((ale_inprogress==0)&&(hf_link_partner==-1)&&(hf_station_count>0)&&(time(0)>=hf_next_call_time)) {
-      int next_station = hf_next_station_to_call();
-      if (next_station>-1) {
+    // If nobody is due a call, keep probing instead, as the other side may
+    // have linked with us.
+    int next_station=-1;
+    if ((ale_inprogress==0)&&(hf_link_partner==-1)&&(hf_station_count>0)&&(gettime_s()>=hf_next_call_time))
+      next_station = hf_next_station_to_call();
+    if (next_station>-1) {
 			  // Ensure we have a clear line for new command (we were getting some
 			  // errors here intermittantly).				
 			  write(serialfd,"\r\n",2);
@@ -162,19 +165,18 @@ int hfbarrett_serviceloop(int serialfd)
 					
 			    fprintf(stderr,"HF: Attempting to call station #%d '%s'\n",
 				    next_station,hf_stations[next_station].name);
-			    hf_next_call_time=time(0)+ALElink_establishment_time;
+			    hf_next_call_time=gettime_s()+ALElink_establishment_time;
         }else{
           printf("The radio is not idle. The call request is not sent.\n");
         }
-		  }
     }
     else if (hf_link_partner>-1)
       hf_state=HF_ALELINK;
 	  // Probe periodically with AILTBL to get link table, because the modem doesn't
     // preemptively tell us when we get a link established 
-	  else if (time(0)!=last_link_probe_time) { //once a second
+	  else if (gettime_s()!=last_link_probe_time) { //once a second
       write(serialfd,"AILTBL\r\n",8);
-      last_link_probe_time=time(0);
+      last_link_probe_time=gettime_s();
     }
   
     break;
@@ -182,15 +184,15 @@ int hfbarrett_serviceloop(int serialfd)
   case HF_CALLREQUESTED: //2
 		// Probe periodically with AILTBL to get link table, because the modem doesn't
     // preemptively tell us when we get a link established
-    if (time(0)!=last_link_probe_time)  { //once a second
+    if (gettime_s()!=last_link_probe_time)  { //once a second
       //write(serialfd,"AILTBL\r\n",8);
-      last_link_probe_time=time(0);
+      last_link_probe_time=gettime_s();
     }
     if (ale_inprogress==2){
       printf("Another radio is calling. Marking this sent call disconnected\n");
       hf_state=HF_DISCONNECTED;
     }
-		if (time(0)>=hf_next_call_time){ //no reply from the called station
+		if (gettime_s()>=hf_next_call_time){ //no reply from the called station
 			hf_state = HF_DISCONNECTED;
 			printf("Make the call disconnected because of no reply\n");
 		}
@@ -207,10 +209,12 @@ int hfbarrett_serviceloop(int serialfd)
 		// Also in the case where previsou_state=-1
 		// because previous_state is only updeated at the end of the first service loop.
 		// So we are sure to cover the case of the first loop.
-    if ((previous_state==HF_DISCONNECTED)||(previous_state==-1)||previous_state==HF_ALESENDING){
+    if ((previous_state==HF_DISCONNECTED)||(previous_state==-1)){
       printf("Let the other side send messages\n");
       hf_radio_pause_for_turnaround();
     }
+    // After sending, keep the turn if we are part way through a burst
+    if (previous_state==HF_ALESENDING) hf_radio_frame_sent();
 		
 		if (message_failure>10){
 		  printf("Receiving message failed more than 10 times. The link is not good. Reset radio\n");
@@ -219,14 +223,14 @@ int hfbarrett_serviceloop(int serialfd)
 		  return -1;
 		}
 		
-    if (time(0)!=last_link_probe_time)  { //once a second
-			last_link_probe_time=time(0);
+    if (gettime_s()!=last_link_probe_time)  { //once a second
+			last_link_probe_time=gettime_s();
     }
     
     if (previous_state!=HF_ALELINK){
       fprintf(stderr,"Radio linked with %s (station #%d), I will send a packet in %ld seconds\n",
       barrett_link_partner_string,hf_link_partner,
-      hf_next_packet_time-time(0));
+      hf_next_packet_time-gettime_s());
     }
 
     
@@ -305,14 +309,14 @@ int hfbarrett_process_line(char *l)
   if ((!strcmp(l,"EV00"))&&(hf_state==HF_CALLREQUESTED)) {
     // Syntax error in our request to call.
     printf("Saw EV00 response. Marking call disconnected.\n");
-		hf_next_call_time=time(0); //AXLINK failed, no call have been tried
+		hf_next_call_time=gettime_s(); //AXLINK failed, no call have been tried
     hf_state = HF_DISCONNECTED;
     return 0;
   }
   if ((!strcmp(l,"E0"))&&(hf_state==HF_CALLREQUESTED)) {
     // Syntax error in our request to call.
     printf("Saw E0 response. Marking call disconnected.\n");
-		hf_next_call_time=time(0); //AXLINK failed, no call have been tried
+		hf_next_call_time=gettime_s(); //AXLINK failed, no call have been tried
     hf_state = HF_DISCONNECTED;
     return 0;
   }
@@ -339,10 +343,11 @@ int hfbarrett_process_line(char *l)
 		}
 	}
 
-  if (sscanf(l,"AIAMDM%s",tmp)==1) {
-    fprintf(stderr,"Barrett radio saw ALE AMD message '%s'\n",&tmp[6]);
+  // (Not sscanf("%s"), as ASCII-64 messages can contain spaces)
+  if ((!strncmp(l,"AIAMDM",6))&&(strlen(l)>12)) {
+    fprintf(stderr,"Barrett radio saw ALE AMD message '%s'\n",&l[12]);
     message_failure=0;
-    hf_process_fragment(&tmp[6]);
+    hf_process_fragment(hf_link_partner,&l[12]);
   }
 
   if (sscanf(l, "AISTAT%s", tmp)==1){
@@ -464,38 +469,35 @@ int hfbarrett_send_packet(int serialfd,unsigned char *out, int len)
 {
   // We can send upto 90 ALE encoded bytes.  ALE bytes are 6-bit, so we can send
   // 22 groups of 3 bytes = 66 bytes raw and 88 encoded bytes.
-  // XXX - In practice we get only 4 bits per byte, as we don't seem to be able
-  // to get 6-bit clean. But recheck with Barrett to Barrett, as it might be a
-  // Barrett / Codan interoperabilitty problem.
-  // We can use the first
-  // two bytes for fragmentation, since we would still like to support 256-byte
-  // messages.  This means we need upto 4 pieces for each message.
+  // We used to get only 4 bits per byte (hex), as we didn't seem to be able
+  // to get 6-bit clean.  That was at least partly because we parsed AIAMDM
+  // lines with sscanf("%s"), which stopped at the first space.  We now send
+  // ASCII-64 once the other side says it understands it, and hex until then,
+  // or always with flags=128 (see hf_encode_fragments()).
+  // We use the first three characters for fragmentation, since we would still
+  // like to support 256-byte messages.
   char message[8192];
-  char fragment[8192];
+  char fragments[HF_MAX_MESSAGES][HF_ALE3G_MESSAGE_CHARS+1];
 
   int i;
 
-  time_t absolute_timeout=time(0)+200;
+  time_t absolute_timeout=gettime_s()+200;
 
   if (!hfbarrett_ready_test()) return -1;
   
-  // How many pieces to send (1-6)
-  // This means we have 36 possible fragment indications, if we wish to imply the
-  // number of fragments in the fragment counter.
-  int pieces=len/43; if (len%43) pieces++;
+  int pieces=hf_encode_fragments(out,len,RADIOTYPE_HFBARRETT,fragments);
+  if (pieces<1) {
+    fprintf(stderr,"Not sending packet, because it won't fit in %d AMD messages.\n",
+	    HF_MAX_FRAGMENTS);
+    return -1;
+  }
   
   previous_state=hf_state; //necessary because LBARD will nor run the service loop while being in HF_ALESENDING state
   hf_state=HF_ALESENDING;
   
-  fprintf(stderr,"Sending message of %d bytes via Barratt HF\n",len);
-  for(i=0;i<len;i+=43) {
+  fprintf(stderr,"Sending message of %d bytes via Barratt HF in %d pieces\n",len,pieces);
+  for(i=0;i<pieces;i++) {
 		//printf("Nb of loops=%d\n", i);
-    // Indicate radio type in fragment header
-    fragment[0]=0x41+(hf_message_sequence_number&0x07);
-    fragment[1]=0x30+(i/43);
-    fragment[2]=0x30+pieces;
-    int frag_len=43; if (len-i<43) frag_len=len-i;
-    hex_encode(&out[i],&fragment[3],frag_len,radio_get_type());
 
     unsigned char buffer[8192];
 
@@ -509,12 +511,12 @@ int hfbarrett_send_packet(int serialfd,unsigned char *out, int len)
     
     snprintf(message,8192,"AXNMSG%s%02d%s\r\n",
 	     barrett_link_partner_string,
-	     (int)strlen(fragment),fragment);
+	     (int)strlen(fragments[i]),fragments[i]);
 
 		int time_to_send_frag;
 		ale_command_state=0;
     while (ale_command_state!=1) {
-      if (time(0)>absolute_timeout) {
+      if (gettime_s()>absolute_timeout) {
 	fprintf(stderr,"Failed to send packet in reasonable amount of time. Aborting.\n");
 	hf_message_sequence_number++;
 	previous_state=hf_state; //necessary because LBARD will nor run the service loop while being in HF_ALESENDING state
@@ -578,7 +580,7 @@ int hfbarrett_send_packet(int serialfd,unsigned char *out, int len)
 					//printf("buffer is: %s\n", buffer);
 					//if (strstr((const char *)buffer,"AIMESS1")){
 					if (ale_command_state==1){
-						char timestr[100]; time_t now=time(0); ctime_r(&now,timestr);
+						char timestr[100]; time_t now=gettime_s(); ctime_r(&now,timestr);
 		 				if (timestr[0]) timestr[strlen(timestr)-1]=0;
 						fprintf(stderr,"  [%s] Sent %s",timestr,message);
 					}
@@ -614,10 +616,10 @@ int hfbarrett_send_packet(int serialfd,unsigned char *out, int len)
   previous_state=hf_state; //necessary because LBARD will nor run the service loop while being in HF_ALESENDING state
   hf_state=HF_ALELINK;
   hf_message_sequence_number++;
-  char timestr[100]; time_t now=time(0); ctime_r(&now,timestr);
+  char timestr[100]; time_t now=gettime_s(); ctime_r(&now,timestr);
   if (timestr[0]) timestr[strlen(timestr)-1]=0;
   fprintf(stderr,"  [%s] Finished sending packet, next in %ld seconds.\n",
-	  timestr,hf_next_packet_time-time(0));
+	  timestr,hf_next_packet_time-gettime_s());
   
   return 0;
 }
@@ -86,13 +86,14 @@ int hfcodanbarrett_radio_detect(int fd)
   if (sscanf((char *)buf,"VER\r\nCICS: V%d.%d",&verhi,&verlo)==2) {
     fprintf(stderr,"Codan HF Radio running CICS V%d.%d\n",
 	    verhi,verlo);
+    // (setting the type clears the features, so it goes first)
+    radio_set_type(RADIOTYPE_HFCODAN);
     if ((verhi>3)||((verhi==3)&&(verlo>=37)))
       // Codan radio supports ALE 3G (255 x 8-bit chars per message)
       radio_set_feature(RADIO_ALE_2G|RADIO_ALE_3G);
     else
       // Codan radio supports only ALE 2G (90 x 6-bit chars per message)
       radio_set_feature(RADIO_ALE_2G);
-    radio_set_type(RADIOTYPE_HFCODAN);
     // PART THAT HAS TO BE MODIFIED IN ORDER TO USE ALELINK
     //Setting manually the ID of the radio, the ID of other radios
     //are also hardcoded at the beginning
@@ -126,9 +127,9 @@ int hfcodan_serviceloop(int serialfd)
     // The radio tries to call 3 time the "next_station" until it goes to the next of
     // the list
     // Wait until we are allowed our first call before doing so
-    if (time(0)<last_outbound_call) return 0;
+    if (gettime_s()<last_outbound_call) return 0;
 
-    if ((time(0)>=hf_next_call_time)) {
+    if ((gettime_s()>=hf_next_call_time)) {
       if (next_station>sizeof(id_list)-1) {
     next_station = 0;}
 	  snprintf(cmd,1024,"alecall %d from %d\r\n", id_list[next_station], selfid);
@@ -179,7 +180,7 @@ int hfcodan_process_line(char *l)
   else if (sscanf(l,"AMD-CALL: %d, %d, %d, %d/%d %d:%d, \"%[^\"]\"",
 		  &channel,&caller,&callee,&day,&month,&hour,&minute,fragment)==8) {
     // Saw a fragment
-    hf_process_fragment(fragment);
+    hf_process_fragment(caller,fragment);
     // We must also by definition be connected
     hf_state=HF_ALELINK;
   } else if (sscanf(l,"ALE-LINK: %d, %d, %d, %d/%d %d:%d",
@@ -193,7 +194,7 @@ int hfcodan_process_line(char *l)
 
     fprintf(stderr,"ALE Link from %d -> %d on channel %d, I will send a packet in %ld seconds\n",
 	    caller,callee,channel,
-    hf_next_packet_time-time(0));
+    hf_next_packet_time-gettime_s());
     // We are by definition connected
     hf_state=HF_ALELINK;
   } else if ((!strcmp(l,"ALE-LINK: FAILED"))||(!strcmp(l,"LINK: CLOSED"))) {
@@ -234,14 +235,14 @@ int hfcodan_receive_bytes(unsigned char *bytes,int count)
 int hfcodan_send_packet(int serialfd,unsigned char *out, int len)
 {
   // We can send upto 90 ALE encoded bytes.  ALE bytes are 6-bit, so we can send
-  // 22 groups of 3 bytes = 66 bytes raw and 88 encoded bytes.  We can use the first
-  // two bytes for fragmentation, since we would still like to support 256-byte
-  // messages.  This means we need upto 4 pieces for each message.
+  // 22 groups of 3 bytes = 66 bytes raw and 88 encoded bytes.  We use the first
+  // three for the fragment header (see hf_encode_fragments()), since we would
+  // still like to support 256-byte messages.
   char message[8192];
-  char fragment[8192];
+  char fragments[HF_MAX_MESSAGES][HF_ALE3G_MESSAGE_CHARS+1];
 
   int i;
-  time_t absolute_timeout=time(0)+90;
+  time_t absolute_timeout=gettime_s()+90;
 
   if (hf_state!=HF_ALELINK) {
     fprintf(stderr,"Not sending packet, because we don't think we are in an ALE link.\n");
@@ -251,26 +252,25 @@ int hfcodan_send_packet(int serialfd,unsigned char *out, int len)
     fprintf(stderr,"Not sending packet, because we think an ALE transaction is already occurring.\n");
     return -1;
   }
-  // How many pieces to send (1-6)
-  // This means we have 36 possible fragment indications, if we wish to imply the
-  // number of fragments in the fragment counter.
-  int pieces=len/43; if (len%43) pieces++;
-
-  fprintf(stderr,"Sending message of %d bytes via Codan HF\n",len);
-  for(i=0;i<len;i+=43) {
-    // Indicate radio type in fragment header
-    fragment[0]=0x30+(hf_message_sequence_number&0x07);
-    fragment[1]=0x30+(i/43);
-    fragment[2]=0x30+pieces;
-    int frag_len=43; if (len-i<43) frag_len=len-i;
-    hex_encode(&out[i],&fragment[3],frag_len,radio_get_type());
-
-    snprintf(message,8192,"amd %s\r\n",fragment);
+  int pieces=hf_encode_fragments(out,len,RADIOTYPE_HFCODAN,fragments);
+  if (pieces<1) {
+    fprintf(stderr,"Not sending packet, because it won't fit in %d AMD messages.\n",
+	    HF_MAX_FRAGMENTS);
+    return -1;
+  }
+
+  // The amd command sends ALE 3G messages too: CICS V3.37 and later send
+  // one that is too long for ALE 2G (HF_ALE_MESSAGE_CHARS), or has 8-bit
+  // characters, as ALE 3G, up to HF_ALE3G_MESSAGE_CHARS.  We only make such
+  // messages when the radio says it has ALE 3G (see hf_use_large_blocks()).
+  fprintf(stderr,"Sending message of %d bytes via Codan HF in %d pieces\n",len,pieces);
+  for(i=0;i<pieces;i++) {
+    snprintf(message,8192,"amd %s\r\n",fragments[i]);
     write_all(serialfd,message,strlen(message));
 
     int not_ready=1;
     while (not_ready) {
-      if (time(0)>absolute_timeout) {
+      if (gettime_s()>absolute_timeout) {
 	fprintf(stderr,"Failed to send packet in reasonable amount of time. Aborting.\n");
 	hf_message_sequence_number++;
 	return -1;
@@ -283,7 +283,7 @@ int hfcodan_send_packet(int serialfd,unsigned char *out, int len)
       if (count) hfcodan_receive_bytes(buffer,count);
       if (strstr((const char *)buffer,"AMD CALL FINISHED")) {
 	not_ready=0;
-	char timestr[100]; time_t now=time(0); ctime_r(&now,timestr);
+	char timestr[100]; time_t now=gettime_s(); ctime_r(&now,timestr);
 	if (timestr[0]) timestr[strlen(timestr)-1]=0;
 	fprintf(stderr,"  [%s] Sent %s",timestr,message);
 
@@ -298,12 +298,12 @@ int hfcodan_send_packet(int serialfd,unsigned char *out, int len)
     }
   }
 
-  hf_radio_pause_for_turnaround();
+  hf_radio_frame_sent();
   hf_message_sequence_number++;
-  char timestr[100]; time_t now=time(0); ctime_r(&now,timestr);
+  char timestr[100]; time_t now=gettime_s(); ctime_r(&now,timestr);
   if (timestr[0]) timestr[strlen(timestr)-1]=0;
   fprintf(stderr,"  [%s] Finished sending packet, next in %ld seconds.\n",
-	  timestr,hf_next_packet_time-time(0));
+	  timestr,hf_next_packet_time-gettime_s());
 
   return 0;
 }
@@ -11,27 +11,37 @@
   as soon as possible, so that early warning of disaster messages can
   be received in a timely manner.
   Also, because the satellite link may end up with lost packets, we need
-  to both interleave and apply some level of redundancy.  We will use 3+1
-  RAID5-style parity, together with a 1:5 interleave, i.e., we will uplink
-  five bundles simultaneously, with one packet from each being sent, and for
-  every 3 packets, we will provide one parity packet.  This means that at
-  least six consecutive packets must be lost before there will be a problem
-  with reception.  However, it is of course possible that problems will still
-  occur, and so we must retransmit high priority bundles repeatedly.  For now,
-  this will be managed by having the Rhizome database for the uplink side having
-  to exercise restraint at the number of bundles that it is pushing.  To also
+  to both interleave and apply some level of redundancy.  Each lane's data
+  is cut into zones of k packets, followed by m parity packets from a
+  Reed-Solomon erasure code (see src/fec/rs_erasure.c), so that any k of
+  each k+m packets are enough.  The lanes take turns, one packet each (see
+  outernet_uplink_choose_lane()), so with all five lanes sending, the default
+  of k=12, m=4 rides out a burst of 20 consecutive lost packets, for the same
+  4/3 expansion as the 3+1 parity we used to use.  (That could repair only
+  one loss in four, which satellite fades easily exceed.)  In general a lane
+  rides out a burst of m times the fewest lanes in any of its rotations, so a
+  lane that is sending alone, or that outweighs the others so far that they
+  seldom join its rotations, is back to bursts of m.
+  However, it is of course possible that problems will still
+  occur, and so we must retransmit high priority bundles repeatedly.  To also
   help minimise latency, the five simultaneous upload lanes will be allocated
   to different bundle sizes, similar to how Rhizome over Wi-Fi works, so that
   a large bundle can continue to be uplinked without preventing the immediate
   uplink of new small bundles.  
 
-  Thus, for each of the five uplink lanes, we should produce a list of the bundles
-  in it, and uplink them endlessly in a loop.  When a new bundle is detected (or
-  a new version of an old bundle), it should most likely be immediately uplinked.
-
-  The remaining question is whether we should use the priority score of the bundles
-  within a lane to affect the frequency of uplink of each, i.e., so that high
-  priority bundles can be uplinked repeatedly over a relatively short period of time.
+  Thus each of the five uplink lanes is a carousel of the bundles in it, which
+  are uplinked endlessly.  Each bundle has a weight from its priority (MeshMS
+  above everything else), and the carousel uses stride scheduling: a bundle
+  gets a share of its lane in proportion to its weight, so it comes around
+  again after about (its packets x lane weight total / its weight) packets of
+  the lane, no matter how many low priority bundles are queued with it.  A new
+  bundle, or new version, is uplinked next.
+
+  The lanes themselves share the uplink in rotations of one packet per lane,
+  with each lane weighted by the most important bundle in it, so that a lane
+  carrying MeshMS is in every rotation, and one carrying only large files in
+  fewer.  Lanes with nothing in them are skipped, rather than holding up the
+  others.
 */
 /*
 The following specially formatted comments tell the LBARD build environment about this radio.
@@ -63,6 +73,8 @@ RADIO TYPE: OUTERNET,"outernet","Outernet.is broadcast satellite",outernet_radio
 #include "hf.h"
 #include "radios.h"
 #include "code_instrumentation.h"
+#include "metrics.h"
+#include "rs_erasure.h"
 
 long long last_uplink_packet_time=0;
 int last_uplink_lane=-1;
@@ -81,25 +93,96 @@ extern char *serial_port;
 struct sockaddr_in addr_uplink;
 int uplink_fd=-1;
 
+// Bundles in the carousel of an uplink lane
+struct outernet_carousel_entry {
+  int bundle;
+  int weight;
+  // Stride scheduling virtual time at which the bundle is next due
+  long long pass;
+  // When we last started uplinking it, so we know how long receivers that
+  // missed it have to wait.
+  long long last_start_ms;
+};
+
 // TX queues for each lane.
 struct outernet_lane_tx_queue {
-  int bundle_numbers[MAX_BUNDLES];
+  struct outernet_carousel_entry *carousel;
   int queue_len;
+  int queue_alloc;
+  // Pass of the bundle we most recently started
+  long long lane_pass;
 
   // Size of bundles this lane handles
   int min_size;
   int max_size;
 
-  // Flattened form of bundle we are currently uplinking.
+  // Share of the uplink, credit towards joining rotations, and whether
+  // we are in the current one
+  int weight;
+  int credit;
+  int busy;
+  int in_rotation;
+
+  // Uplink bandwidth used by this lane
+  long long packets_uplinked;
+  long long bytes_uplinked;
+  long long passes_completed;
+
+  // Flattened form of bundle we are currently uplinking, padded out to a
+  // whole number of zones.
   int serialised_bundle_number;
   unsigned char *serialised_bundle;
   int serialised_len;
-  int serialised_offset;
+  // Next packet to send, counting parity packets
+  int serialised_seq;
+
+  // Erasure code for the bundle, and the parity of the current zone
+  struct rs_erasure fec;
+  unsigned char parity_shards[RS_ERASURE_MAX_SHARDS][MAX_MTU];
 };
 
 #define UPLINK_LANES 5
 struct outernet_lane_tx_queue *lane_queues[UPLINK_LANES]={NULL};
 
+// Lane (plus one) whose carousel each bundle is in, or 0 if none
+unsigned char outernet_bundle_lane[MAX_BUNDLES];
+
+#define OUTERNET_CAROUSEL_STRIDE 65536
+#define OUTERNET_WEIGHT_MESHMS1 4
+#define OUTERNET_WEIGHT_MESHMS2 8
+// Next lane to visit in the current rotation
+int outernet_rotation_next=UPLINK_LANES;
+
+// Data (k) and parity (m) packets per zone in each lane
+int outernet_fec_k[UPLINK_LANES]={OUTERNET_DEFAULT_FEC_K,OUTERNET_DEFAULT_FEC_K,
+				  OUTERNET_DEFAULT_FEC_K,OUTERNET_DEFAULT_FEC_K,
+				  OUTERNET_DEFAULT_FEC_K};
+int outernet_fec_m[UPLINK_LANES]={OUTERNET_DEFAULT_FEC_M,OUTERNET_DEFAULT_FEC_M,
+				  OUTERNET_DEFAULT_FEC_M,OUTERNET_DEFAULT_FEC_M,
+				  OUTERNET_DEFAULT_FEC_M};
+
+/*
+  Parse an outernetfec= option: "k:m" for every lane, or "lane:k:m".
+  Takes effect from the next bundle uplinked in each lane.
+*/
+int outernet_set_fec(char *spec)
+{
+  int lane=-1,k=0,m=0;
+  struct rs_erasure check;
+  if (sscanf(spec,"%d:%d:%d",&lane,&k,&m)!=3) {
+    lane=-1;
+    if (sscanf(spec,"%d:%d",&k,&m)!=2) return -1;
+  }
+  if (lane>=UPLINK_LANES) return -1;
+  if (rs_erasure_init(&check,k,m)) return -1;
+  for(int i=0;i<UPLINK_LANES;i++)
+    if (lane==-1||lane==i) {
+      outernet_fec_k[i]=k;
+      outernet_fec_m[i]=m;
+    }
+  return 0;
+}
+
 int outernet_lane_queue_setup(void)
 {
   int retVal=0;
@@ -143,18 +226,130 @@ int outernet_lane_queue_setup(void)
   return retVal;
 }
 
-int outernet_uplink_next_in_queue(int lane)
+char *outernet_lane_label(int lane)
+{
+  static char label[32];
+  snprintf(label,sizeof(label),"lane=\"%d\"",lane);
+  return label;
+}
+
+/*
+  How often a bundle comes around in its lane, relative to others.
+  Follows calculate_bundle_intrinsic_priority() in putting MeshMS first.
+*/
+int outernet_bundle_weight(int b)
 {
-  /* Pick the first item in the queue, serialise it, and mark
-     it ready for uplinking.
+  if (!bundles[b].service) return 1;
+  if (!strcasecmp("MeshMS2",bundles[b].service)) return OUTERNET_WEIGHT_MESHMS2;
+  if (!strcasecmp("MeshMS1",bundles[b].service)) return OUTERNET_WEIGHT_MESHMS1;
+  return 1;
+}
 
-     We then put that item to the end of the queue, so that we 
-     round-robin through all the items in the lane's queue.
+// Packets (including parity) to uplink a bundle once, roughly
+int outernet_bundle_packets(int lane,int b)
+{
+  int zone_bytes=outernet_fec_k[lane]*(outernet_mtu-OUTERNET_HEADER_LEN);
+  // Allow for the header and a typical compressed manifest
+  long long bytes=2+4+256+bundles[b].length;
+  return ((bytes+zone_bytes-1)/zone_bytes)*(outernet_fec_k[lane]+outernet_fec_m[lane]);
+}
+
+int outernet_lane_update_weight(int lane)
+{
+  struct outernet_lane_tx_queue *q=lane_queues[lane];
+  q->weight=1;
+  for(int n=0;n<q->queue_len;n++)
+    if (q->carousel[n].weight>q->weight) q->weight=q->carousel[n].weight;
+  return 0;
+}
+
+/*
+  Put a new bundle (or new version of one) in the carousel of a lane, so that
+  it is uplinked next.
+*/
+int outernet_carousel_add(int lane,int b)
+{
+  struct outernet_lane_tx_queue *q=lane_queues[lane];
+  int n;
+
+  if (outernet_bundle_lane[b]==lane+1) {
+    for(n=0;n<q->queue_len;n++) if (q->carousel[n].bundle==b) break;
+    LOG_NOTE("Bundle #%d remains in lane #%d after update.",b,lane);
+  } else {
+    if (q->queue_len>=q->queue_alloc) {
+      int new_alloc=q->queue_alloc?q->queue_alloc*2:64;
+      struct outernet_carousel_entry *c=
+	realloc(q->carousel,new_alloc*sizeof(struct outernet_carousel_entry));
+      if (!c) {
+	LOG_ERROR("Could not grow carousel of uplink lane #%d to %d bundles",lane,new_alloc);
+	return -1;
+      }
+      q->carousel=c;
+      q->queue_alloc=new_alloc;
+    }
+    n=q->queue_len++;
+    q->carousel[n].bundle=b;
+    q->carousel[n].last_start_ms=0;
+    outernet_bundle_lane[b]=lane+1;
+    LOG_NOTE("Bundle #%d added to uplink lane #%d.",b,lane);
+  }
+  q->carousel[n].weight=outernet_bundle_weight(b);
+  // Ahead of everything else that is due now
+  q->carousel[n].pass=q->lane_pass-1;
+  outernet_lane_update_weight(lane);
+  return 0;
+}
+
+int outernet_carousel_remove(int lane,int b)
+{
+  struct outernet_lane_tx_queue *q=lane_queues[lane];
+  if (outernet_bundle_lane[b]!=lane+1) return 0;
+  for(int n=0;n<q->queue_len;n++)
+    if (q->carousel[n].bundle==b) {
+      LOG_NOTE("Removing bundle #%d from outernet uplink lane #%d",b,lane);
+      // Order does not matter, so fill the gap with the last one
+      q->carousel[n]=q->carousel[--q->queue_len];
+      break;
+    }
+  outernet_bundle_lane[b]=0;
+  outernet_lane_update_weight(lane);
+  return 0;
+}
+
+/*
+  Pick the bundle that is due next in a lane's carousel, and work out when
+  it will next be due.  Returns -1 if the carousel is empty.
+*/
+int outernet_carousel_next(int lane)
+{
+  struct outernet_lane_tx_queue *q=lane_queues[lane];
+  int best=-1;
+  for(int n=0;n<q->queue_len;n++) {
+    if ((best==-1)
+	||(q->carousel[n].pass<q->carousel[best].pass)
+	||((q->carousel[n].pass==q->carousel[best].pass)
+	   &&(q->carousel[n].weight>q->carousel[best].weight)))
+      best=n;
+  }
+  if (best==-1) return -1;
+
+  struct outernet_carousel_entry *e=&q->carousel[best];
+  q->lane_pass=e->pass;
+  e->pass+=(long long)outernet_bundle_packets(lane,e->bundle)
+    *OUTERNET_CAROUSEL_STRIDE/e->weight;
+
+  long long now=gettime_ms();
+  if (e->last_start_ms)
+    metric_histogram_observe("lbard_outernet_uplink_revisit_ms",
+			     outernet_lane_label(lane),now-e->last_start_ms);
+  e->last_start_ms=now;
+  return e->bundle;
+}
 
-     XXX -- We should have a prioritisation scheme, once we have
-     a means of setting the priority of the bundles. For now this
-     has to be managed by not having too many bundles in the
-     queue for the lane.
+int outernet_uplink_next_in_queue(int lane)
+{
+  /* Pick the bundle that is due next in the lane's carousel, serialise it,
+     and mark it ready for uplinking.
   */
 
   int retVal=0;
@@ -162,20 +357,9 @@ int outernet_uplink_next_in_queue(int lane)
   
   do {
     int bundle=-1;
-    int source_lane=lane;
     
     // Work out next bundle
     if (lane<0||lane>4) { retVal=-1; break; } // lane exists?
-    if (!lane_queues[lane]->queue_len) {
-      // There is nothing in the queue for this lane.
-      // We are allowed to take things from the queue of lower
-      // numbered lanes.
-      for(source_lane=0;source_lane<lane;source_lane++)
-	if (lane_queues[source_lane]->queue_len) break;
-      LOG_NOTE("source_lane = %d (for lane #%d)",source_lane,lane);
-      // If still nothing to do, then exit
-      if (!lane_queues[source_lane]->queue_len) break;      
-    }
 
     if (lane_queues[lane]->serialised_bundle_number!=-1) {
       LOG_ERROR("Must dequeue bundle being transmitted before calling outernet_upline_next_in_queue() for lane #%d",lane);
@@ -183,14 +367,8 @@ int outernet_uplink_next_in_queue(int lane)
       break;
     }
     
-    // Get bundle # of head of queue
-    bundle=lane_queues[source_lane]->bundle_numbers[0];
-    // Move head of queue to tail of queue
-    int n;
-    for(n=0;n<lane_queues[source_lane]->queue_len-1;n++)
-      lane_queues[source_lane]->bundle_numbers[n]
-	=lane_queues[source_lane]->bundle_numbers[n+1];
-    lane_queues[source_lane]->bundle_numbers[n]=bundle;
+    bundle=outernet_carousel_next(lane);
+    if (bundle<0) break;
     
     // Get requested bundle in the bundle cache
     if (prime_bundle_cache(bundle,
@@ -207,11 +385,15 @@ int outernet_uplink_next_in_queue(int lane)
     /* Build serialised version.
        We use a very simple file format:
        2 bytes = length of encoded manifest,
+       4 bytes = length of body,
        followed by manifest and body.
     */       
     int serialised_len=2+4+cached_manifest_encoded_len+cached_body_len;
-    // (but allow extra space for a complete parity zone, so that packet building is simpler)
-    unsigned char *serialised_data=malloc(serialised_len+MAX_MTU*4);
+    // (but pad it out to a whole number of zones, so that packet building is simpler)
+    rs_erasure_init(&lane_queues[lane]->fec,outernet_fec_k[lane],outernet_fec_m[lane]);
+    int zone_bytes=lane_queues[lane]->fec.k*(outernet_mtu-OUTERNET_HEADER_LEN);
+    int padded_len=((serialised_len+zone_bytes-1)/zone_bytes)*zone_bytes;
+    unsigned char *serialised_data=malloc(padded_len);
     if (!serialised_data) {
       LOG_ERROR("Could not allocate buffer for serialised data for bundle #%d (manifest len=%d, body len=%d)",
 		bundle,cached_manifest_encoded_len,cached_body_len);
@@ -228,19 +410,17 @@ int outernet_uplink_next_in_queue(int lane)
     serialised_data[5]=(cached_body_len>>24)&0xff;
     bcopy(cached_manifest_encoded,&serialised_data[2+4],cached_manifest_encoded_len);
     bcopy(cached_body,&serialised_data[2+4+cached_manifest_encoded_len],cached_body_len);
-    // Put a safe empty region at the end, so the last parity block can be correctly
-    // calculated, regardless of the length of the serialised bundle modulo parity block
-    // size.
-    bzero(&serialised_data[2+4+cached_manifest_encoded_len+cached_body_len],MAX_MTU*4);
+    // Pad the last zone with zeroes
+    bzero(&serialised_data[serialised_len],padded_len-serialised_len);
 
     // Store in lane
     lane_queues[lane]->serialised_bundle=serialised_data;
-    lane_queues[lane]->serialised_offset=0;
+    lane_queues[lane]->serialised_seq=0;
     lane_queues[lane]->serialised_bundle_number=bundle;
     lane_queues[lane]->serialised_len=serialised_len;
 
-    LOG_NOTE("Bundle #%d serialised and ready for uplink in lane #%d (pulled from queue of lane #%d)",
-	     bundle,lane,source_lane);
+    LOG_NOTE("Bundle #%d serialised and ready for uplink in lane #%d",
+	     bundle,lane);
     
   } while(0);
   LOG_EXIT;
@@ -266,6 +446,9 @@ int outernet_uplink_lane_dequeue_current(int lane)
 int outernet_uplink_lane_dequeue_bundle(int lane,int bundle)
 {
   LOG_ENTRY;
+  // Remove the bundle from the carousel, if present.
+  outernet_carousel_remove(lane,bundle);
+
   // Remove from active uplink if it was being uplinked.
   if (lane_queues[lane]->serialised_bundle_number==bundle) {
     LOG_NOTE("Stopping uplink of bundle #%d in lane #%d",
@@ -273,20 +456,6 @@ int outernet_uplink_lane_dequeue_bundle(int lane,int bundle)
     outernet_uplink_lane_dequeue_current(lane);
   }
 
-  // Remove the bundle from the queue, if present.
-  for(int n=0;n<lane_queues[lane]->queue_len;n++)
-    {
-      if (lane_queues[lane]->bundle_numbers[n]==bundle) {
-	LOG_NOTE("Removing bundle #%d from outernet uplink lane #%d",
-		 bundle,lane);
-	for(int m=n;m<(lane_queues[lane]->queue_len-1);m++)
-	  lane_queues[lane]->bundle_numbers[m]=
-	    lane_queues[lane]->bundle_numbers[m+1];
-	lane_queues[lane]->queue_len--;
-	break;
-      }
-    }
-
   return 0;
   LOG_EXIT;
 }
@@ -315,29 +484,11 @@ int outernet_upline_queue_triage(void)
 	    &&(bundles[b].length<=lane_queues[lane]->max_size)) {
 	  LOG_NOTE("Newly received bundle #%d of length %d goes in lane #%d\n",
 		   b,bundles[b].length,lane);
-	  if (lane_queues[lane]->queue_len>=MAX_BUNDLES) {
-	    LOG_ERROR("Uplink lane #%d is full. This should not be possible.",lane);
-	    break;
-	  }
-	  int bb;
-	  // Check if already queued
-	  for(bb=0;bb<lane_queues[lane]->queue_len;bb++)
-	    if (b==lane_queues[lane]->bundle_numbers[bb]) {
-	      LOG_NOTE("Bundle #%d remains in lane #%d after update.",
-		       b,lane);
-	      break;
-	    }
-	  if (bb==lane_queues[lane]->queue_len) {
-	    LOG_NOTE("Bundle #%d added to uplink lane #%d.",
-		     b,lane);
-	    lane_queues[lane]->bundle_numbers[lane_queues[lane]->queue_len++]=b;
-	  } else {
-	    // This bundle wasn't previously in this lane, so check
-	    // the other lanes, in case it has changed size and needs
-	    // to move from one lane to another
-	    for(int l=0;l<5;l++)
-	      if (l!=lane) outernet_uplink_lane_dequeue_bundle(l,b);
-	  }
+	  // If it has changed size, it needs to move from its old lane
+	  int old_lane=outernet_bundle_lane[b]-1;
+	  if ((old_lane>=0)&&(old_lane!=lane))
+	    outernet_uplink_lane_dequeue_bundle(old_lane,b);
+	  outernet_carousel_add(lane,b);
 	  break;
 	}
       }
@@ -470,36 +621,26 @@ int outernet_check_if_ready(void)
 }
 
 /*
-  For simplicity, we don't want to have separate parity packets.
-  Rather, we want a constant amount of data in each packet, and 
-  a constant amount of parity.  That way, we can use a simple 
-  offset pointer, and it will get us the right piece of data, and
-  calculate the right piece of parity. This relies on the MTU not
-  changing during the uplink of a bundle, as it will mess up all
-  the calculations.
-  
-  The packets need to include the sequence number and lane number,
-  and also a unique identifier for the bundle. Ideally that
-  identifier should be the same for if the same bundle is sent
-  again, so that we can recover from high levels of packet loss
-  through repetition of the whole bundle.  The trade-off is that
-  we then need to spend more bytes on the identifier, which we 
-  have to be careful of, because our MTU is likely to be only
-  around 200 bytes.  The more bandwidth efficient approach, but
-  at the expense of being able to use re-transmissions of the whole
-  bundle, is to simply mark packets as start and/or end packets,
-  similar to how we do in normal LBARD radio packets.  These two
-  bits can be merged in with the sequence number.
+  Each packet carries one shard of a zone: either k data shards, which are
+  consecutive pieces of the serialised bundle, or one of the m parity shards
+  that follow them.  The shard size is fixed by the MTU, so this relies on
+  the MTU not changing during the uplink of a bundle.
+
+  The packets need to include the sequence number and lane number, and
+  enough to decode the zone.  Rather than spend bytes on an identifier for
+  the bundle, we mark packets as start and/or end packets, similar to how
+  we do in normal LBARD radio packets.  These two bits are merged in with
+  the sequence number.
 
   So, we then need in each packet:
 
-  1 byte = data unit size, i.e., the fixed number of data bytes
-  per packet. Used to calculate parity regions.
+  1 byte = lane number, with OUTERNET_LANE_RS set, so that receivers that
+  only know the old 3+1 parity format ignore the packet.
   2 bytes = sequence number (16K values = ~6 hour turn over), plus
   start/end of bundle markers.
-  n bytes = data.
-  n/3 bytes = parity stripe.
-
+  1 byte = logical MTU, which gives the shard size.
+  1 byte each = k and m for this lane.
+  n bytes = shard.
 */
  
 int outernet_uplink_build_packet(int lane)
@@ -512,93 +653,57 @@ int outernet_uplink_build_packet(int lane)
     if (!lane_queues[lane]) { retVal=-1; break;}
     if (lane_queues[lane]->serialised_bundle_number==-1)
        { retVal=-1; break;}
-  
-    // 3/4 of the usable bytes are available for data
-    int data_bytes=(outernet_mtu-(1+2+1))*3/4;
-    int parity_bytes=data_bytes/3;
-    if (parity_bytes*3!=data_bytes) {
-      LOG_ERROR("Parity stripe size problem. MTU=%d, data_bytes=%d, parity_bytes=%d",
-		outernet_mtu,data_bytes,parity_bytes);
-      retVal=-1;
-      break;
-    }
 
-    // Work out where parity zone lies, i.e., which 3 packets
-    // worth of data.
-    int parity_zone_size=data_bytes*4;
-    int parity_zone_start=lane_queues[lane]->serialised_offset
-      -(lane_queues[lane]->serialised_offset%parity_zone_size);
-    // Within that, work out where the parity stripe lies, i.e.,
-    // which third of a packet offset.
-    int parity_stripe_number=
-      (lane_queues[lane]->serialised_offset-parity_zone_start)
-      /data_bytes;
-    LOG_NOTE("serialised_offset=%d, parity_zone_start=%d, parity_stripe_number=%d, data_bytes=%d, parity_bytes=%d, serialised_len=%d",
-	     lane_queues[lane]->serialised_offset,
-	     parity_zone_start,parity_stripe_number,
-	     data_bytes,parity_bytes,
-	     lane_queues[lane]->serialised_len	     );
-
-    /* Generate the parity stripe for this zone.
-       For each block of data, we XOR together 1/3 of each of the other 
-       three data blocks in the parity zone to produce the parity stripe.
-       
-    */
-    unsigned char *dataStart=&lane_queues[lane]->serialised_bundle[parity_zone_start];
-    unsigned char parity_stripe[MAX_MTU];
-    unsigned char *srcA,*srcB,*srcC;
-    switch (parity_stripe_number) {
-    case 0:
-      srcA=&dataStart[data_bytes*1+parity_bytes*0];
-      srcB=&dataStart[data_bytes*2+parity_bytes*0];
-      srcC=&dataStart[data_bytes*3+parity_bytes*0];
-      break;
-    case 1:
-      srcA=&dataStart[data_bytes*0+parity_bytes*0];
-      srcB=&dataStart[data_bytes*2+parity_bytes*1];
-      srcC=&dataStart[data_bytes*3+parity_bytes*1];
-      break;
-    case 2:
-      srcA=&dataStart[data_bytes*0+parity_bytes*1];
-      srcB=&dataStart[data_bytes*1+parity_bytes*1];
-      srcC=&dataStart[data_bytes*3+parity_bytes*2];
-      break;
-    case 3:
-      srcA=&dataStart[data_bytes*0+parity_bytes*2];
-      srcB=&dataStart[data_bytes*1+parity_bytes*2];
-      srcC=&dataStart[data_bytes*2+parity_bytes*2];
-      break;
+    struct outernet_lane_tx_queue *q=lane_queues[lane];
+    int k=q->fec.k;
+    int m=q->fec.m;
+    int shard_bytes=outernet_mtu-OUTERNET_HEADER_LEN;
+    int zone=q->serialised_seq/(k+m);
+    int shard=q->serialised_seq%(k+m);
+    unsigned char *zone_data=&q->serialised_bundle[zone*k*shard_bytes];
+    LOG_NOTE("serialised_seq=%d, zone=%d, shard=%d (k=%d, m=%d), shard_bytes=%d, serialised_len=%d",
+	     q->serialised_seq,zone,shard,k,m,shard_bytes,q->serialised_len);
+
+    // Work out the parity for the whole zone as we start it
+    if (!shard) {
+      unsigned char *data[RS_ERASURE_MAX_SHARDS];
+      unsigned char *parity[RS_ERASURE_MAX_SHARDS];
+      for(int i=0;i<k;i++) data[i]=&zone_data[i*shard_bytes];
+      for(int i=0;i<m;i++) parity[i]=q->parity_shards[i];
+      rs_erasure_encode(&q->fec,data,parity,shard_bytes);
     }
-    for(int i=0;i<parity_bytes;i++) parity_stripe[i]=srcA[i]^srcB[i]^srcC[i];
 
-    // Glue everything together:
-
-    bcopy(&lane_queues[lane]->serialised_bundle[lane_queues[lane]->serialised_offset],&outernet_packet[1+2+1],data_bytes);
-    bcopy(parity_stripe,&outernet_packet[1+2+1+data_bytes],parity_bytes);
+    if (shard<k)
+      bcopy(&zone_data[shard*shard_bytes],&outernet_packet[OUTERNET_HEADER_LEN],shard_bytes);
+    else
+      bcopy(q->parity_shards[shard-k],&outernet_packet[OUTERNET_HEADER_LEN],shard_bytes);
     
     // Sequence number
-    int seq=lane_queues[lane]->serialised_offset/data_bytes;
+    int seq=q->serialised_seq&0x3fff;
     // Start of bundle marker
-    if (!lane_queues[lane]->serialised_offset) seq|=0x4000;
+    if (!q->serialised_seq) seq|=0x4000;
+    q->serialised_seq++;
 
-    lane_queues[lane]->serialised_offset+=data_bytes;
+    outernet_packet[0]=OUTERNET_LANE_RS|lane;
+    outernet_packet[3]=outernet_mtu;
+    outernet_packet[4]=k;
+    outernet_packet[5]=m;
+    outernet_packet_len=OUTERNET_HEADER_LEN+shard_bytes;
 
-    // Send to end of serialised bundle + rounded out to end of parity zone, to make sure end of
-    // bundle is protected as well as the rest of it is.
-    if ((lane_queues[lane]->serialised_offset>=lane_queues[lane]->serialised_len)
-        &&(parity_stripe_number==3)) {
+    // The last packet is the last parity packet of the last zone, so that
+    // the end of the bundle is protected as well as the rest of it is.
+    if ((shard==k+m-1)&&((zone+1)*k*shard_bytes>=q->serialised_len)) {
       // Last packet in bundle
       seq|=0x8000;
+      q->passes_completed++;
+      metric_counter_add("lbard_outernet_uplink_passes_total",outernet_lane_label(lane),1);
       // So get ready for next one
       outernet_uplink_lane_dequeue_current(lane);
     }
 
-    outernet_packet[0]=lane&0xff;
     outernet_packet[1]=(seq>>0)&0xff;
     outernet_packet[2]=(seq>>8)&0xff;
-    outernet_packet[3]=outernet_mtu;
 
-    outernet_packet_len=1+2+1+data_bytes+parity_bytes;
     // dump_bytes(stderr,"Packet for uplink",outernet_packet,outernet_packet_len);
     
   } while(0);
@@ -608,6 +713,73 @@ int outernet_uplink_build_packet(int lane)
 }
 				 
 
+/*
+  The lanes share the uplink in rotations: a rotation visits the lanes in
+  order, and each lane taking part sends one packet, so that consecutive
+  packets of a lane always have the other lanes of the rotation between them.
+  The weights decide which lanes take part.  At the start of each rotation,
+  every busy lane earns its weight in credit, and those with at least the
+  weight of the heaviest busy lane spend that much to join.  So the heaviest
+  lane is in every rotation, and a lane of half its weight in every other.
+  A lane that was idle starts with no credit, rather than catching up on the
+  turns it didn't need.
+*/
+int outernet_uplink_start_rotation(void)
+{
+  int heaviest=0;
+  for(int lane=0;lane<UPLINK_LANES;lane++) {
+    struct outernet_lane_tx_queue *q=lane_queues[lane];
+    if (!q) continue;
+    if (q->serialised_bundle_number==-1) outernet_uplink_next_in_queue(lane);
+    if (q->serialised_bundle_number==-1) { q->busy=0; q->in_rotation=0; continue; }
+    if (!q->busy) { q->credit=0; q->busy=1; }
+    if (q->weight>heaviest) heaviest=q->weight;
+  }
+
+  int members=0;
+  for(int lane=0;lane<UPLINK_LANES;lane++) {
+    struct outernet_lane_tx_queue *q=lane_queues[lane];
+    if ((!q)||(!q->busy)) continue;
+    q->credit+=q->weight;
+    q->in_rotation=(q->credit>=heaviest);
+    if (q->in_rotation) { q->credit-=heaviest; members++; }
+  }
+  outernet_rotation_next=0;
+  return members;
+}
+
+/*
+  Returns the next lane of the current rotation, starting a new rotation
+  when it is done, with a bundle serialised and ready, or -1 if there is
+  nothing to uplink.
+*/
+int outernet_uplink_choose_lane(void)
+{
+  for(int rotations=0;rotations<2;rotations++) {
+    while(outernet_rotation_next<UPLINK_LANES) {
+      int lane=outernet_rotation_next++;
+      struct outernet_lane_tx_queue *q=lane_queues[lane];
+      if ((!q)||(!q->in_rotation)) continue;
+      q->in_rotation=0;
+      if (q->serialised_bundle_number==-1) outernet_uplink_next_in_queue(lane);
+      if (q->serialised_bundle_number!=-1) return lane;
+    }
+    if (!outernet_uplink_start_rotation()) return -1;
+  }
+  return -1;
+}
+
+int outernet_uplink_account_packet(int lane,int bytes)
+{
+  struct outernet_lane_tx_queue *q=lane_queues[lane];
+  q->packets_uplinked++;
+  q->bytes_uplinked+=bytes;
+  metric_counter_add("lbard_outernet_uplink_packets_total",outernet_lane_label(lane),1);
+  metric_counter_add("lbard_outernet_uplink_bytes_total",outernet_lane_label(lane),bytes);
+  metric_gauge_set("lbard_outernet_uplink_lane_bundles",outernet_lane_label(lane),q->queue_len);
+  return 0;
+}
+
 int outernet_serviceloop(int serialfd)
 {
   int retVal=0;
@@ -646,41 +818,17 @@ int outernet_serviceloop(int serialfd)
 
     // XXX Enforce 1 sec time out to deal with packet loss for now.
     if ((gettime_ms()-last_uplink_packet_time)>1000) {
-      // 1 minute has passed, or we have received an ack for our last
-      // packet, so send next uplink packet.
-      // Note that if some lanes don't have anything to send,
-      // we don't just send the next thing for another lane,
-      // because the interlacing of lanes is to separate successive
-      // packets in time for a single lane sufficiently to provide
-      // some tolerance against fade.
-      // Thus if we have nothing to send for the current lane, we
-      // send whatever it was we sent last time.  Thus we gain some
-      // further redundancy.  This could of course be greatly
-      // improved, for example by remembering the last n packets
-      // for each lane, and sending older ones, so that we have a
-      // longer effective window.  But for now, the goal is to prove
-      // the concept, and get something that works reasonably.
-      
-      last_uplink_lane++;
-      if (last_uplink_lane<0||last_uplink_lane>4) last_uplink_lane=0;
-      if (lane_queues[last_uplink_lane]) {
-	// Make sure we have something to uplink
-	if (lane_queues[last_uplink_lane]->serialised_bundle_number==-1) {
-	  LOG_NOTE("Nothing queued in lane #%d, so trying to queue something",last_uplink_lane);
-	  outernet_uplink_next_in_queue(last_uplink_lane);
-	}
-	// If still nothing to uplink, then do nothing, i.e.,
-	// resend last packet.  Else, replace packet content.
-	if (lane_queues[last_uplink_lane]->serialised_bundle_number==-1) {
-	  // This queue is idle, try to get something on it
-	  outernet_uplink_next_in_queue(last_uplink_lane);
-	}
-	if (lane_queues[last_uplink_lane]->serialised_bundle_number!=-1) {
-	  LOG_NOTE("Something in the queue for lane #%d, namely bundle #%d BID %s)",last_uplink_lane,
-		   lane_queues[last_uplink_lane]->serialised_bundle_number,
-		   bundles[lane_queues[last_uplink_lane]->serialised_bundle_number].bid_hex);
-	  outernet_uplink_build_packet(last_uplink_lane);
-	}
+      // 1 second has passed, or we have received an ack for our last
+      // packet, so send next uplink packet from whichever lane is due.
+      // If no lane has anything to send, we send whatever it was we sent
+      // last time, and thus gain some further redundancy.
+      last_uplink_lane=outernet_uplink_choose_lane();
+      if (last_uplink_lane>=0) {
+	LOG_NOTE("Something in the queue for lane #%d, namely bundle #%d BID %s)",last_uplink_lane,
+		 lane_queues[last_uplink_lane]->serialised_bundle_number,
+		 bundles[lane_queues[last_uplink_lane]->serialised_bundle_number].bid_hex);
+	outernet_uplink_build_packet(last_uplink_lane);
+	outernet_uplink_account_packet(last_uplink_lane,outernet_packet_len);
       }
 
       if (outernet_packet_len>0) {
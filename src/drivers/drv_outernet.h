@@ -4,3 +4,15 @@ int outernet_process_line(char *l);
 int outernet_receive_bytes(unsigned char *bytes,int count);
 int outernet_send_packet(int serialfd,unsigned char *out, int len);
 int outernet_check_if_ready(void);
+
+/*
+  Outernet lane packets (see outernet_uplink_build_packet()):
+  lane number + 0x80, 2 byte sequence number with start and end markers,
+  logical MTU, data shards (k) and parity shards (m) per zone, then one
+  shard of MTU - OUTERNET_HEADER_LEN bytes.
+*/
+#define OUTERNET_HEADER_LEN 6
+#define OUTERNET_LANE_RS 0x80
+#define OUTERNET_DEFAULT_FEC_K 12
+#define OUTERNET_DEFAULT_FEC_M 4
+int outernet_set_fec(char *spec);
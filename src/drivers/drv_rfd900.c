@@ -58,9 +58,7 @@ long long congestion_update_time=0;
 
 #define MAX_PACKET_SIZE 255
 
-// This need only be the maximum control header size + maximum packet size
-#define RADIO_RXBUFFER_SIZE 64+MAX_PACKET_SIZE
-unsigned char radio_rx_buffer[RADIO_RXBUFFER_SIZE];
+struct rfd900_rx rfd900_rx;
 
 int last_rx_rssi=-1;
 unsigned char *packet_data=NULL;
@@ -78,13 +76,23 @@ extern char *servald_server;
 extern char *credential;
 extern char *prefix;
 
-int target_transmissions_per_4seconds=TARGET_TRANSMISSIONS_PER_4SECONDS;
+// packetrate=: a fixed target, as we used to have, instead of adapting
+int target_transmissions_per_4seconds=0;
+// channeltarget=: share of airtime to aim for, in percent (0 for the default)
+int target_channel_occupancy=0;
 
 int rfd900_serviceloop(int serialfd)
 {
   // Deal with clocks running backwards sometimes
   if ((congestion_update_time-gettime_ms())>4000)
     congestion_update_time=gettime_ms()+4000;
+
+  struct rate_control *rc=&radio_interface->rate_control;
+  if (!radio_interface->rate_control_ready) {
+    rate_control_init(rc,target_transmissions_per_4seconds,target_channel_occupancy);
+    rc->interval_ms=message_update_interval;
+    radio_interface->rate_control_ready=1;
+  }
   
   if (gettime_ms()>congestion_update_time) {
     /* Very 4 seconds count how many radio packets we have seen, so that we can
@@ -93,70 +101,24 @@ int rfd900_serviceloop(int serialfd)
        should be able to send packets very often. But if there are lots of stations
        on channel, then we should back-off.
     */
-
-    double ratio = 1.00;
-    if (target_transmissions_per_4seconds)
-      ratio = (radio_transmissions_seen+radio_transmissions_byus)
-	*1.0/target_transmissions_per_4seconds;
-    else {
-      fprintf(stderr,"WARNING: target_transmissions_per_4seconds = 0\n");
-    }
-    // printf("--- Congestion ratio = %.3f\n",ratio);
-    if (ratio<0.95) {
-      // Speed up: If we are way too slow, then double our rate
-      // If not too slow, then just trim 10ms from our interval
-      if (ratio<0.25) message_update_interval/=2;
-      else {
-	int adjust=10;
-	if ((ratio<0.80)&&(message_update_interval>300)) adjust=20;
-	if ((ratio<0.50)&&(message_update_interval>300)) adjust=50;
-	if (ratio>0.90) adjust=3;
-	// Only increase our packet rate, if we are not already hogging the channel
-	// i.e., we are allowed to send at most 1/n of the packets.
-	float max_packets_per_second=1;
-	int active_peers=active_peer_count();
-	if (active_peers) {
-	  max_packets_per_second=(TARGET_TRANSMISSIONS_PER_4SECONDS/active_peers)
-	    /4.0;
-	}
-	int minimum_interval=1000.0/max_packets_per_second;
-	if (radio_transmissions_byus<=radio_transmissions_seen)
-	  message_update_interval-=adjust;
-	if (message_update_interval<minimum_interval)
-	  message_update_interval=minimum_interval;
-      }
-    } else if (ratio>1.0) {
-      // Slow down!  We slow down quickly, so as to try to avoid causing
-      // too many colissions.
-      message_update_interval*=(ratio+0.4);
-      if (!message_update_interval) message_update_interval=50;
-      if (message_update_interval>4000) message_update_interval=4000;
-    }
-    
-    if (!radio_transmissions_seen) {
-      // If we haven't seen anyone else transmit anything, then only transmit
-      // at a slow rate, so that we don't jam the channel and flatten our battery
-      // while waiting for a peer
-      message_update_interval=1000;
-    }
-    
-    // Make randomness 1/4 of interval, or 25ms, whichever is greater.
-    // The addition of the randomness means that we should never actually reach
-    // our target capacity.
-    message_update_interval_randomness = message_update_interval >> 2;
-    if (message_update_interval_randomness<25)
-      message_update_interval_randomness=25;
-    
-    // Force message interval to be at least 150ms + randomness
-    // This keeps duty cycle < about 10% always.
-    // 4 - 5 packets per second is therefore the fastest that we will go
-    // (256 byte packet @ 128kbit/sec takes ~20ms)
-    if (message_update_interval<150)
-      message_update_interval=150;
-    
-    printf("*** TXing every %d+1d%dms, ratio=%.3f (%d+%d)\n",
-	   message_update_interval,message_update_interval_randomness,ratio,
-	   radio_transmissions_seen,radio_transmissions_byus);
+    struct rate_control_window w;
+    w.window_ms=RATE_CONTROL_WINDOW_MS;
+    if (congestion_update_time)
+      w.window_ms+=gettime_ms()-congestion_update_time;
+    w.frames_sent=radio_transmissions_byus;
+    w.frames_heard=radio_transmissions_seen;
+    w.frames_missed=radio_frames_missed;
+    w.bytes_sent=radio_bytes_sent;
+    w.bytes_heard=radio_bytes_heard;
+    w.active_peers=active_peer_count();
+    rate_control_update(rc,&w);
+    message_update_interval=rc->interval_ms;
+    message_update_interval_randomness=rc->randomness_ms;
+
+    printf("*** TXing every %d+1d%dms, occupancy=%.3f, loss=%.3f (%d+%d, %d missed)\n",
+	   message_update_interval,message_update_interval_randomness,
+	   rc->occupancy,rc->loss,
+	   radio_transmissions_seen,radio_transmissions_byus,radio_frames_missed);
     congestion_update_time=gettime_ms()+4000;
     
     if (radio_transmissions_seen) {
@@ -176,128 +138,191 @@ int rfd900_serviceloop(int serialfd)
     
     radio_transmissions_seen=0;
     radio_transmissions_byus=0;
+    radio_frames_missed=0;
+    radio_bytes_sent=0;
+    radio_bytes_heard=0;
   }
   
   return 0;
 }
 
-int rfd900_receive_bytes(unsigned char *bytes,int count)
-{
-  int i;
-  for(i=0;i<count;i++) {
-      
-    bcopy(&radio_rx_buffer[1],&radio_rx_buffer[0],RADIO_RXBUFFER_SIZE-1);
-    radio_rx_buffer[RADIO_RXBUFFER_SIZE-1]=bytes[i];
-
-    /*
-      The revised RFD900+ firmware for the Mesh Extender 2.0 sends a little
-      more useful information.
-
-      It is framed with UTF-8 characters for in and out trays for human readability,
-      and the various internal fields have also been improved for human readability.
-
-      Preamble - 4 bytes 0xf0, 0x9f, 0x93, 0xa5
-      Radio temperature - 4 byts  <+/->nnn
-      Degree UTF-8 symbol - 2 bytes 0xc2, 0xb0
-      GPIO state - 6 bytes, each one of 0,1,X or x
-      Board frequency band - 2 bytes, e.g., "86" or "91"
-      Postamble - 4 bytes 0xf0, 0x9f, 0x93, 0xa4
-    */
+/*
+  The radio interleaves what it receives with its own reports, and both are
+  recognised by what they end with.  Serial reads are appended to a window
+  that is only compacted when it fills, keeping enough behind the newest
+  byte for the longest packet and its envelope, so every trailer and the
+  packet in front of it can be looked at (and handed to saw_packet()) where
+  they lie.  Only bytes that can end a trailer are looked at more closely.
+*/
+
+/*
+  The revised RFD900+ firmware for the Mesh Extender 2.0 sends a little
+  more useful information.
+
+  It is framed with UTF-8 characters for in and out trays for human readability,
+  and the various internal fields have also been improved for human readability.
+
+  Preamble - 4 bytes 0xf0, 0x9f, 0x93, 0xa5
+  Radio temperature - 4 byts  <+/->nnn
+  Degree UTF-8 symbol - 2 bytes 0xc2, 0xb0
+  GPIO state - 6 bytes, each one of 0,1,X or x
+  Board frequency band - 2 bytes, e.g., "86" or "91"
+  Postamble - 4 bytes 0xf0, 0x9f, 0x93, 0xa4
+*/
 #define REPORT_LENGTH (4+4+2+6+2+4)
-    int template[REPORT_LENGTH]={
-      0xf0, 0x9f, 0x93, 0xa5,
-      -1,-1,-1,-1,
-      0xc2,0xb0,
-      -1,-1,-1,-1,-1,-1,
-      -1,-1,
-      0xf0,0x9f,0x93,0xa4};
-    int isReport=1;
+static const int rfd900_report_template[REPORT_LENGTH]={
+  0xf0, 0x9f, 0x93, 0xa5,
+  -1,-1,-1,-1,
+  0xc2,0xb0,
+  -1,-1,-1,-1,-1,-1,
+  -1,-1,
+  0xf0,0x9f,0x93,0xa4};
+
+// The last byte of each kind of trailer
+static const unsigned char rfd900_trailer_last[256]={
+  [0xa4]=RFD900_RX_REPORT,
+  [0xdd]=RFD900_RX_OLD_REPORT,
+  [0x55]=RFD900_RX_ENVELOPE
+};
+
+// What kind of trailer, if any, ends just before end
+static int rfd900_trailer_kind(unsigned char *end)
+{
+  switch(rfd900_trailer_last[end[-1]]) {
+  case RFD900_RX_REPORT:
     for(int i=0;i<REPORT_LENGTH;i++)
-      if (template[i]!=-1)
-	if (radio_rx_buffer[RADIO_RXBUFFER_SIZE-REPORT_LENGTH+i]!=template[i])
-	  { isReport=0;
-	    break; }
-    if (isReport) {
-      char tempstring[5]={radio_rx_buffer[RADIO_RXBUFFER_SIZE-REPORT_LENGTH+4+0],
-			  radio_rx_buffer[RADIO_RXBUFFER_SIZE-REPORT_LENGTH+4+1],
-			  radio_rx_buffer[RADIO_RXBUFFER_SIZE-REPORT_LENGTH+4+2],
-			  radio_rx_buffer[RADIO_RXBUFFER_SIZE-REPORT_LENGTH+4+3],
-			  0};
-      radio_last_heartbeat_time=gettime_ms();
-      radio_temperature=atoi(tempstring);
-      printf("Radio temperature = %dC, frequency band = %c%c\n",
-	     radio_temperature,
-	     radio_rx_buffer[RADIO_RXBUFFER_SIZE-REPORT_LENGTH+4+4+2+6+0],
-	     radio_rx_buffer[RADIO_RXBUFFER_SIZE-REPORT_LENGTH+4+4+2+6+1]);
-      if (debug_gpio) {
-	printf("GPIO ADC values = [");
-	for(int j=0;j<6;j++) {
-	  printf("%c",
-		 radio_rx_buffer[RADIO_RXBUFFER_SIZE-REPORT_LENGTH+4+4+2+j]);
-	}
-	printf("]  Radio TX interval = %dms, TX seen = %d, TX us = %d\n",
-	       message_update_interval,
-	       radio_transmissions_seen,
-	       radio_transmissions_byus);
-      }
-      
-    } else if ((radio_rx_buffer[RADIO_RXBUFFER_SIZE-1]==0xdd)
-	       &&(radio_rx_buffer[RADIO_RXBUFFER_SIZE-8]==0xec)
-	       &&(radio_rx_buffer[RADIO_RXBUFFER_SIZE-9]==0xce))
-      // Support old-style RFD900 Mesh Extender firmware reports
-      {
-	if (debug_gpio) {
-	  printf("GPIO ADC values = ");
-	  for(int j=0;j<6;j++) {
-	    printf("%s0x%02x",
-		   j?",":"",
-		   radio_rx_buffer[RADIO_RXBUFFER_SIZE-7+j]);
-	  }
-	  printf(".  Radio TX interval = %dms, TX seen = %d, TX us = %d\n",
-		 message_update_interval,
-		 radio_transmissions_seen,
-		 radio_transmissions_byus);
-	}
-      } else if ((radio_rx_buffer[RADIO_RXBUFFER_SIZE-1]==0x55)
-		 &&(radio_rx_buffer[RADIO_RXBUFFER_SIZE-8]==0x55)
-		 &&(radio_rx_buffer[RADIO_RXBUFFER_SIZE-9]==0xaa))
-      {
-	// Found RFD900 CSMA envelope: packet was immediately before this
-	int packet_bytes=radio_rx_buffer[RADIO_RXBUFFER_SIZE-4];
-	radio_last_heartbeat_time=gettime_ms();
-	radio_temperature=radio_rx_buffer[RADIO_RXBUFFER_SIZE-5];
-	last_rx_rssi=radio_rx_buffer[RADIO_RXBUFFER_SIZE-7];
-	
-	int buffer_space=radio_rx_buffer[RADIO_RXBUFFER_SIZE-3];
-	buffer_space+=radio_rx_buffer[RADIO_RXBUFFER_SIZE-2]*256;	
+      if ((rfd900_report_template[i]!=-1)
+	  &&(end[i-REPORT_LENGTH]!=rfd900_report_template[i]))
+	return 0;
+    return RFD900_RX_REPORT;
+  case RFD900_RX_OLD_REPORT:
+    // Old-style RFD900 Mesh Extender firmware reports
+    if ((end[-8]==0xec)&&(end[-9]==0xce)) return RFD900_RX_OLD_REPORT;
+    return 0;
+  case RFD900_RX_ENVELOPE:
+    // RFD900 CSMA envelope: packet was immediately before this
+    if ((end[-8]==0x55)&&(end[-9]==0xaa)) return RFD900_RX_ENVELOPE;
+    return 0;
+  }
+  return 0;
+}
 
-	if (packet_bytes>MAX_PACKET_SIZE) packet_bytes=0;       
-	packet_data = &radio_rx_buffer[RADIO_RXBUFFER_SIZE-9-packet_bytes];
-	radio_transmissions_seen++;
-	
-	if (packet_bytes) {
-	  // Have whole packet
-	  if (debug_radio)
-	    message_buffer_length+=
-	      snprintf(&message_buffer[message_buffer_length],
-		       message_buffer_size-message_buffer_length,
-		       "Saw RFD900 CSMA Data frame: temp=%dC, last rx RSSI=%d, frame len=%d\n",
-		       radio_temperature, last_rx_rssi,
-		       packet_bytes);
-
-	  if (saw_packet(packet_data,packet_bytes,last_rx_rssi,
-			 my_sid_hex,prefix,
-			 servald_server,credential)) {
-	  } else {
-	  }
-	  	  
-	  packet_bytes=0;
-	}
+int rfd900_rx_init(struct rfd900_rx *rx,
+		   int (*saw_trailer)(struct rfd900_rx *rx,int kind,unsigned char *end))
+{
+  bzero(rx,sizeof(struct rfd900_rx));
+  // Start as though we had already seen a packet's worth of zeroes
+  rx->end=RFD900_RX_HISTORY;
+  rx->saw_trailer=saw_trailer;
+  return 0;
+}
+
+int rfd900_rx_scan(struct rfd900_rx *rx,unsigned char *bytes,int count)
+{
+  while(count>0) {
+    if (rx->end==RFD900_RX_WINDOW_SIZE) {
+      memmove(rx->window,&rx->window[rx->end-RFD900_RX_HISTORY],RFD900_RX_HISTORY);
+      rx->end=RFD900_RX_HISTORY;
+    }
+    int n=RFD900_RX_WINDOW_SIZE-rx->end;
+    if (n>count) n=count;
+    unsigned char *p=&rx->window[rx->end];
+    unsigned char *new_end=p+n;
+    memcpy(p,bytes,n);
+    rx->end+=n; bytes+=n; count-=n;
+
+    for(;p<new_end;p++) {
+      if (!rfd900_trailer_last[*p]) continue;
+      int kind=rfd900_trailer_kind(p+1);
+      if (kind) rx->saw_trailer(rx,kind,p+1);
+    }
+  }
+  return 0;
+}
+
+static int rfd900_saw_trailer(struct rfd900_rx *rx,int kind,unsigned char *end)
+{
+  switch(kind) {
+  case RFD900_RX_REPORT: {
+    unsigned char *report=end-REPORT_LENGTH;
+    char tempstring[5]={report[4+0],report[4+1],report[4+2],report[4+3],0};
+    radio_last_heartbeat_time=gettime_ms();
+    radio_temperature=atoi(tempstring);
+    printf("Radio temperature = %dC, frequency band = %c%c\n",
+	   radio_temperature,
+	   report[4+4+2+6+0],
+	   report[4+4+2+6+1]);
+    if (debug_gpio) {
+      printf("GPIO ADC values = [");
+      for(int j=0;j<6;j++) {
+	printf("%c",report[4+4+2+j]);
+      }
+      printf("]  Radio TX interval = %dms, TX seen = %d, TX us = %d\n",
+	     message_update_interval,
+	     radio_transmissions_seen,
+	     radio_transmissions_byus);
+    }
+    break;
+  }
+  case RFD900_RX_OLD_REPORT:
+    if (debug_gpio) {
+      printf("GPIO ADC values = ");
+      for(int j=0;j<6;j++) {
+	printf("%s0x%02x",
+	       j?",":"",
+	       end[-7+j]);
       }
+      printf(".  Radio TX interval = %dms, TX seen = %d, TX us = %d\n",
+	     message_update_interval,
+	     radio_transmissions_seen,
+	     radio_transmissions_byus);
+    }
+    break;
+  case RFD900_RX_ENVELOPE: {
+    int packet_bytes=end[-4];
+    radio_last_heartbeat_time=gettime_ms();
+    radio_temperature=end[-5];
+    last_rx_rssi=end[-7];
+
+    int buffer_space=end[-3];
+    buffer_space+=end[-2]*256;
+
+    if (packet_bytes>MAX_PACKET_SIZE) packet_bytes=0;
+    packet_data=end-9-packet_bytes;
+    radio_transmissions_seen++;
+    radio_bytes_heard+=packet_bytes;
+
+    if (packet_bytes) {
+      // Have whole packet
+      // (the message buffer belongs to the main loop, not the radio thread)
+      if (debug_radio&&threads_on_radio_thread())
+	printf("Saw RFD900 CSMA Data frame: temp=%dC, last rx RSSI=%d, frame len=%d\n",
+	       radio_temperature, last_rx_rssi,
+	       packet_bytes);
+      else if (debug_radio)
+	message_buffer_length+=
+	  snprintf(&message_buffer[message_buffer_length],
+		   message_buffer_size-message_buffer_length,
+		   "Saw RFD900 CSMA Data frame: temp=%dC, last rx RSSI=%d, frame len=%d\n",
+		   radio_temperature, last_rx_rssi,
+		   packet_bytes);
+
+      saw_packet(packet_data,packet_bytes,last_rx_rssi,
+		 my_sid_hex,prefix,
+		 servald_server,credential);
+    }
+    break;
+  }
   }
   return 0;
 }
 
+int rfd900_receive_bytes(unsigned char *bytes,int count)
+{
+  if (!rfd900_rx.saw_trailer) rfd900_rx_init(&rfd900_rx,rfd900_saw_trailer);
+  return rfd900_rx_scan(&rfd900_rx,bytes,count);
+}
+
 int rfd900_radio_detect(int fd)
 {
   /* Initialise an RFD900 radio.
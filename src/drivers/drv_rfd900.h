@@ -1,6 +1,31 @@
+#ifndef __DRV_RFD900_H__
+#define __DRV_RFD900_H__
+
 int always_ready(void);
 int rfd900_serviceloop(int serialfd);
 int rfd900_receive_bytes(unsigned char *bytes,int count);
 int rfd900_radio_detect(int fd);
 int rfd900_set_tx_power(int serialfd);
 int rfd900_send_packet(int serialfd,unsigned char *out, int offset);
+
+// What we keep behind the newest byte: the longest packet, envelope and all
+#define RFD900_RX_HISTORY (64+255)
+#define RFD900_RX_WINDOW_SIZE 4096
+
+// Kinds of trailer
+#define RFD900_RX_REPORT 1
+#define RFD900_RX_OLD_REPORT 2
+#define RFD900_RX_ENVELOPE 3
+
+struct rfd900_rx {
+  unsigned char window[RFD900_RX_WINDOW_SIZE];
+  int end;
+  // Called with a pointer just past the last byte of each trailer found
+  int (*saw_trailer)(struct rfd900_rx *rx,int kind,unsigned char *end);
+};
+
+int rfd900_rx_init(struct rfd900_rx *rx,
+		   int (*saw_trailer)(struct rfd900_rx *rx,int kind,unsigned char *end));
+int rfd900_rx_scan(struct rfd900_rx *rx,unsigned char *bytes,int count);
+int rfd900_benchmark(char *capture_file,int read_bytes);
+#endif
@@ -16,17 +16,25 @@ struct barrett_radio_state {
 
   // The set of channels
 
-  // The list of radios 
+  // The list of radios: every Barrett radio in the simulation, indexed by
+  // client number, with this one marked as self (see AIATBL).
+
+  // The radio we have an ALE link with, from when
+  int linked;
+  int link_partner;
+  long long link_time;
   
 // Commands and responses we implement
 // "AXLINK'+<link partner> make connection to peer
 //     (modem doesn't respond preemptively, must be queried with AILTBL)
 // "AILTBL" - query current ALE link status
 //   "AILTBL" - ALE not connected/no longer connected
-//   "AILTBL"+<linkpartner> - ALE link established to this partner
+//   "AILTBL"+<link number>+<self index>+<partner index> - ALE link established
 // "AXNMGS"+<linkpartner>+<two digit message length in decimal>+<message text>
 //    OK or EV response after sending
-//    "AIAMDM"+<message> - ALE message received
+//    "AISTAT" - whether we are idle, sending or receiving
+//    "AIMESS1" - message sent
+//    "AIAMDM"+<linkpartner>+<length>+<message> - ALE message received
 
 };
 
@@ -34,9 +42,105 @@ struct barrett_radio_state barrett[MAX_CLIENTS];
 
 unsigned char barrett_e0_string[6]={0x13,'E','0',13,10,0x11};
 unsigned char barrett_ok_string[6]={0x13,'O','K',13,10,0x11};
-unsigned char AIATBL_resp[50]={0x13,'A','I','A','T','B','L','0','0','1','1','5','F','A','K','1','B','A','R','2','0','2','A','0','0','2','4',
-'0','1','2','1','5','F','A','K','2','B','A','R','2','0','2','A','0','0','2','4',13,10,0x11};
-unsigned char AILTBL_resp[14]={0x13,'A','I','L','T','B','L', 13 ,10 ,0x11};
+
+extern long long rx_delivered_packets;
+extern long long rx_lost_packets;
+
+// Responses are framed by XOFF ... CRLF XON
+int barrett_say(int client,long long when,char *line)
+{
+  char msg[RX_PACKET_MAX];
+  snprintf(msg,sizeof(msg),"\x13%s\r\n\x11",line);
+  return enqueue_response_for_client(client,when,(uint8_t *)msg,strlen(msg));
+}
+
+// The address table, with one entry per Barrett radio
+int barrett_address_table(int client)
+{
+  char line[RX_PACKET_MAX]="AIATBL";
+  int len=strlen(line);
+  for(int k=0;k<client_count&&k<100;k++) {
+    if (clients[k].radio_type!=RADIO_HFBARRETT) continue;
+    if (len+11>=sizeof(line)-6) break;
+    len+=snprintf(&line[len],sizeof(line)-len,"%02d%c06FAKE%02d",
+		  k,(k==client)?'1':'2',k);
+  }
+  return barrett_say(client,gettime_ms(),line);
+}
+
+int barrett_link_table(int client)
+{
+  char line[64];
+  struct barrett_radio_state *b=&barrett[client];
+  if (b->linked&&(gettime_ms()>=b->link_time))
+    snprintf(line,sizeof(line),"AILTBL01%02d%02d",client,b->link_partner);
+  else
+    snprintf(line,sizeof(line),"AILTBL");
+  return barrett_say(client,gettime_ms(),line);
+}
+
+// An ALE call to a radio that can hear us always gets a link
+int barrett_link(int client,char *args)
+{
+  int callee=-1;
+  if ((strlen(args)<4)||(sscanf(args,"%2d",&callee)!=1)) return -1;
+  int reachable=0;
+  for(int n=0;n<clients[client].neighbour_count;n++)
+    if ((clients[client].neighbours[n]==callee)
+	&&(clients[callee].radio_type==RADIO_HFBARRETT)) reachable=1;
+  if (!reachable) return 0;
+  long long done=gettime_ms()+hf_amd_airtime_ms(0)*4;
+  hf_start_transmitting(client,done);
+  barrett[client].linked=1;
+  barrett[client].link_partner=callee;
+  barrett[client].link_time=done;
+  barrett[callee].linked=1;
+  barrett[callee].link_partner=client;
+  barrett[callee].link_time=done;
+  return 0;
+}
+
+/*
+  Send an AMD message to our link partner.  We say that we are sending
+  straight away, and that the message has been sent once its time on the
+  air is up, when the partner gets it, unless it was lost or collided on
+  the way.  The partner hears us start, as the real radios do.
+*/
+int barrett_send_amd(int client,char *args)
+{
+  char line[RX_PACKET_MAX];
+  int len;
+  if ((strlen(args)<6)||(sscanf(&args[4],"%2d",&len)!=1)) return -1;
+  char *message=&args[6];
+  long long now=gettime_ms();
+  long long done=now+hf_amd_airtime_ms(strlen(message));
+  hf_start_transmitting(client,done);
+  hf_amd_messages_sent++;
+  barrett_say(client,now,"OK");
+  barrett_say(client,now,"AISTAT011");
+  struct barrett_radio_state *b=&barrett[client];
+  if (b->linked) {
+    int j=b->link_partner;
+    barrett_say(j,now,"AISTAT021");
+    snprintf(line,sizeof(line),"\x13" "AIAMDM%02d%02d%02d%s\r\n\x11",
+	     client,j,len,message);
+    enqueue_packet_for_client(client,j,done,(uint8_t *)line,strlen(line));
+    barrett_say(j,done,"AISTAT000");
+  }
+  // Codan radios in range hear it too
+  for(int n=0;n<clients[client].neighbour_count;n++) {
+    int j=clients[client].neighbours[n];
+    if (clients[j].radio_type==RADIO_HFCODAN) codan_receive_amd(client,j,done,message);
+  }
+  barrett_say(client,done,"AIMESS1");
+  barrett_say(client,done,"AISTAT000");
+  fprintf(stderr,"Barrett HF Radio #%d sends AMD message of %d chars, taking %lldms"
+	  " (%lld AMD messages sent, %lld delivered, %lld lost in all)\n",
+	  client,(int)strlen(message),done-now,
+	  hf_amd_messages_sent,rx_delivered_packets,rx_lost_packets);
+  return 0;
+}
+
 //tests
 unsigned char test1[6]={0x13,'O','K',13,10,0};
 unsigned char test2[5]={'H','E','L','L','O'};
@@ -67,8 +171,10 @@ int hfbarrett_read_byte(int i,unsigned char c)
       // Process the command here
       if (!strncasecmp("AXNMSG",(char *)clients[i].buffer,6)) {
 	// Send ALE message
-	// XXX- implement me!
-	fprintf(stderr,"Saw AXNMSG command\n");
+	if (barrett_send_amd(i,(char *)&clients[i].buffer[6]))
+	  write(clients[i].socket,barrett_e0_string,6);
+      } else if (!strncasecmp("AXABORT",(char *)clients[i].buffer,7)) {
+	write(clients[i].socket,barrett_ok_string,6);
       } else if (!strncasecmp("ARAMDM",(char *)clients[i].buffer,6)) {
 	// [un]Register for AMD messages
 	switch (clients[i].buffer[6]) {
@@ -140,12 +246,15 @@ int hfbarrett_read_byte(int i,unsigned char c)
 	  write(clients[i].socket,barrett_e0_string,6);
 	}
       } else if (!strncasecmp("AIATBL",(char *)clients[i].buffer,6)) {
-	write(clients[i].socket,AIATBL_resp,50);	
+	barrett_address_table(i);
       }	else if (!strncasecmp("AXLINK",(char *)clients[i].buffer,6)) {
 	printf("link establishment\n");	
-	sleep(4);
+	if (barrett_link(i,(char *)&clients[i].buffer[6]))
+	  write(clients[i].socket,barrett_e0_string,6);
+	else
+	  write(clients[i].socket,barrett_ok_string,6);
       }	else if (!strncasecmp("AILTBL",(char *)clients[i].buffer,6)) {
-	write(clients[i].socket,AIATBL_resp,14);	
+	barrett_link_table(i);
       }else {
 	// Complain about unknown commands
 	fprintf(stderr,"Responding with Barrett E0 string\n");
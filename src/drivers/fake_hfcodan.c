@@ -1,6 +1,105 @@
+#include <ctype.h>
+
 #include "fakecsmaradio.h"
 
 long long codan_starttime=0;
+extern long long rx_delivered_packets;
+extern long long rx_lost_packets;
+
+// What the radio says about ALE calls and AMD messages.  The date and time
+// fields are fixed, as LBARD doesn't look at them.
+int codan_say(int client,long long when,char *line)
+{
+  char msg[RX_PACKET_MAX];
+  snprintf(msg,sizeof(msg),"%s\r\n",line);
+  return enqueue_response_for_client(client,when,(uint8_t *)msg,strlen(msg));
+}
+
+long long codan_amd_unreadable=0;
+
+/*
+  A Codan radio hears AMD messages from any make of radio, and reports them
+  in double quotes, so it can't give us an ALE 2G message (one in the 64
+  character set, 0x20 - 0x5f) with '"' in it, and it loses spaces.  We count
+  those messages and drop them, so that an encoding that sends them shows up
+  here, rather than as a mystery at the other end.
+*/
+int codan_receive_amd(int from,int to,long long when,char *message)
+{
+  char line[RX_PACKET_MAX];
+  int ale2g=1;
+  for(int i=0;message[i];i++)
+    if ((message[i]<0x20)||(message[i]>0x5f)) ale2g=0;
+  if (ale2g&&strpbrk(message," \"")) {
+    codan_amd_unreadable++;
+    fprintf(stderr,"Codan HF Radio #%d can't receive AMD message from #%d, as it contains"
+	    " '%c' (%lld such messages)\n",
+	    to,from,*strpbrk(message," \""),codan_amd_unreadable);
+    return -1;
+  }
+  snprintf(line,sizeof(line),"AMD-CALL: 01, 100, 100, 01/01 12:00, \"%s\"\r\n",message);
+  return enqueue_packet_for_client(from,to,when,(uint8_t *)line,strlen(line));
+}
+
+/*
+  Send an AMD message to every Codan radio that can hear this one.  The
+  sender is told when it has finished, and the receivers get the message
+  then, unless it was lost or collided on the way.
+
+  We claim CICS V3.37, so, as LBARD expects of that (see drv_hfcodan.c), a
+  message that is too long for ALE 2G, or has characters outside its 64
+  character set, goes as ALE 3G, if it fits.  Anything longer is refused.
+*/
+#define CODAN_ALE2G_MESSAGE_CHARS 90
+#define CODAN_ALE3G_MESSAGE_CHARS 255
+long long codan_amd_ale3g_messages=0;
+
+int codan_send_amd(int client,char *message)
+{
+  int ale2g=(strlen(message)<=CODAN_ALE2G_MESSAGE_CHARS);
+  for(int i=0;message[i];i++)
+    if ((message[i]<0x20)||(message[i]>0x5f)) ale2g=0;
+  if (strlen(message)>CODAN_ALE3G_MESSAGE_CHARS) {
+    fprintf(stderr,"Codan HF Radio #%d refuses AMD message of %d chars, more than ALE 3G"
+	    " carries\n",client,(int)strlen(message));
+    codan_say(client,gettime_ms(),"ERROR: Message too long");
+    return -1;
+  }
+  if (!ale2g) codan_amd_ale3g_messages++;
+
+  long long now=gettime_ms();
+  long long done=now+hf_amd_airtime_ms(strlen(message));
+  hf_start_transmitting(client,done);
+  hf_amd_messages_sent++;
+  codan_say(client,now,"AMD CALL STARTED");
+  for(int n=0;n<clients[client].neighbour_count;n++) {
+    int j=clients[client].neighbours[n];
+    if (clients[j].radio_type!=RADIO_HFCODAN) continue;
+    codan_receive_amd(client,j,done,message);
+  }
+  codan_say(client,done,"AMD CALL FINISHED");
+  fprintf(stderr,"Codan HF Radio #%d sends %s AMD message of %d chars, taking %lldms"
+	  " (%lld AMD messages sent, %lld as ALE 3G, %lld delivered, %lld lost in all)\n",
+	  client,ale2g?"ALE 2G":"ALE 3G",(int)strlen(message),done-now,
+	  hf_amd_messages_sent,codan_amd_ale3g_messages,rx_delivered_packets,rx_lost_packets);
+  return 0;
+}
+
+// An ALE call always succeeds, and links every Codan radio that hears it
+int codan_alecall(int client,int callee,int caller)
+{
+  char line[RX_PACKET_MAX];
+  long long now=gettime_ms();
+  long long done=now+hf_amd_airtime_ms(0)*4;
+  hf_start_transmitting(client,done);
+  snprintf(line,sizeof(line),"ALE-LINK: 01, %d, %d, 01/01 12:00",caller,callee);
+  codan_say(client,done,line);
+  for(int n=0;n<clients[client].neighbour_count;n++) {
+    int j=clients[client].neighbours[n];
+    if (clients[j].radio_type==RADIO_HFCODAN) codan_say(j,done,line);
+  }
+  return 0;
+}
 
 void codan_prompt(int client)
 {
@@ -45,10 +144,20 @@ int hfcodan_read_byte(int i,unsigned char c)
       fprintf(stderr,"Codan HF Radio #%d sent command '%s'\n",i,clients[i].buffer);
 
       // Process the command here
+      int callee,caller,selfid;
+      // Skip any line noise in front of the command
+      char *cmd=(char *)clients[i].buffer;
+      while(*cmd&&!isalnum(*cmd)) cmd++;
       if (!strcasecmp("VER",(char *)clients[i].buffer)) {
 	// Claim to be an ALE 3G capable radio
 	write(clients[i].socket,"CICS: V3.37\r\n",
 	      strlen("CICS: V3.37\r\n"));
+      } else if (!strncasecmp("amd ",cmd,4)) {
+	codan_send_amd(i,&cmd[4]);
+      } else if (sscanf(cmd,"alecall %d from %d",&callee,&caller)==2) {
+	codan_alecall(i,callee,caller);
+      } else if (sscanf(cmd,"selfid %d",&selfid)==1) {
+	// Nothing to do: we link every radio that hears a call
       } else {
 	// Complain about unknown commands
 	write(clients[i].socket,
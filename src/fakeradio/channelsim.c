@@ -0,0 +1,186 @@
+/*
+  Simulate many RFD900 radios sharing a channel, each sending as often as
+  rate_control.c tells it to, as lbard does, so that the rate controller can
+  be judged on how much gets through.  This runs on a private virtual clock,
+  and frames go through the normal RFD900 command parser and collision
+  model, but nothing else of lbard is involved: each radio sends frames
+  shaped like lbard's, and counts what it hears, and what it missed going by
+  the gaps in each sender's message numbers, just as lbard does.
+
+  Goodput is the frame bytes received intact, summed over all receivers, per
+  second.  It is measured over the second half of the run, once the rates
+  have settled.
+*/
+
+#include "fakecsmaradio.h"
+#include "virtualtime.h"
+#include "rate_control.h"
+
+// Peers heard from this recently count as active, as in lbard
+#define CHANNELSIM_PEER_KEEPALIVE_MS 20000
+
+struct channelsim_node {
+  struct rate_control rc;
+  struct rate_control_window w;
+  long long next_tx;
+  long long next_update;
+  int message_number;
+  // Per sender
+  int *last_message_number;
+  long long *last_heard;
+};
+
+static struct channelsim_node *channelsim_nodes=NULL;
+static int channelsim_radios=0;
+static long long channelsim_measure_from=0;
+static long long channelsim_goodput_bytes=0;
+static long long channelsim_receptions=0;
+
+static int channelsim_delivered(int to,uint8_t *packet,int packet_len)
+{
+  // Strip the FEC and envelope the radio added, to get back the frame
+  // that was sent
+  int len=packet_len-9-FEC_LENGTH;
+  if (len<8) return -1;
+  int from=packet[0]+(packet[1]<<8);
+  if (from<0||from>=channelsim_radios) return -1;
+  int msg_number=packet[6]+256*(packet[7]&0x7f);
+
+  struct channelsim_node *n=&channelsim_nodes[to];
+  n->w.frames_heard++;
+  n->w.bytes_heard+=len;
+  int last=n->last_message_number[from];
+  if ((last>=0)&&(msg_number>last)&&(msg_number-last<256))
+    n->w.frames_missed+=msg_number-last-1;
+  n->last_message_number[from]=msg_number;
+  n->last_heard[from]=gettime_ms();
+
+  if (gettime_ms()>=channelsim_measure_from) {
+    channelsim_goodput_bytes+=len;
+    channelsim_receptions++;
+  }
+  return 0;
+}
+
+static int channelsim_transmit(int from,unsigned char *frame,int len)
+{
+  struct channelsim_node *n=&channelsim_nodes[from];
+  frame[0]=from; frame[1]=from>>8;
+  frame[6]=n->message_number; frame[7]=(n->message_number>>8)&0x7f;
+  n->message_number++;
+  for(int i=0;i<len;i++) {
+    if (frame[i]=='!') {
+      rfd900_read_byte(from,'!'); rfd900_read_byte(from,'.');
+    } else rfd900_read_byte(from,frame[i]);
+  }
+  rfd900_read_byte(from,'!'); rfd900_read_byte(from,'!');
+  n->w.frames_sent++;
+  n->w.bytes_sent+=len;
+  return 0;
+}
+
+static int channelsim_update(int i)
+{
+  struct channelsim_node *n=&channelsim_nodes[i];
+  long long now=gettime_ms();
+  n->w.window_ms=RATE_CONTROL_WINDOW_MS;
+  n->w.active_peers=0;
+  for(int j=0;j<channelsim_radios;j++)
+    if (n->last_heard[j]&&(now-n->last_heard[j]<=CHANNELSIM_PEER_KEEPALIVE_MS))
+      n->w.active_peers++;
+  rate_control_update(&n->rc,&n->w);
+  bzero(&n->w,sizeof(n->w));
+  n->next_update=now+RATE_CONTROL_WINDOW_MS;
+  return 0;
+}
+
+int channel_simulation(int radio_count,int seconds,int packetrate,char *topology)
+{
+  char clock_file[]="/tmp/fakecsmaradio.clock.XXXXXX";
+  int fd=mkstemp(clock_file);
+  if (fd<0) { perror("mkstemp"); return -1; }
+  close(fd);
+  if (virtual_clock_create(clock_file,0,1)) return -1;
+  unlink(clock_file);
+  srandom(1);
+  start_time=gettime_ms();
+  filter_verbose=0;
+
+  for(int i=0;i<radio_count;i++)
+    register_client(open("/dev/null",O_WRONLY),RADIO_RFD900);
+  topology_file=topology;
+  if (topology_setup()) return -1;
+
+  channelsim_radios=radio_count;
+  channelsim_nodes=calloc(radio_count,sizeof(struct channelsim_node));
+  if (!channelsim_nodes) return -1;
+  for(int i=0;i<radio_count;i++) {
+    struct channelsim_node *n=&channelsim_nodes[i];
+    rate_control_init(&n->rc,packetrate,0);
+    n->last_message_number=malloc(sizeof(int)*radio_count);
+    n->last_heard=calloc(radio_count,sizeof(long long));
+    if (!n->last_message_number||!n->last_heard) return -1;
+    for(int j=0;j<radio_count;j++) n->last_message_number[j]=-1;
+    // Radios don't all start at once, or in step
+    n->next_tx=start_time+random()%2000;
+    n->next_update=start_time+RATE_CONTROL_WINDOW_MS+random()%RATE_CONTROL_WINDOW_MS;
+  }
+  rx_delivered_hook=channelsim_delivered;
+  long long end_time=start_time+seconds*1000LL;
+  channelsim_measure_from=start_time+seconds*500LL;
+
+  // As in benchmark(): SID prefix, message number, a time stamp, an instance
+  // ID and a sync tree message, and the FEC lbard adds.
+  unsigned char frame[8+13+5+150+FEC_LENGTH];
+  bzero(frame,sizeof(frame));
+  int o=8;
+  frame[o]='T'; o+=13;
+  frame[o]='G'; o+=5;
+  frame[o]='S'; frame[o+1]=150;
+  for(int i=2;i<150;i++) frame[o+i]=random();
+
+  long long frames_sent=0,potential_receptions=0;
+  while(1) {
+    long long now=gettime_ms();
+    for(int i=0;i<client_count;i++) release_pending_packets(i);
+    for(int i=0;i<radio_count;i++) {
+      struct channelsim_node *n=&channelsim_nodes[i];
+      if (n->next_update<=now) channelsim_update(i);
+      if (n->next_tx<=now) {
+	channelsim_transmit(i,frame,sizeof(frame));
+	if (now>=channelsim_measure_from) {
+	  frames_sent++;
+	  potential_receptions+=clients[i].neighbour_count;
+	}
+	n->next_tx=now+n->rc.interval_ms+random()%n->rc.randomness_ms;
+      }
+    }
+
+    // Move on to whatever happens next
+    long long next=next_delivery_time();
+    for(int i=0;i<radio_count;i++) {
+      if ((next<0)||(channelsim_nodes[i].next_tx<next)) next=channelsim_nodes[i].next_tx;
+      if (channelsim_nodes[i].next_update<next) next=channelsim_nodes[i].next_update;
+    }
+    if (next>=end_time) break;
+    if (next>now) virtual_clock_advance_to(next*1000);
+  }
+
+  double measured=(end_time-channelsim_measure_from)/1000.0;
+  double interval=0,occupancy=0,loss=0;
+  for(int i=0;i<radio_count;i++) {
+    interval+=channelsim_nodes[i].rc.interval_ms+channelsim_nodes[i].rc.randomness_ms/2.0;
+    occupancy+=channelsim_nodes[i].rc.occupancy;
+    loss+=channelsim_nodes[i].rc.loss;
+  }
+  printf("%d radios, %d seconds, %s\n",radio_count,seconds,
+	 packetrate?"fixed rate (packetrate=)":"adaptive rate");
+  if (packetrate) printf("Aiming for %d frames per 4 seconds\n",packetrate);
+  printf("At the end: mean TX interval %.0fms, estimated occupancy %.3f, estimated loss %.3f\n",
+	 interval/radio_count,occupancy/radio_count,loss/radio_count);
+  printf("%.1f frames sent per second, %.1f receptions per second (%.1f%% lost)\n",
+	 frames_sent/measured,channelsim_receptions/measured,
+	 potential_receptions?100-channelsim_receptions*100.0/potential_receptions:0);
+  printf("Aggregate goodput: %.0f bytes/sec\n",channelsim_goodput_bytes/measured);
+  return 0;
+}
@@ -4,6 +4,9 @@
 // 
 
 #include "fakecsmaradio.h"
+#include "virtualtime.h"
+#include "capture.h"
+#include <poll.h>
 
 int filter_verbose=1;
 
@@ -13,6 +16,8 @@ int packet_count=0;
 
 char *socketname="/tmp/fakecsmaradio.socket";
 
+FILE *capture_file=NULL;
+
 struct client clients[MAX_CLIENTS];
 int client_count=0;
 
@@ -32,16 +37,15 @@ char timestamp_str_out[1024];
 char *timestamp_str(unsigned char *s)
 {
   struct tm tm;
-  time_t now=time(0);
+  long long now_ms=gettime_ms();
+  time_t now=now_ms/1000;
   localtime_r(&now,&tm);
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
   if (!s)
     snprintf(timestamp_str_out,1024,"[%02d:%02d.%02d.%03d RADIO]",
-	     tm.tm_hour,tm.tm_min,tm.tm_sec,(int)tv.tv_usec/1000);
+	     tm.tm_hour,tm.tm_min,tm.tm_sec,(int)(now_ms%1000));
   else
     snprintf(timestamp_str_out,1024,"[%02d:%02d.%02d.%03d %02X%02X*]",
-	     tm.tm_hour,tm.tm_min,tm.tm_sec,(int)tv.tv_usec/1000,
+	     tm.tm_hour,tm.tm_min,tm.tm_sec,(int)(now_ms%1000),
 	     s[0],s[1]);
     
   return timestamp_str_out;
@@ -53,8 +57,18 @@ int set_nonblocking(int fd)
   return 0;
 }
 
+// Real time, even when running on a virtual clock, for measuring ourselves
+long long gettime_us_real()
+{
+  struct timeval nowtv;
+  if (gettimeofday(&nowtv, NULL) == -1) return -1;
+  return nowtv.tv_sec * 1000000LL + nowtv.tv_usec;
+}
+
 long long gettime_ms()
 {
+  if (virtual_clock) return virtual_clock_now_us()/1000;
+
   struct timeval nowtv;
   // If gettimeofday() fails or returns an invalid value, all else is lost!
   if (gettimeofday(&nowtv, NULL) == -1) return -1;
@@ -145,6 +159,7 @@ struct filterable {
   uint64_t timestamp_sec;
   uint64_t timestamp_usec;
   uint32_t instance_id;
+  uint8_t capabilities;
 
   // The segment of the packet covered by this fragment
   int packet_start;
@@ -173,6 +188,13 @@ void filterable_parse_progress_bitmap(struct filterable *f,
   (*offset)+=32;
 }
 
+void filterable_parse_progress_runs(struct filterable *f,
+				    const uint8_t *packet,int *offset)
+{
+  // The runs fill the rest of the message, whose length follows its type
+  (*offset)=f->packet_start+packet[f->packet_start+1];
+}
+
 void filterable_parse_timestamp(struct filterable *f,
 				 const uint8_t *packet,int *offset)
 {
@@ -236,6 +258,12 @@ void filterable_parse_instance_id(struct filterable *f,const uint8_t *packet,
   (*offset)+=4;
 }
 
+void filterable_parse_capabilities(struct filterable *f,const uint8_t *packet,
+				   int *offset)
+{
+  f->capabilities=packet[*offset]; (*offset)++;
+}
+
 void filterable_parse_offset_compound(struct filterable *f,const uint8_t *packet,
 				      int *offset)
 {
@@ -280,6 +308,46 @@ void filterable_parse_segment_offset(struct filterable *f,const uint8_t *packet,
   }
 }
 
+/*
+  The piece slots ('K') each radio has bound, so that its compact pieces can
+  be shown and filtered like full ones.
+*/
+struct slot_binding {
+  uint8_t recipient_sid_prefix[2];
+  uint8_t bid_prefix[8];
+  uint64_t version;
+};
+struct slot_binding *slot_bindings[MAX_CLIENTS];
+
+void filterable_parse_slot_binding(struct filterable *f,const uint8_t *packet,
+				   int *offset)
+{
+  uint8_t slot=packet[(*offset)++];
+  filterable_parse_recipient_prefix_2(f,packet,offset);
+  filterable_parse_bid_prefix(f,packet,offset);
+  filterable_parse_version(f,packet,offset);
+
+  if (f->src_radio<0||f->src_radio>=MAX_CLIENTS||!slot) return;
+  if (!slot_bindings[f->src_radio])
+    slot_bindings[f->src_radio]=calloc(256,sizeof(struct slot_binding));
+  if (!slot_bindings[f->src_radio]) return;
+  struct slot_binding *b=&slot_bindings[f->src_radio][slot];
+  memcpy(b->recipient_sid_prefix,f->recipient_sid_prefix,2);
+  memcpy(b->bid_prefix,f->bid_prefix,8);
+  b->version=f->version;
+}
+
+void filterable_parse_slot(struct filterable *f,const uint8_t *packet,
+			   int *offset)
+{
+  uint8_t slot=packet[(*offset)++];
+  if (f->src_radio<0||f->src_radio>=MAX_CLIENTS||!slot_bindings[f->src_radio]) return;
+  struct slot_binding *b=&slot_bindings[f->src_radio][slot];
+  memcpy(f->recipient_sid_prefix,b->recipient_sid_prefix,2);
+  memcpy(f->bid_prefix,b->bid_prefix,8);
+  f->version=b->version;
+}
+
 char *fragment_name(int type)
 {
   switch(type) {
@@ -287,11 +355,22 @@ char *fragment_name(int type)
   case 'P': return "Bundle end piece (offset >= 1MB)";
   case 'q': return "Bundle piece (offset < 1MB)";
   case 'Q': return "Bundle piece (offset >= 1MB)";
+  case 'h': return "Compact bundle end piece (offset < 1MB)";
+  case 'H': return "Compact bundle end piece (offset >= 1MB)";
+  case 'i': return "Compact bundle piece (offset < 1MB)";
+  case 'I': return "Compact bundle piece (offset >= 1MB)";
+  case 'K': return "Piece slot binding";
+  case 'k': return "Piece slot binding acknowledgement";
   case 'G': return "LBARD instance identifier";
   case 'T': return "Time stamp";
+  case 'C': return "LBARD capabilities";
   case 'M': return "Bundle transfer progress bitmap";
+  case 'm': return "Bundle transfer progress bitmap (run lengths)";
   case 'A': return "Bundle transfer progress acknowledgement";
   case 'a': return "Bundle transfer redirect and acknowledgement";
+  case 'F': return "Bundle transfer acknowledgement (all before held)";
+  case 'f': return "Bundle transfer redirect and acknowledgement (all before held)";
+  case 'J': return "Length of journal already held";
   default: return "unknown";
   }
 }
@@ -304,7 +383,7 @@ char *fragment_name(int type)
 int filter_fragment(uint8_t *packet_in,uint8_t *packet_out,int *out_len,
 		    struct filterable *f, int log_pieces)
 {  
-  if (filter_verbose) {
+  if (filter_verbose&&log_pieces) {
     fprintf(stderr,"T+%lldms : from sid:%02X%02X%02X%02X%02X%02X* to sid:%02X%02X[%02X%02X]*\n",
 	    gettime_ms()-start_time,
 	    f->sender_sid_prefix[0],f->sender_sid_prefix[1],f->sender_sid_prefix[2],
@@ -315,7 +394,7 @@ int filter_fragment(uint8_t *packet_in,uint8_t *packet_out,int *out_len,
     fprintf(stderr,"          Fragment type '%c' : %s\n",
 	    f->type,fragment_name(f->type));
 
-    if ((f->type!='G')&&(f->type!='T')) {
+    if ((f->type!='G')&&(f->type!='T')&&(f->type!='C')) {
       fprintf(stderr,"          bid=%02X%02X%02X%02X%02X%02X%02X%02X*, version=%llx\n",
 	      f->bid_prefix[0],f->bid_prefix[1],f->bid_prefix[2],f->bid_prefix[3],
 	      f->bid_prefix[4],f->bid_prefix[5],f->bid_prefix[6],f->bid_prefix[7],
@@ -327,7 +406,7 @@ int filter_fragment(uint8_t *packet_in,uint8_t *packet_out,int *out_len,
     }
 
     switch(f->type) {
-    case 'P': case 'p':
+    case 'P': case 'p': case 'H': case 'h':
       if (f->is_manifest_piece)
 	fprintf(stderr,"          manifest length = %d\n",
 		f->manifest_offset+f->piece_length-1);
@@ -346,7 +425,7 @@ int filter_fragment(uint8_t *packet_in,uint8_t *packet_out,int *out_len,
 		packet_count,f->packet_start
 		);
       break;
-    case 'q': case 'Q':
+    case 'q': case 'Q': case 'i': case 'I':
       if (f->is_manifest_piece)
 	fprintf(stderr,"          manifest bytes [%d..%d]\n",
 		f->manifest_offset,f->manifest_offset+f->piece_length-1);
@@ -369,10 +448,17 @@ int filter_fragment(uint8_t *packet_in,uint8_t *packet_out,int *out_len,
       dump_bytes(12,"Bytes of piece",
 		 &packet_in[f->piece_packet_offset],f->piece_length);
       break;
-    case 'A': case 'a':
+    case 'A': case 'a': case 'F': case 'f':
       fprintf(stderr,"          Acknowledging to manifest offset %d, body offset %d\n",
 	      f->manifest_offset,f->body_offset);
-      if (f->type=='a') fprintf(stderr,"          Requesting redirection to a random offset thereafter.\n");
+      if ((f->type=='a')||(f->type=='f')) fprintf(stderr,"          Requesting redirection to a random offset thereafter.\n");
+      break;
+    case 'C':
+      fprintf(stderr,"          Capability bits 0x%02x\n",f->capabilities);
+      break;
+    case 'J':
+      fprintf(stderr,"          Already holds the first %d bytes of the journal\n",
+	      f->body_offset);
       break;
     }
   
@@ -380,7 +466,8 @@ int filter_fragment(uint8_t *packet_in,uint8_t *packet_out,int *out_len,
 
   int match=0;
   int r;
-  fprintf(stderr,"There are %d filter rules.\n",filter_rule_count);
+  if (filter_verbose&&filter_rule_count)
+    fprintf(stderr,"There are %d filter rules.\n",filter_rule_count);
   for(r=0;r<filter_rule_count;r++) {
 
     // Ignore packet-level filters
@@ -391,6 +478,7 @@ int filter_fragment(uint8_t *packet_in,uint8_t *packet_out,int *out_len,
     match=1;
 #if 1
     //    if ((f->type=='p')||(f->type=='P')||(f->type=='q')||(f->type=='Q')) {
+    if (filter_verbose)
       fprintf(stderr,"FILTER: rule: src=%d, dst=%d, mP=%d, pP=%d  -- fragment: src=%d, dst=%d, mP=%d, pP=%d, party_match=%d\n",
 	      filter_rules[r]->src,filter_rules[r]->dst,
 	      filter_rules[r]->manifestP,filter_rules[r]->bodyP,
@@ -474,7 +562,7 @@ int filter_process_packet(int from,int to,
   struct filterable f; 
   
   int len=*packet_len;
-  uint8_t packet_out[256];
+  uint8_t packet_out[RX_PACKET_MAX];
   int out_len=0;
 
   int offset=0;
@@ -511,9 +599,10 @@ int filter_process_packet(int from,int to,
 
   if (to==-1) {
     packet_count++;
-    fprintf(stderr,">>> %s Packet #%d : length=%d bytes\n",
-	    timestamp_str(f.sender_sid_prefix),
-	    packet_count,*packet_len);
+    if (filter_verbose)
+      fprintf(stderr,">>> %s Packet #%d : length=%d bytes\n",
+	      timestamp_str(f.sender_sid_prefix),
+	      packet_count,*packet_len);
   }  
   
   // Ignore msg number and is_retransmission flag bytes
@@ -527,7 +616,7 @@ int filter_process_packet(int from,int to,
   
   while(offset<len) {
     switch(packet[offset]) {
-    case 'A': case 'a':
+    case 'A': case 'a': case 'F': case 'f':
       // Ack of bundle transfer
       filterable_erase_fragment(&f,offset);
       f.type=packet[offset++];
@@ -575,6 +664,22 @@ int filter_process_packet(int from,int to,
       f.fragment_length=offset-f.packet_start;
       filter_fragment(packet,packet_out,&out_len,&f,to==-1);
       break;
+    case 'm': // Progress bitmap as run lengths
+      if (packet[offset+1]<(1+1+8+2+4)) {
+	fprintf(stderr,"WARNING: Saw short progress bitmap @ 0x%02x -- Ignoring packet\n",
+		offset);
+	return -1;
+      }
+      filterable_erase_fragment(&f,offset);
+      f.type=packet[offset++];
+      offset++; // length
+      filterable_parse_bid_prefix(&f,packet,&offset);
+      filterable_parse_manifest_offset(&f,packet,&offset);
+      filterable_parse_body_offset(&f,packet,&offset);
+      filterable_parse_progress_runs(&f,packet,&offset);
+      f.fragment_length=offset-f.packet_start;
+      filter_fragment(packet,packet_out,&out_len,&f,to==-1);
+      break;
     case 'P': case 'p': case 'q': case 'Q':
       // Piece of body or manifest
       filterable_erase_fragment(&f,offset);
@@ -592,6 +697,43 @@ int filter_process_packet(int from,int to,
 	}
       }
       break;
+    case 'H': case 'h': case 'I': case 'i':
+      // Compact piece of body or manifest, of the bundle bound to the slot
+      filterable_erase_fragment(&f,offset);
+      f.type=packet[offset++];
+      filterable_parse_slot(&f,packet,&offset);
+      filterable_parse_offset_compound(&f,packet,&offset);
+      f.fragment_length=offset-f.packet_start;      
+      if (!filter_fragment(packet,packet_out,&out_len,&f,to==-1)) {
+	if (to==-1) {
+	  // Log rhizome bytes actually sent
+	  if (f.is_manifest_piece) tx_log_manifest_bytes+=f.piece_length;
+	  if (f.is_body_piece) tx_log_payload_bytes+=f.piece_length;
+	}
+      }
+      break;
+    case 'K': // piece slot binding
+      // 1 byte slot ID
+      // 2 bytes target SID
+      // 8 bytes BID prefix
+      // 8 bytes version
+      filterable_erase_fragment(&f,offset);
+      f.type=packet[offset++];
+      filterable_parse_slot_binding(&f,packet,&offset);
+      f.fragment_length=offset-f.packet_start;
+      filter_fragment(packet,packet_out,&out_len,&f,to==-1);
+      break;
+    case 'k': // piece slot binding acknowledgement
+      // 2 bytes SID of sender of the pieces
+      // 1 byte slot ID
+      // 1 byte known flag
+      filterable_erase_fragment(&f,offset);
+      f.type=packet[offset++];
+      filterable_parse_recipient_prefix_2(&f,packet,&offset);
+      offset+=2;
+      f.fragment_length=offset-f.packet_start;
+      filter_fragment(packet,packet_out,&out_len,&f,to==-1);
+      break;
     case 'R': // segment request
       // 2 bytes target SID
       // 8 bytes BID prefix
@@ -614,6 +756,18 @@ int filter_process_packet(int from,int to,
       }
       offset+=packet[offset+1];
       break;
+    case 'J': // journal length held
+      // 2 bytes target SID
+      // 8 bytes BID prefix
+      // 4 bytes length held
+      filterable_erase_fragment(&f,offset);
+      f.type=packet[offset++];
+      filterable_parse_recipient_prefix_2(&f,packet,&offset);
+      filterable_parse_bid_prefix(&f,packet,&offset);
+      filterable_parse_body_offset(&f,packet,&offset);
+      f.fragment_length=offset-f.packet_start;
+      filter_fragment(packet,packet_out,&out_len,&f,to==-1);
+      break;
     case 'T': // time stamp
       filterable_erase_fragment(&f,offset);
       f.type=packet[offset++];
@@ -621,6 +775,13 @@ int filter_process_packet(int from,int to,
       f.fragment_length=offset-f.packet_start;
       filter_fragment(packet,packet_out,&out_len,&f,to==-1);
       break;
+    case 'C': // capabilities
+      filterable_erase_fragment(&f,offset);
+      f.type=packet[offset++];
+      filterable_parse_capabilities(&f,packet,&offset);
+      f.fragment_length=offset-f.packet_start;
+      filter_fragment(packet,packet_out,&out_len,&f,to==-1);
+      break;
     default:
       fprintf(stderr,"WARNING: Saw unknown fragment type 0x%02x @ 0x%02x -- Ignoring packet\n",
 	      packet[offset],offset);
@@ -642,7 +803,7 @@ int filter_process_packet(int from,int to,
   memcpy(packet,packet_out,out_len);
   *packet_len=out_len;
   
-  switch(clients[to].radio_type)
+  if (to>=0) switch(clients[to].radio_type)
     {
     case RADIO_RFD900:
       rfd900_encapsulate_packet(from,to,packet,packet_len); break;
@@ -660,19 +821,139 @@ int filter_process_packet(int from,int to,
   return 0;
 }
 
+struct link *links=NULL;
+long long rx_delivered_packets=0;
+long long rx_lost_packets=0;
+// Told of each packet a radio receives intact, for simulations
+int (*rx_delivered_hook)(int to,uint8_t *packet,int packet_len)=NULL;
+
+struct link *link_between(int from,int to)
+{
+  static struct link all_hear_all;
+  if (links) return &links[from*client_count+to];
+  all_hear_all.reachable=1;
+  all_hear_all.drop_threshold=packet_drop_threshold;
+  all_hear_all.delay_ms=0;
+  return &all_hear_all;
+}
+
+/*
+  Queue an already filtered and encapsulated packet for delivery to a radio,
+  applying the link delay and loss, and marking any packets whose time on
+  the air overlaps at the receiver as colliding.
+*/
+int enqueue_packet_for_client(int from,int to,long long delivery_time,
+			      uint8_t *packet,int packet_len)
+{
+  struct client *c=&clients[to];
+  struct link *l=link_between(from,to);
+  long long now=gettime_ms();
+
+  if (c->rx_queue_len>=RX_QUEUE_DEPTH) {
+    printf("WARNING: RX queue full for radio #%d, discarding packet of %d bytes\n",
+	   to,packet_len);
+    rx_lost_packets++;
+    return -1;
+  }
+  if (packet_len>RX_PACKET_MAX) packet_len=RX_PACKET_MAX;
+
+  struct rx_packet *p=&c->rx_queue[c->rx_queue_len++];
+  p->start_time=now+l->delay_ms;
+  p->delivery_time=delivery_time+l->delay_ms;
+  p->colliding=0;
+  p->local=0;
+  p->dropped=(l->drop_threshold&&((random()&0x7fffffff)<l->drop_threshold));
+  p->len=packet_len;
+  bcopy(packet,p->bytes,packet_len);
+
+  // A half-duplex radio can't hear while it is transmitting
+  if (p->start_time<c->tx_until) p->colliding=1;
+  for(int i=0;i<c->rx_queue_len-1;i++) {
+    struct rx_packet *q=&c->rx_queue[i];
+    if (q->local) continue;
+    if ((q->start_time<=p->delivery_time)&&(p->start_time<q->delivery_time)) {
+      if (filter_verbose)
+	printf("WARNING: RX colission for radio #%d (embargo time = T%+lldms, last packet = %d bytes)\n",
+	       to,q->delivery_time-now,q->len);
+      q->colliding=1;
+      p->colliding=1;
+    }
+  }
+  if (p->colliding) tx_colissions++;
+  return 0;
+}
+
+/*
+  Queue something the radio itself says to its host at a given time, e.g.,
+  that it has finished sending a message.  This is not subject to link loss
+  or collisions.
+*/
+int enqueue_response_for_client(int to,long long delivery_time,
+				uint8_t *bytes,int len)
+{
+  struct client *c=&clients[to];
+  if (c->rx_queue_len>=RX_QUEUE_DEPTH) {
+    printf("WARNING: RX queue full for radio #%d, discarding response of %d bytes\n",
+	   to,len);
+    return -1;
+  }
+  if (len>RX_PACKET_MAX) len=RX_PACKET_MAX;
+  struct rx_packet *p=&c->rx_queue[c->rx_queue_len++];
+  p->start_time=delivery_time;
+  p->delivery_time=delivery_time;
+  p->colliding=0;
+  p->dropped=0;
+  p->local=1;
+  p->len=len;
+  bcopy(bytes,p->bytes,len);
+  return 0;
+}
+
+/*
+  HF ALE messages (AMD) go out as 3-character ALE words, each of which takes
+  392ms on the air with the redundancy ALE adds, after a call preamble of a
+  couple of seconds.  hfairtime=<factor> on the command line scales this,
+  so that HF tests need not run at the speed of real HF.
+*/
+float hf_airtime_scale=1.0;
+long long hf_amd_messages_sent=0;
+
+int hf_amd_airtime_ms(int chars)
+{
+  return (2000+((chars+2)/3)*392)*hf_airtime_scale;
+}
+
+// A radio has started transmitting: it won't hear anything until it stops
+int hf_start_transmitting(int from,long long until)
+{
+  struct client *c=&clients[from];
+  long long now=gettime_ms();
+  for(int n=0;n<c->rx_queue_len;n++) {
+    struct rx_packet *p=&c->rx_queue[n];
+    if ((!p->local)&&(p->delivery_time>now)&&(!p->colliding)) {
+      p->colliding=1;
+      tx_colissions++;
+    }
+  }
+  if (until>c->tx_until) c->tx_until=until;
+  return 0;
+}
+
 int filter_and_enqueue_packet_for_client(int from,int to, long long delivery_time,
 					 uint8_t *packet_in,int packet_len)
 {
-  fprintf(stderr,"Filter and enqueue %d bytes from %d -> %d\n",
-	  packet_len,from,to);
+  if (filter_verbose)
+    fprintf(stderr,"Filter and enqueue %d bytes from %d -> %d\n",
+	    packet_len,from,to);
 
-  uint8_t packet[256];
+  uint8_t packet[RX_PACKET_MAX];
+  if (packet_len>255) packet_len=255;
   memcpy(packet,packet_in,packet_len);
   
   filter_process_packet(from,to,packet,&packet_len);
 
   if (first_transmission_time==gettime_ms()) first_transmission_time--; // avoid divide by zero
-  if (to==-1)
+  if ((to==-1)&&filter_verbose)
     fprintf(stderr,">>> %s @ T+%lldms: %lld bytes, %lld packets, %lld sync bytes, %lld manifest bytes, %lld body bytes, %lld colissions, %02.1f%% channel utilisation.\n",	    
 	    timestamp_str(NULL),
 	    gettime_ms()-start_time,
@@ -697,17 +978,138 @@ int filter_and_enqueue_packet_for_client(int from,int to, long long delivery_tim
     // Entire packet was filtered, so do nothing
     return 0;
   }
-  
-  bcopy(packet,clients[to].rx_queue,packet_len);
-  long long now=gettime_ms();
-  if (clients[to].rx_queue_len) {
-    printf("WARNING: RX colission for radio #%d (embargo time = T%+lldms, last packet = %d bytes)\n",
-	   to,clients[to].rx_embargo-now,clients[to].rx_queue_len);
-    clients[to].rx_colission=1;
-    tx_colissions++;
-  } else clients[to].rx_colission=0;
-  clients[to].rx_queue_len=packet_len;
-  clients[to].rx_embargo=delivery_time;
+
+  return enqueue_packet_for_client(from,to,delivery_time,packet,packet_len);
+}
+
+/*
+  Send a packet from one radio to every radio that can hear it.
+  Without filter rules, the processed packet depends only on the type of the
+  receiving radio, so it is prepared once per type rather than once per
+  receiver.
+*/
+int transmit_packet(int from,long long delivery_time,int transmission_time,
+		    uint8_t *packet,int packet_len)
+{
+  // Client == -1 tells filter process to log packet details for statistics
+  // for post-analysis.
+  filter_and_enqueue_packet_for_client(from,-1,delivery_time,packet,packet_len);
+
+  // The frame as the radio put it on the air.  RSSI is up to each receiver.
+  if (capture_file)
+    capture_write(capture_file,gettime_ms()*1000,from,-1,packet,packet_len);
+
+  uint8_t prepared[RADIO_HFBARRETT+1][RX_PACKET_MAX];
+  int prepared_len[RADIO_HFBARRETT+1];
+  for(int t=0;t<=RADIO_HFBARRETT;t++) prepared_len[t]=-1;
+
+  if (packet_len>255) packet_len=255;
+  for(int n=0;n<clients[from].neighbour_count;n++) {
+    int j=clients[from].neighbours[n];
+    int t=clients[j].radio_type;
+    if (filter_rule_count||(t<0)||(t>RADIO_HFBARRETT))
+      filter_and_enqueue_packet_for_client(from,j,delivery_time,packet,packet_len);
+    else {
+      if (prepared_len[t]<0) {
+	memcpy(prepared[t],packet,packet_len);
+	prepared_len[t]=packet_len;
+	filter_process_packet(from,j,prepared[t],&prepared_len[t]);
+      }
+      if (prepared_len[t])
+	enqueue_packet_for_client(from,j,delivery_time,prepared[t],prepared_len[t]);
+    }
+    if (!transmission_time) release_pending_packets(j);
+  }
+  return 0;
+}
+
+/*
+  Read the link matrix.  Each line describes the link from one radio to
+  another (radios are numbered from 0, in the order given on the command
+  line):
+
+    <from> <to> [loss <probability>] [delay <ms>] [oneway]
+
+  Links are symmetric unless marked oneway.  Radio pairs that are not
+  listed cannot hear each other, unless the file contains "default reachable",
+  in which case they can, with no loss or delay.  # starts a comment.
+*/
+char *topology_file=NULL;
+
+int topology_load(char *filename)
+{
+  FILE *f=fopen(filename,"r");
+  if (!f) { perror("fopen(topology)"); return -1; }
+
+  links=calloc(client_count*client_count,sizeof(struct link));
+  int default_reachable=0;
+  char line[1024];
+  int line_number=0;
+  int link_count=0;
+  while(fgets(line,1024,f)) {
+    line_number++;
+    char *hash=strchr(line,'#'); if (hash) *hash=0;
+    char word[1024];
+    if (sscanf(line,"%s",word)!=1) continue;
+    if (!strcmp(word,"default")) {
+      if (sscanf(line,"default %s",word)==1&&!strcmp(word,"reachable"))
+	default_reachable=1;
+      continue;
+    }
+    int from,to,offset=0;
+    if (sscanf(line,"%d %d%n",&from,&to,&offset)!=2
+	||from<0||to<0||from>=client_count||to>=client_count||from==to) {
+      fprintf(stderr,"%s:%d: Could not parse link '%s'\n",filename,line_number,line);
+      fclose(f);
+      return -1;
+    }
+    struct link l={.reachable=1,.drop_threshold=0,.delay_ms=0};
+    int oneway=0;
+    char *brk;
+    for(char *token=strtok_r(&line[offset]," \t\r\n",&brk);token;
+	token=strtok_r(NULL," \t\r\n",&brk)) {
+      if (!strcmp(token,"oneway")) { oneway=1; continue; }
+      char *value=strtok_r(NULL," \t\r\n",&brk);
+      float p=value?atof(value):-1;
+      if (value&&!strcmp(token,"loss")&&(p>=0)&&(p<=1))
+	l.drop_threshold=p*0x7fffffff;
+      else if (value&&!strcmp(token,"delay"))
+	l.delay_ms=atoi(value);
+      else {
+	fprintf(stderr,"%s:%d: Unknown or incomplete link property '%s'\n",
+		filename,line_number,token);
+	fclose(f);
+	return -1;
+      }
+    }
+    links[from*client_count+to]=l;
+    if (!oneway) links[to*client_count+from]=l;
+    link_count++;
+  }
+  fclose(f);
+
+  if (default_reachable)
+    for(int i=0;i<client_count*client_count;i++)
+      if (!links[i].reachable) {
+	links[i].reachable=1;
+	links[i].drop_threshold=packet_drop_threshold;
+      }
+
+  fprintf(stderr,"Loaded %d links from topology file '%s'\n",link_count,filename);
+  return 0;
+}
+
+int topology_setup(void)
+{
+  if (topology_file&&topology_load(topology_file)) return -1;
+  for(int i=0;i<client_count;i++) {
+    free(clients[i].neighbours);
+    clients[i].neighbours=malloc(sizeof(int)*client_count);
+    clients[i].neighbour_count=0;
+    for(int j=0;j<client_count;j++)
+      if ((j!=i)&&link_between(i,j)->reachable)
+	clients[i].neighbours[clients[i].neighbour_count++]=j;
+  }
   return 0;
 }
 
@@ -812,34 +1214,144 @@ int filter_rules_parse(char *text)
 int release_pending_packets(int i)
 {
   long long now = gettime_ms();
-  if (clients[i].rx_queue_len&&(clients[i].rx_embargo<=now))
-    {
-      if (!clients[i].rx_colission) {
-	if ((random()&0x7fffffff)>=packet_drop_threshold) {
-	  write(clients[i].socket,
-		clients[i].rx_queue,
-		clients[i].rx_queue_len);
-	  printf("Radio #%d receives a packet of %d bytes\n",
-		 i,clients[i].rx_queue_len);
-	} else
-	  printf(">>> %s Radio #%d misses a packet of %d bytes due to simulated packet loss\n",
-		 timestamp_str(NULL),
-		 i,clients[i].rx_queue_len);
-	
-      }
-      printf("Radio #%d ready to receive.\n",i);
-      clients[i].rx_queue_len=0;
-      clients[i].rx_colission=0;
-      return 1;
+  int released=0;
+  struct client *c=&clients[i];
+  for(int n=0;n<c->rx_queue_len;) {
+    struct rx_packet *p=&c->rx_queue[n];
+    if (p->delivery_time>now) { n++; continue; }
+    if (p->local) {
+      write(c->socket,p->bytes,p->len);
+    } else if (p->colliding) {
+      rx_lost_packets++;
+    } else if (p->dropped) {
+      rx_lost_packets++;
+      if (filter_verbose)
+	printf(">>> %s Radio #%d misses a packet of %d bytes due to simulated packet loss\n",
+	       timestamp_str(NULL),
+	       i,p->len);
     } else {
-    if (clients[i].rx_embargo&&clients[i].rx_queue_len)
-      printf("Radio #%d WAITING until T+%lldms for a packet of %d bytes\n",
-	     i,clients[i].rx_embargo-now,clients[i].rx_queue_len);
-    
+      write(c->socket,p->bytes,p->len);
+      rx_delivered_packets++;
+      if (rx_delivered_hook) rx_delivered_hook(i,p->bytes,p->len);
+      if (filter_verbose)
+	printf("Radio #%d receives a packet of %d bytes\n",
+	       i,p->len);
+    }
+    // Fill the hole with the last packet in the queue
+    c->rx_queue_len--;
+    if (n<c->rx_queue_len) memcpy(p,&c->rx_queue[c->rx_queue_len],sizeof(struct rx_packet));
+    released++;
+  }
+  if (released&&(!c->rx_queue_len)&&filter_verbose)
+    printf("Radio #%d ready to receive.\n",i);
+  return released;
+}
+
+long long next_delivery_time(void)
+{
+  long long next=-1;
+  for(int i=0;i<client_count;i++)
+    for(int n=0;n<clients[i].rx_queue_len;n++)
+      if ((next<0)||(clients[i].rx_queue[n].delivery_time<next))
+	next=clients[i].rx_queue[n].delivery_time;
+  return next;
+}
+
+/*
+  True if some lbard has yet to read bytes we have written to its radio.  It
+  may have declared itself idle before they arrived, so the virtual clock
+  must not move until it has read them.  We look from the lbard side of each
+  pty, where poll() also sees bytes still on their way through the pty.
+  Ptys that have hung up (see below) have nobody to read them.
+*/
+int radios_have_unread_input(struct pollfd *fds)
+{
+  for(int i=0;i<client_count;i++) {
+    if ((clients[i].radio_type==RADIO_REAL)||(fds[i].fd<0)) continue;
+    char *name=ptsname(clients[i].socket);
+    if (!name) continue;
+    int fd=open(name,O_RDWR|O_NOCTTY|O_NONBLOCK);
+    if (fd<0) continue;
+    struct pollfd pfd={.fd=fd,.events=POLLIN};
+    int unread=(poll(&pfd,1,0)>0)&&(pfd.revents&POLLIN);
+    close(fd);
+    if (unread) return 1;
   }
   return 0;
 }
 
+/*
+  Measure how many frames per second the simulation core can move, by having
+  randomly chosen radios transmit synthetic LBARD frames through the normal
+  RFD900 command parser, while simulated time advances on a private virtual
+  clock.  Packets are delivered to /dev/null.
+*/
+int benchmark(int radio_count,int frames,char *topology)
+{
+  char clock_file[]="/tmp/fakecsmaradio.clock.XXXXXX";
+  int fd=mkstemp(clock_file);
+  if (fd<0) { perror("mkstemp"); return -1; }
+  close(fd);
+  if (virtual_clock_create(clock_file,0,1)) return -1;
+  unlink(clock_file);
+  srandom(1);
+  start_time=gettime_ms();
+  filter_verbose=0;
+
+  for(int i=0;i<radio_count;i++)
+    register_client(open("/dev/null",O_WRONLY),RADIO_RFD900);
+  topology_file=topology;
+  if (topology_setup()) return -1;
+
+  // SID prefix, message number, then a time stamp, an instance ID and a
+  // sync tree message, followed by space for the FEC.
+  unsigned char frame[8+13+5+150+FEC_LENGTH];
+  bzero(frame,sizeof(frame));
+  int o=8;
+  frame[o]='T'; o+=13;
+  frame[o]='G'; o+=5;
+  frame[o]='S'; frame[o+1]=150;
+  for(int i=2;i<150;i++) frame[o+i]=random();
+
+  // Mean gap between transmissions, enough for the channel to be busy but
+  // not hopelessly congested in a full mesh.
+  int gap_ms=20;
+  long long link_frames=0;
+  for(int i=0;i<radio_count;i++) link_frames+=clients[i].neighbour_count;
+
+  long long real_start=gettime_us_real();
+  for(int f=0;f<frames;f++) {
+    int from=random()%radio_count;
+    frame[0]=from; frame[1]=from>>8;
+    frame[6]=f; frame[7]=(f>>8)&0x7f;
+    for(int i=0;i<sizeof(frame);i++) {
+      if (frame[i]=='!') {
+	rfd900_read_byte(from,'!'); rfd900_read_byte(from,'.');
+      } else rfd900_read_byte(from,frame[i]);
+    }
+    rfd900_read_byte(from,'!'); rfd900_read_byte(from,'!');
+
+    virtual_clock_advance_to(virtual_clock_now_us()+1000*(random()%(2*gap_ms)));
+    for(int i=0;i<client_count;i++) release_pending_packets(i);
+  }
+  long long next;
+  while((next=next_delivery_time())>=0) {
+    virtual_clock_advance_to(next*1000);
+    for(int i=0;i<client_count;i++) release_pending_packets(i);
+  }
+  long long elapsed=gettime_us_real()-real_start;
+  if (elapsed<1) elapsed=1;
+
+  printf("%d radios, %d frames transmitted (%lld potential receptions)\n",
+	 radio_count,frames,link_frames*frames/radio_count);
+  printf("%lld frames delivered, %lld lost to collision or link loss\n",
+	 rx_delivered_packets,rx_lost_packets);
+  printf("%.1f simulated seconds in %.3f real seconds\n",
+	 (gettime_ms()-start_time)/1000.0,elapsed/1000000.0);
+  printf("%.0f simulated frames per second (%.0f receptions per second)\n",
+	 frames*1000000.0/elapsed,(rx_delivered_packets+rx_lost_packets)*1000000.0/elapsed);
+  return 0;
+}
 
 int main(int argc,char **argv)
 {
@@ -848,6 +1360,24 @@ int main(int argc,char **argv)
 
   start_time=gettime_ms();
 
+  if ((argc>=4)&&(argc<=5)&&!strcmp(argv[1],"benchmark")) {
+    int count=atoi(argv[2]);
+    if ((count<2)||(count>=MAX_CLIENTS)) {
+      fprintf(stderr,"Number of radios must be between 2 and %d.\n",MAX_CLIENTS-1);
+      exit(-1);
+    }
+    return benchmark(count,atoi(argv[3]),argc>4?argv[4]:NULL);
+  }
+  if ((argc>=4)&&(argc<=6)&&!strcmp(argv[1],"channelsim")) {
+    int count=atoi(argv[2]);
+    if ((count<2)||(count>=MAX_CLIENTS)) {
+      fprintf(stderr,"Number of radios must be between 2 and %d.\n",MAX_CLIENTS-1);
+      exit(-1);
+    }
+    return channel_simulation(count,atoi(argv[3]),argc>4?atoi(argv[4]):0,
+			      argc>5?argv[5]:NULL);
+  }
+
   char *radio_types="rfd900,rfd900";
   
   if (argv&&argv[1]) radio_types=argv[1];
@@ -857,30 +1387,48 @@ int main(int argc,char **argv)
   fprintf(stderr,"radio_count=%d\n",radio_count);
   
   if (argc>2) tty_file=fopen(argv[2],"w");
-  if ((argc<3)||(argc>4)||(!tty_file)||(radio_count<2)||(radio_count>=MAX_CLIENTS)) {
-    fprintf(stderr,"usage: fakecsmaradio <radio_type,...> <tty file> [packet drop probability|filter rules]\n");
+  if ((argc<3)||(!tty_file)||(radio_count<2)||(radio_count>=MAX_CLIENTS)) {
+    fprintf(stderr,"usage: fakecsmaradio <radio_type,...> <tty file> [packet drop probability|filter rules|infinitespeed|topology=<file>|capture=<file>|hfairtime=<factor>] ...\n");
+    fprintf(stderr,"usage: fakecsmaradio benchmark <radio count> <frames> [topology file]\n");
+    fprintf(stderr,"usage: fakecsmaradio channelsim <radio count> <seconds> [packetrate] [topology file]\n");
     fprintf(stderr,"\nNumber of radios must be between 2 and %d.\n",MAX_CLIENTS-1);
     fprintf(stderr,"The name of each tty will be written to <tty file>\n");
     fprintf(stderr,"The optional packet drop probability allows the simulation of packet loss.\n");
     fprintf(stderr,"Filter rules take the form of:  \"drop <manifest|body> <from|to> <radio id>; ...\"\n");
+    fprintf(stderr,"A topology file lists which radios can hear each other, one link per line:\n"
+	    "  <from> <to> [loss <probability>] [delay <ms>] [oneway]\n");
+    fprintf(stderr,"hfairtime=<factor> scales the time HF radios take to send each ALE message.\n");
     fprintf(stderr,"\n"
 	    "To run tests using real radios, set the LBARD_REAL_RADIOS environment variable to the list of serial ports.\n"
 	    " e.g., export LBARD_REAL_RADIOS=/dev/ttyUSB0,/dev/ttyUSB1\n"
 	    "These will then take precedence over whatever radio types are listed on the command line, and thus in the tests.\n");
     exit(-1);
   }
-  if (argc>3) 
+  for(int a=3;a<argc;a++) 
     {
-      if (argv[3][0]=='d'||argv[3][0]=='a') {
+      if (argv[a][0]=='d'||argv[a][0]=='a') {
 	// Filter rules
-	if (filter_rules_parse(argv[3])) {
+	if (filter_rules_parse(argv[a])) {
 	  fprintf(stderr,"Invalid filter rules.\n");
 	  exit(-1);
 	}
-      } else if (!strcmp(argv[3],"infinitespeed"))
+      } else if (!strcmp(argv[a],"infinitespeed"))
 	rfd900_setbitrate("1000000000");
+      else if (!strncmp(argv[a],"topology=",9))
+	topology_file=&argv[a][9];
+      else if (!strncmp(argv[a],"hfairtime=",10)) {
+	hf_airtime_scale=atof(&argv[a][10]);
+	if (hf_airtime_scale<=0) {
+	  fprintf(stderr,"HF airtime factor must be positive\n");
+	  exit(-1);
+	}
+      }
+      else if (!strncmp(argv[a],"capture=",8)) {
+	capture_file=capture_open_write(&argv[a][8]);
+	if (!capture_file) exit(-1);
+      }
       else {
-	float p=atof(argv[3]);
+	float p=atof(argv[a]);
 	if (p<0||p>1) {
 	  fprintf(stderr,"Packet drop probability must be in range [0..1]\n");
 	  exit(-1);
@@ -890,7 +1438,22 @@ int main(int argc,char **argv)
 		p*100.0,packet_drop_threshold);
       }
     }
-  srandom(time(0));
+
+  // In virtual-time mode, we own the clock that all the lbard instances read,
+  // and runs are repeatable for a given seed.
+  char *clock_path=getenv("LBARD_VIRTUAL_CLOCK");
+  if (clock_path&&clock_path[0]) {
+    unsigned int seed=1;
+    int participants=radio_count;
+    if (getenv("LBARD_VIRTUAL_CLOCK_SEED"))
+      seed=strtoul(getenv("LBARD_VIRTUAL_CLOCK_SEED"),NULL,0);
+    if (getenv("LBARD_VIRTUAL_CLOCK_PARTICIPANTS"))
+      participants=atoi(getenv("LBARD_VIRTUAL_CLOCK_PARTICIPANTS"));
+    if (virtual_clock_create(clock_path,participants,seed)) exit(-1);
+    srandom(seed);
+    start_time=gettime_ms();
+  } else
+    srandom(time(0));
 
   char *r=radio_types;
   
@@ -929,6 +1492,17 @@ int main(int argc,char **argv)
     register_client(fd,radio_type_id);
   }
   fclose(tty_file);
+
+  if (topology_setup()) {
+    fprintf(stderr,"Invalid topology file.\n");
+    exit(-1);
+  }
+
+  struct pollfd *fds=calloc(client_count,sizeof(struct pollfd));
+  for(int i=0;i<client_count;i++) {
+    fds[i].fd=clients[i].socket;
+    fds[i].events=POLLIN;
+  }
   
   long long last_heartbeat_time=0;
   
@@ -939,11 +1513,25 @@ int main(int argc,char **argv)
     for(int i=0;i<client_count;i++)
       // Release any queued packet once we pass the embargo time
       activity+=release_pending_packets(i);
+
+    // Wait for input, or until the next packet is due or heartbeat needed
+    long long now = gettime_ms();
+    long long next_event=last_heartbeat_time+501;
+    long long next_delivery=next_delivery_time();
+    if ((next_delivery>=0)&&(next_delivery<next_event)) next_event=next_delivery;
+    int timeout=next_event-now;
+    if (timeout<0||activity||virtual_clock) timeout=0;
+    poll(fds,client_count,timeout);
     
     // Read input from each client.  This may cause packet transmission.
     for(int i=0;i<client_count;i++) {
+      if (!(fds[i].revents&(POLLIN|POLLHUP|POLLERR))) continue;
       unsigned char buffer[8192];
       int count = read(clients[i].socket,buffer,8192);
+      // A pty with nobody on the other end reports a hangup on every poll,
+      // so stop watching it until the next heartbeat.
+      if ((count<=0)&&(fds[i].revents&POLLHUP)) fds[i].fd=-1;
+      fds[i].revents=0;
       if (count>0) {
 	for(int j=0;j<count;j++) {
 	  switch(clients[i].radio_type) {
@@ -956,9 +1544,12 @@ int main(int argc,char **argv)
       }
     }
 
-    long long now = gettime_ms();
+    now = gettime_ms();
+    int heartbeat=0;
     if (last_heartbeat_time<(now-500)) {
+      heartbeat=1;
       for(int i=0;i<client_count;i++) {
+	fds[i].fd=clients[i].socket;
 	switch(clients[i].radio_type) {
 	case RADIO_RFD900: rfd900_heartbeat(i); break;
 	case RADIO_HFCODAN: hfcodan_heartbeat(i); break;
@@ -968,8 +1559,24 @@ int main(int argc,char **argv)
       last_heartbeat_time=now;
     }
 
-    // Sleep for 10ms if there has been no activity, else look for more activity
-    if (!activity) usleep(1000);      
+    if (virtual_clock) {
+      if (activity||heartbeat) {
+	// Anything we have written may wake a participant, so any idleness
+	// they declared before now no longer counts.
+	virtual_clock_note_activity();
+	continue;
+      }
+      // Jump to the next event if everyone is waiting for time to pass
+      next_event=(last_heartbeat_time+501)*1000;
+      next_delivery=next_delivery_time();
+      if ((next_delivery>=0)&&(next_delivery*1000<next_event))
+	next_event=next_delivery*1000;
+      if (virtual_clock_all_idle(&next_event)
+	  &&!radios_have_unread_input(fds))
+	virtual_clock_advance_to(next_event);
+      else usleep(50);
+      continue;
+    }
   }
   
 }
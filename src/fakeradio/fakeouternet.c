@@ -7,6 +7,15 @@
 
   The receiver side writes the received packets to a named UNIX socket.
 
+  Satellite reception tends to lose packets in bursts, rather than
+  singly, so the receivers can be made to lose packets following a
+  Gilbert-Elliott model: each receiver is either in a good state, where
+  it gets every packet, or a bad state, where it loses every packet.
+  loss=<percent> sets the long-run proportion of packets lost, and
+  burst=<packets> the mean length of a run of losses (default 1, i.e.,
+  independent losses).  seed=<n> makes the losses repeatable.  These
+  options can appear anywhere among the socket paths.
+
 */
 
 #include <unistd.h>
@@ -236,6 +245,23 @@ long long gettime_ms()
 
 
 
+struct receiver_channel {
+  int bad;
+  int lost;
+  int sent;
+};
+
+// Returns 1 if the packet should be lost on the way to this receiver
+int channel_loses_packet(struct receiver_channel *c,double p_good_bad,double p_bad_good)
+{
+  double x=random()/(RAND_MAX+1.0);
+  if (c->bad) { if (x<p_bad_good) c->bad=0; }
+  else { if (x<p_good_bad) c->bad=1; }
+  c->sent++;
+  if (c->bad) c->lost++;
+  return c->bad;
+}
+
 int main(int argc,char **argv)
 {
   unsigned char buffer[8192];
@@ -256,7 +282,10 @@ int main(int argc,char **argv)
 
 #define MAX_CLIENT_PATHS 1024
   struct sockaddr_un client_paths[MAX_CLIENT_PATHS];
+  struct receiver_channel client_channels[MAX_CLIENT_PATHS];
   int client_path_count=0;
+  double loss=0,burst=1;
+  double p_good_bad=0,p_bad_good=1;
   
   int retVal=-1;
   do {
@@ -274,12 +303,28 @@ int main(int argc,char **argv)
     // And build list of UNIX socket client paths to push the packets out to.
     for(int i=2;i<argc;i++)
       {
+	if (!strncasecmp("loss=",argv[i],5)) { loss=atof(&argv[i][5])/100.0; continue; }
+	if (!strncasecmp("burst=",argv[i],6)) { burst=atof(&argv[i][6]); continue; }
+	if (!strncasecmp("seed=",argv[i],5)) { srandom(atoi(&argv[i][5])); continue; }
+	if (client_path_count>=MAX_CLIENT_PATHS) break;
+	bzero(&client_channels[client_path_count],sizeof(struct receiver_channel));
 	memset(&client_paths[client_path_count], 0, sizeof(struct sockaddr_un));
 	client_paths[client_path_count].sun_family = AF_UNIX;
 	strncpy(client_paths[client_path_count].sun_path, argv[i], sizeof(client_paths[0].sun_path) - 1);
 	LOG_NOTE("Added UNIX socket client path '%s'",argv[i]);
 	client_path_count++;
       }
+    if (loss<0||loss>=1||burst<1) {
+      LOG_ERROR("loss= must be in [0,100) and burst= at least 1");
+      break;
+    }
+    // Leave the bad state after burst packets on average, and enter it often
+    // enough that loss of the packets are lost overall.
+    p_bad_good=1.0/burst;
+    p_good_bad=loss*p_bad_good/(1-loss);
+    if (loss>0)
+      LOG_NOTE("Receivers will lose %.1f%% of packets, in bursts of %.1f on average",
+	       loss*100,burst);
     
     while(1) {
 
@@ -327,6 +372,12 @@ int main(int argc,char **argv)
 	  // simultaneously.
 	  for(int i=0;i<client_path_count;i++)
 	    {
+	      if (channel_loses_packet(&client_channels[i],p_good_bad,p_bad_good)) {
+		LOG_NOTE("Losing packet on the way to '%s' (%d of %d lost so far)",
+			 client_paths[i].sun_path,
+			 client_channels[i].lost,client_channels[i].sent);
+		continue;
+	      }
 	      LOG_NOTE("Trying to send to '%s'\n",
 		       client_paths[i].sun_path);
 	      result=sendto(named_socket,queued_ack_body,queued_ack_len,0,
@@ -334,8 +385,8 @@ int main(int argc,char **argv)
 			    sizeof(struct sockaddr_un));
 	      if (result) {
 		perror("sendto(UNIXDOMAIN) failed");
-		LOG_NOTE("Failed to send to UNIX socket '%s' (result=%d)",argv[2+i],result);
-	      } else LOG_NOTE("UNIX socket send ok to '%s'",argv[2+i]);
+		LOG_NOTE("Failed to send to UNIX socket '%s' (result=%d)",client_paths[i].sun_path,result);
+	      } else LOG_NOTE("UNIX socket send ok to '%s'",client_paths[i].sun_path);
 	    }
 	  queued_ack_len=0;
 	}
@@ -0,0 +1,124 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2018 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Erasure code benchmark.  Encodes zones of k data shards, then rebuilds
+  them with as many data shards missing as the parity allows (the most
+  expensive case), and reports the throughput of each in MB of data per
+  second.  Every decoded zone is checked against the original, and every
+  pattern of up to m lost shards in the first zones is tried, so that this
+  doubles as a test of the code.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "rs_erasure.h"
+
+static long long fecbench_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1000000000LL+ts.tv_nsec;
+}
+
+// Try every way of losing up to m of the k+m shards (for small codes)
+static int fecbench_check_all_patterns(struct rs_erasure *c,unsigned char **shards,
+				       unsigned char **original,int len)
+{
+  int n=c->k+c->m;
+  if (n>20) return 0;
+  int failures=0;
+  for(unsigned long long present=0;present<(1ULL<<n);present++) {
+    if (__builtin_popcountll(present)<c->k) continue;
+    for(int s=0;s<c->k;s++)
+      if (!(present&(1ULL<<s))) memset(shards[s],0xee,len);
+    if (rs_erasure_decode(c,shards,present,len)) failures++;
+    for(int s=0;s<c->k;s++)
+      if (memcmp(shards[s],original[s],len)) { failures++; break; }
+    for(int s=0;s<c->k;s++) memcpy(shards[s],original[s],len);
+  }
+  return failures;
+}
+
+int fec_benchmark(int k,int m,int shard_bytes)
+{
+  struct rs_erasure c;
+  if (rs_erasure_init(&c,k,m)||shard_bytes<1) {
+    fprintf(stderr,"k=%d, m=%d is not a supported code (k+m must be at most %d)\n",
+	    k,m,RS_ERASURE_MAX_SHARDS);
+    return -1;
+  }
+
+  unsigned char *shards[RS_ERASURE_MAX_SHARDS];
+  unsigned char *original[RS_ERASURE_MAX_SHARDS];
+  srandom(1);
+  for(int s=0;s<k+m;s++) {
+    shards[s]=malloc(shard_bytes);
+    original[s]=malloc(shard_bytes);
+    for(int i=0;i<shard_bytes;i++) shards[s][i]=random();
+  }
+  rs_erasure_encode(&c,shards,&shards[k],shard_bytes);
+  for(int s=0;s<k+m;s++) memcpy(original[s],shards[s],shard_bytes);
+
+  int failures=fecbench_check_all_patterns(&c,shards,original,shard_bytes);
+
+  printf("Reed-Solomon (k=%d, m=%d) erasure code, %d byte shards, %s kernel\n",
+	 k,m,shard_bytes,
+#ifdef __SSSE3__
+	 "SSSE3"
+#else
+	 "64-bit word"
+#endif
+	 );
+
+  // Encode
+  long long zones=0;
+  long long start=fecbench_ns(),elapsed;
+  do {
+    for(int i=0;i<100;i++) rs_erasure_encode(&c,shards,&shards[k],shard_bytes);
+    zones+=100;
+    elapsed=fecbench_ns()-start;
+  } while(elapsed<500000000LL);
+  printf("encode: %8.1f MB/s, %8.2f us per zone\n",
+	 zones*k*shard_bytes*1000.0/elapsed,elapsed/1000.0/zones);
+
+  // Decode with the first min(k,m) data shards lost
+  int lost=m<k?m:k;
+  unsigned long long present=((1ULL<<(k+m))-1)&~((1ULL<<lost)-1);
+  zones=0;
+  start=fecbench_ns();
+  do {
+    for(int i=0;i<100;i++)
+      if (rs_erasure_decode(&c,shards,present,shard_bytes)) failures++;
+    zones+=100;
+    elapsed=fecbench_ns()-start;
+  } while(elapsed<500000000LL);
+  for(int s=0;s<k;s++)
+    if (memcmp(shards[s],original[s],shard_bytes)) failures++;
+  printf("decode: %8.1f MB/s, %8.2f us per zone (%d data shards lost)\n",
+	 zones*k*shard_bytes*1000.0/elapsed,elapsed/1000.0/zones,lost);
+
+  for(int s=0;s<k+m;s++) { free(shards[s]); free(original[s]); }
+  if (failures) printf("FAIL: %d zones did not decode correctly\n",failures);
+  return failures?-1:0;
+}
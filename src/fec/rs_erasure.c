@@ -0,0 +1,206 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2018 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Reed-Solomon erasure coding, used to protect the Outernet lanes (see
+  drv_outernet.c and outernetrx.c).  Both encoding and decoding reduce to
+  "dst ^= c * src" over whole shards, so that is the only loop that matters
+  for speed.  With SSSE3 it looks up 16 products at once from two 16-entry
+  nibble tables; otherwise it looks up eight bytes from the full product
+  table and XORs them in as one 64-bit word.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+#include "rs_erasure.h"
+
+// x^8 + x^4 + x^3 + x^2 + 1
+#define GF256_POLY 0x11d
+
+static unsigned char gf_exp[512];
+static unsigned char gf_log[256];
+static unsigned char gf_mul[256][256];
+static int gf_ready=0;
+
+static void gf256_init(void)
+{
+  int x=1;
+  for(int i=0;i<255;i++) {
+    gf_exp[i]=x; gf_log[x]=i;
+    x<<=1; if (x&0x100) x^=GF256_POLY;
+  }
+  for(int i=255;i<512;i++) gf_exp[i]=gf_exp[i-255];
+  for(int a=0;a<256;a++)
+    for(int b=0;b<256;b++)
+      gf_mul[a][b]=(a&&b)?gf_exp[gf_log[a]+gf_log[b]]:0;
+  gf_ready=1;
+}
+
+static unsigned char gf256_inv(unsigned char a)
+{
+  return gf_exp[255-gf_log[a]];
+}
+
+void gf256_mul_add_region(unsigned char *dst,unsigned char *src,
+			  unsigned char c,int len)
+{
+  int i=0;
+  if (!c) return;
+  if (!gf_ready) gf256_init();
+  if (c==1) {
+    for(;i+8<=len;i+=8) {
+      uint64_t d,s;
+      memcpy(&d,&dst[i],8); memcpy(&s,&src[i],8);
+      d^=s;
+      memcpy(&dst[i],&d,8);
+    }
+  } else {
+    const unsigned char *t=gf_mul[c];
+#ifdef __SSSE3__
+    unsigned char lo[16],hi[16];
+    for(int n=0;n<16;n++) { lo[n]=t[n]; hi[n]=t[n<<4]; }
+    __m128i tlo=_mm_loadu_si128((__m128i *)lo);
+    __m128i thi=_mm_loadu_si128((__m128i *)hi);
+    __m128i mask=_mm_set1_epi8(0x0f);
+    for(;i+16<=len;i+=16) {
+      __m128i s=_mm_loadu_si128((__m128i *)&src[i]);
+      __m128i l=_mm_and_si128(s,mask);
+      __m128i h=_mm_and_si128(_mm_srli_epi64(s,4),mask);
+      __m128i p=_mm_xor_si128(_mm_shuffle_epi8(tlo,l),_mm_shuffle_epi8(thi,h));
+      __m128i d=_mm_loadu_si128((__m128i *)&dst[i]);
+      _mm_storeu_si128((__m128i *)&dst[i],_mm_xor_si128(d,p));
+    }
+#endif
+    for(;i+8<=len;i+=8) {
+      unsigned char p[8];
+      uint64_t d,pw;
+      for(int n=0;n<8;n++) p[n]=t[src[i+n]];
+      memcpy(&d,&dst[i],8); memcpy(&pw,p,8);
+      d^=pw;
+      memcpy(&dst[i],&d,8);
+    }
+  }
+  const unsigned char *t=gf_mul[c];
+  for(;i<len;i++) dst[i]^=t[src[i]];
+}
+
+int rs_erasure_init(struct rs_erasure *c,int k,int m)
+{
+  if (k<1||m<0||(k+m)>RS_ERASURE_MAX_SHARDS) return -1;
+  if (!gf_ready) gf256_init();
+  c->k=k; c->m=m;
+  // Cauchy matrix: 1/(x_i + y_j), with x_i = k+i and y_j = j all distinct
+  for(int i=0;i<m;i++)
+    for(int j=0;j<k;j++)
+      c->parity[i][j]=gf256_inv((k+i)^j);
+  return 0;
+}
+
+int rs_erasure_encode(struct rs_erasure *c,unsigned char **data,
+		      unsigned char **parity,int len)
+{
+  for(int i=0;i<c->m;i++) {
+    bzero(parity[i],len);
+    for(int j=0;j<c->k;j++)
+      gf256_mul_add_region(parity[i],data[j],c->parity[i][j],len);
+  }
+  return 0;
+}
+
+/*
+  Invert the k x k matrix a in place (Gauss-Jordan), into inv.
+  Returns -1 if it is singular, which it cannot be for rows of [I;C].
+*/
+static int gf256_invert_matrix(unsigned char a[RS_ERASURE_MAX_SHARDS][RS_ERASURE_MAX_SHARDS],
+			       unsigned char inv[RS_ERASURE_MAX_SHARDS][RS_ERASURE_MAX_SHARDS],
+			       int k)
+{
+  for(int r=0;r<k;r++)
+    for(int col=0;col<k;col++) inv[r][col]=(r==col);
+
+  for(int col=0;col<k;col++) {
+    int pivot=col;
+    while(pivot<k&&!a[pivot][col]) pivot++;
+    if (pivot==k) return -1;
+    if (pivot!=col)
+      for(int n=0;n<k;n++) {
+	unsigned char t=a[col][n]; a[col][n]=a[pivot][n]; a[pivot][n]=t;
+	t=inv[col][n]; inv[col][n]=inv[pivot][n]; inv[pivot][n]=t;
+      }
+    unsigned char scale=gf256_inv(a[col][col]);
+    for(int n=0;n<k;n++) {
+      a[col][n]=gf_mul[scale][a[col][n]];
+      inv[col][n]=gf_mul[scale][inv[col][n]];
+    }
+    for(int r=0;r<k;r++) {
+      unsigned char f=a[r][col];
+      if (r==col||!f) continue;
+      for(int n=0;n<k;n++) {
+	a[r][n]^=gf_mul[f][a[col][n]];
+	inv[r][n]^=gf_mul[f][inv[col][n]];
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+  Rebuild any missing data shards.  shards[] has k+m entries, and bit n of
+  present is set if shards[n] was received.  The buffers of missing data
+  shards are overwritten; missing parity shards are left alone.
+  Returns -1 if fewer than k shards are present.
+*/
+int rs_erasure_decode(struct rs_erasure *c,unsigned char **shards,
+		      unsigned long long present,int len)
+{
+  int k=c->k;
+  int rows[RS_ERASURE_MAX_SHARDS];
+  int row_count=0;
+  int missing=0;
+
+  // Use the data shards we have, and make up the rest from parity
+  for(int n=0;n<k;n++)
+    if (present&(1ULL<<n)) rows[row_count++]=n; else missing++;
+  if (!missing) return 0;
+  for(int n=k;n<k+c->m&&row_count<k;n++)
+    if (present&(1ULL<<n)) rows[row_count++]=n;
+  if (row_count<k) return -1;
+
+  unsigned char a[RS_ERASURE_MAX_SHARDS][RS_ERASURE_MAX_SHARDS];
+  unsigned char inv[RS_ERASURE_MAX_SHARDS][RS_ERASURE_MAX_SHARDS];
+  for(int r=0;r<k;r++)
+    for(int col=0;col<k;col++)
+      a[r][col]=(rows[r]<k)?(rows[r]==col):c->parity[rows[r]-k][col];
+  if (gf256_invert_matrix(a,inv,k)) return -1;
+
+  for(int n=0;n<k;n++) {
+    if (present&(1ULL<<n)) continue;
+    bzero(shards[n],len);
+    for(int r=0;r<k;r++)
+      gf256_mul_add_region(shards[n],shards[rows[r]],inv[n][r],len);
+  }
+  return 0;
+}
@@ -34,6 +34,7 @@ station "103" 5 minutes every 2 hours
 #include "lbard.h"
 #include "hf.h"
 #include "radios.h"
+#include "metrics.h"
 
 extern unsigned char my_sid[32];
 extern char *my_sid_hex;
@@ -100,45 +101,34 @@ char *radio_type_description(int radio_type)
 
 int hf_radio_check_if_ready(void)
 {  
-  if (time(0)>=hf_next_packet_time) {
-    if (time(0)!=last_ready_report_time) {
-      char timestr[100]; time_t now=time(0); ctime_r(&now,timestr);
+  hf_reassembly_expire();
+  if (gettime_s()>=hf_next_packet_time) {
+    if (gettime_s()!=last_ready_report_time) {
+      char timestr[100]; time_t now=gettime_s(); ctime_r(&now,timestr);
       if (timestr[0]) timestr[strlen(timestr)-1]=0;
       if (hf_state==HF_ALELINK){
 	      fprintf(stderr,"  [%s] HF Radio cleared to transmit.\n",
 		timestr);
 		  }
     }
-    last_ready_report_time=time(0);
+    last_ready_report_time=gettime_s();
     return 1;
   } else {
-    if (time(0)!=last_ready_report_time) {
-      char timestr[100]; time_t now=time(0); ctime_r(&now,timestr);
+    if (gettime_s()!=last_ready_report_time) {
+      char timestr[100]; time_t now=gettime_s(); ctime_r(&now,timestr);
       if (timestr[0]) timestr[strlen(timestr)-1]=0;
       //fprintf(stderr,"  [%s] Wait %ld more seconds to allow other side to send.\n",
-	      //timestr,hf_next_packet_time-time(0));
+	      //timestr,hf_next_packet_time-gettime_s());
     }
-    last_ready_report_time=time(0);
+    last_ready_report_time=gettime_s();
     return 0;
   }
 }
 
-int hf_next_station_to_call(void)
-{
-  int i;
-  for(i=0;i<hf_station_count;i++) {
-    if (time(0)>hf_stations[i].next_link_time){ 
-			hf_stations[i].next_link_time = time(0) + timeout_call_a_radio_again;
-			return i;
-		}
-  }
-  if (hf_station_count) return random()%hf_station_count; else return -1;
-}
-
 int hf_radio_mark_ready(void)
 {
   hf_next_packet_time=0;
-  char timestr[100]; time_t now=time(0); ctime_r(&now,timestr);
+  char timestr[100]; time_t now=gettime_s(); ctime_r(&now,timestr);
   if (timestr[0]) timestr[strlen(timestr)-1]=0;
   fprintf(stderr,"  [%s] It is our turn to send.\n",timestr);
   return 0;
@@ -153,63 +143,348 @@ int hf_radio_pause_for_turnaround(void)
   // We add a random 1 - 10 seconds to avoid lock-step failure modes,
   // e.g., where both radios keep trying to talk to each other at
   // the same time.
-  hf_next_packet_time=time(0)+radio_types[radio_get_type()].hf_turnaround_delay+(random()%10)+30; //+30 for debug, time to detect for the transmitting radio if message is sent
+  hf_next_packet_time=gettime_s()+radio_types[radio_get_type()].hf_turnaround_delay+(random()%10)
+    +hf_burst_response_timeout(); // time for the other side to respond
 
   fprintf(stderr,"  [%s] Delaying %ld seconds to allow other side to send.\n",
-	  timestamp_str(),hf_next_packet_time-time(0));
+	  timestamp_str(),hf_next_packet_time-gettime_s());
   
   return 0;
 }
 
-int pieces_seen[6]={0,0,0,0,0,0};
+/*
+  Packets are sent over ALE as a series of AMD messages of at most
+  HF_ALE_MESSAGE_CHARS characters (HF_ALE3G_MESSAGE_CHARS for large
+  blocks).  Each starts with a three character header: the packet sequence
+  number (0-7) offset by a letter that says which kind of radio sent it and
+  how the rest is encoded, then the piece number as a digit, and the number
+  of pieces, offset by a letter that says whether the turn passes to the
+  other side after this packet.
+
+  '0'-'7' Codan, hex          'I'-'P' Codan, ASCII-64
+  'A'-'H' Barrett, hex        'Q'-'X' Barrett, ASCII-64
+  'a'-'h' Codan, 8-bit        'i'-'p' Barrett, 8-bit
+
+  '1'-'9' pieces, the turn passes (a single packet, as always)
+  'A'-'I' pieces, more packets follow in this burst
+  'J'-'R' pieces, the last packet of the burst, so the turn passes
+
+  A message starting with 'Z' is a block ACK for a burst (see burst.c).
+
+  Hex is always understood, and is 43 bytes per piece.  ASCII-64 (see
+  ascii64_encode()) fits about 64 bytes in each piece, but older versions
+  ignore it, and it needs the radios to carry all 64 characters, so we only
+  use it once everyone we can hear has said they understand it.
+
+  ALE 3G radios carry messages of 8-bit characters up to 256 long, so if
+  both ends have one, we send each byte as itself (see escape8_encode()),
+  in blocks big enough that a whole LBARD frame fits in one message.
+*/
+#define HF_MARKER_CODAN_HEX '0'
+#define HF_MARKER_BARRETT_HEX 'A'
+#define HF_MARKER_CODAN_ASCII64 'I'
+#define HF_MARKER_BARRETT_ASCII64 'Q'
+#define HF_MARKER_CODAN_8BIT 'a'
+#define HF_MARKER_BARRETT_8BIT 'i'
+#define HF_MARKER_BURST_ACK 'Z'
+#define HF_COUNT_BURST_MORE 'A'
+#define HF_COUNT_BURST_LAST 'J'
+
+#define HF_ENCODING_HEX 0
+#define HF_ENCODING_ASCII64 1
+#define HF_ENCODING_8BIT 2
+
+struct hf_marker {
+  char first;
+  int radio_type;
+  int encoding;
+};
+
+struct hf_marker hf_markers[]={
+  {HF_MARKER_CODAN_HEX,RADIOTYPE_HFCODAN,HF_ENCODING_HEX},
+  {HF_MARKER_BARRETT_HEX,RADIOTYPE_HFBARRETT,HF_ENCODING_HEX},
+  {HF_MARKER_CODAN_ASCII64,RADIOTYPE_HFCODAN,HF_ENCODING_ASCII64},
+  {HF_MARKER_BARRETT_ASCII64,RADIOTYPE_HFBARRETT,HF_ENCODING_ASCII64},
+  {HF_MARKER_CODAN_8BIT,RADIOTYPE_HFCODAN,HF_ENCODING_8BIT},
+  {HF_MARKER_BARRETT_8BIT,RADIOTYPE_HFBARRETT,HF_ENCODING_8BIT},
+  {0,-1,-1}
+};
+
+char *hf_encoding_names[]={"hex","ASCII-64","8-bit"};
+
+int hf_link_has_capability(int capability)
+{
+  // Don't assume anything of a link partner we haven't heard from yet
+  int heard=0;
+  for(int peer=0;peer<peer_count;peer++)
+    if (peer_records[peer]
+	&&peer_is_active(peer_records[peer]))
+      heard++;
+  return heard&&active_peers_have_capability(capability);
+}
+
+int hf_use_ascii64(void)
+{
+  if (option_flags&FLAG_NO_HF_ASCII64) return 0;
+  return hf_link_has_capability(CAPABILITY_HF_ASCII64);
+}
+
+int hf_use_large_blocks(void)
+{
+  if (option_flags&FLAG_NO_HF_LARGE_BLOCKS) return 0;
+  if (!radio_has_feature(RADIO_ALE_3G)) return 0;
+  return hf_link_has_capability(CAPABILITY_HF_LARGE_BLOCKS);
+}
+
+/*
+  Cut a packet into the AMD messages to send it as, behind the block ACK we
+  owe the other side, if any (see burst.c).  Returns the number of
+  messages, or -1 if it won't fit.
+*/
+int hf_encode_fragments(unsigned char *packet,int len,int radio_type,
+			char fragments[HF_MAX_MESSAGES][HF_ALE3G_MESSAGE_CHARS+1])
+{
+  int first=hf_burst_take_ack(fragments[0]);
+  int encoding=hf_use_large_blocks()?HF_ENCODING_8BIT:
+    hf_use_ascii64()?HF_ENCODING_ASCII64:HF_ENCODING_HEX;
+  int message_chars=(encoding==HF_ENCODING_8BIT)?HF_ALE3G_MESSAGE_CHARS:HF_ALE_MESSAGE_CHARS;
+  int marker=-1;
+  for(int m=0;hf_markers[m].first;m++)
+    if ((hf_markers[m].radio_type==radio_type)&&(hf_markers[m].encoding==encoding))
+      marker=hf_markers[m].first;
+  if (marker<0) return -1;
+
+  int pieces=0;
+  int frag_len=message_chars;
+  for(int i=0;i<len;) {
+    char group[16];
+    int bytes,chars;
+    if (encoding==HF_ENCODING_8BIT) {
+      bytes=1;
+      chars=escape8_encode(&packet[i],group,1);
+    } else if (encoding==HF_ENCODING_ASCII64) {
+      // As many whole groups of 3 bytes as will fit, escapes and all
+      bytes=(len-i<3)?len-i:3;
+      chars=ascii64_encode(&packet[i],group,bytes,radio_type);
+    } else {
+      // The same 43 bytes per piece as we have always sent
+      bytes=(len-i<HF_HEX_FRAGMENT_BYTES)?len-i:HF_HEX_FRAGMENT_BYTES;
+      chars=bytes*2;
+    }
+    if (frag_len+chars>message_chars) {
+      if (pieces>=HF_MAX_FRAGMENTS) return -1;
+      fragments[first+pieces][0]=marker+(hf_message_sequence_number&0x07);
+      fragments[first+pieces][1]='0'+pieces;
+      fragments[first+pieces][3]=0;
+      pieces++;
+      frag_len=HF_FRAGMENT_HEADER_CHARS;
+    }
+    char *fragment=fragments[first+pieces-1];
+    if (encoding==HF_ENCODING_HEX) hex_encode(&packet[i],&fragment[frag_len],bytes,radio_type);
+    else strcpy(&fragment[frag_len],group);
+    frag_len+=chars;
+    i+=bytes;
+  }
+
+  int count_base='0';
+  switch(hf_burst_next_frame(hf_message_sequence_number)) {
+  case HF_FRAME_MORE: count_base=HF_COUNT_BURST_MORE-1; break;
+  case HF_FRAME_LAST: count_base=HF_COUNT_BURST_LAST-1; break;
+  }
+  for(int n=0;n<pieces;n++) fragments[first+n][2]=count_base+pieces;
+  hf_schedule_sent(len);
+  return first+pieces;
+}
+
+/*
+  Frames being reassembled, by who sent them and their sequence number, so
+  that the pieces of one frame can arrive in any order, interleaved with
+  those of others.  A frame is passed up only once every piece is in.  One
+  that isn't complete by the time its slot is needed again, or within
+  HF_REASSEMBLY_TIMEOUT, is reported as incomplete and thrown away, rather
+  than being handed to the FEC as garbage.
+*/
+#define HF_REASSEMBLY_SLOTS 8
+#define HF_REASSEMBLY_TIMEOUT 300
+
+struct hf_reassembly {
+  int in_use;
+  int sender;
+  int radio_type;
+  int sequence;
+  int pieces;
+  unsigned int seen;
+  time_t last_time;
+  int piece_len[HF_MAX_FRAGMENTS];
+  unsigned char piece_data[HF_MAX_FRAGMENTS][HF_ALE3G_MESSAGE_CHARS];
+};
+
+struct hf_reassembly hf_reassembly[HF_REASSEMBLY_SLOTS];
 unsigned char accummulated_packet[256];
 
+static int hf_reassembly_count(char *outcome)
+{
+  char labels[MAX_METRIC_LABELS_LEN];
+  snprintf(labels,sizeof(labels),"%s,outcome=\"%s\"",metric_radio_label(),outcome);
+  metric_counter_add("lbard_hf_frames_received_total",labels,1);
+  return 0;
+}
 
-int hf_process_fragment(char *fragment)
+static int hf_reassembly_abandon(struct hf_reassembly *r,char *why)
 {
-  int peer_radio=-1;
-  int sequence=-1;
-  if ((fragment[0]>='0')&&(fragment[0]<='7')) {
-    peer_radio=RADIOTYPE_HFCODAN;
-    sequence=fragment[0]-'0';
+  if (!r->in_use) return 0;
+  fprintf(stderr,"HF: Incomplete packet sequence #%d from %d (%s): have pieces 0x%x of %d.\n",
+	  r->sequence,r->sender,why,r->seen,r->pieces);
+  hf_reassembly_count("incomplete");
+  r->in_use=0;
+  return 0;
+}
+
+int hf_reassembly_expire(void)
+{
+  time_t now=gettime_s();
+  for(int i=0;i<HF_REASSEMBLY_SLOTS;i++)
+    if (hf_reassembly[i].in_use&&(now-hf_reassembly[i].last_time>HF_REASSEMBLY_TIMEOUT))
+      hf_reassembly_abandon(&hf_reassembly[i],"timed out");
+  return 0;
+}
+
+static struct hf_reassembly *hf_reassembly_find(int sender,int radio_type,int sequence,
+						int pieces)
+{
+  struct hf_reassembly *free_slot=NULL,*oldest=NULL;
+  for(int i=0;i<HF_REASSEMBLY_SLOTS;i++) {
+    struct hf_reassembly *r=&hf_reassembly[i];
+    if (!r->in_use) { if (!free_slot) free_slot=r; continue; }
+    if ((r->sender==sender)&&(r->radio_type==radio_type)&&(r->sequence==sequence)) {
+      // The sequence number has come around again for a new frame
+      if (r->pieces!=pieces) hf_reassembly_abandon(r,"superseded");
+      else return r;
+      if (!free_slot) free_slot=r;
+      continue;
+    }
+    if ((!oldest)||(r->last_time<oldest->last_time)) oldest=r;
   }
-  if ((fragment[0]>='A')&&(fragment[0]<='H')) {
-    peer_radio=RADIOTYPE_HFBARRETT;
-    sequence=fragment[0]-'A';
+  if (!free_slot) {
+    hf_reassembly_abandon(oldest,"out of slots");
+    free_slot=oldest;
   }
+  bzero(free_slot,sizeof(struct hf_reassembly));
+  free_slot->in_use=1;
+  free_slot->sender=sender;
+  free_slot->radio_type=radio_type;
+  free_slot->sequence=sequence;
+  free_slot->pieces=pieces;
+  return free_slot;
+}
+
+static int hf_reassembly_deliver(struct hf_reassembly *r)
+{
+  int packet_len=0;
+  for(int p=0;p<r->pieces;p++) {
+    if (packet_len+r->piece_len[p]>sizeof(accummulated_packet)) {
+      r->in_use=0;
+      fprintf(stderr,"HF: Packet sequence #%d from %d is too long, so ignoring it.\n",
+	      r->sequence,r->sender);
+      hf_reassembly_count("oversize");
+      return -1;
+    }
+    bcopy(r->piece_data[p],&accummulated_packet[packet_len],r->piece_len[p]);
+    packet_len+=r->piece_len[p];
+  }
+  r->in_use=0;
+  hf_reassembly_count("complete");
+  fprintf(stderr,"Passing reassembled packet of %d bytes up for processing.\n",
+	  packet_len);
+  hf_schedule_heard(accummulated_packet,packet_len);
+  saw_packet(accummulated_packet,packet_len,0 /* RSSI unknown */,
+	     my_sid_hex,prefix,servald_server,credential);
+  return 0;
+}
+
+/*
+  Process an AMD message from the station sender (as the driver identifies
+  it: the two ends of a link must only agree on it between themselves).
+*/
+int hf_process_fragment(int sender,char *fragment)
+{
+  int peer_radio=-1;
+  int sequence=-1;
+  int encoding=-1;
+
+  // Anything from the other side means the turn is theirs
+  hf_burst_saw_fragment();
+  if (fragment[0]==HF_MARKER_BURST_ACK) return hf_burst_saw_ack(fragment);
+
+  for(int m=0;hf_markers[m].first;m++)
+    if ((fragment[0]>=hf_markers[m].first)&&(fragment[0]<=hf_markers[m].first+7)) {
+      peer_radio=hf_markers[m].radio_type;
+      encoding=hf_markers[m].encoding;
+      sequence=fragment[0]-hf_markers[m].first;
+    }
+  if (peer_radio<0) return -1;
+  if (!fragment[1]||!fragment[2]) return -1;
   int piece_number=(fragment[1]-'0');
   int pieces=(fragment[2]-'0');
+  int burst=HF_FRAME_SINGLE;
+  if ((fragment[2]>=HF_COUNT_BURST_MORE)&&(fragment[2]<HF_COUNT_BURST_LAST)) {
+    burst=HF_FRAME_MORE;
+    pieces=fragment[2]-HF_COUNT_BURST_MORE+1;
+  } else if (fragment[2]>=HF_COUNT_BURST_LAST) {
+    burst=HF_FRAME_LAST;
+    pieces=fragment[2]-HF_COUNT_BURST_LAST+1;
+  }
 
   fprintf(stderr,"Checking if message is a fragment (piece %d/%d, peer=%d).\n",
 	  piece_number,pieces,peer_radio);
-  if (peer_radio<0) return -1;
-  if (pieces<1||pieces>6) return -1;
-  if (piece_number<0||piece_number>5) return -1;
-  fprintf(stderr,"Received piece %d/%d of packet sequence #%d from a %s radio.\n",
-	  piece_number+1,pieces,sequence,radio_type_name(peer_radio));
-
-  int packet_offset=piece_number*43;
-  int i;
-  for(i=3;i<strlen(fragment);i+=2) {
-    if (ishex(fragment[i+0])&&ishex(fragment[i+1])) {
-      int v=(chartohexnybl(fragment[i+0])<<4)+chartohexnybl(fragment[i+1]);
-      accummulated_packet[packet_offset++]=v;
-    }
+  if (pieces<1||pieces>HF_MAX_FRAGMENTS) return -1;
+  if (piece_number<0||piece_number>=pieces) return -1;
+  fprintf(stderr,"Received piece %d/%d of packet sequence #%d from %d, a %s radio (%s).\n",
+	  piece_number+1,pieces,sequence,sender,radio_type_name(peer_radio),
+	  hf_encoding_names[encoding]);
+
+  // They took the turn without acknowledging any of our burst
+  if (!piece_number) hf_burst_saw_unacknowledged_frame();
+
+  hf_reassembly_expire();
+  struct hf_reassembly *r=hf_reassembly_find(sender,peer_radio,sequence,pieces);
+  // A piece we already have means a new frame with the same sequence number
+  if (r->seen&(1<<piece_number)) {
+    hf_reassembly_abandon(r,"superseded");
+    r=hf_reassembly_find(sender,peer_radio,sequence,pieces);
   }
-  if (piece_number==(pieces-1)) {
-    // We have a terminal piece: so assume we have the whole packet.
+  r->last_time=gettime_s();
+
+  unsigned char *data=r->piece_data[piece_number];
+  int n;
+  if (encoding==HF_ENCODING_8BIT)
+    n=escape8_decode(&fragment[3],data,HF_ALE3G_MESSAGE_CHARS);
+  else if (encoding==HF_ENCODING_ASCII64)
+    n=ascii64_decode(&fragment[3],data,HF_ALE3G_MESSAGE_CHARS,peer_radio);
+  else
+    n=hex_decode(&fragment[3],data,HF_ALE3G_MESSAGE_CHARS,peer_radio);
+  if (n<0)
+    fprintf(stderr,"Could not decode piece %d/%d.\n",piece_number+1,pieces);
+  else {
+    r->seen|=1<<piece_number;
+    r->piece_len[piece_number]=n;
+  }
+
+  if (r->seen==((1U<<pieces)-1)) {
     // (the FEC will reject it if it is incorrectly assembled).
-    fprintf(stderr,"Passing reassembled packet of %d bytes up for processing.\n",
-	    packet_offset);
-    saw_packet(accummulated_packet,packet_offset,0 /* RSSI unknown */,
-	       my_sid_hex,prefix,servald_server,credential);
+    if (!hf_reassembly_deliver(r)&&(burst!=HF_FRAME_SINGLE))
+      hf_burst_saw_frame(sequence);
+  } else if (piece_number==(pieces-1))
+    fprintf(stderr,"Missing some pieces of packet sequence #%d, holding on to the rest.\n",
+	    sequence);
 
-    // Now it is our turn to send
-    hf_radio_mark_ready();
+  if (piece_number==(pieces-1)) {
+    // Now it is our turn to send, unless more of their burst is coming
+    if (burst==HF_FRAME_MORE) hf_radio_pause_for_turnaround();
+    else hf_radio_mark_ready();
   } else
     // Not end of packet, wait 8+1d8 seconds before we try transmitting.
     hf_radio_pause_for_turnaround();
-  
+
   return 0;
 }
-
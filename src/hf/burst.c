@@ -0,0 +1,190 @@
+/*
+  HF burst mode.
+
+  Without it, each side of an ALE link sends one LBARD frame and then hands
+  the turn over, and if the frame (or the reply) is lost, both sides sit out
+  a long turnaround timeout.  In burst mode the side holding the turn sends
+  a window of frames, and only the last of them hands the turn over.  This
+  is said by the piece count in the fragment header (see ale.c): '1'-'9' is
+  a single frame as always, 'A'-'I' a frame with more to follow in this
+  turn, and 'J'-'R' the last frame of the turn.
+
+  The first message the other side sends when it takes the turn is a block
+  ACK, "Z" followed by two hex digits: a bitmap of the sequence numbers
+  (0-7) of the frames of our burst that it received whole.  Frames are not
+  resent (the sync process sends whatever is still missing), but the loss
+  tells us how big a window the link will take: one more frame after a
+  clean burst, or as many fewer as the fraction lost.  If they take the turn
+  without an ACK, they heard none of our burst.
+
+  How long we wait for the other side to respond before taking the turn
+  back is twice the smoothed time they have taken to respond before, rather
+  than a fixed 30 seconds.
+
+  Burst mode is only used when everyone we can hear has said they
+  understand it, as older versions would take the turn after every frame.
+*/
+#include <unistd.h>
+#include <time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <strings.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include "sync.h"
+#include "lbard.h"
+#include "hf.h"
+#include "radios.h"
+#include "metrics.h"
+
+#define HF_BURST_INITIAL_WINDOW 2
+#define HF_BURST_MAX_WINDOW 8
+#define HF_BURST_MAX_RESPONSE_TIMEOUT 30
+
+int hf_burst_window=HF_BURST_INITIAL_WINDOW;
+int hf_burst_frames_this_turn=0;
+// Sequence numbers of the frames in our last burst, and of the frames we
+// have received whole since we last sent an ACK.
+unsigned char hf_burst_sent_seqs=0;
+unsigned char hf_burst_rx_seqs=0;
+int hf_burst_ack_pending=0;
+int hf_burst_awaiting_response=0;
+long long hf_burst_turn_end_ms=0;
+// Smoothed time the other side takes to respond to the end of our turn
+long long hf_burst_response_ms=0;
+
+int hf_use_burst(void)
+{
+  if (option_flags&FLAG_NO_HF_BURST) return 0;
+  return hf_link_has_capability(CAPABILITY_HF_BURST);
+}
+
+static int hf_burst_adapt(int sent,int received)
+{
+  char labels[MAX_METRIC_LABELS_LEN];
+  snprintf(labels,sizeof(labels),"%s,outcome=\"acked\"",metric_radio_label());
+  metric_counter_add("lbard_hf_burst_frames_total",labels,received);
+  snprintf(labels,sizeof(labels),"%s,outcome=\"lost\"",metric_radio_label());
+  metric_counter_add("lbard_hf_burst_frames_total",labels,sent-received);
+
+  if (received>=sent) {
+    if (hf_burst_window<HF_BURST_MAX_WINDOW) hf_burst_window++;
+  } else if (sent) {
+    hf_burst_window=hf_burst_window*received/sent;
+    if (hf_burst_window<1) hf_burst_window=1;
+  }
+  metric_gauge_set("lbard_hf_burst_window",metric_radio_label(),hf_burst_window);
+  fprintf(stderr,"HF: %d of %d frames of our burst arrived, window is now %d frames.\n",
+	  received,sent,hf_burst_window);
+  return 0;
+}
+
+/*
+  Called as each frame is cut into fragments.  Returns HF_FRAME_SINGLE if
+  we are not in burst mode, otherwise HF_FRAME_MORE or HF_FRAME_LAST.
+*/
+int hf_burst_next_frame(int sequence)
+{
+  if (!hf_use_burst()) {
+    hf_burst_frames_this_turn=0;
+    return HF_FRAME_SINGLE;
+  }
+  if (!hf_burst_frames_this_turn) {
+    // We took the turn back without hearing from them at all
+    if (hf_burst_awaiting_response) {
+      hf_burst_awaiting_response=0;
+      hf_burst_adapt(__builtin_popcount(hf_burst_sent_seqs),0);
+    }
+    hf_burst_sent_seqs=0;
+  }
+  hf_burst_sent_seqs|=1<<(sequence&7);
+  hf_burst_frames_this_turn++;
+  if (hf_burst_frames_this_turn>=hf_burst_window) {
+    hf_burst_frames_this_turn=0;
+    return HF_FRAME_LAST;
+  }
+  return HF_FRAME_MORE;
+}
+
+// The block ACK to put in front of our next frame, if we owe one
+int hf_burst_take_ack(char *out)
+{
+  if (!hf_burst_ack_pending) return 0;
+  snprintf(out,4,"Z%02X",hf_burst_rx_seqs);
+  hf_burst_ack_pending=0;
+  hf_burst_rx_seqs=0;
+  return 1;
+}
+
+// The radio has finished sending a frame: keep the turn, or hand it over
+int hf_radio_frame_sent(void)
+{
+  if (hf_burst_frames_this_turn) {
+    hf_next_packet_time=gettime_s();
+    return 0;
+  }
+  if (hf_use_burst()) {
+    hf_burst_awaiting_response=1;
+    hf_burst_turn_end_ms=gettime_ms();
+  }
+  return hf_radio_pause_for_turnaround();
+}
+
+/*
+  The other side has started sending.  Whatever we were doing, the turn is
+  theirs now, and if this is the answer to our burst, we know how long they
+  took to respond.
+*/
+int hf_burst_saw_fragment(void)
+{
+  hf_burst_frames_this_turn=0;
+  if ((!hf_burst_awaiting_response)||(!hf_burst_turn_end_ms)) return 0;
+
+  long long sample=gettime_ms()-hf_burst_turn_end_ms;
+  hf_burst_turn_end_ms=0;
+  if (sample>=0) {
+    hf_burst_response_ms=hf_burst_response_ms?
+      (3*hf_burst_response_ms+sample)/4:sample;
+    metric_histogram_observe("lbard_hf_turn_response_ms",metric_radio_label(),sample);
+  }
+  return 0;
+}
+
+int hf_burst_saw_ack(char *fragment)
+{
+  int bitmap=0;
+  if (!ishex(fragment[1])||!ishex(fragment[2])) return -1;
+  bitmap=(chartohexnybl(fragment[1])<<4)+chartohexnybl(fragment[2]);
+  if (!hf_burst_awaiting_response) return 0;
+  hf_burst_awaiting_response=0;
+  hf_burst_adapt(__builtin_popcount(hf_burst_sent_seqs),
+		 __builtin_popcount(hf_burst_sent_seqs&bitmap));
+  return 0;
+}
+
+// The first piece of a frame of theirs, without an ACK for our burst
+int hf_burst_saw_unacknowledged_frame(void)
+{
+  if (!hf_burst_awaiting_response) return 0;
+  hf_burst_awaiting_response=0;
+  hf_burst_adapt(__builtin_popcount(hf_burst_sent_seqs),0);
+  return 0;
+}
+
+// A whole frame of a burst of theirs arrived
+int hf_burst_saw_frame(int sequence)
+{
+  hf_burst_rx_seqs|=1<<(sequence&7);
+  hf_burst_ack_pending=1;
+  return 0;
+}
+
+// How long to wait for the other side, beyond the radio's turnaround time
+int hf_burst_response_timeout(void)
+{
+  if (!hf_use_burst()||!hf_burst_response_ms) return HF_BURST_MAX_RESPONSE_TIMEOUT;
+  long long timeout=2*hf_burst_response_ms/1000+1;
+  if (timeout>HF_BURST_MAX_RESPONSE_TIMEOUT) timeout=HF_BURST_MAX_RESPONSE_TIMEOUT;
+  return timeout;
+}
@@ -44,6 +44,7 @@ int hf_parse_linkcandidate(char *l)
 	while(l[l_pointer] != 0)
 		{
 		struct hf_station new_hf_station;
+		bzero(&new_hf_station,sizeof(new_hf_station));
 		//get index			
 		str_part(tmp, l, l_pointer, 2);
 		str_copy(new_hf_station.index, tmp);				
@@ -92,8 +93,8 @@ int hf_parse_linkcandidate(char *l)
       // ignore blank lines and # comments
     } else if (sscanf(line,"wait %d seconds%n",&seconds,&offset)==1) {
       // Wait this long before making first call
-      last_outbound_call=time(0)+seconds;
-      hf_next_packet_time=time(0)+seconds;
+      last_outbound_call=gettime_s()+seconds;
+      hf_next_packet_time=gettime_s()+seconds;
     } else if (sscanf(line,"%d%% duty cycle%n",&hf_callout_duty_cycle,&offset)==1) {
       if (hf_callout_duty_cycle<0||hf_callout_duty_cycle>100) {
 	fprintf(stderr,"Invalid call out duty cycle: Must be between 0%% and 100%%\n");
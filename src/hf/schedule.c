@@ -0,0 +1,292 @@
+/*
+  Decide which HF station to call next.
+
+  Setting up an ALE link costs minutes of channel time, so calls should go
+  to the stations we have the most to send to, and that have been worth
+  calling before.  We can't know what a station is missing until we have
+  talked to it: over each link we learn the SID of the lbard behind the
+  station, and the sync process then fills that peer's TX queue with what it
+  lacks.  That queue outlives the link, so it tells us how much is waiting for
+  the station the next time we think about calling it.
+
+  Each station that is due a call is scored as
+
+    min(pending bytes, what its links carry in link_time_target minutes)
+      x (1 + priority of the most important bundle queued for it / 8192)
+      / 2^(consecutive failed calls)
+
+  where 8192 is what rank.c adds for a bundle addressed to a peer, so MeshMS
+  for the station counts several times over.  A station is due once its
+  next_link_time has passed.  Calling it pushes that back, by twice as much
+  for each call in a row that didn't get a link; ending a link pushes it to
+  line_time_interval hours later (stretched pro-rata if the link ran over
+  link_time_target), or if no interval is configured, to when we would
+  normally call again.  Stations we have nothing queued for are still
+  called, last, once an interval (or an hour) has passed since we last spoke
+  to them, so that they get a chance to send to us.  Stations we have never
+  spoken to are called when nothing better is due, so that we find out what
+  they need.
+
+  The plan is on the status page as "hfplan".
+*/
+#include <unistd.h>
+#include <time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <strings.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include "sync.h"
+#include "lbard.h"
+#include "hf.h"
+#include "radios.h"
+
+// Link length and check-in interval assumed for stations without one set
+#define HF_SCHEDULE_DEFAULT_LINK_SECONDS (5*60)
+#define HF_SCHEDULE_DEFAULT_CHECKIN_SECONDS (60*60)
+// Bytes per second assumed for a station we haven't seen carry any
+#define HF_SCHEDULE_DEFAULT_THROUGHPUT 1.0
+#define HF_SCHEDULE_PRIORITY_UNIT 8192.0
+#define HF_SCHEDULE_MAX_BACKOFF_SHIFT 5
+
+struct hf_plan_entry {
+  int station;
+  int peer;
+  long long pending_bytes;
+  long long priority;
+  int due;
+  double score;
+};
+
+struct hf_plan_entry hf_plan[MAX_HF_STATIONS];
+int hf_plan_len=0;
+time_t hf_plan_time=0;
+
+// The link (or call) we are keeping track of
+int hf_schedule_partner=-1;
+time_t hf_schedule_link_start=0;
+long long hf_schedule_link_bytes=0;
+int hf_schedule_called=-1;
+
+static int hf_station_valid(int station)
+{
+  return (station>=0)&&(station<hf_station_count);
+}
+
+static int hf_station_peer(struct hf_station *s)
+{
+  if (!s->sid_known) return -1;
+  for(int i=0;i<peer_count;i++)
+    if (peer_records[i]&&!bcmp(peer_records[i]->sid_prefix_bin,s->sid_prefix_bin,4))
+      return i;
+  return -1;
+}
+
+// Bytes we have queued for a peer, and the priority of the most important
+static long long hf_peer_pending(int peer,long long *priority)
+{
+  struct peer_state *p=peer_records[peer];
+  long long bytes=0;
+  *priority=0;
+  if (p->tx_bundle>=0&&p->tx_bundle<bundle_count) {
+    long long left=bundles[p->tx_bundle].length-p->tx_bundle_body_offset_hard_lower_bound;
+    bytes+=left>0?left:0;
+    *priority=p->tx_bundle_priority;
+  }
+  for(int i=0;i<p->tx_queue_len;i++) {
+    int b=p->tx_queue_bundles[i];
+    if (b<0||b>=bundle_count) continue;
+    bytes+=bundles[b].length;
+    if (p->tx_queue_priorities[i]>*priority) *priority=p->tx_queue_priorities[i];
+  }
+  return bytes;
+}
+
+static double hf_mean_throughput(void)
+{
+  double sum=0;
+  int n=0;
+  for(int i=0;i<hf_station_count;i++)
+    if (hf_stations[i].throughput>0) { sum+=hf_stations[i].throughput; n++; }
+  return n?sum/n:HF_SCHEDULE_DEFAULT_THROUGHPUT;
+}
+
+static int hf_plan_compare(const void *a,const void *b)
+{
+  const struct hf_plan_entry *x=a,*y=b;
+  if (x->due!=y->due) return y->due-x->due;
+  if (x->score<y->score) return 1;
+  if (x->score>y->score) return -1;
+  // Otherwise whoever has waited longest
+  time_t tx=hf_stations[x->station].next_link_time;
+  time_t ty=hf_stations[y->station].next_link_time;
+  return (tx>ty)-(tx<ty);
+}
+
+static int hf_schedule_plan(void)
+{
+  time_t now=gettime_s();
+  double mean_throughput=hf_mean_throughput();
+
+  hf_schedule_track_link();
+
+  hf_plan_len=0;
+  for(int i=0;i<hf_station_count;i++) {
+    struct hf_station *s=&hf_stations[i];
+    struct hf_plan_entry *e=&hf_plan[hf_plan_len++];
+    bzero(e,sizeof(struct hf_plan_entry));
+    e->station=i;
+    e->peer=hf_station_peer(s);
+    if (e->peer>=0) e->pending_bytes=hf_peer_pending(e->peer,&e->priority);
+
+    e->due=(now>=s->next_link_time);
+    if (e->due&&s->sid_known&&!e->pending_bytes) {
+      time_t checkin=s->line_time_interval?s->line_time_interval*3600:
+	HF_SCHEDULE_DEFAULT_CHECKIN_SECONDS;
+      if (now<s->last_link_time+checkin) e->due=0;
+    }
+
+    int link_seconds=s->link_time_target?s->link_time_target*60:
+      HF_SCHEDULE_DEFAULT_LINK_SECONDS;
+    double throughput=s->throughput>0?s->throughput:mean_throughput;
+    double useful=e->pending_bytes;
+    if (useful>throughput*link_seconds) useful=throughput*link_seconds;
+    e->score=useful*(1+e->priority/HF_SCHEDULE_PRIORITY_UNIT);
+    if (!s->sid_known) {
+      // Someone we have never spoken to: worth a call only if nothing else is
+      e->score=0.5;
+    }
+    int failures=s->consecutive_connection_failures;
+    if (failures>HF_SCHEDULE_MAX_BACKOFF_SHIFT*2) failures=HF_SCHEDULE_MAX_BACKOFF_SHIFT*2;
+    e->score/=(double)(1<<failures);
+  }
+  qsort(hf_plan,hf_plan_len,sizeof(struct hf_plan_entry),hf_plan_compare);
+  hf_plan_time=now;
+  return 0;
+}
+
+int hf_next_station_to_call(void)
+{
+  time_t now=gettime_s();
+
+  // The last call we made didn't get us a link
+  if (hf_station_valid(hf_schedule_called)
+      &&(hf_stations[hf_schedule_called].last_link_time<
+	 hf_stations[hf_schedule_called].last_call_time)) {
+    hf_stations[hf_schedule_called].consecutive_connection_failures++;
+    fprintf(stderr,"HF: Call to station #%d '%s' was not answered (%d times in a row)\n",
+	    hf_schedule_called,hf_stations[hf_schedule_called].name,
+	    hf_stations[hf_schedule_called].consecutive_connection_failures);
+  }
+  hf_schedule_called=-1;
+
+  hf_schedule_plan();
+  if ((!hf_plan_len)||(!hf_plan[0].due)) return -1;
+
+  int station=hf_plan[0].station;
+  struct hf_station *s=&hf_stations[station];
+  int shift=s->consecutive_connection_failures;
+  if (shift>HF_SCHEDULE_MAX_BACKOFF_SHIFT) shift=HF_SCHEDULE_MAX_BACKOFF_SHIFT;
+  s->next_link_time=now+(timeout_call_a_radio_again<<shift);
+  s->last_call_time=now;
+  hf_schedule_called=station;
+
+  fprintf(stderr,"HF: Calling station #%d '%s': %lld bytes queued, priority %lld, score %.1f\n",
+	  station,s->name,hf_plan[0].pending_bytes,hf_plan[0].priority,hf_plan[0].score);
+  return station;
+}
+
+/*
+  Notice links starting and ending.  The drivers set hf_link_partner in many
+  places, so rather than hook each of them, we look whenever anything passes
+  over the link, and whenever we are asked who to call.
+*/
+int hf_schedule_track_link(void)
+{
+  int partner=hf_station_valid(hf_link_partner)?hf_link_partner:-1;
+  if (partner==hf_schedule_partner) return 0;
+  time_t now=gettime_s();
+
+  if (hf_station_valid(hf_schedule_partner)) {
+    struct hf_station *s=&hf_stations[hf_schedule_partner];
+    long long duration=now-hf_schedule_link_start;
+    if (duration>0) {
+      float rate=hf_schedule_link_bytes*1.0/duration;
+      s->throughput=s->throughput>0?(0.7*s->throughput+0.3*rate):rate;
+    }
+    s->last_link_time=now;
+    if (s->line_time_interval) {
+      long long wait=s->line_time_interval*3600LL;
+      if (s->link_time_target&&duration>s->link_time_target*60)
+	wait=wait*duration/(s->link_time_target*60);
+      s->next_link_time=now+wait;
+    } else
+      s->next_link_time=now+timeout_call_a_radio_again;
+    fprintf(stderr,"HF: Link with station #%d '%s' ended after %lld seconds, %lld bytes (%.1f bytes/sec on average)\n",
+	    hf_schedule_partner,s->name,duration,hf_schedule_link_bytes,s->throughput);
+  }
+
+  hf_schedule_partner=partner;
+  hf_schedule_link_start=now;
+  hf_schedule_link_bytes=0;
+  if (partner>=0) {
+    hf_stations[partner].last_link_time=now;
+    hf_stations[partner].consecutive_connection_failures=0;
+  }
+  return 0;
+}
+
+// A packet came over the link: remember who is behind the station
+int hf_schedule_heard(unsigned char *packet,int len)
+{
+  hf_schedule_track_link();
+  if (hf_schedule_partner<0) return -1;
+  hf_schedule_link_bytes+=len;
+  if (len<4) return 0;
+  struct hf_station *s=&hf_stations[hf_schedule_partner];
+  bcopy(packet,s->sid_prefix_bin,4);
+  s->sid_known=1;
+  return 0;
+}
+
+int hf_schedule_sent(int len)
+{
+  hf_schedule_track_link();
+  if (hf_schedule_partner>=0) hf_schedule_link_bytes+=len;
+  return 0;
+}
+
+int hf_schedule_dump(FILE *f)
+{
+  if (!hf_station_count) {
+    fprintf(f,"No HF stations known.\n");
+    return 0;
+  }
+  hf_schedule_plan();
+  time_t now=gettime_s();
+  fprintf(f,"<table border=1 padding=2 spacing=2><tr><th>Order</th><th>Station</th><th>SID</th>"
+	  "<th>Queued bytes</th><th>Priority</th><th>Bytes/sec</th><th>Failed calls</th>"
+	  "<th>Next call</th><th>Score</th></tr>\n");
+  for(int i=0;i<hf_plan_len;i++) {
+    struct hf_plan_entry *e=&hf_plan[i];
+    struct hf_station *s=&hf_stations[e->station];
+    char sid[16]="unknown";
+    if (s->sid_known)
+      snprintf(sid,sizeof(sid),"%02X%02X%02X%02X*",
+	       s->sid_prefix_bin[0],s->sid_prefix_bin[1],
+	       s->sid_prefix_bin[2],s->sid_prefix_bin[3]);
+    char when[64];
+    if (e->station==hf_schedule_partner) snprintf(when,sizeof(when),"linked");
+    else if (e->due) snprintf(when,sizeof(when),"due");
+    else if (s->next_link_time>now)
+      snprintf(when,sizeof(when),"T+%llds",(long long)(s->next_link_time-now));
+    else snprintf(when,sizeof(when),"nothing to send");
+    fprintf(f,"<tr><td>%d</td><td>%s (%s)</td><td>%s</td><td>%lld</td><td>%lld</td>"
+	    "<td>%.1f</td><td>%d</td><td>%s</td><td>%.1f</td></tr>\n",
+	    i+1,s->name,s->index,sid,e->pending_bytes,e->priority,
+	    s->throughput,s->consecutive_connection_failures,when,e->score);
+  }
+  fprintf(f,"</table>\n");
+  return 0;
+}
@@ -184,19 +184,36 @@ int json_body(int sock,long long timeout_time)
   return 0;
 }
 
+/*
+  When set, no connection to servald is attempted, and every request fails
+  immediately as though servald were down.  Used by the receive path
+  benchmark, which counts the requests that would otherwise have been made.
+*/
+int servald_stubbed=0;
+long long servald_stubbed_requests=0;
+
 int connect_to_port(char *host,int port)
 {
-  struct hostent *hostent;
-  hostent = gethostbyname(host);
-  if (!hostent) {
+  if (servald_stubbed) {
+    servald_stubbed_requests++;
+    return -1;
+  }
+
+  // (not gethostbyname(), as the servald workers call this at the same time)
+  struct addrinfo hints,*res=NULL;
+  bzero(&hints,sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host,NULL,&hints,&res)||!res) {
     return -1;
   }
 
   struct sockaddr_in addr;  
   addr.sin_family = AF_INET;     
   addr.sin_port = htons(port);   
-  addr.sin_addr = *((struct in_addr *)hostent->h_addr);
+  addr.sin_addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
   bzero(&(addr.sin_zero),8);     
+  freeaddrinfo(res);
 
   int sock=socket(AF_INET, SOCK_STREAM, 0);
   if (sock==-1) {
@@ -403,6 +420,41 @@ int http_post_bundle(char *server_and_port, char *auth_token,
 		     unsigned char *body_data, int body_length,
 		    int timeout_ms)
 {
+  return http_post_bundle_parts(server_and_port,auth_token,path,
+				manifest_data,manifest_length,
+				body_data,body_length,NULL,0,
+				timeout_ms);
+}
+
+// Copy length bytes from the file to the socket, a block at a time
+static int write_file_part(int sock,FILE *f,int length)
+{
+  unsigned char block[16384];
+  while(length>0) {
+    int n=length<(int)sizeof(block)?length:(int)sizeof(block);
+    if (fread(block,1,n,f)!=n) return -1;
+    write_all(sock,block,n);
+    length-=n;
+  }
+  return 0;
+}
+
+/*
+  Post a bundle whose payload is in two pieces, e.g., the part of a journal we
+  already had, followed by the part we have just received.  The pieces are
+  written to the socket one after the other, so the payload is never copied
+  into one buffer.  If head_file is given, the head is read from there instead
+  of body_head.
+*/
+static int http_post_bundle_common(char *server_and_port, char *auth_token,
+				   char *path,
+				   unsigned char *manifest_data, int manifest_length,
+				   FILE *head_file,
+				   unsigned char *body_head, int head_length,
+				   unsigned char *body_tail, int tail_length,
+				   int timeout_ms)
+{
+  int body_length=head_length+tail_length;
 
   char server_name[1024];
   int server_port=-1;
@@ -417,7 +469,7 @@ int http_post_bundle(char *server_and_port, char *auth_token,
   if (strlen(auth_token)>500) return -1;
   if (strlen(path)>500) return -1;
   
-  char request[8192+body_length];
+  char request[8192];
   char authdigest[1024];
   int zero=0;
 
@@ -496,35 +548,36 @@ int http_post_bundle(char *server_and_port, char *auth_token,
 			      manifest_header);
   
   total_len=header_length+extra_length;
+  // The manifest is at most a few KB, so it goes in with the headers
+  if (manifest_length>(8192-total_len-1024)) return -1;
   bcopy(manifest_data,&request[total_len],manifest_length);
-
-  int subtotal_len=total_len;
   total_len=total_len+manifest_length;
-  total_len+=snprintf(&request[total_len],8192+body_length-total_len,  
+  total_len+=snprintf(&request[total_len],8192-total_len,
 			   "\r\n"
 			   "--%s\r\n"
 			   "%s",
 			   boundary_string,
 			   body_header);
-  bcopy(body_data,&request[total_len],body_length);
-  total_len=total_len+body_length;
-  total_len+=snprintf(&request[total_len],8192+body_length-total_len,
-	   "\r\n"
-	   "--%s--\r\n",
-	   boundary_string);
+  char trailer[1024];
+  int trailer_len=snprintf(trailer,1024,
+			   "\r\n"
+			   "--%s--\r\n",
+			   boundary_string);
 
-  if (0) fprintf(stderr,"  content_length was calculated at %d bytes, total_len=%d\n",
-		 content_length,total_len);
-  int present_len=2+boundary_len+2+strlen(manifest_header);
-  if  (0) fprintf(stderr,
-		  "    subtotal_len=%d, difference+present=%d (should match content_length)\n",
-		  subtotal_len,total_len-subtotal_len+present_len);
-  
   int sock=connect_to_port(server_name,server_port);
   if (sock<0) return -1;
 
-  // Write request
+  // Write request: headers and manifest, then the payload in place
   write_all(sock,request,total_len);
+  if (head_file) {
+    if (write_file_part(sock,head_file,head_length)) {
+      fprintf(stderr,"Could not read %d byte payload head from file\n",head_length);
+      close(sock);
+      return -1;
+    }
+  } else if (head_length) write_all(sock,body_head,head_length);
+  if (tail_length) write_all(sock,body_tail,tail_length);
+  write_all(sock,trailer,trailer_len);
 
   // Read reply, streaming output to file after we have skipped the header
   int http_response=-1;
@@ -565,6 +618,33 @@ int http_post_bundle(char *server_and_port, char *auth_token,
   return http_response;  
 }
 
+int http_post_bundle_parts(char *server_and_port, char *auth_token,
+			   char *path,
+			   unsigned char *manifest_data, int manifest_length,
+			   unsigned char *body_head, int head_length,
+			   unsigned char *body_tail, int tail_length,
+			   int timeout_ms)
+{
+  return http_post_bundle_common(server_and_port,auth_token,path,
+				 manifest_data,manifest_length,
+				 NULL,body_head,head_length,
+				 body_tail,tail_length,timeout_ms);
+}
+
+// As http_post_bundle_parts(), with the first head_length bytes of the payload from a file
+int http_post_bundle_file_parts(char *server_and_port, char *auth_token,
+				char *path,
+				unsigned char *manifest_data, int manifest_length,
+				FILE *head_file, int head_length,
+				unsigned char *body_tail, int tail_length,
+				int timeout_ms)
+{
+  return http_post_bundle_common(server_and_port,auth_token,path,
+				 manifest_data,manifest_length,
+				 head_file,NULL,head_length,
+				 body_tail,tail_length,timeout_ms);
+}
+
 int http_post_meshms_common(char *server_and_port, char *auth_token,
 			    char *message,char *sender,char *recipient,
 			    int timeout_ms,int meshmsP)
@@ -46,6 +46,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include "sync.h"
 #include "lbard.h"
+#include "metrics.h"
 
 char *inreach_gateway_ip=NULL;
 time_t inreach_gateway_time=0;
@@ -235,6 +236,21 @@ int http_process(struct sockaddr *cliaddr,
 	write_all(socket,m,strlen(m));
 	close(socket);
 	return 0;	
+      } else if (!strcasecmp(uri,"/metrics")) {
+	// Counters, gauges and histograms for fleet monitoring
+	http_report_metrics(socket);
+	close(socket);
+	return 0;
+      } else if (!strcasecmp(uri,"/timeaccount.json")) {
+	// Per-section main loop latency histograms
+	http_report_time_accounting(socket,1);
+	close(socket);
+	return 0;
+      } else if (!strcasecmp(uri,"/timeaccount.txt")) {
+	// Same, in plain-text exposition format for scraping
+	http_report_time_accounting(socket,0);
+	close(socket);
+	return 0;
       } else if (!strcasecmp(uri,"/status.json")) {
 	// Report on current peer status
 	http_report_network_status_json(socket);
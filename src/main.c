@@ -49,6 +49,10 @@
 #include "radios.h"
 #include "hf.h"
 #include "code_instrumentation.h"
+#include "virtualtime.h"
+#include "interface.h"
+#include "capture.h"
+#include "rs_erasure.h"
 
 extern int serial_errors;
 
@@ -70,6 +74,7 @@ int debug_sync_keys = 0;
 int debug_noprioritisation = 0;
 int debug_bundlelog = 0;
 char *bundlelog_filename = NULL;
+FILE *capture_file = NULL;
 
 int serialfd = -1;
 
@@ -280,7 +285,7 @@ int main(int argc, char **argv)
     {
       urandombytes((unsigned char *) &my_instance_id, sizeof(unsigned int));
     }
-    last_instance_time = time(0);
+    last_instance_time = gettime_s();
 
     // MeshMS operations via HTTP, so that we can avoid direct database modification
     // by scripts on the mesh extender devices, and thus avoid database lock problems.
@@ -326,6 +331,113 @@ int main(int argc, char **argv)
       break;
     }
 
+    if ((argc >= 3) && (argc <= 5) && (! strcasecmp(argv[1], "replay"))) 
+    {
+      LOG_NOTE("found replay param");
+
+      // Frames from this SID are treated as our own, so default to one
+      // that nobody has.
+      my_sid_hex = "0000000000000000000000000000000000000000000000000000000000000000";
+      prefix = "000000";
+      if (argc > 4)
+      {
+        my_sid_hex = argv[4];
+        for (int i = 0; i < 32; i++)
+        {
+          char hex[3] = { my_sid_hex[i*2], my_sid_hex[i*2+1], 0 };
+          my_sid[i] = strtoll(hex, NULL, 16);
+        }
+      }
+      servald_server = "127.0.0.1:1";
+      http_server = 0;
+
+      exitVal = replay_capture(argv[2], argc > 3 ? atoi(argv[3]) : 1);
+      break;
+    }
+
+    if ((argc >= 2) && (argc <= 3) && (! strcasecmp(argv[1], "rxbench"))) 
+    {
+      LOG_NOTE("found rxbench param");
+
+      my_sid_hex = "5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a";
+      prefix = "5a5a5a";
+      memset(my_sid, 0x5a, sizeof(my_sid));
+      servald_server = "127.0.0.1:1";
+      credential = "lbard:rxbench";
+      http_server = 0;
+
+      exitVal = rx_benchmark(argc > 2 ? atoi(argv[2]) : 20000);
+      break;
+    }
+
+    if ((argc >= 2) && (argc <= 6) && (! strcasecmp(argv[1], "xferbench"))) 
+    {
+      LOG_NOTE("found xferbench param");
+
+      servald_server = "127.0.0.1:1";
+      credential = "lbard:xferbench";
+      http_server = 0;
+
+      exitVal = xfer_benchmark(argc > 2 ? atoi(argv[2]) : 1024*1024,
+                               argc > 3 ? atoi(argv[3]) : 25,
+                               argc > 4 ? atoi(argv[4]) : 5,
+                               argc > 5 ? atoi(argv[5]) : 0);
+      break;
+    }
+
+    if ((argc >= 2) && (argc <= 5) && (! strcasecmp(argv[1], "fecbench"))) 
+    {
+      LOG_NOTE("found fecbench param");
+
+      exitVal = fec_benchmark(argc > 2 ? atoi(argv[2]) : OUTERNET_DEFAULT_FEC_K,
+                              argc > 3 ? atoi(argv[3]) : OUTERNET_DEFAULT_FEC_M,
+                              argc > 4 ? atoi(argv[4]) : 234);
+      break;
+    }
+
+    if ((argc >= 2) && (argc <= 4) && (! strcasecmp(argv[1], "rfd900bench"))) 
+    {
+      LOG_NOTE("found rfd900bench param");
+
+      exitVal = rfd900_benchmark((argc > 2 && strcmp(argv[2], "-")) ? argv[2] : NULL,
+                                 argc > 3 ? atoi(argv[3]) : 256);
+      break;
+    }
+
+    if ((argc >= 2) && (argc <= 6) && (! strcasecmp(argv[1], "syncbench"))) 
+    {
+      LOG_NOTE("found syncbench param");
+      exitVal = sync_memory_benchmark(argc > 2 ? atoi(argv[2]) : 200,
+                                      argc > 3 ? atoi(argv[3]) : 20000,
+                                      argc > 4 ? atoi(argv[4]) : 10,
+                                      argc > 5 ? atoi(argv[5]) : SYNC_DEFAULT_PEER_BUDGET_KB);
+      break;
+    }
+
+    if ((argc >= 2) && (argc <= 5) && (! strcasecmp(argv[1], "threadbench"))) 
+    {
+      LOG_NOTE("found threadbench param");
+
+      my_sid_hex = "5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a5a";
+      prefix = "5a5a5a";
+      memset(my_sid, 0x5a, sizeof(my_sid));
+      credential = "lbard:threadbench";
+      http_server = 0;
+
+      exitVal = thread_benchmark(argc > 2 ? atoi(argv[2]) : 200,
+                                 argc > 3 ? atoi(argv[3]) : 250,
+                                 argc > 4 ? atoi(argv[4]) : THREADS_DEFAULT_SERVALD_WORKERS);
+      break;
+    }
+
+    if ((argc >= 2) && (argc <= 3) && (! strcasecmp(argv[1], "codecbench"))) 
+    {
+      LOG_NOTE("found codecbench param");
+
+      exitVal = codec_benchmark(argc > 2 ? atoi(argv[2]) : 232);
+      break;
+    }
+
     if ((argc == 5) && (! strcasecmp(argv[1], "energysamplecalibrate"))) 
     {
       LOG_NOTE("found energysamplecalibrate param");
@@ -372,7 +484,10 @@ int main(int argc, char **argv)
 	break;
       }
       
-      serial_port = argv[2];
+      if (radio_interface_add_ports(argv[2])) {
+	exitVal=-1;
+	break;
+      }
       LOG_NOTE("serial_port = %s", serial_port);
     } 
     else 
@@ -381,10 +496,18 @@ int main(int argc, char **argv)
       {
         LOG_NOTE("less than 5 arguments");
 
-        fprintf(stderr,"usage: lbard <servald hostname:port> <servald credential> <my sid> <my signing id> <serial port> [options ...]\n");
+        fprintf(stderr,"usage: lbard <servald hostname:port> <servald credential> <my sid> <my signing id> <serial port[,serial port ...]> [options ...]\n");
         fprintf(stderr,"usage: lbard monitor <serial port>\n");
         fprintf(stderr,"usage: lbard meshms <meshms command>\n");
         fprintf(stderr,"usage: lbard meshmb <meshmb command>\n");
+        fprintf(stderr,"usage: lbard replay <capture file> [passes] [my sid]\n");
+        fprintf(stderr,"usage: lbard rxbench [messages per type]\n");
+        fprintf(stderr,"usage: lbard xferbench [bundle bytes] [loss percent] [runs] [journal bytes held]\n");
+        fprintf(stderr,"usage: lbard fecbench [data shards] [parity shards] [shard bytes]\n");
+        fprintf(stderr,"usage: lbard codecbench [frame bytes]\n");
+        fprintf(stderr,"usage: lbard rfd900bench [capture file|-] [bytes per read]\n");
+        fprintf(stderr,"usage: lbard threadbench [frames] [servald delay ms] [servald workers]\n");
+        fprintf(stderr,"usage: lbard syncbench [peers] [keys] [percent of keys peers lack] [budget KB]\n");
         fprintf(stderr,"usage: energysamplecalibrate <args>\n");
         fprintf(stderr,"usage: energysamplemaster <broadcast addr> <backchannel addr> <gapusec=n,holdusec=n,packetbytes=n>\n");
         fprintf(stderr,"usage: energysample <port> <interface> <broadcast address>\n");
@@ -392,7 +515,10 @@ int main(int argc, char **argv)
         break;
       }
 
-      serial_port = argv[5];
+      if (radio_interface_add_ports(argv[5])) {
+	exitVal=-1;
+	break;
+      }
       LOG_NOTE("serial_port = %s", serial_port);
     }
 
@@ -484,6 +610,19 @@ int main(int argc, char **argv)
       LOG_NOTE("servald_server = %s", servald_server);
     }
 
+    // In simulations, fakecsmaradio may own a virtual clock that we must run on
+    if ((! monitor_mode) && getenv("LBARD_VIRTUAL_CLOCK") && getenv("LBARD_VIRTUAL_CLOCK")[0])
+    {
+      if (virtual_clock_attach(getenv("LBARD_VIRTUAL_CLOCK"), my_sid_hex))
+      {
+        LOG_ERROR("cannot attach to virtual clock");
+        exitVal = -1;
+        break;
+      }
+      atexit(virtual_clock_detach);
+      last_instance_time = gettime_s();
+    }
+
     /*
       The serial port is normally exactly that. However,
       for internet-mediated transports, the serial port is
@@ -491,37 +630,49 @@ int main(int argc, char **argv)
       the serial port name contains a :, i.e., looks like a
       URI, then we don't try to open the port.
     */
-    if (strstr(serial_port,":")) {
-      // Has a :, so assume it is a URI kind of thing
-      fprintf(stderr,"Serial port looks like a URI, not (yet) opening/connecting\n");
-      LOG_NOTE("Serial port looks like a URI, not (yet) opening/connecting\n");
+    // Each radio in turn (see src/xfer/interface.c)
+    for (int ri = 0; (ri < radio_interface_count) && (exitVal == 0); ri++)
+    {
+      radio_interface_select(ri);
+      if (strstr(serial_port,":")) {
+	// Has a :, so assume it is a URI kind of thing
+	fprintf(stderr,"Serial port looks like a URI, not (yet) opening/connecting\n");
+	LOG_NOTE("Serial port looks like a URI, not (yet) opening/connecting\n");
       
-      // So skip serial port fiddling, and go direct to auto detection routines
-      autodetect_radio_type(serialfd);
-    } else if (!strcmp("noradio",serial_port)) {
-      // Force detection as no radio
-      serialfd=-1;
-      null_radio_detect(serialfd);
-    } else {
-      serialfd = open(serial_port,O_RDWR);
-      if (serialfd < 0) {
-	LOG_ERROR("cannot open serial port: %d ('%s')", serialfd,serial_port);
-	perror("Opening serial port in main");
-	exitVal = -1;
-	break;
-      }
-
-      if (serial_setup_port(serialfd))
-	{
-	  LOG_ERROR("cannot set up serial port");
-	  fprintf(stderr,"Failed to setup serial port. Exiting.\n");
+	// So skip serial port fiddling, and go direct to auto detection routines
+	autodetect_radio_type(serialfd);
+      } else if (!strcmp("noradio",serial_port)) {
+	// Force detection as no radio
+	serialfd=-1;
+	null_radio_detect(serialfd);
+      } else {
+	serialfd = open(serial_port,O_RDWR);
+	if (serialfd < 0) {
+	  LOG_ERROR("cannot open serial port: %d ('%s')", serialfd,serial_port);
+	  perror("Opening serial port in main");
 	  exitVal = -1;
-	  break;
+	  continue;
 	}
+
+	if (serial_setup_port(serialfd))
+	  {
+	    LOG_ERROR("cannot set up serial port");
+	    fprintf(stderr,"Failed to setup serial port. Exiting.\n");
+	    exitVal = -1;
+	    continue;
+	  }
       
-      fprintf(stderr,"Serial port open as fd %d\n",serialfd);
-      LOG_NOTE("Serial port open as fd %d",serialfd);
+	fprintf(stderr,"Serial port open as fd %d\n",serialfd);
+	LOG_NOTE("Serial port open as fd %d",serialfd);
+      }
+      
+      if (radio_interface_detected())
+      {
+        exitVal = -1;
+      }
     }
+    if (exitVal) break;
+    radio_interface_select(0);
       
     int n = 6;
     while (n < argc) 
@@ -701,6 +852,37 @@ int main(int argc, char **argv)
 	  }
 	  LOG_NOTE("Outernet socket name is '%s'",outernet_socketname);
 	}
+        else if (! strncasecmp("outernetspill=", argv[n], 14)) 
+        {
+          outernet_rx_spill_bytes = atoi(&argv[n][14]);
+          LOG_NOTE("Outernet bundles over %u bytes will be reassembled on disk",outernet_rx_spill_bytes);
+        }
+        else if (! strncasecmp("outernetspilldir=", argv[n], 17)) 
+        {
+          outernet_rx_spill_dir = strdup(&argv[n][17]);
+        }
+        else if (! strncasecmp("outernetfec=", argv[n], 12)) 
+        {
+          if (outernet_set_fec(&argv[n][12]))
+          {
+            LOG_ERROR("invalid outernetfec option");
+            fprintf(stderr,"outernetfec must be <data shards>:<parity shards>, or <lane>:<data shards>:<parity shards>\n");
+            exitVal = -1;
+            break;
+          }
+        }
+        else if (! strncasecmp("capture=", argv[n], 8)) 
+        {
+          capture_file = capture_open_write(&argv[n][8]);
+          if (! capture_file)
+          {
+            LOG_ERROR("cannot create capture file");
+            exitVal = -1;
+            break;
+          }
+          LOG_NOTE("capturing received frames to %s", &argv[n][8]);
+          fprintf(stderr,"Capturing received frames to '%s'\n", &argv[n][8]);
+        }
 	else if (! strncasecmp("bundlelog=", argv[n], 10)) 
         {
           bundlelog_filename = strdup(&argv[n][10]);
@@ -761,6 +943,28 @@ int main(int argc, char **argv)
           target_transmissions_per_4seconds = atoi(&argv[n][11]);
           LOG_NOTE("target_transmissions_per_4seconds set to %d", target_transmissions_per_4seconds);
         }
+        else if (! strcasecmp("threads", argv[n]))
+        {
+          lbard_threads = THREADS_DEFAULT_SERVALD_WORKERS;
+          LOG_NOTE("threaded mode, %d servald workers", lbard_threads);
+        }
+        else if (! strncasecmp("threads=", argv[n], 8))
+        {
+          lbard_threads = atoi(&argv[n][8]);
+          if (lbard_threads < 1) lbard_threads = 1;
+          LOG_NOTE("threaded mode, %d servald workers", lbard_threads);
+        }
+        else if (! strncasecmp("syncbudget=", argv[n], 11))
+        {
+          int budget_kb = atoi(&argv[n][11]);
+          sync_set_peer_budget(sync_state, (size_t)budget_kb * 1024);
+          LOG_NOTE("sync tree budget set to %dKB", budget_kb);
+        }
+        else if (! strncasecmp("channeltarget=", argv[n], 14))
+        {
+          target_channel_occupancy = atoi(&argv[n][14]);
+          LOG_NOTE("target_channel_occupancy set to %d%%", target_channel_occupancy);
+        }
         else if (! strncasecmp("otabid=", argv[n], 7)) 
         {
           // BID of Over The Air Update Rhizome bundle
@@ -810,6 +1014,18 @@ int main(int argc, char **argv)
       break;
     }
 
+    // Radio I/O and servald requests on threads of their own (see src/xfer/threads.c)
+    if (lbard_threads)
+    {
+      if (monitor_mode || threads_start(lbard_threads))
+      {
+        LOG_ERROR("cannot start threaded mode");
+        fprintf(stderr,"Could not start threaded mode (it is not available in monitor mode).\n");
+        exitVal = -1;
+        break;
+      }
+    }
+
     // Open UDP socket to listen for time updates from other LBARD instances
     // (poor man's NTP for LBARD nodes that lack internal clocks)
     int timesocket = -1;
@@ -879,7 +1095,7 @@ int main(int argc, char **argv)
 
       // Refresh our instance ID every four minutes, so that any bundle list sync bugs
       // can only block transmission for a few minutes.
-      if ((time(0) - last_instance_time) > 240) 
+      if ((gettime_s() - last_instance_time) > 240) 
       {
         my_instance_id = 0;
         while(my_instance_id == 0)
@@ -887,12 +1103,21 @@ int main(int argc, char **argv)
           urandombytes((unsigned char *) &my_instance_id, sizeof(unsigned int));
         }
 
-        last_instance_time = time(0);
+        last_instance_time = gettime_s();
       }
       
       account_time("radio_read_bytes()");
       
-      radio_read_bytes(serialfd, monitor_mode);
+      if (lbard_threads)
+      {
+        // The radio thread, if there is one, has done the reading
+        threads_poll();
+      }
+      if (! threads_reading_radio()) for (int ri = 0; ri < radio_interface_count; ri++)
+      {
+        radio_interface_select(ri);
+        radio_read_bytes(serialfd, monitor_mode);
+      }
 
       account_time("outernet_rx_serviceloop()");
       
@@ -908,28 +1133,36 @@ int main(int argc, char **argv)
 
       account_time("radio.serviceloop()");
 
-      if (radio_get_type() >= 0) 
+      for (int ri = 0; ri < radio_interface_count; ri++)
       {
-        if (! radio_types[radio_get_type()].serviceloop) 
+        radio_interface_select(ri);
+        if (radio_get_type() >= 0) 
         {
-          LOG_ERROR("Illegal radio type");
-          fprintf(
-            stderr,
-            "Radio type set to illegal value %d\n",
-            radio_get_type());
+          if (! radio_types[radio_get_type()].serviceloop) 
+          {
+            LOG_ERROR("Illegal radio type");
+            fprintf(
+              stderr,
+              "Radio type set to illegal value %d\n",
+              radio_get_type());
+            exitVal = -1;
+            break;
+          }
+
+          radio_lock();
+          radio_types[radio_get_type()].serviceloop(serialfd);
+          radio_unlock();
+        }
+        else 
+        {
+          LOG_ERROR("Unknown radio type");
+          fprintf(stderr,"ERROR: Connected to unknown radio type.\n");
           exitVal = -1;
           break;
         }
-
-        radio_types[radio_get_type()].serviceloop(serialfd);
-      }
-      else 
-      {
-        LOG_ERROR("Unknown radio type");
-        fprintf(stderr,"ERROR: Connected to unknown radio type.\n");
-        exitVal = -1;
-        break;
       }
+      if (exitVal) break;
+      radio_interface_select(0);
 
       account_time("time server: reverse timeflow check");
 
@@ -1056,24 +1289,7 @@ int main(int argc, char **argv)
         
         if ((! monitor_mode) && radio_ready()) 
         {
-          update_my_message(
-            serialfd,
-            my_sid,
-            my_sid_hex,
-            LINK_MTU,
-            msg_out,
-            servald_server,
-            credential);
-    
-          // Vary next update time by upto 250ms, to prevent radios getting lock-stepped.
-          if (message_update_interval_randomness)
-          {
-            next_message_update_time = gettime_ms() + (random()%message_update_interval_randomness) + message_update_interval;
-          }
-          else
-          {
-            next_message_update_time = gettime_ms() + message_update_interval;
-          }
+          radio_interface_send_frame(msg_out);
         }
     
        	account_time("status_dump()");
@@ -1081,13 +1297,13 @@ int main(int argc, char **argv)
         // Update the state file to help debug things
         // (but not too often, since it is SLOW on the MR3020s
         //  XXX fix all those linear searches, and it will be fine!)
-      	if (last_status_time>time(0)) 
+      	if (last_status_time>gettime_s()) 
       	{
-        	last_status_time=time(0);
+        	last_status_time=gettime_s();
         }
 
-        if (time(0) > last_status_time) {
-          last_status_time = time(0) + 2;
+        if (gettime_s() > last_status_time) {
+          last_status_time = gettime_s() + 2;
           status_dump();
         }
         
@@ -1095,6 +1311,18 @@ int main(int argc, char **argv)
       	
       }
 
+      // The other radios send when they are ready, but leave the rest of the
+      // above to the first.
+      for (int ri = 1; ri < radio_interface_count; ri++)
+      {
+        radio_interface_select(ri);
+        if ((gettime_ms() >= next_message_update_time) && (! monitor_mode) && radio_ready())
+        {
+          radio_interface_send_frame(msg_out);
+        }
+      }
+      radio_interface_select(0);
+
       account_time("stuck serial reboot check");
 
       if ((serial_errors>20) && reboot_when_stuck) 
@@ -1112,13 +1340,33 @@ int main(int argc, char **argv)
 
       account_time("usleep()");
       
-      usleep(10000);
+      if (lbard_threads)
+      {
+        // Until the radio thread or a servald worker has something for us
+        threads_wait_us(10000);
+      }
+      else if (virtual_clock)
+      {
+        // Let virtual time move on, unless a radio has something for us
+        int radio_fds[MAX_RADIO_INTERFACES];
+        for (int ri = 0; ri < radio_interface_count; ri++)
+          radio_fds[ri] = (&radio_interfaces[ri] == radio_interface)
+            ? serialfd : radio_interfaces[ri].fd;
+        virtual_clock_sleep_us(10000, radio_fds, radio_interface_count);
+      }
+      else
+      {
+        usleep(10000);
+      }
+
+      account_time("sync_evict_idle_peers()");
+      sync_evict_idle_peers();
 
       account_time("show_progress()");
 
-      if (time(0) > last_summary_time) 
+      if (gettime_s() > last_summary_time) 
       {
-        last_summary_time = time(0);
+        last_summary_time = gettime_s();
         show_progress(stderr, 0);
       }
       
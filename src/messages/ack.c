@@ -58,6 +58,11 @@ int sync_schedule_progress_report(int peer, int partial, int randomJump)
   int isReallyFirstByte=0;
   int first_required_body_offset
     =partial_find_missing_byte(partials[partial].body_segments,&isReallyFirstByte);
+  // We already have the start of a journal from its old version
+  if (first_required_body_offset<partials[partial].journal_base) {
+    first_required_body_offset=partials[partial].journal_base;
+    isReallyFirstByte=1;
+  }
   
   if (slot>=REPORT_QUEUE_LEN) slot=random()%REPORT_QUEUE_LEN;
 
@@ -95,14 +100,8 @@ int sync_schedule_progress_report(int peer, int partial, int randomJump)
   report_queue_message[slot]=strdup("progress report");
 
   // BID prefix
-  for(int i=0;i<8;i++) {
-    int hex_value=0;
-    char hex_string[3]={partials[partial].bid_prefix[i*2+0],
-			partials[partial].bid_prefix[i*2+1],
-			0};
-    hex_value=strtoll(hex_string,NULL,16);
-    report_queue[slot][ofs++]=hex_value;
-  }
+  bcopy(id_bin(partials[partial].bid_id),&report_queue[slot][ofs],8);
+  ofs+=8;
   
   // manifest and body offset
   // (for manifest, it can only consist of 16 x 64 byte pieces, so instead
@@ -195,31 +194,21 @@ int sync_parse_ack(struct peer_state *p,unsigned char *msg,
 
   if (bundle<0) return -1;
 
-  if (bundle==p->request_bitmap_bundle) {
+  if (peer_request_progress_is_current(p,bundle)) {
 
     // For manifest progress, simply copy in the manifest progress bitmap
     p->request_manifest_bitmap[0]=msg[9];
-    p->request_manifest_bitmap[0]=msg[10];
-
-    // Reset (or translate) TX bitmap, since we are being asked to send from here.
-    if (msg[0]=='F'&&msg[0]=='f') {
-      // Message types  F and f indicate that this really is the first byte we
-      // could ever need, so translate the progress bitmap to the new offset
-      progress_bitmap_translate(p,body_offset);
-    } else {
-      // Message types A and a indicate that there are lowered number byte(s) we
-      // still need, so we should only conservatively advance the bitmap, so as
-      // to keep as much of the state that we have that might tell us which those
-      // missing bytes might be.
-      int body_offset_conservative=p->request_bitmap_offset;
-      // First, always go backwards if we need to
-      if (body_offset<body_offset_conservative) body_offset_conservative=body_offset;
-      // And advance only if the new offset would be <4KB from the end of the window
-      // (and only then if we aren't sure that the bundle is <= 16KB)
-      if (bundles[bundle].length>(16*1024)) {
-	if (body_offset>(body_offset_conservative+(12*1024)))
-	  body_offset_conservative=body_offset;	    
-      }
+    p->request_manifest_bitmap[1]=msg[10];
+
+    if (msg[0]=='F'||msg[0]=='f') {
+      // Message types F and f indicate that this really is the first byte we
+      // could ever need, so everything before it is held.
+      // Message types A and a indicate that there are lower numbered byte(s) we
+      // still need, so they tell us nothing new about the progress bitmap.
+      int first_missing_block=body_offset/PROGRESS_BLOCK_SIZE;
+      progress_bitmap_set_range(&p->request_progress,0,first_missing_block);
+      if (first_missing_block>p->request_progress_acked)
+	p->request_progress_acked=first_missing_block;
     }
   }
   
@@ -244,10 +233,10 @@ int sync_parse_ack(struct peer_state *p,unsigned char *msg,
 	      manifest_offset&=0xffffff00;
 	    }
 	  }
-	  if (body_offset<cached_body_len) {
+	  if (body_offset<cached_body_wire_len) {
 	    if (!(option_flags&FLAG_NO_RANDOMIZE_REDIRECT_OFFSET)) {
-	      if (cached_body_len-body_offset)
-		body_offset+=random()%(cached_body_len-body_offset);
+	      if (cached_body_wire_len-body_offset)
+		body_offset+=random()%(cached_body_wire_len-body_offset);
 	      body_offset&=0xffffff00;
 	    }
 	  }
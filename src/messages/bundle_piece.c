@@ -41,13 +41,27 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include "sync.h"
 #include "lbard.h"
+#include "metrics.h"
 
 int sync_append_some_bundle_bytes(int bundle_number,int start_offset,int len,
 				  unsigned char *p, int is_manifest,
 				  int *offset,int mtu,unsigned char *msg,
 				  int target_peer)
 {
-  int max_bytes=mtu-(*offset)-21;
+  // Bundle version (8 bytes), with how the body is encoded in the top byte.
+  // A piece slot binding covers both the manifest and the body, so it always
+  // carries the body codec.
+  long long version=cached_version;
+  long long slot_version=cached_version|(((long long)cached_body_codec)<<BODY_CODEC_SHIFT);
+  if (!is_manifest) version=slot_version;
+
+  // Use a compact header if this transfer has a piece slot
+  int bind_slot=0;
+  int slot=piece_slot_choose(target_peer,bundles[bundle_number].bid_bin,slot_version,&bind_slot);
+  int header_len=PIECE_HEADER_LEN;
+  if (slot) header_len=COMPACT_PIECE_HEADER_LEN+(bind_slot?PIECE_SLOT_BINDING_LEN:0);
+  
+  int max_bytes=mtu-(*offset)-header_len;
   int bytes_available=len-start_offset;
   int actual_bytes=0;
   int not_end_of_item=0;
@@ -98,21 +112,30 @@ int sync_append_some_bundle_bytes(int bundle_number,int start_offset,int len,
   if (is_manifest) offset_compound|=0x80000000;
   offset_compound|=((start_offset>>20LL)&0xffffLL)<<32LL;
 
-  // Now write the 23/25 byte header and actual bytes into output message
-  // BID prefix (8 bytes)
-  if (start_offset>0xfffff)
-    msg[(*offset)++]='P'+not_end_of_item;
-  else 
-    msg[(*offset)++]='p'+not_end_of_item;
-
-  // Intended recipient
-  msg[(*offset)++]=peer_records[target_peer]->sid_prefix_bin[0];
-  msg[(*offset)++]=peer_records[target_peer]->sid_prefix_bin[1];
-  
-  for(int i=0;i<8;i++) msg[(*offset)++]=bundles[bundle_number].bid_bin[i];
-  // Bundle version (8 bytes)
-  for(int i=0;i<8;i++)
-    msg[(*offset)++]=(cached_version>>(i*8))&0xff;
+  if (slot) {
+    // Compact piece: the slot ID stands in for recipient, BID and version
+    if (bind_slot) append_piece_slot_binding(target_peer,msg,offset);
+    if (start_offset>0xfffff)
+      msg[(*offset)++]='H'+not_end_of_item;
+    else
+      msg[(*offset)++]='h'+not_end_of_item;
+    msg[(*offset)++]=slot;
+  } else {
+    // Now write the 23/25 byte header and actual bytes into output message
+    if (start_offset>0xfffff)
+      msg[(*offset)++]='P'+not_end_of_item;
+    else 
+      msg[(*offset)++]='p'+not_end_of_item;
+
+    // Intended recipient
+    msg[(*offset)++]=peer_records[target_peer]->sid_prefix_bin[0];
+    msg[(*offset)++]=peer_records[target_peer]->sid_prefix_bin[1];
+
+    // BID prefix (8 bytes)
+    for(int i=0;i<8;i++) msg[(*offset)++]=bundles[bundle_number].bid_bin[i];
+    for(int i=0;i<8;i++)
+      msg[(*offset)++]=(version>>(i*8))&0xff;
+  }
   // offset_compound (4 bytes)
   for(int i=0;i<4;i++)
     msg[(*offset)++]=(offset_compound>>(i*8))&0xff;
@@ -123,6 +146,8 @@ int sync_append_some_bundle_bytes(int bundle_number,int start_offset,int len,
 
   bcopy(p,&msg[(*offset)],actual_bytes);
   (*offset)+=actual_bytes;
+  metric_counter_add("lbard_bundle_bytes_sent_total",
+		     is_manifest?"part=\"manifest\"":"part=\"body\"",actual_bytes);
 
   /* Advance the cursor for sending this bundle to all other peers if their cursor
      sits within the window we have just sent. */
@@ -176,7 +201,7 @@ int sync_append_some_bundle_bytes(int bundle_number,int start_offset,int len,
 
 int saw_piece(char *peer_prefix,int for_me,
 	      char *bid_prefix, unsigned char *bid_prefix_bin,
-	      long long version,
+	      long long version,int body_codec,
 	      long long piece_offset,int piece_bytes,int is_end_piece,
 	      int is_manifest_piece,unsigned char *piece,
 
@@ -209,7 +234,8 @@ int saw_piece(char *peer_prefix,int for_me,
   // introduced for this special purpose) addressed to itself, so that the priority
   // scheme gets stuck trying to send these bundles to them forever.
   if (for_me) {
-    if (sync_is_bundle_recently_received(bid_prefix,version)) {
+    if (sync_is_bundle_recently_received(id_find(bid_prefix_bin,ID_BID_PREFIX_BYTES),
+					 version)) {
       // We have this version already: mark it for announcement to sender,
       // and then return immediately.
       fprintf(stderr,
@@ -219,62 +245,66 @@ int saw_piece(char *peer_prefix,int for_me,
       return 0;      
     }
   }
-  for(int i=0;i<bundle_count;i++) {
-    if (!strncasecmp(bid_prefix,bundles[i].bid_hex,strlen(bid_prefix))) {
-      if (debug_pieces) printf("We have version %lld of BID=%s*.  %s is offering %s version %lld\n",
-			       bundles[i].version,bid_prefix,peer_prefix,for_me?"us":"someone else",version);
-      if (version<=bundles[i].version) {
-	// We have this version already: mark it for announcement to sender,
-	// and then return immediately.
+  int held=lookup_bundle_by_prefix(bid_prefix_bin,ID_BID_PREFIX_BYTES);
+  if (held>=0) {
+    if (debug_pieces) printf("We have version %lld of BID=%s*.  %s is offering %s version %lld\n",
+			     bundles[held].version,bid_prefix,peer_prefix,for_me?"us":"someone else",version);
+    if (version<=bundles[held].version) {
+      // We have this version already: mark it for announcement to sender,
+      // and then return immediately.
 #ifdef SYNC_BY_BAR
-	bundles[i].announce_bar_now=1;
+      bundles[held].announce_bar_now=1;
 #endif
-	if (for_me) {
-	  fprintf(stderr,"We already have %s* version %lld - ignoring piece.\n",
-		  bid_prefix,version);
-	  sync_tell_peer_we_have_this_bundle(peer,i);
-	}
+      if (for_me) {
+	fprintf(stderr,"We already have %s* version %lld - ignoring piece.\n",
+		bid_prefix,version);
+	sync_tell_peer_we_have_this_bundle(peer,held);
+      }
 
-	// Even if it wasn't addressed to us, we now know that this peer doesn't have the bundle.
-	sync_queue_bundle(peer_records[peer],i);
+      // Even if it wasn't addressed to us, we now know that this peer doesn't have the bundle.
+      sync_queue_bundle(peer_records[peer],held);
 	
-	// Update progress bitmaps for all peers whenver we see a piece received that we
-	// think that they might want.  This stops us from resending the same piece later.
-	if (bundle_number>=0) {
-	  printf(">>> %s Examining transmitted piece for bitmap updates.\n",
-		 timestamp_str());
-	  peer_update_request_bitmaps_due_to_transmitted_piece(bundle_number,is_manifest_piece,
-							       piece_offset,piece_bytes);
-	}
-	
-	return 0;
-      } else {
-	// We have an older version.
-	// Remember the bundle number so that we can pre-fetch the body we have
-	// for incremental journal transfers
-	if (version<0x100000000LL) {
-	  bundle_number=i;
-	}	
+      // Update progress bitmaps for all peers whenver we see a piece received that we
+      // think that they might want.  This stops us from resending the same piece later.
+      if (bundle_number>=0) {
+	printf(">>> %s Examining transmitted piece for bitmap updates.\n",
+	       timestamp_str());
+	peer_update_request_bitmaps_due_to_transmitted_piece(bundle_number,is_manifest_piece,
+							     piece_offset,piece_bytes);
       }
+	
+      return 0;
+    } else {
+      // We have an older version.
+      // Remember the bundle number so that we can pre-fetch the body we have
+      // for incremental journal transfers
+      if (version<0x100000000LL) {
+	bundle_number=held;
+      }       
     }
   }
 
   // Update progress bitmaps for all peers whenver we see a piece received that we
   // think that they might want.  This stops us from resending the same piece later.
-  if (bundle_number>=0) {
+  // (Body offsets are only comparable if the body is being sent the way we send it.)
+  if ((bundle_number>=0)
+      &&(is_manifest_piece||(body_codec==bundle_body_codec(bundle_number)))) {
     printf(">>> %s Examining transmitted piece for bitmap updates.\n",
 	   timestamp_str());
     peer_update_request_bitmaps_due_to_transmitted_piece(bundle_number,is_manifest_piece,
 							 piece_offset,piece_bytes);
   }
   
+  // (only interned below, if we start a partial for it)
+  int bid_id=id_find(bid_prefix_bin,ID_BID_PREFIX_BYTES);
+
   int i;
   int spare_record=random()%MAX_BUNDLES_IN_FLIGHT;
   for(i=0;i<MAX_BUNDLES_IN_FLIGHT;i++) {
-    if (!partials[i].bid_prefix) {
+    if (!partials[i].bid_id) {
       if (spare_record==-1) spare_record=i;
     } else {
-      if (!strcasecmp(partials[i].bid_prefix,bid_prefix))
+      if (partials[i].bid_id==bid_id)
 	{
 	  if (debug_pieces) printf("Saw another piece for BID=%s* from SID=%s: ",
 			 bid_prefix,peer_prefix);
@@ -316,14 +346,25 @@ int saw_piece(char *peer_prefix,int for_me,
     if (debug_pieces)
       printf("@@@   Using slot %d\n",i);
 
-    // Now prepare the partial record
-    partials[i].bid_prefix=strdup(bid_prefix);
+    // Now prepare the partial record, which holds the BID prefix until
+    // clear_partial()
+    bid_id=id_intern(bid_prefix_bin,ID_BID_PREFIX_BYTES);
+    if (!bid_id) return -1;
+    partials[i].bid_id=bid_id;
+    partials[i].bid_prefix=id_hex(bid_id);
     partials[i].bundle_version=version;
     partials[i].manifest_length=-1;
     partials[i].body_length=-1;
   }
 
   partial_update_recent_senders(&partials[i],peer_prefix);
+
+  if ((!is_manifest_piece)&&partial_accept_body_codec(&partials[i],body_codec)) {
+    if (debug_pieces)
+      printf("Ignoring body piece sent with codec %d, as we are collecting codec %d.\n",
+	     body_codec,partials[i].body_codec);
+    return 0;
+  }
   
   int piece_end=piece_offset+piece_bytes;
 
@@ -340,28 +381,39 @@ int saw_piece(char *peer_prefix,int for_me,
   }
 
   if ((bundle_number>-1)
+      &&(!partials[i].journal_base)
       &&(!partials[i].body_segments)) {
-    // This is a bundle that for which we already have a previous version, and
-    // for which we as yet have no body segments.  So fetch from Rhizome the content
-    // that we do have, and prepopulate the body segment.
-    fprintf(stderr,"%s:%d:My SID as hex is %s\n",__FILE__,__LINE__,my_sid_hex);
-    if (!prime_bundle_cache(bundle_number,my_sid_hex,servald_server,credential)) {
-      struct segment_list *s=calloc(1,sizeof(struct segment_list));
-      assert(s);
-      s->data=malloc(cached_body_len);
-      assert(s->data);
-      bcopy(cached_body,s->data,cached_body_len);
-      s->start_offset=0;
-      s->length=cached_body_len;
-      partials[i].body_segments=s;
-      if (debug_pieces)
-	printf("Preloaded %d bytes from old version of journal bundle.\n",
-		cached_body_len);
-    } else {
+    // This is a journal bundle for which we already have a previous version.
+    // Journals only ever grow, so we already have its first bytes.  Rather than
+    // fetching and copying them now, ask the sender to start after them, and
+    // only fetch them from Rhizome when we have the rest.
+    partials[i].journal_base=bundles[bundle_number].length;
+    // Older peers stop reading a packet at a 'J', which they don't know, so
+    // unless the sender and everyone else can take it, the sender learns
+    // where to start from our progress reports, which start from here.
+    if ((partials[i].journal_base>0)
+	&&(peer_records[peer]->capabilities&CAPABILITY_JOURNAL_REPORT)
+	&&active_peers_have_capability(CAPABILITY_JOURNAL_REPORT))
+      sync_schedule_journal_report(peer,i);
+  }
+
+  if ((!is_manifest_piece)&&(piece_offset<partials[i].journal_base)) {
+    if (piece_end<=partials[i].journal_base) {
+      // All old bytes: the sender can't have heard how much we have
       if (debug_pieces)
-	printf("Failed to preload bytes from old version of journal bundle. XFER will likely fail due to far end thinking it can skip the bytes we already have, so ignoring current piece.\n");
-      return -1;
+	printf("Piece [%lld,%d) is within the %d bytes of journal we already have.\n",
+	       piece_offset,piece_end,partials[i].journal_base);
+      metric_counter_add("lbard_bundle_bytes_received_total",
+			 "part=\"body\",new=\"no\"",piece_bytes);
+      // We told them when the transfer began, and our progress reports all
+      // start from the end of the old version, so we don't say it again.
+      return 0;
     }
+    // Keep only the new bytes
+    int old_bytes=partials[i].journal_base-piece_offset;
+    piece+=old_bytes;
+    piece_offset+=old_bytes;
+    piece_bytes-=old_bytes;
   }
 
   // Now we have the right partial, we need to look for the right segment to add this
@@ -490,6 +542,12 @@ int saw_piece(char *peer_prefix,int for_me,
   fprintf(stderr,"(Piece was [%lld,%lld)\n",piece_offset,piece_offset+piece_bytes);
 
   partials[i].recent_bytes += piece_bytes;
+  metric_counter_add("lbard_bundle_bytes_received_total",
+		     is_manifest_piece?"part=\"manifest\",new=\"no\"":"part=\"body\",new=\"no\"",
+		     piece_bytes-new_bytes_in_piece);
+  metric_counter_add("lbard_bundle_bytes_received_total",
+		     is_manifest_piece?"part=\"manifest\",new=\"yes\"":"part=\"body\",new=\"yes\"",
+		     new_bytes_in_piece);
   
   // Check if we have the whole bundle now
   // XXX - this breaks when we have nothing about the bundle, because then we think the length is zero, so we think we have it all, when really we have none.
@@ -498,11 +556,11 @@ int saw_piece(char *peer_prefix,int for_me,
       &&(!partials[i].manifest_segments->next)
       &&(!partials[i].body_segments->next)
       &&(partials[i].manifest_segments->start_offset==0)
-      &&(partials[i].body_segments->start_offset==0)
+      &&(partials[i].body_segments->start_offset==partials[i].journal_base)
       &&(partials[i].manifest_segments->length
 	 ==partials[i].manifest_length)
       &&(partials[i].body_segments->length
-	 ==partials[i].body_length))
+	 ==partials[i].body_length-partials[i].journal_base))
     {
       // We have a single segment for body and manifest that span the complete
       // size.
@@ -523,11 +581,47 @@ int saw_piece(char *peer_prefix,int for_me,
 	// Display decompressed manifest
 	dump_bytes(stdout,"Decompressed Manifest",manifest,manifest_len);
 	
-	insert_result=
-	  rhizome_update_bundle(manifest,manifest_len,
-				partials[i].body_segments->data,
-				partials[i].body_length,
-				servald_server,credential);
+	if (partials[i].body_codec!=BODY_CODEC_NONE) {
+	  // The body was sent compressed.  The manifest says how long it is.
+	  char filesize[1024];
+	  manifest_get_field(manifest,manifest_len,"filesize",filesize);
+	  int body_length=atoi(filesize);
+	  unsigned char *body=NULL;
+	  if ((body_length>0)&&(body_length<=MAX_DECOMPRESSED_BODY_LEN))
+	    body=malloc(body_length);
+	  if (body
+	      &&!body_decompress(partials[i].body_codec,
+				 partials[i].body_segments->data,
+				 partials[i].body_length,
+				 body,body_length))
+	    // (the insert frees the body when it is done with it)
+	    insert_result=
+	      rhizome_update_bundle_given(manifest,manifest_len,
+					  body,body_length,free,body,
+					  servald_server,credential);
+	  else {
+	    printf(">>> %s Could not decompress %d byte body of %s* to %d bytes.  Not inserting\n",
+		   timestamp_str(),partials[i].body_length,bid_prefix,body_length);
+	    free(body);
+	  }
+	} else if (!partials[i].journal_base)
+	  insert_result=
+	    rhizome_update_bundle(manifest,manifest_len,
+				  partials[i].body_segments->data,
+				  partials[i].body_length,
+				  servald_server,credential);
+	else if (bundle_number>-1)
+	  // Insert the old version we hold followed by the new bytes
+	  insert_result=
+	    rhizome_append_journal(manifest,manifest_len,
+				   bundles[bundle_number].bid_hex,
+				   partials[i].journal_base,
+				   partials[i].body_segments->data,
+				   partials[i].body_segments->length,
+				   servald_server,credential);
+	else
+	  printf(">>> %s We no longer have the %d bytes of %s* we already had.  Not inserting\n",
+		 timestamp_str(),partials[i].journal_base,bid_prefix);
 
 	if (debug_bundlelog) {
 	  // Write details of bundle to a log file for monitoring
@@ -545,7 +639,7 @@ int saw_piece(char *peer_prefix,int for_me,
 	    char service[1024];
 	    char sender[1024];
 	    char recipient[1024];
-	    time_t now=time(0);
+	    time_t now=gettime_s();
 	    manifest_get_field(manifest,manifest_len,"name",filename);
 	    manifest_get_field(manifest,manifest_len,"id",bid);
 	    manifest_get_field(manifest,manifest_len,"version",version);
@@ -571,7 +665,7 @@ int saw_piece(char *peer_prefix,int for_me,
 	// process periodically, we will catch any straglers. It still isn't perfect,
 	// but it's a start.
 	sync_remember_recently_received_bundle
-	  (partials[i].bid_prefix,
+	  (partials[i].bid_id,
 	   partials[i].bundle_version);
       } else {
 	printf(">>> %s Could not decompress binary manifest.  Not inserting\n",
@@ -581,6 +675,8 @@ int saw_piece(char *peer_prefix,int for_me,
 	// XXX - Decompress manifest as soon as we have it to catch this problem
 	// earlier. 
       }
+      metric_counter_add("lbard_bundles_received_total",
+			 insert_result?"result=\"failed\"":"result=\"inserted\"",1);
       if (insert_result) {
 	// Failed to insert, so mark this bundle for deprioritisation, so that we
 	// don't just keep asking for it.
@@ -590,7 +686,7 @@ int saw_piece(char *peer_prefix,int for_me,
 	dump_bytes(stdout,"manifest",manifest,manifest_len);
 	dump_bytes(stdout,"payload",
 		   partials[i].body_segments->data,
-		   partials[i].body_length);
+		   partials[i].body_segments->length);
 
 	char bid[32*2+1];
 	if (!manifest_extract_bid(partials[i].manifest_segments->data,
@@ -683,6 +779,8 @@ int message_parser_50(struct peer_state *sender,char *sender_prefix,
   version=0;
   for(int i=0;i<8;i++) version|=((long long)msg[offset+i])<<(i*8LL);
   offset+=8;
+  int body_codec=(version>>BODY_CODEC_SHIFT)&0xff;
+  version&=BUNDLE_VERSION_MASK;
   offset_compound=0;
   for(int i=0;i<6;i++) offset_compound|=((long long)msg[offset+i])<<(i*8LL);
   offset+=4;
@@ -709,7 +807,7 @@ int message_parser_50(struct peer_state *sender,char *sender_prefix,
   
   saw_piece(sender_prefix,for_me,
 	    bid_prefix,bid_prefix_bin,
-	    version,piece_offset,piece_bytes,is_end_piece,
+	    version,body_codec,piece_offset,piece_bytes,is_end_piece,
 	    piece_is_manifest,&msg[offset],
 	    prefix, servald_server,credential);
   
@@ -43,8 +43,12 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "lbard.h"
 
 int announce_bundle_length(int mtu, unsigned char *msg,int *offset,
-			   unsigned char *bid_bin,long long version,unsigned int length)
+			   unsigned char *bid_bin,long long version,int body_codec,
+			   unsigned int length)
 {
+  // The length is of the body as it is sent, and the codec is in the top
+  // byte of the version, as for body pieces.
+  version|=((long long)body_codec)<<BODY_CODEC_SHIFT;
   if ((mtu-*offset)>(1+8+8+4)) {
     // Announce length of bundle
     msg[(*offset)++]='L';
@@ -62,24 +66,22 @@ int announce_bundle_length(int mtu, unsigned char *msg,int *offset,
 }
 
 int saw_length(char *peer_prefix,char *bid_prefix,long long version,
-	       int body_length)
+	       int body_codec,int body_length)
 {
   // Note length of payload for this bundle, if we don't already know it
   int peer=find_peer_by_prefix(peer_prefix);
   if (peer<0) return -1;
 
-  int i;
-  int spare_record=random()%MAX_BUNDLES_IN_FLIGHT;
-  for(i=0;i<MAX_BUNDLES_IN_FLIGHT;i++) {
-    if (!partials[i].bid_prefix) {
-      if (spare_record==-1) spare_record=i;
-    } else {
-      if (!strcasecmp(partials[i].bid_prefix,bid_prefix))
-	if (partials[i].bundle_version==version)
-	  {
-	    partials[i].body_length=body_length;
-	    return 0;
-	  }
+  // (Not a bundle we are receiving if we have never heard of it)
+  int bid_id=id_find_hex(bid_prefix,ID_BID_PREFIX_BYTES);
+  if (!bid_id) return -1;
+
+  for(int i=0;i<MAX_BUNDLES_IN_FLIGHT;i++) {
+    if ((partials[i].bid_id==bid_id)&&(partials[i].bundle_version==version)) {
+      // The length is only of use if it is of the bytes we are collecting
+      if (partial_accept_body_codec(&partials[i],body_codec)) return -1;
+      partials[i].body_length=body_length;
+      return 0;
     }
   }
   return -1;
@@ -110,6 +112,8 @@ int message_parser_4C(struct peer_state *sender,char *sender_prefix,
   long long version=0;
   for(int i=0;i<8;i++) version|=((long long)msg[offset+i])<<(i*8LL);
   offset+=8;
+  int body_codec=(version>>BODY_CODEC_SHIFT)&0xff;
+  version&=BUNDLE_VERSION_MASK;
   long long offset_compound=0;
   for(int i=0;i<4;i++) offset_compound|=((long long)msg[offset+i])<<(i*8LL);
   offset+=4;
@@ -122,13 +126,14 @@ int message_parser_4C(struct peer_state *sender,char *sender_prefix,
       char bid_prefix[128];
       bytes_to_prefix(&msg[bid_prefix_offset],bid_prefix);
       snprintf(monitor_log_buf,sizeof(monitor_log_buf),
-	       "Payload length: BID=%s*, version 0x%010llx, length = %lld bytes",
-	       bid_prefix,version,offset_compound);
+	       "Payload length: BID=%s*, version 0x%010llx, length = %lld bytes%s",
+	       bid_prefix,version,offset_compound,
+	       body_codec?" (compressed)":"");
       
       monitor_log(sender_prefix,NULL,monitor_log_buf);
     }
   
-  saw_length(sender_prefix,bid_prefix,version,offset_compound);
+  saw_length(sender_prefix,bid_prefix,version,body_codec,offset_compound);
   
   return offset;
 }
@@ -0,0 +1,61 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2015-2018 Serval Project Inc., Flinders University.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <assert.h>
+#include <sys/time.h>
+
+#include "sync.h"
+#include "lbard.h"
+#include "hf.h"
+
+/*
+  Tell our peers which optional protocol features we understand.  Older
+  versions of lbard stop reading a packet at a message type they don't know,
+  so this must only ever be put at the end of a packet.
+*/
+int append_capabilities(unsigned char *msg_out,int *offset)
+{
+  // C + capability bits = 2 bytes
+  msg_out[(*offset)++]='C';
+  msg_out[(*offset)++]=MY_CAPABILITIES
+    |(radio_has_feature(RADIO_ALE_3G)?CAPABILITY_HF_LARGE_BLOCKS:0);
+  return 0;
+}
+
+int message_parser_43(struct peer_state *sender,char *sender_prefix,
+		      char *servald_server, char *credential,
+		      unsigned char *msg,int length)
+{
+  if (length<CAPABILITIES_LEN) {
+    fprintf(stderr,"Error parsing message type 0x43: length=%d, but expected at least %d bytes.\n",
+	    length,CAPABILITIES_LEN);
+    return -3;
+  }
+  sender->capabilities=msg[1];
+  return CAPABILITIES_LEN;
+}
@@ -68,22 +68,25 @@ int message_parser_47(struct peer_state *sender,char *sender_prefix,
       // Peer's instance ID has changed: Forget all knowledge of the peer and
       // return (ignoring the rest of the packet).
 #ifndef SYNC_BY_BAR
-      int peer_index=-1;
-      for(int i=0;i<peer_count;i++) if (sender==peer_records[i]) { peer_index=i; break; }
+      int sid_id=sender->sid_id;
+      int peer_index=find_peer_by_id(sid_id);
       if (peer_index==-1) {
 	// Could not find peer structure. This should not happen.
 	return 0;
       }
       
+      // (the new record keeps the SID prefix the old one held)
+      id_hold(sid_id);
       free_peer(peer_records[peer_index]);
       sender=calloc(1,sizeof(struct peer_state));
       for(int i=0;i<4;i++) sender->sid_prefix_bin[i]=msg[i];
+      sender->sid_id=sid_id;
       sender->sid_prefix=strdup(sender_prefix);
-      sender->last_message_number=-1;
+      for(int i=0;i<MAX_RADIO_INTERFACES;i++) sender->last_message_number[i]=-1;
       sender->tx_bundle=-1;
       sender->instance_id=peer_instance_id;
       printf("Peer %s* has restarted -- discarding stale knowledge of its state.\n",sender->sid_prefix);
-      peer_records[peer_index]=sender;
+      peer_set_record(peer_index,sender);
 #endif
     }
   }
@@ -0,0 +1,143 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2015-2018 Serval Project Inc., Flinders University.
+
+This program monitors a local Rhizome database and attempts
+to synchronise it over low-bandwidth declarative transports, 
+such as bluetooth name or wifi-direct service information
+messages.  It is intended to give a high priority to MeshMS
+converations among nearby nodes.
+
+The design is fully asynchronous, so a call to the update_my_message()
+function from time to time should be all that is required.
+
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Journal bundles (e.g., MeshMS conversations) only ever grow, so when we are
+  sent a new version of one we already have, we only need the bytes past the
+  end of our version.  The 'J' message tells the sender how long our version
+  is, so that it can start sending from exactly there:
+
+  'J', 2 byte recipient SID prefix, 8 byte BID prefix, 4 byte length held.
+*/
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <assert.h>
+#include <sys/time.h>
+
+#include "sync.h"
+#include "lbard.h"
+
+#define JOURNAL_REPORT_LEN (1+2+8+4)
+
+int sync_schedule_journal_report(int peer, int partial)
+{
+  int slot=report_queue_length;
+
+  // Replace any journal report we have already queued for this transfer
+  for(int i=0;i<report_queue_length;i++) {
+    if ((report_queue[i][0]=='J')
+	&&(report_queue_peers[i]==peer_records[peer])
+	&&(report_queue_partials[i]==partial)) {
+      slot=i; break;
+    }
+  }
+
+  if (slot>=REPORT_QUEUE_LEN) slot=random()%REPORT_QUEUE_LEN;
+
+  report_queue_partials[slot]=partial;
+  report_queue_peers[slot]=peer_records[peer];
+
+  if (report_queue_message[slot]) {
+    free(report_queue_message[slot]);
+    report_queue_message[slot]=NULL;
+  }
+  report_queue_message[slot]=strdup("journal length");
+
+  int ofs=0;
+  report_queue[slot][ofs++]='J';
+
+  // Include who we are asking
+  report_queue[slot][ofs++]=peer_records[peer]->sid_prefix_bin[0];
+  report_queue[slot][ofs++]=peer_records[peer]->sid_prefix_bin[1];
+
+  // BID prefix
+  bcopy(id_bin(partials[partial].bid_id),&report_queue[slot][ofs],8);
+  ofs+=8;
+
+  // How much of the journal we already have
+  for(int i=0;i<4;i++)
+    report_queue[slot][ofs++]=(partials[partial].journal_base>>(i*8))&0xff;
+
+  report_lengths[slot]=ofs;
+  assert(ofs<MAX_REPORT_LEN);
+  if (slot>=report_queue_length) report_queue_length=slot+1;
+
+  if (!monitor_mode)
+    fprintf(stderr,"T+%lldms : Asking %s* to send %s* from the end of our %d byte version.\n",
+	    gettime_ms()-start_time,
+	    peer_records[peer]->sid_prefix,
+	    partials[partial].bid_prefix,
+	    partials[partial].journal_base);
+
+  return 0;
+}
+
+int message_parser_4A(struct peer_state *sender,char *sender_prefix,
+		      char *servald_server, char *credential,
+		      unsigned char *msg,int length)
+{
+  if (length<JOURNAL_REPORT_LEN) {
+    fprintf(stderr,"Error parsing message type 0x4A: length=%d, but expected at least %d bytes.\n",
+	    length,JOURNAL_REPORT_LEN);
+    return -3;
+  }
+
+  // Ignore reports meant for other senders
+  if ((msg[1]!=my_sid[0])||(msg[2]!=my_sid[1])) return JOURNAL_REPORT_LEN;
+
+  int held=msg[11]|(msg[12]<<8)|(msg[13]<<16)|(msg[14]<<24);
+  int bundle=lookup_bundle_by_prefix(&msg[3],8);
+
+  if ((bundle<0)||(bundle!=sender->tx_bundle)) return JOURNAL_REPORT_LEN;
+  // Only journals can be sent as a delta
+  if (bundles[bundle].version>=0x100000000LL) return JOURNAL_REPORT_LEN;
+  if ((held<0)||(held>bundles[bundle].length)) return JOURNAL_REPORT_LEN;
+
+  fprintf(stderr,"T+%lldms : %s* already has the first %d bytes of journal %s*, sending from there.\n",
+	  gettime_ms()-start_time,sender->sid_prefix,held,bundles[bundle].bid_hex);
+
+  sender->tx_bundle_body_offset_hard_lower_bound=held;
+  if (sender->tx_bundle_body_offset<held) sender->tx_bundle_body_offset=held;
+
+  if (!peer_request_progress_is_current(sender,bundle))
+    peer_reset_request_progress(sender,bundle);
+  progress_bitmap_set_range(&sender->request_progress,0,held/PROGRESS_BLOCK_SIZE);
+  if (held/PROGRESS_BLOCK_SIZE>sender->request_progress_acked)
+    sender->request_progress_acked=held/PROGRESS_BLOCK_SIZE;
+
+  return JOURNAL_REPORT_LEN;
+}
@@ -0,0 +1,282 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2015-2018 Serval Project Inc., Flinders University.
+
+This program monitors a local Rhizome database and attempts
+to synchronise it over low-bandwidth declarative transports,
+such as bluetooth name or wifi-direct service information
+messages.  It is intended to give a high priority to MeshMS
+converations among nearby nodes.
+
+The design is fully asynchronous, so a call to the update_my_message()
+function from time to time should be all that is required.
+
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Compact bundle pieces.  A full piece header ('p'/'q') spends 19 of its 23
+  bytes saying who the piece is for, and which bundle and version it is of.
+  That never changes during a transfer, so instead the sender binds a one
+  byte slot ID to it, and then sends pieces with just the slot ID:
+
+  'K', slot ID, 2 byte recipient SID prefix, 8 byte BID prefix,
+       8 byte version (body codec in the top byte)
+  'h'/'i' (or 'H'/'I' beyond 1MB), slot ID, 4 (or 6) byte offset compound,
+       piece bytes
+
+  The offset compound and the end-of-item and 1MB bits of the type byte are
+  as for full pieces.  The recipient tells the sender that it knows the
+  binding, or that it was sent a compact piece for a slot it does not know
+  (e.g., because it missed the binding, or has restarted):
+
+  'k', 2 byte SID prefix of the sender of the pieces, slot ID, 1 if known
+
+  Until the binding is acknowledged, the sender puts it in front of each
+  compact piece.  Slot IDs are per sender, so anyone else who hears the
+  binding can make use of the pieces too.  We only send compact pieces when
+  every active peer has said it understands them, as older versions stop
+  reading a packet at the first message type they don't know.
+*/
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <assert.h>
+#include <sys/time.h>
+
+#include "sync.h"
+#include "lbard.h"
+
+#define PIECE_SLOT_REPORT_LEN (1+2+1+1)
+
+static unsigned char last_piece_slot=0;
+
+/*
+  Work out whether a piece of the bundle with the given BID prefix and
+  version (with the body codec in its top byte) for this peer can be sent
+  compact.  Returns the slot ID to use, or 0 if the piece needs a full
+  header.  *bind is set if the binding has to be sent in front of the piece.
+*/
+int piece_slot_choose(int peer,unsigned char *bid_bin,long long version,int *bind)
+{
+  struct peer_state *p=peer_records[peer];
+  *bind=0;
+  if (option_flags&FLAG_NO_COMPACT_PIECES) return 0;
+  if (!active_peers_have_capability(CAPABILITY_COMPACT_PIECES)) return 0;
+
+  if ((!p->tx_piece_slot)
+      ||bcmp(p->tx_piece_slot_bid_bin,bid_bin,8)
+      ||(p->tx_piece_slot_version!=version)) {
+    // New transfer, so new slot.  IDs are not reused until we have been
+    // through all 255 of them, by which time the old binding is long gone.
+    if (!++last_piece_slot) last_piece_slot=1;
+    p->tx_piece_slot=last_piece_slot;
+    bcopy(bid_bin,p->tx_piece_slot_bid_bin,8);
+    p->tx_piece_slot_version=version;
+    p->tx_piece_slot_acked=0;
+  }
+  if (!p->tx_piece_slot_acked) *bind=1;
+  return p->tx_piece_slot;
+}
+
+int append_piece_slot_binding(int peer,unsigned char *msg,int *offset)
+{
+  struct peer_state *p=peer_records[peer];
+  msg[(*offset)++]='K';
+  msg[(*offset)++]=p->tx_piece_slot;
+  msg[(*offset)++]=p->sid_prefix_bin[0];
+  msg[(*offset)++]=p->sid_prefix_bin[1];
+  for(int i=0;i<8;i++) msg[(*offset)++]=p->tx_piece_slot_bid_bin[i];
+  for(int i=0;i<8;i++) msg[(*offset)++]=(p->tx_piece_slot_version>>(i*8))&0xff;
+  return 0;
+}
+
+int sync_schedule_piece_slot_report(int peer,unsigned char slot,int known)
+{
+  // An older peer that hears us, but not the sender, would stop reading our
+  // packet at the 'k'.  Without it, the sender keeps putting the binding in
+  // front of each piece, as it does until the slot is acknowledged.
+  if (!active_peers_have_capability(CAPABILITY_COMPACT_PIECES)) return 0;
+
+  int q=report_queue_length;
+
+  // Replace any report we have already queued about this slot
+  for(int i=0;i<report_queue_length;i++) {
+    if ((report_queue[i][0]=='k')
+	&&(report_queue_peers[i]==peer_records[peer])
+	&&(report_queue[i][3]==slot)) {
+      q=i; break;
+    }
+  }
+
+  if (q>=REPORT_QUEUE_LEN) q=random()%REPORT_QUEUE_LEN;
+
+  report_queue_partials[q]=-1;
+  report_queue_peers[q]=peer_records[peer];
+
+  if (report_queue_message[q]) {
+    free(report_queue_message[q]);
+    report_queue_message[q]=NULL;
+  }
+  report_queue_message[q]=strdup(known?"piece slot known":"piece slot unknown");
+
+  int ofs=0;
+  report_queue[q][ofs++]='k';
+  report_queue[q][ofs++]=peer_records[peer]->sid_prefix_bin[0];
+  report_queue[q][ofs++]=peer_records[peer]->sid_prefix_bin[1];
+  report_queue[q][ofs++]=slot;
+  report_queue[q][ofs++]=known?1:0;
+
+  report_lengths[q]=ofs;
+  assert(ofs<MAX_REPORT_LEN);
+  if (q>=report_queue_length) report_queue_length=q+1;
+
+  return 0;
+}
+
+static struct piece_slot *piece_slot_lookup(struct peer_state *p,unsigned char id)
+{
+  if (!id) return NULL;
+  for(int i=0;i<PIECE_SLOTS_PER_PEER;i++)
+    if (p->rx_piece_slots[i].id==id) return &p->rx_piece_slots[i];
+  return NULL;
+}
+
+int message_parser_4B(struct peer_state *sender,char *sender_prefix,
+		      char *servald_server, char *credential,
+		      unsigned char *msg,int length)
+{
+  if (length<PIECE_SLOT_BINDING_LEN) {
+    fprintf(stderr,"Error parsing message type 0x4B: length=%d, but expected at least %d bytes.\n",
+	    length,PIECE_SLOT_BINDING_LEN);
+    return -3;
+  }
+  if (!msg[1]) return PIECE_SLOT_BINDING_LEN;
+
+  // Rebinding a slot we know replaces it, otherwise replace the oldest
+  struct piece_slot *s=piece_slot_lookup(sender,msg[1]);
+  if (!s) {
+    s=&sender->rx_piece_slots[sender->rx_piece_slot_next];
+    sender->rx_piece_slot_next=(sender->rx_piece_slot_next+1)%PIECE_SLOTS_PER_PEER;
+  }
+  s->id=msg[1];
+  s->recipient[0]=msg[2]; s->recipient[1]=msg[3];
+  bcopy(&msg[4],s->bid_bin,8);
+  s->version=0;
+  for(int i=0;i<8;i++) s->version|=((long long)msg[12+i])<<(i*8LL);
+
+  if ((s->recipient[0]==my_sid[0])&&(s->recipient[1]==my_sid[1])) {
+    int peer=find_peer_by_prefix(sender_prefix);
+    if (peer>=0) sync_schedule_piece_slot_report(peer,s->id,1);
+  }
+  return PIECE_SLOT_BINDING_LEN;
+}
+
+int message_parser_6B(struct peer_state *sender,char *sender_prefix,
+		      char *servald_server, char *credential,
+		      unsigned char *msg,int length)
+{
+  if (length<PIECE_SLOT_REPORT_LEN) {
+    fprintf(stderr,"Error parsing message type 0x6B: length=%d, but expected at least %d bytes.\n",
+	    length,PIECE_SLOT_REPORT_LEN);
+    return -3;
+  }
+
+  // Ignore reports meant for other senders
+  if ((msg[1]!=my_sid[0])||(msg[2]!=my_sid[1])) return PIECE_SLOT_REPORT_LEN;
+
+  unsigned char slot=msg[3];
+  if (msg[4]) {
+    // Only the recipient of a transfer can acknowledge its slot
+    if (sender->tx_piece_slot==slot) sender->tx_piece_slot_acked=1;
+  } else {
+    // Whoever missed the binding, send it again
+    for(int peer=0;peer<peer_count;peer++)
+      if (peer_records[peer]&&(peer_records[peer]->tx_piece_slot==slot))
+	peer_records[peer]->tx_piece_slot_acked=0;
+  }
+  return PIECE_SLOT_REPORT_LEN;
+}
+
+#define message_parser_69 message_parser_68
+#define message_parser_48 message_parser_68
+#define message_parser_49 message_parser_68
+
+int message_parser_68(struct peer_state *sender,char *sender_prefix,
+		      char *servald_server, char *credential,
+		      unsigned char *msg,int length)
+{
+  int above_1mb=!(msg[0]&0x20);
+  int is_end_piece=!(msg[0]&0x01);
+  int header_len=COMPACT_PIECE_HEADER_LEN+(above_1mb?2:0);
+  if (length<header_len) return -3;
+
+  long long offset_compound=0;
+  for(int i=0;i<(above_1mb?6:4);i++)
+    offset_compound|=((long long)msg[2+i])<<(i*8LL);
+  long long piece_offset=(offset_compound&0xfffff)|((offset_compound>>12LL)&0xfff00000LL);
+  int piece_bytes=(offset_compound>>20)&0x7ff;
+  int piece_is_manifest=offset_compound&0x80000000;
+  if (length<header_len+piece_bytes) return -3;
+
+  struct piece_slot *s=piece_slot_lookup(sender,msg[1]);
+  if (!s) {
+    // We don't know which bundle this is a piece of, so ask for the binding
+    // again.  The piece itself is lost.
+    int peer=find_peer_by_prefix(sender_prefix);
+    if (peer>=0) sync_schedule_piece_slot_report(peer,msg[1],0);
+    return header_len+piece_bytes;
+  }
+
+  char bid_prefix[8*2+1];
+  snprintf(bid_prefix,8*2+1,"%02x%02x%02x%02x%02x%02x%02x%02x",
+	   s->bid_bin[0],s->bid_bin[1],s->bid_bin[2],s->bid_bin[3],
+	   s->bid_bin[4],s->bid_bin[5],s->bid_bin[6],s->bid_bin[7]);
+  int for_me=(s->recipient[0]==my_sid[0])&&(s->recipient[1]==my_sid[1]);
+  int body_codec=(s->version>>BODY_CODEC_SHIFT)&0xff;
+  long long version=s->version&BUNDLE_VERSION_MASK;
+
+  if (monitor_mode)
+    {
+      char sender_prefix[128];
+      char monitor_log_buf[1024];
+      sprintf(sender_prefix,"%s*",sender->sid_prefix);
+      snprintf(monitor_log_buf,sizeof(monitor_log_buf),
+	       "Piece of bundle: BID=%s*, [%lld--%lld) of %s.%s",
+	       bid_prefix,
+	       piece_offset,piece_offset+piece_bytes-1,
+	       piece_is_manifest?"manifest":"payload",
+	       is_end_piece?" This is the last piece of that.":""
+	       );
+
+      monitor_log(sender_prefix,NULL,monitor_log_buf);
+    }
+
+  saw_piece(sender_prefix,for_me,
+	    bid_prefix,s->bid_bin,
+	    version,body_codec,piece_offset,piece_bytes,is_end_piece,
+	    piece_is_manifest,&msg[header_len],
+	    prefix,servald_server,credential);
+
+  return header_len+piece_bytes;
+}
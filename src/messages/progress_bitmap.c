@@ -42,6 +42,11 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "sync.h"
 #include "lbard.h"
 
+// 'M', 8 byte BID prefix, 2 byte manifest bitmap, 4 byte start offset, 32 byte bitmap
+#define PROGRESS_BITMAP_REPORT_LEN (1+8+2+4+32)
+// 'm', length, then the same up to the start offset, then the runs
+#define PROGRESS_RUNS_HEADER_LEN (1+1+8+2+4)
+
 int sync_schedule_progress_report_bitmap(int peer, int partial)
 {
   printf(">>> %s Scheduling bitmap report.\n",timestamp_str());
@@ -51,12 +56,13 @@ int sync_schedule_progress_report_bitmap(int peer, int partial)
   int slot=report_queue_length;
 
   for(int i=0;i<report_queue_length;i++) {
-    // BITMAP reports are broadcast, so not per-peer
-    //    if (report_queue_peers[i]==peer_records[peer]) {
-      // We already want to tell this peer something.
-      // We should only need to tell a peer one thing at a time.
+    // BITMAP reports are broadcast, so not per-peer, but a newer bitmap
+    // replaces an older one for the same transfer.  (Other reports, like the
+    // journal length, must not be lost to it.)
+    if (((report_queue[i][0]=='M')||(report_queue[i][0]=='m'))
+	&&(report_queue_partials[i]==partial)) {
       slot=i; break;
-      //    }
+    }
   }
   
   if (slot>=REPORT_QUEUE_LEN) slot=random()%REPORT_QUEUE_LEN;
@@ -81,30 +87,50 @@ int sync_schedule_progress_report_bitmap(int peer, int partial)
   
   // Announce progress bitmap to all recipients.
   partial_update_request_bitmap(&partials[partial]);
-  report_queue[slot][ofs++]='M';
+  struct progress_bitmap *b=&partials[partial].body_progress;
+
+  // Everyone who hears it must be able to parse it, or they lose the rest of
+  // the packet, so only use the run-length form if every active peer can.
+  int runs=active_peers_have_capability(CAPABILITY_PROGRESS_RUNS);
+  report_queue[slot][ofs++]=runs?'m':'M';
+  // Length of the whole message, filled in once we know it
+  int length_ofs=ofs;
+  if (runs) ofs++;
   
   // BID prefix
-  for(int i=0;i<8;i++) {
-    int hex_value=0;
-    char hex_string[3]={partials[partial].bid_prefix[i*2+0],
-			partials[partial].bid_prefix[i*2+1],
-			0};
-    hex_value=strtoll(hex_string,NULL,16);
-    report_queue[slot][ofs++]=hex_value;
-  }
+  bcopy(id_bin(partials[partial].bid_id),&report_queue[slot][ofs],8);
+  ofs+=8;
   
   // Current manifest reception state (16 bits is all we ever need)
   report_queue[slot][ofs++]=partials[partial].request_manifest_bitmap[0];
   report_queue[slot][ofs++]=partials[partial].request_manifest_bitmap[1];
   
-  // Start of region of interest
-  for(int i=0;i<4;i++)
-    report_queue[slot][ofs++]
-      =(partials[partial].request_bitmap_start>>(i*8))&0xff;
+  if (runs) {
+    // First body byte we are missing: we have everything before it
+    int first_missing=b->first_missing*PROGRESS_BLOCK_SIZE;
+    if (first_missing<partials[partial].journal_base)
+      first_missing=partials[partial].journal_base;
+    for(int i=0;i<4;i++)
+      report_queue[slot][ofs++]=(first_missing>>(i*8))&0xff;
   
-  // 32 bytes of bitmap
-  for(int i=0;i<32;i++)
-    report_queue[slot][ofs++]=partials[partial].request_bitmap[i];
+    // Then the holes and held runs after it, as much as will fit
+    ofs+=progress_bitmap_encode(b,&report_queue[slot][ofs],MAX_REPORT_LEN-1-ofs);
+    report_queue[slot][length_ofs]=ofs;
+  } else {
+    // Start of region of interest, which is block aligned so that the bits
+    // line up with our blocks
+    int start=b->first_missing*PROGRESS_BLOCK_SIZE;
+    for(int i=0;i<4;i++)
+      report_queue[slot][ofs++]=(start>>(i*8))&0xff;
+
+    // 32 bytes of bitmap of the 256 blocks from there
+    for(int i=0;i<32;i++) {
+      unsigned char bits=0;
+      for(int j=0;j<8;j++)
+	if (progress_bitmap_test(b,b->first_missing+i*8+j)) bits|=1<<j;
+      report_queue[slot][ofs++]=bits;
+    }
+  }
 
   report_lengths[slot]=ofs;
   assert(ofs<MAX_REPORT_LEN);
@@ -116,29 +142,49 @@ int sync_schedule_progress_report_bitmap(int peer, int partial)
 int sync_parse_progress_bitmap(struct peer_state *p,unsigned char *msg_in,int *offset)
 {  
   unsigned char *msg=&msg_in[*offset];
-  (*offset)+=1; // Skip 'M'
-  (*offset)+=8; // Skip BID prefix
-  (*offset)+=2; // Skip manifest bitmap
-  (*offset)+=4; // Skip start of region of interest
-  (*offset)+=32; // Skip progress bitmap
+  // 'M', 8 byte BID prefix, 2 byte manifest bitmap, 4 byte start of region of
+  // interest, then a 32 byte bitmap of the 256 blocks from there, set if held.
+  // 'm', length, then the same up to the 4 byte first missing body offset,
+  // then run lengths of missing and held blocks.
+  int runs=(msg[0]=='m');
+  int msg_len=runs?msg[1]:PROGRESS_BITMAP_REPORT_LEN;
+  if (msg_len<PROGRESS_RUNS_HEADER_LEN) return -1;
+  (*offset)+=msg_len;
 
   // Get fields
-  unsigned char *bid_prefix=&msg[1];
-  unsigned char *manifest_bitmap=&msg[9];
-  int body_offset=msg[11]|(msg[12]<<8)|(msg[13]<<16)|(msg[14]<<24);
-  unsigned char *bitmap=&msg[15];
+  unsigned char *bid_prefix=&msg[runs?2:1];
+  unsigned char *manifest_bitmap=&bid_prefix[8];
+  unsigned char *o=&manifest_bitmap[2];
+  int body_offset=o[0]|(o[1]<<8)|(o[2]<<16)|(o[3]<<24);
+  if (body_offset<0) body_offset=0;
   int bundle=lookup_bundle_by_prefix(bid_prefix,8);
   int manifest_offset=1024;    
   
-  if (p->tx_bundle==bundle) {
+  if (bundle>-1&&p->tx_bundle==bundle) {
     // We are sending this bundle to them, so update our info
-
-    // XXX - We should also remember these as the last verified progress,
-    // so that when we fill the bitmap, we can resend all not yet-acknowledged content
-
-    p->request_bitmap_bundle=bundle;
-    p->request_bitmap_offset=body_offset;
-    memcpy(p->request_bitmap,bitmap,32);
+    if (!peer_request_progress_is_current(p,bundle)) peer_reset_request_progress(p,bundle);
+    int first_block=body_offset/PROGRESS_BLOCK_SIZE;
+    if (runs)
+      progress_bitmap_decode(&p->request_progress,first_block,
+			     &msg[PROGRESS_RUNS_HEADER_LEN],msg_len-PROGRESS_RUNS_HEADER_LEN);
+    else {
+      // The region of interest starts at the first block they lack
+      unsigned char *bitmap=&o[4];
+      progress_bitmap_set_range(&p->request_progress,0,first_block);
+      for(int i=0;i<256;i++) {
+	if (bitmap[i>>3]&(1<<(i&7)))
+	  progress_bitmap_set_range(&p->request_progress,first_block+i,1);
+	else
+	  progress_bitmap_clear_range(&p->request_progress,first_block+i,1);
+      }
+    }
+    p->request_progress_acked=first_block;
+    // They hold everything before it, so we need never go back there (this
+    // is also how we hear where a journal's new bytes start if the 'J' report
+    // was lost)
+    if ((!(option_flags&FLAG_NO_HARD_LOWER))
+	&&(body_offset>p->tx_bundle_body_offset_hard_lower_bound))
+      p->tx_bundle_body_offset_hard_lower_bound=body_offset;
 
     // Update manifest bitmap ...
     memcpy(p->request_manifest_bitmap,manifest_bitmap,2);
@@ -147,27 +193,22 @@ int sync_parse_progress_bitmap(struct peer_state *p,unsigned char *msg_in,int *o
     p->tx_bundle_manifest_offset=manifest_offset;
   }
 
-  if (debug_bitmap)
+  if (debug_bitmap) {
     printf(">>> %s BITMAP ACK: %s* is informing everyone to send from m=%d (%02x%02x), p=%d of"
 	   " %02x%02x%02x%02x%02x%02x%02x%02x (bundle #%d/%d):  ",
 	   timestamp_str(),
 	   p?p->sid_prefix:"<null>",
 	   manifest_offset,
-	   p->request_manifest_bitmap[0],p->request_manifest_bitmap[1],
+	   manifest_bitmap[0],manifest_bitmap[1],
 	   body_offset,
-	   msg[1],msg[2],msg[3],msg[4],msg[5],msg[6],msg[7],msg[8],
+	   bid_prefix[0],bid_prefix[1],bid_prefix[2],bid_prefix[3],
+	   bid_prefix[4],bid_prefix[5],bid_prefix[6],bid_prefix[7],
 	   bundle,bundle_count);
-
-  int max_block=256;
-  if (bundle>-1) {
-    max_block=(bundles[bundle].length-p->request_bitmap_offset);
-    if (max_block&0x3f)
-      max_block=1+max_block/64;
+    if (peer_request_progress_is_current(p,bundle))
+      dump_progress_bitmap(stdout,&p->request_progress);
     else
-      max_block=0+max_block/64;    
+      printf("\n");
   }
-  if (max_block>256) max_block=256;
-  if (debug_bitmap) dump_progress_bitmap(stdout, bitmap, max_block);
   
   return 0;
 }
@@ -177,8 +218,20 @@ int message_parser_4D(struct peer_state *sender,char *sender_prefix,
 		      unsigned char *msg,int length)
 {
   int offset=0;
+  if (length<PROGRESS_BITMAP_REPORT_LEN) return -1;
   sync_parse_progress_bitmap(sender,msg,&offset);
   
   return offset;
 }
 
+int message_parser_6D(struct peer_state *sender,char *sender_prefix,
+		      char *servald_server, char *credential,
+		      unsigned char *msg,int length)
+{
+  int offset=0;
+  // The message says how long it is, so make sure it is all there
+  if (length<2||msg[1]>length) return -1;
+  if (sync_parse_progress_bitmap(sender,msg,&offset)) return -1;
+  
+  return offset;
+}
@@ -155,7 +155,7 @@ int message_parser_52(struct peer_state *sender,char *sender_prefix,
       for(int i=0;i<bundle_count;i++) {
 	if (!strncasecmp(bid_prefix,bundles[i].bid,16)) {
 	  if (debug_pull) printf("  -> found the bundle.\n");
-	  bundles[i].transmit_now=time(0)+TRANSMIT_NOW_TIMEOUT;
+	  bundles[i].transmit_now=gettime_s()+TRANSMIT_NOW_TIMEOUT;
 	  if (debug_announce) {
 	    printf("*** Setting transmit_now flag on %s*\n",
 		   bundles[i].bid);
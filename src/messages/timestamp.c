@@ -74,7 +74,9 @@ int saw_timestamp(char *sender_prefix,int stratum, struct timeval *tv)
 	if (next_message_update_time) next_message_update_time+=delta;
 	if (congestion_update_time) congestion_update_time+=delta;
 	if (last_status_time) last_status_time+=delta;
+	radio_lock();
 	if (radio_last_heartbeat_time) radio_last_heartbeat_time+=delta;
+	radio_unlock();
 	log_rssi_timewarp(delta);
 	if (status_dump_epoch) status_dump_epoch+=delta;
 	if (last_servald_contact) last_servald_contact+=delta;
@@ -126,8 +128,10 @@ int append_timestamp(unsigned char *msg_out,int *offset)
   // T + (our stratum) + (64 bit seconds since 1970) +
   // + (24 bit microseconds)
   // = 1+1+8+3 = 13 bytes
+  // (Taken from gettime_us(), so that it follows the virtual clock in simulations)
   struct timeval tv;
-  gettimeofday(&tv,NULL);    
+  long long now=gettime_us();
+  tv.tv_sec=now/1000000; tv.tv_usec=now%1000000;
   
   msg_out[(*offset)++]='T';
   msg_out[(*offset)++]=my_time_stratum>>8;
@@ -189,7 +193,7 @@ int message_parser_54(struct peer_state *sender,char *sender_prefix,
     // of other mesh extenders.  By being able to relate the claimed time of each mesh extender
     // against each other, we can hopefully quite accurately piece together the timing of bundle
     // transfers via UHF, for example.
-    time_t now =time(0);
+    time_t now =gettime_s();
     long long delta=(long long)now-(long long)sender->last_timestamp_received;
     // fprintf(stderr,"Logging timestamp message from %s (delta=%lld).\n",sender_prefix,delta);
     if (delta<0) {
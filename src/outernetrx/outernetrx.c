@@ -43,6 +43,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/mman.h>
 
 #include "sync.h"
 #include "lbard.h"
@@ -50,6 +51,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "version.h"
 #include "radios.h"
 #include "code_instrumentation.h"
+#include "rs_erasure.h"
 
 int outernet_socket=-1;
 
@@ -61,44 +63,62 @@ extern char *credential;
   See also drv_outernet.c, and outernet_uplink_build_packet()
   in particular.
 
-  The packets we send are protected by RAID-5 like parity,
-  which can be used to reconstruct a single missing packet
-  from each parity zone.  The initial implementation uses 
-  a parity zone of four packets, with 1/4 of the data being
-  parity, that is the parity expands the dataa to 4/3 the
-  original size, and thus allows one in four packets to be
-  lost, without loss of data.
+  Each lane's data is sent in zones of k data packets followed by m
+  parity packets from a Reed-Solomon erasure code, so that any k of the
+  k+m packets of a zone are enough to recover it.  The uplink chooses k
+  and m, and says what they are in every packet.
 
   There are five lanes of transfer simultaneously, so we
   need to keep track of those.
 
   The packet format is:
 
-  lane number - one byte
+  lane number + OUTERNET_LANE_RS - one byte
   sequence number + stop and start markers - two bytes
   logical MTU - one byte
-  data - variable length
-  parity stripe - variable length
+  k and m - one byte each
+  shard - MTU - OUTERNET_HEADER_LEN bytes
 
   More specifically, the logical MTU specifies the total packet
-  size being used, for the purposes of determining the data and
-  parity strip sizes in each packet. 
+  size being used, for the purposes of determining the shard size.
+  Packets in the old 3+1 parity format (lane numbers without
+  OUTERNET_LANE_RS) are ignored.
+
+  The first zone of a bundle tells us how long it is, so each lane's buffer
+  is allocated once, at the right size.  Bundles bigger than
+  outernet_rx_spill_bytes are instead reassembled in an (unlinked) file in
+  outernet_rx_spill_dir that is mapped into memory, so that five lanes of
+  large bundles don't need five times as much RAM; the kernel writes the
+  pages out as it needs to.  Either way, the bundle is posted to servald
+  straight out of that buffer.
 
 */
 
+// Bundles bigger than this are reassembled in a file rather than in RAM
+unsigned int outernet_rx_spill_bytes=256*1024;
+char *outernet_rx_spill_dir="/tmp";
+// http_post_bundle_parts() won't take a bigger body than this, so there is
+// no point receiving one.
+#define OUTERNET_RX_MAX_BODY_BYTES (5*1024*1024)
+
 struct outernet_rx_bundle {
-  unsigned int offset;
-  unsigned int parity_zone_number;
-  unsigned int last_parity_zone_number;
   unsigned int data_size;
+  // Bytes of data recovered so far, i.e., all zones before zone_number
+  unsigned int data_committed;
   unsigned char *data;
+  // File descriptor of the file data is mapped from, or -1 if it is in RAM
+  int spill_fd;
   time_t rx_start_time;
+
+  // Zone we are collecting, and the shards of it we have
+  unsigned int zone_number;
+  unsigned long long zone_bitmap;
+  int shard_bytes;
+  struct rs_erasure fec;
 #define MAX_DATA_BYTES 256
-  unsigned char parity_zone[MAX_DATA_BYTES*4];
-  unsigned char parity_bytes[MAX_DATA_BYTES];
-  unsigned char parity_zone_bitmap;
-  unsigned char data_bytes;  
+  unsigned char zone[RS_ERASURE_MAX_SHARDS][MAX_DATA_BYTES];
   unsigned char waitingForStart;
+  unsigned char inserted;
 };
 
 #define MAX_LANES 5
@@ -106,6 +126,23 @@ struct outernet_rx_bundle outernet_rx_bundles[MAX_LANES];
 
 int outernet_rx_lane_init(int i,int freeP);
 
+// A lane's buffer, once it has been handed to the insert of its bundle
+struct outernet_rx_buffer {
+  unsigned char *data;
+  unsigned int data_size;
+  int spill_fd;
+};
+
+static void outernet_rx_buffer_release(void *context)
+{
+  struct outernet_rx_buffer *b=context;
+  if (b->spill_fd!=-1) {
+    munmap(b->data,b->data_size);
+    close(b->spill_fd);
+  } else free(b->data);
+  free(b);
+}
+
 int outernet_rx_try_bundle_insert(int lane)
 {
   int retVal=0;
@@ -115,15 +152,22 @@ int outernet_rx_try_bundle_insert(int lane)
 
     LOG_NOTE("Trying to insert bundle from lane #%d",lane);
     
+    // (an inserted bundle's buffer is no longer the lane's, see below)
+    if (outernet_rx_bundles[lane].inserted) {
+      LOG_NOTE("... but we have already inserted it");
+      break;
+    }
     if (!outernet_rx_bundles[lane].data) {
       LOG_NOTE("... but nothing was in that lane");
       retVal=-1;
       break;
     }
+    if (outernet_rx_bundles[lane].data_committed<2+4) {
+      LOG_NOTE("... but we don't have its header");
+      retVal=-1;
+      break;
+    }
 
-    dump_bytes(stdout,"Received data",outernet_rx_bundles[lane].data,
-	       1024);
-    
     unsigned int packed_manifest_len=outernet_rx_bundles[lane].data[0]
       +(outernet_rx_bundles[lane].data[1]<<8);
     unsigned char manifest[8192];
@@ -145,21 +189,35 @@ int outernet_rx_try_bundle_insert(int lane)
     LOG_NOTE("Manifest decompressed to %d bytes",manifest_len);
     dump_bytes(stdout,"Manifest",manifest,manifest_len);
 
-    if ((2+4+payload_len)>outernet_rx_bundles[lane].data_size) {
+    if ((2+4+packed_manifest_len+payload_len)>outernet_rx_bundles[lane].data_committed) {
       LOG_ERROR("Bundle is longer than what we have received");
       retVal=-1;
       break;
     }
 
-    dump_bytes(stdout,"Payload",&outernet_rx_bundles[lane].data[2+4+packed_manifest_len],
-	       payload_len);
-    
-    // Otherwise, insert the bundle into the rhizome database if we can
-    r=rhizome_update_bundle(manifest,manifest_len,
-			    &outernet_rx_bundles[lane].data[2+4+packed_manifest_len],payload_len,
-			    servald_server,credential);
+    // Otherwise, insert the bundle into the rhizome database if we can.
+    // The insert takes the lane's buffer, so that a servald worker can insert
+    // the body from it, rather than from a copy of up to
+    // OUTERNET_RX_MAX_BODY_BYTES, and the lane gets a new one for its next bundle.
+    struct outernet_rx_buffer *given=malloc(sizeof(struct outernet_rx_buffer));
+    if (given) {
+      given->data=outernet_rx_bundles[lane].data;
+      given->data_size=outernet_rx_bundles[lane].data_size;
+      given->spill_fd=outernet_rx_bundles[lane].spill_fd;
+      outernet_rx_bundles[lane].data=NULL;
+      outernet_rx_bundles[lane].data_size=0;
+      outernet_rx_bundles[lane].spill_fd=-1;
+      r=rhizome_update_bundle_given(manifest,manifest_len,
+				    &given->data[2+4+packed_manifest_len],payload_len,
+				    outernet_rx_buffer_release,given,
+				    servald_server,credential);
+    } else
+      r=rhizome_update_bundle(manifest,manifest_len,
+			      &outernet_rx_bundles[lane].data[2+4+packed_manifest_len],payload_len,
+			      servald_server,credential);
+    outernet_rx_bundles[lane].inserted=1;
     LOG_NOTE("rhizome_update_bundle() returned %d.  RX duration was %lld seconds for %d manifest and %d payload bytes",r,
-	     (long long)(time(0)-outernet_rx_bundles[lane].rx_start_time),manifest_len,payload_len);	     
+	     (long long)(gettime_s()-outernet_rx_bundles[lane].rx_start_time),manifest_len,payload_len);	     
 
     
   } while(0);
@@ -169,6 +227,76 @@ int outernet_rx_try_bundle_insert(int lane)
 }
 
 
+int outernet_rx_lane_release(int lane)
+{
+  struct outernet_rx_bundle *b=&outernet_rx_bundles[lane];
+  if (b->data) {
+    if (b->spill_fd!=-1) munmap(b->data,b->data_size);
+    else free(b->data);
+  }
+  if (b->spill_fd!=-1) close(b->spill_fd);
+  b->data=NULL;
+  b->data_size=0;
+  b->spill_fd=-1;
+  return 0;
+}
+
+/*
+  Get the buffer for a bundle of the given size (already rounded up to whole
+  zones), in RAM or in a spill file according to its size.
+*/
+int outernet_rx_lane_alloc(int lane,unsigned int size)
+{
+  int retVal=0;
+  LOG_ENTRY;
+
+  do {
+    struct outernet_rx_bundle *b=&outernet_rx_bundles[lane];
+
+    if (size<=outernet_rx_spill_bytes) {
+      b->data=malloc(size);
+      if (!b->data) {
+	LOG_ERROR("malloc(%u) failed",size);
+	retVal=-1;
+	break;
+      }
+      b->data_size=size;
+      break;
+    }
+
+    char filename[1024];
+    snprintf(filename,sizeof(filename),"%s/lbard-outernet-XXXXXX",outernet_rx_spill_dir);
+    int fd=mkstemp(filename);
+    if (fd==-1) {
+      LOG_ERROR("Could not create spill file '%s': (%i) %m",filename,errno);
+      retVal=-1;
+      break;
+    }
+    // We only need it while we have it open
+    unlink(filename);
+    if (ftruncate(fd,size)) {
+      LOG_ERROR("Could not grow spill file to %u bytes: (%i) %m",size,errno);
+      close(fd);
+      retVal=-1;
+      break;
+    }
+    unsigned char *d=mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    if (d==MAP_FAILED) {
+      LOG_ERROR("Could not map %u byte spill file: (%i) %m",size,errno);
+      close(fd);
+      retVal=-1;
+      break;
+    }
+    b->data=d;
+    b->data_size=size;
+    b->spill_fd=fd;
+    LOG_NOTE("Lane #%d will reassemble its %u byte bundle in a spill file",lane,size);
+  } while(0);
+
+  LOG_EXIT;
+  return retVal;
+}
+
 int outernet_rx_lane_init(int i,int freeP)
 {
   /* Clear RX lane.
@@ -184,174 +312,92 @@ int outernet_rx_lane_init(int i,int freeP)
   }
 
   LOG_NOTE("Clearing lane #%d",i);
+  // (before data_size is cleared, as a spill file is unmapped by its size)
+  if (freeP) outernet_rx_lane_release(i);
   outernet_rx_bundles[i].waitingForStart=1;
-  outernet_rx_bundles[i].offset=0;
+  outernet_rx_bundles[i].inserted=0;
   outernet_rx_bundles[i].data_size=0;
-  outernet_rx_bundles[i].parity_zone_bitmap=0;  
-  outernet_rx_bundles[i].parity_zone_number=0;  
-  outernet_rx_bundles[i].last_parity_zone_number=0;  
-  if (freeP&&outernet_rx_bundles[i].data) free(outernet_rx_bundles[i].data);
+  outernet_rx_bundles[i].data_committed=0;
+  outernet_rx_bundles[i].zone_bitmap=0;
+  outernet_rx_bundles[i].zone_number=0;
   outernet_rx_bundles[i].data=NULL;
+  outernet_rx_bundles[i].spill_fd=-1;
   return 0;
 }
 
-int outernet_rx_lane_commit_parity_zone(int lane)
+/*
+  Returns 1 if we have all of the bundle, judging by the lengths in its
+  header.
+*/
+int outernet_rx_lane_complete(int lane)
 {
-  int retVal=0;
-  LOG_ENTRY;
-
-  do {
-    LOG_NOTE("Commiting parity zone at offset %d for lane #%d",
-	     outernet_rx_bundles[lane].parity_zone_number
-	     *4*outernet_rx_bundles[lane].data_bytes,lane);
-
-    if ((!outernet_rx_bundles[lane].data)
-	||(outernet_rx_bundles[lane].data_size
-	   < ( outernet_rx_bundles[lane].parity_zone_number + 1)
-	   * 4 * outernet_rx_bundles[lane].data_bytes))
-      {
-	// Insufficient space allocated, realloc.
-	
-	unsigned int new_size=outernet_rx_bundles[lane].data_size;
-	if (!new_size) new_size=65536;
-	else new_size=new_size<<1;
-	if (new_size<outernet_rx_bundles[lane].data_size)
-	  new_size=outernet_rx_bundles[lane].data_size;
-	
-	unsigned char *d=realloc(outernet_rx_bundles[lane].data,
-				 (size_t)new_size);
-	if (!d) {
-	  LOG_ERROR("realloc(%u) failed",new_size);
-	  // We can't allocate enough space, so free the lane
-	  // for the next bundle, which will hopefully be smaller.
-	  outernet_rx_lane_init(lane,1);
-	  retVal=-1;
-	  break;
-	} else {
-	  outernet_rx_bundles[lane].data=d;
-	  outernet_rx_bundles[lane].data_size=new_size;	  
-	}
-      }
-    
-    // Copy the parity zone into place
-    dump_bytes(stderr,"Parity zone in commit",
-	       outernet_rx_bundles[lane].parity_zone,
-	       4*outernet_rx_bundles[lane].data_bytes);	       
-    memcpy(&outernet_rx_bundles[lane].data
-	   [outernet_rx_bundles[lane].parity_zone_number
-	    *4*outernet_rx_bundles[lane].data_bytes],
-	   outernet_rx_bundles[lane].parity_zone,
-	   4*outernet_rx_bundles[lane].data_bytes);
-    
-    // Prepare for receiving the next parity zone
-    outernet_rx_bundles[lane].last_parity_zone_number=
-      outernet_rx_bundles[lane].parity_zone_number;
-    outernet_rx_bundles[lane].parity_zone_number++;
-    outernet_rx_bundles[lane].parity_zone_bitmap=0;        
-    
-  } while(0);
-
-  LOG_EXIT;
-  return retVal;
+  struct outernet_rx_bundle *b=&outernet_rx_bundles[lane];
+  if (b->data_committed<2+4) return 0;
+  unsigned int needed=2+4+(b->data[0]|(b->data[1]<<8))
+    +(b->data[2]|(b->data[3]<<8)|(b->data[4]<<16)|(b->data[5]<<24));
+  return b->data_committed>=needed;
 }
 
-int outernet_rx_lane_update_parity_zone(int lane)
+int outernet_rx_lane_commit_zone(int lane)
 {
   int retVal=0;
   LOG_ENTRY;
 
   do {
-    unsigned char *pz=outernet_rx_bundles[lane].parity_zone;
-    unsigned char *pb=outernet_rx_bundles[lane].parity_bytes;
-    int data_bytes=(unsigned char)outernet_rx_bundles[lane].data_bytes;
-    int parity_bytes=data_bytes/3;
-
-    // Handy macros to make it easier to decode
-#define PZ(A,B) (&pz[A*data_bytes+B*parity_bytes])
-#define PB(A) (&pb[A*parity_bytes])
-#define COPY(FROM,TO) { LOG_NOTE("COPY(%p -> %p) (data_bytes=%d)",FROM,TO,data_bytes); memcpy(TO,FROM,parity_bytes); }
-#define XOR(THIS,ONTO) { for(int i=0;i<parity_bytes;i++) ONTO[i]^=THIS[i]; }
-    
-    switch (outernet_rx_bundles[lane].parity_zone_bitmap)
-      {
-      case 0x0: case 0x1: case 0x2: case 0x3:
-      case 0x4: case 0x5: case 0x6: case 0x8:
-      case 0x9: case 0xa: case 0xc:
-	// Do nothing if we don't have enough pieces of this parity zone
-	// Less than 3 pieces received from last parity zone
-	retVal=-1;
-	break;
-      case 0x7:
-	// Missing piece 3
-
-	
-	// Copy the parity slices to the missing spot
-	COPY(PB(0),PZ(3,0));
-	COPY(PB(1),PZ(3,1));
-	COPY(PB(2),PZ(3,2));
-
-	// Reveal the original data
-	XOR(PZ(1,0),PZ(3,0)); XOR(PZ(2,0),PZ(3,0));
-	XOR(PZ(0,0),PZ(3,1)); XOR(PZ(2,1),PZ(3,1));
-	XOR(PZ(0,1),PZ(3,2)); XOR(PZ(1,1),PZ(3,2));
-
-	outernet_rx_lane_commit_parity_zone(lane);
-	
-	break;	
-      case 0xb:
-	// missing piece 2
-
-	// Copy the parity slices to the missing spot
-	COPY(PB(0),PZ(2,0));
-	COPY(PB(1),PZ(2,1));
-	COPY(PB(2),PZ(2,2));
-
-	// Reveal the original data
-	XOR(PZ(1,0),PZ(2,0)); XOR(PZ(3,0),PZ(2,0));
-	XOR(PZ(0,0),PZ(2,1)); XOR(PZ(3,1),PZ(2,1));
-	XOR(PZ(0,2),PZ(2,2)); XOR(PZ(1,2),PZ(2,2));
-
-	outernet_rx_lane_commit_parity_zone(lane);
-
-	break;
-      case 0xd:
-	// missing piece 1
-
-	// Copy the parity slices to the missing spot
-	COPY(PB(0),PZ(1,0));
-	COPY(PB(1),PZ(1,1));
-	COPY(PB(2),PZ(1,2));
-
-	// Reveal the original data
-	XOR(PZ(2,0),PZ(1,0)); XOR(PZ(3,0),PZ(1,0));
-	XOR(PZ(0,1),PZ(1,1)); XOR(PZ(3,2),PZ(1,1));
-	XOR(PZ(0,2),PZ(1,2)); XOR(PZ(2,2),PZ(1,2));
-
-	outernet_rx_lane_commit_parity_zone(lane);
-
-	break;
-      case 0xe:
-	// missing piece 0
-
-	// Copy the parity slices to the missing spot
-	COPY(PB(0),PZ(0,0));
-	COPY(PB(1),PZ(0,1));
-	COPY(PB(2),PZ(0,2));
-
-	// Reveal the original data
-	XOR(PZ(2,1),PZ(0,0)); XOR(PZ(3,1),PZ(0,0));
-	XOR(PZ(1,1),PZ(0,1)); XOR(PZ(3,2),PZ(0,1));
-	XOR(PZ(1,2),PZ(0,2)); XOR(PZ(2,2),PZ(0,2));
-
-	outernet_rx_lane_commit_parity_zone(lane);
+    struct outernet_rx_bundle *b=&outernet_rx_bundles[lane];
+    int k=b->fec.k;
+    unsigned int zone_bytes=k*b->shard_bytes;
+
+    LOG_NOTE("Commiting zone #%d at offset %d for lane #%d",
+	     b->zone_number,b->data_committed,lane);
+
+    // Recover any missing data shards from the parity
+    unsigned char *shards[RS_ERASURE_MAX_SHARDS];
+    for(int i=0;i<k+b->fec.m;i++) shards[i]=b->zone[i];
+    if (rs_erasure_decode(&b->fec,shards,b->zone_bitmap,b->shard_bytes)) {
+      LOG_ERROR("Could not decode zone #%d in lane #%d",b->zone_number,lane);
+      retVal=-1;
+      break;
+    }
 
+    if (!b->data) {
+      // This is the first zone, so now we know how big the bundle is
+      unsigned char header[2+4];
+      for(int i=0;i<2+4;i++) header[i]=b->zone[i/b->shard_bytes][i%b->shard_bytes];
+      unsigned int manifest_len=header[0]|(header[1]<<8);
+      unsigned int body_len=header[2]|(header[3]<<8)|(header[4]<<16)|(header[5]<<24);
+      if (body_len>OUTERNET_RX_MAX_BODY_BYTES) {
+	LOG_ERROR("Bundle in lane #%d has a %u byte body, which is too big for us to insert",
+		  lane,body_len);
+	outernet_rx_lane_init(lane,1);
+	retVal=-1;
 	break;
-      case 0xf:	
-	// We have all four pieces, so life is easy.
-	outernet_rx_lane_commit_parity_zone(lane);
+      }
+      unsigned int size=2+4+manifest_len+body_len;
+      size=((size+zone_bytes-1)/zone_bytes)*zone_bytes;
+      if (outernet_rx_lane_alloc(lane,size)) {
+	// Free the lane for the next bundle, which will hopefully be smaller.
+	outernet_rx_lane_init(lane,1);
+	retVal=-1;
 	break;
+      }
     }
-
+    if (b->data_size<b->data_committed+zone_bytes) {
+      LOG_ERROR("Lane #%d has more zones than its bundle header said",lane);
+      outernet_rx_lane_init(lane,1);
+      retVal=-1;
+      break;
+    }
+    
+    // Copy the data shards into place
+    for(int i=0;i<k;i++)
+      memcpy(&b->data[b->data_committed+i*b->shard_bytes],b->zone[i],b->shard_bytes);
+    b->data_committed+=zone_bytes;
+    
+    // Prepare for receiving the next zone
+    b->zone_number++;
+    b->zone_bitmap=0;
+    
   } while(0);
 
   LOG_EXIT;
@@ -365,8 +411,20 @@ int outernet_rx_saw_packet(unsigned char *buffer,int bytes)
 
   do {
 
-    unsigned int lane=buffer[0];
+    if (bytes<OUTERNET_HEADER_LEN) {
+      LOG_ERROR("Outernet packet is too short (%d bytes)",bytes);
+      retVal=-1;
+      break;
+    }
+    if (!(buffer[0]&OUTERNET_LANE_RS)) {
+      LOG_NOTE("Ignoring Outernet packet in the old 3+1 parity format");
+      break;
+    }
+    unsigned int lane=buffer[0]&0x7f;
     unsigned int packet_mtu=buffer[3];
+    int k=buffer[4];
+    int m=buffer[5];
+    int shard_bytes=packet_mtu-OUTERNET_HEADER_LEN;
 
     if (lane>=MAX_LANES) {
       LOG_ERROR("Outernet packet is for lane #%d (we only support 0 -- %d)",
@@ -374,13 +432,11 @@ int outernet_rx_saw_packet(unsigned char *buffer,int bytes)
       retVal=-1;
       break;
     }
-    
-    // 3/4 of the usable bytes are available for data
-    int data_bytes=(packet_mtu-3)*3/4;
-    int parity_bytes=data_bytes/3;
-    if (parity_bytes*3!=data_bytes) {
-      LOG_ERROR("Parity stripe size problem. MTU=%d, data_bytes=%d, parity_bytes=%d",
-		packet_mtu,data_bytes,parity_bytes);
+    if ((k<1)||((k+m)>RS_ERASURE_MAX_SHARDS)
+	||(shard_bytes<1)||(shard_bytes>MAX_DATA_BYTES)||(k*shard_bytes<2+4)
+	||(bytes<OUTERNET_HEADER_LEN+shard_bytes)) {
+      LOG_ERROR("Outernet packet has an unsupported shape. MTU=%d, k=%d, m=%d, length=%d",
+		packet_mtu,k,m,bytes);
       retVal=-1;
       break;
     }
@@ -392,113 +448,78 @@ int outernet_rx_saw_packet(unsigned char *buffer,int bytes)
     if (buffer[2]&0x40) start_flag=1;
     if (buffer[2]&0x80) end_flag=1;
 
-    int parity_zone_size=data_bytes*4;
-    int parity_zone_offset=(sequence_number*data_bytes)%parity_zone_size;
-    // int parity_zone_start=(sequence_number*data_bytes)-parity_zone_offset;
-    int parity_zone_number=sequence_number/4;
-    int parity_zone_slice=sequence_number&3;
-    
-    unsigned char *data=&buffer[4];
-    unsigned char *parity=&buffer[4+data_bytes];
+    unsigned int zone_number=sequence_number/(k+m);
+    int shard=sequence_number%(k+m);
+    unsigned char *data=&buffer[OUTERNET_HEADER_LEN];
+    struct outernet_rx_bundle *b=&outernet_rx_bundles[lane];
 
-    LOG_NOTE("Received bundle piece in lane #%d, sequence #%d (start=%d, end=%d) (parity zone #%d, packet %d, expected parity zone #%d)",
+    LOG_NOTE("Received bundle piece in lane #%d, sequence #%d (start=%d, end=%d) (zone #%d, shard %d of %d+%d, expected zone #%d)",
 	     lane,
 	     sequence_number,start_flag,end_flag,
-	     parity_zone_number,parity_zone_slice,
-	     outernet_rx_bundles[lane].parity_zone_number);
-    dump_bytes(stderr,"Bundle bytes",data,data_bytes);
-    dump_bytes(stderr,"Parity bytes",parity,parity_bytes);
-
-    // Start receiving if we see a start sequence, or if we see sequence #1 while waiting
-    // for a start (since we can recover the missing start)
-    if (start_flag||((sequence_number==1)&&outernet_rx_bundles[lane].waitingForStart)) {
+	     zone_number,shard,k,m,
+	     b->zone_number);
+
+    // Start receiving if we see a start sequence, or any packet of the first
+    // zone while waiting for a start (since we can recover the missing start)
+    if (start_flag||((zone_number==0)&&b->waitingForStart&&!b->zone_bitmap)) {
       // Erase whatever was sitting in this lane.
       LOG_NOTE("Clearing lane #%d RX state for new bundle",lane);
       outernet_rx_lane_init(lane,1);
 
-      outernet_rx_bundles[lane].waitingForStart=0;
-      outernet_rx_bundles[lane].rx_start_time=time(0);
+      b->waitingForStart=0;
+      b->rx_start_time=gettime_s();
+      b->shard_bytes=shard_bytes;
+      rs_erasure_init(&b->fec,k,m);
     }
 
     // If we are waiting for a new start flag, ignore whatever
     // we see in the meantime.
-    // If we see a sequence #1, then we might have missed
-    // only sequence #0, which we can recover via parity, if we
-    // don't miss the next two packets.  So we should handle that
-    // special case.
-    if (outernet_rx_bundles[lane].waitingForStart
-	&&(sequence_number>1)) {
+    if (b->waitingForStart) {
       LOG_NOTE("Ignoring piece while waiting for start");
       break;
     }
 
-    // Can only happen if we are on sequence #0 or #1, which in either
-    // case counts as a start.
-    outernet_rx_bundles[lane].waitingForStart=0;
+    if ((k!=b->fec.k)||(m!=b->fec.m)||(shard_bytes!=b->shard_bytes)) {
+      LOG_NOTE("Clearing lane #%d RX state because the zone shape changed mid-bundle",lane);
+      outernet_rx_lane_init(lane,1);
+      break;
+    }
 
-    if ((parity_zone_number < outernet_rx_bundles[lane].parity_zone_number)
-        && (parity_zone_number != outernet_rx_bundles[lane].last_parity_zone_number)) {
+    if (zone_number+1==b->zone_number) {
+      // The rest of a zone we have already recovered
+      break;
+    }
+    if (zone_number<b->zone_number) {
       // We seem to have gone backwards, which means that we have to
       // abandon the current transfer, as presumably we missed the end of the
       // last, and the start of this one.
-      LOG_NOTE("Clearing lane #%d RX state because parity_zone_number went backwards from %d to %d",
-	       lane,outernet_rx_bundles[lane].parity_zone_number,parity_zone_number);
+      LOG_NOTE("Clearing lane #%d RX state because zone_number went backwards from %d to %d",
+	       lane,b->zone_number,zone_number);
       outernet_rx_lane_init(lane,1);
       break;
     }    
-    if (parity_zone_number==(1 + outernet_rx_bundles[lane].parity_zone_number))
-      {
-	// Parity zone has advanced by exactly one.
-	// We need to check that the previous parity zone was completed.
-	// If not, then we need to stop receiving.
-      switch (outernet_rx_bundles[lane].parity_zone_bitmap)
-	{
-	case 0x0: case 0x1: case 0x2: case 0x3:
-	case 0x4: case 0x5: case 0x6: case 0x8:
-	case 0x9: case 0xa: case 0xc:
-	  // Less than 3 pieces received from last parity zone
-	  LOG_NOTE("Clearing lane #%d RX state because parity_zone_number advanced, but we havn't received at least 3/4 packets from the last one.",lane);
-	  outernet_rx_lane_init(lane,1);
-	  break;
-	default:
-	  // We have 3 or more pieces in the last parity zone,
-	  // so commit it. Really this should never happen, because
-	  // we should commit a parity zone after adding to it
-	  // each time
-	  outernet_rx_lane_update_parity_zone(lane);
-	}
-      }
-    else if (parity_zone_number==outernet_rx_bundles[lane].parity_zone_number)  {
-      // Okay, the packet is for this parity zone.
-      // Copy the data and parity bytes in, and update the bitmap
-
-      // Copy the data bytes
-      dump_bytes(stderr,"rxd bytes",data,data_bytes);
-      dump_bytes(stderr,"stored bytes",&outernet_rx_bundles[lane].parity_zone[parity_zone_offset],data_bytes);
-      memcpy(&outernet_rx_bundles[lane].parity_zone[parity_zone_offset],
-	     data,data_bytes);
-
-      /* Copy the parity bytes.
-	 For now, we just keep them. It is only when we call
-	 outernet_rx_lane_update_parity_zone() that we try to
-	 use the parity. */
-      memcpy(&outernet_rx_bundles[lane].parity_bytes[parity_zone_slice*parity_bytes],parity,parity_bytes);
-      
-      
-      // Update bitmap
-      outernet_rx_bundles[lane].parity_zone_bitmap|=(1<<parity_zone_slice);
-      outernet_rx_bundles[lane].data_bytes=data_bytes;
-      
-      // See if we have enough received to commit the parity zone
-      outernet_rx_lane_update_parity_zone(lane);
-      
-    }
-    if (parity_zone_number > ( 1 + outernet_rx_bundles[lane].parity_zone_number)) {
-      LOG_NOTE("Clearing lane #%d RX state because parity_zone_number skipped forwards",lane);
+    if (zone_number>b->zone_number) {
+      // We didn't get enough of the zone we were collecting
+      LOG_NOTE("Clearing lane #%d RX state because zone_number advanced, but we only have %d of the %d packets we need from the last one.",
+	       lane,__builtin_popcountll(b->zone_bitmap),k);
       outernet_rx_lane_init(lane,1);
       break;
     }
 
+    // The packet is for this zone: keep the shard, and recover the zone as
+    // soon as we have enough of it.
+    memcpy(b->zone[shard],data,shard_bytes);
+    b->zone_bitmap|=1ULL<<shard;
+    if (__builtin_popcountll(b->zone_bitmap)>=k) {
+      outernet_rx_lane_commit_zone(lane);
+      if (outernet_rx_lane_complete(lane)) {
+	LOG_NOTE("Attempting to insert bundle received via outernet, as we have all of it");
+	outernet_rx_try_bundle_insert(lane);
+	// Ignore the rest of the bundle's packets
+	b->waitingForStart=1;
+      }
+    }
+
     if (end_flag) {
       LOG_NOTE("Attempting to insert bundle received via outernet via end_flag");
       outernet_rx_try_bundle_insert(lane);
@@ -507,8 +528,6 @@ int outernet_rx_saw_packet(unsigned char *buffer,int bytes)
     
     }
     
-    
-    
   } while(0);
   
   LOG_EXIT;
@@ -0,0 +1,104 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2015-2018 Serval Project Inc., Flinders University.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Compression of bundle bodies for sending.
+
+  We use the zlib format from the copy of miniz that is built for the EEPROM
+  code, at the best compression level: a body is only compressed once, when
+  it enters the bundle cache, and the radio is far slower than the CPU.  Every
+  sender compresses the same body to the same bytes, so a receiver can take
+  pieces of a compressed body from more than one sender.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <netinet/in.h>
+
+#include "sync.h"
+#include "lbard.h"
+
+#define MINIZ_NO_ARCHIVE_APIS
+#define MINIZ_NO_ARCHIVE_WRITING_APIS
+#define MINIZ_HEADER_FILE_ONLY
+#include "eeprom/miniz.c"
+
+// Bodies smaller than this gain too little to be worth it
+#define BODY_COMPRESS_MIN_BYTES 128
+// Before compressing a large body, try this much of it quickly, so that we
+// don't spend long finding out that (say) a JPEG doesn't compress.
+#define BODY_COMPRESS_PROBE_BYTES 8192
+
+// Only send a body compressed if it saves at least an eighth
+static int body_compress_worthwhile(unsigned long body_len,unsigned long compressed_len)
+{
+  return compressed_len<=body_len-body_len/8;
+}
+
+/*
+  Compress a body, if it is worth doing.  Returns 0 with the compressed body
+  in a new buffer, or -1 if the body should be sent as it is.
+*/
+int body_compress(unsigned char *body,int body_len,
+		  unsigned char **compressed,int *compressed_len)
+{
+  if (body_len<BODY_COMPRESS_MIN_BYTES) return -1;
+
+  mz_ulong out_len=mz_compressBound(body_len);
+  unsigned char *out=malloc(out_len);
+  if (!out) return -1;
+
+  if (body_len>BODY_COMPRESS_PROBE_BYTES*2) {
+    mz_ulong probe_len=out_len;
+    if ((mz_compress2(out,&probe_len,body,BODY_COMPRESS_PROBE_BYTES,MZ_BEST_SPEED)!=MZ_OK)
+	||!body_compress_worthwhile(BODY_COMPRESS_PROBE_BYTES,probe_len)) {
+      free(out);
+      return -1;
+    }
+  }
+
+  if ((mz_compress2(out,&out_len,body,body_len,MZ_BEST_COMPRESSION)!=MZ_OK)
+      ||!body_compress_worthwhile(body_len,out_len)) {
+    free(out);
+    return -1;
+  }
+  unsigned char *shrunk=realloc(out,out_len);
+  if (!shrunk) {
+    free(out);
+    return -1;
+  }
+  *compressed=shrunk;
+  *compressed_len=out_len;
+  return 0;
+}
+
+/*
+  Decompress a body that should be exactly out_len bytes long.
+*/
+int body_decompress(int codec,unsigned char *in,int in_len,
+		    unsigned char *out,int out_len)
+{
+  if (codec!=BODY_CODEC_DEFLATE) return -1;
+  mz_ulong len=out_len;
+  if (mz_uncompress(out,&len,in,in_len)!=MZ_OK) return -1;
+  if (len!=(mz_ulong)out_len) return -1;
+  return 0;
+}
@@ -58,7 +58,8 @@ int _report_file(const char *filename,const char *file,
   return 0;
 }
 
-char *bid_of_cached_bundle=NULL;
+// The interned BID of the bundle in the cache, or 0
+int cached_bid_id=0;
 long long cached_version=0;
 int cached_manifest_len=0;
 unsigned char *cached_manifest=NULL;
@@ -66,9 +67,296 @@ int cached_manifest_encoded_len=0;
 unsigned char *cached_manifest_encoded=NULL;
 int cached_body_len=0;
 unsigned char *cached_body=NULL;
+int cached_body_codec=BODY_CODEC_NONE;
+int cached_body_wire_len=0;
+unsigned char *cached_body_wire=NULL;
 
-int prime_bundle_cache(int bundle_number,char *sid_prefix_hex,
-		       char *servald_server, char *credential)
+static void release_cached_body_wire(void)
+{
+  // Unless it is compressed, it is just another name for cached_body
+  if (cached_body_codec!=BODY_CODEC_NONE) free(cached_body_wire);
+  cached_body_wire=NULL;
+  cached_body_wire_len=0;
+  cached_body_codec=BODY_CODEC_NONE;
+}
+
+/*
+  Work out how to send the body now in the cache.  We compress it if that
+  saves enough, unless it is encrypted (and so won't compress), a journal
+  (which we send as a delta from the version the receiver has), or some peer
+  we can hear would not be able to decompress it.
+*/
+int bundle_cache_choose_body_codec(int bundle_number)
+{
+  release_cached_body_wire();
+  cached_body_wire=cached_body;
+  cached_body_wire_len=cached_body_len;
+
+  unsigned char *compressed=NULL;
+  int compressed_len=0;
+  char crypt[1024]="";
+  if (cached_manifest)
+    manifest_get_field(cached_manifest,cached_manifest_len,"crypt",crypt);
+  if ((!(option_flags&FLAG_NO_BODY_COMPRESSION))
+      &&(cached_version>=0x100000000LL)
+      &&strcmp(crypt,"1")
+      &&active_peers_have_capability(CAPABILITY_BODY_DEFLATE)
+      &&!body_compress(cached_body,cached_body_len,&compressed,&compressed_len)) {
+    fprintf(stderr,"  body compresses from %d to %d bytes.\n",
+	    cached_body_len,compressed_len);
+    cached_body_wire=compressed;
+    cached_body_wire_len=compressed_len;
+    cached_body_codec=BODY_CODEC_DEFLATE;
+  }
+
+  bundles[bundle_number].wire_version=cached_version;
+  bundles[bundle_number].wire_length=cached_body_wire_len;
+  bundles[bundle_number].body_codec=cached_body_codec;
+  return 0;
+}
+
+/*
+  How a bundle's body is sent, and how many bytes that is.  Until the
+  bundle has been through the cache, we assume that it is sent as it is.
+*/
+static int bundle_wire_is_known(int bundle_number)
+{
+  return (bundle_number>=0)
+    &&bundles[bundle_number].wire_length
+    &&(bundles[bundle_number].wire_version==bundles[bundle_number].version);
+}
+
+int bundle_body_codec(int bundle_number)
+{
+  if (!bundle_wire_is_known(bundle_number)) return BODY_CODEC_NONE;
+  return bundles[bundle_number].body_codec;
+}
+
+int bundle_wire_length(int bundle_number)
+{
+  if (!bundle_wire_is_known(bundle_number)) return bundles[bundle_number].length;
+  return bundles[bundle_number].wire_length;
+}
+
+/*
+  Fetch a bundle's manifest and body from servald.  This touches nothing
+  but its arguments, so that the servald workers can call it.
+*/
+static int bundle_cache_fetch(char *bid_hex,char *servald_server,char *credential,
+			      unsigned char **manifest,int *manifest_len,
+			      unsigned char **body,int *body_len)
+{
+  char path[8192];
+
+  *manifest=NULL; *body=NULL;
+  snprintf(path,8192,"/restful/rhizome/%s.rhm",bid_hex);
+
+  long long t1=gettime_ms();
+
+  FILE *f=tmpfile();
+  if (!f) {
+    perror("tmpfile");
+    return -1;
+  }
+  int result_code=http_get_simple(servald_server,
+				  credential,path,f,5000,NULL,0);
+  if(result_code!=200) {
+    fprintf(stderr,"http request failed (%d). URLPATH:%s\n",result_code,path);
+    fclose(f);
+    return -1;
+  }
+  long long t2=gettime_ms();
+  rewind(f);
+  *manifest=malloc(8192);
+  assert(*manifest);
+  *manifest_len=fread(*manifest,1,8192,f);
+  fclose(f);
+  if (0) fprintf(stderr,"  manifest is %d bytes long.\n",*manifest_len);
+
+  // Reject over-length manifests
+  if ((*manifest_len>1024)||(!*manifest_len)) {
+    free(*manifest); *manifest=NULL;
+    return -1;
+  }
+  *manifest=realloc(*manifest,*manifest_len);
+  assert(*manifest);
+
+  snprintf(path,8192,"/restful/rhizome/%s/raw.bin",bid_hex);
+  f=tmpfile();
+  if (!f) {
+    perror("tmpfile");
+    free(*manifest); *manifest=NULL;
+    return -1;
+  }
+  result_code=http_get_simple(servald_server,
+			      credential,path,f,5000,NULL,0);
+  if(result_code!=200) {
+    fprintf(stderr,"http request failed (%d). URLPATH:%s\n",result_code,path);
+    fclose(f);
+    free(*manifest); *manifest=NULL;
+    return -1;
+  }
+  long long t3=gettime_ms();
+
+  if (0)
+    fprintf(stderr,"  HTTP pre-fetching of next bundle to send took %lldms + %lldms\n",
+	    t2-t1,t3-t2);
+    
+  // XXX - This transport only allows bundles upto 5MB!
+  // (and that is probably pushing it a bit for a mesh extender with only 32MB RAM
+  // for everything!)
+  rewind(f);
+  *body=malloc(5*1024*1024);
+  assert(*body);
+  // XXX - Should check that we read all the bytes
+  *body_len=fread(*body,1,5*1024*1024,f);    
+  *body=realloc(*body,*body_len);
+  if (*body_len) assert(*body); else fprintf(stderr,"WARNING:Body len = 0 bytes!\n");
+  fclose(f);
+  if (1)
+    fprintf(stderr,"  body is %d bytes long. result_code=%d\n",
+	    *body_len,result_code);
+  return 0;
+}
+
+static void bundle_cache_release(void)
+{
+  if (cached_bid_id) {
+    cached_bid_id=0;
+    free(cached_manifest); cached_manifest=NULL;
+    free(cached_manifest_encoded); cached_manifest_encoded=NULL;
+    release_cached_body_wire();
+    free(cached_body); cached_body=NULL;
+  }
+}
+
+// Make a fetched bundle the cached one, taking its manifest and body
+static int bundle_cache_install(int bundle_number,
+				unsigned char *manifest,int manifest_len,
+				unsigned char *body,int body_len)
+{
+  bundle_cache_release();
+  cached_manifest=manifest;
+  cached_manifest_len=manifest_len;
+
+  // Generate binary encoded manifest from plain text version.  Manifest
+  // pieces are heard by everyone in range, so we only use the second
+  // generation encoding if every active peer has said it can read it.
+  cached_manifest_encoded=malloc(1024);
+  assert(cached_manifest_encoded);
+  cached_manifest_encoded_len=0;
+  if (manifest_text_to_binary_generation(cached_manifest,cached_manifest_len,
+					 cached_manifest_encoded,
+					 &cached_manifest_encoded_len,
+					 active_peers_have_capability(CAPABILITY_MANIFEST_V2)?2:1)) {
+    // Failed to binary encode manifest, so just copy it
+    bcopy(cached_manifest,cached_manifest_encoded,cached_manifest_len);
+    cached_manifest_encoded_len = cached_manifest_len;	
+  }        
+
+  cached_body=body;
+  cached_body_len=body_len;
+
+  cached_bid_id=bundles[bundle_number].bid_id;
+
+  cached_version=bundles[bundle_number].version;
+
+  bundle_cache_choose_body_codec(bundle_number);
+
+  if (0)
+    fprintf(stderr,"Cached manifest and body for %s\n",
+	    bundles[bundle_number].bid_hex);
+  return 0;
+}
+
+/*
+  In threaded mode, bundles are fetched by the servald workers, and the
+  cache is filled when the fetch comes back.  Until then, callers are told
+  the bundle can't be had, as when servald doesn't answer, and try again
+  later.  There is no point asking for more at once than this, as only the
+  last one fetched stays in the cache.
+*/
+#define BUNDLE_CACHE_MAX_FETCHES 4
+
+struct bundle_fetch {
+  struct servald_job job;
+  struct bundle_fetch *next;
+  int bundle_number;
+  int bid_id;
+  // (for the worker, which must not use the interned IDs)
+  char *bid_hex;
+  long long version;
+  char *servald_server;
+  char *credential;
+  unsigned char *manifest;
+  int manifest_len;
+  unsigned char *body;
+  int body_len;
+};
+
+static struct bundle_fetch *bundle_fetches=NULL;
+static int bundle_fetch_count=0;
+
+static int bundle_fetch_run(struct servald_job *job)
+{
+  struct bundle_fetch *f=(struct bundle_fetch *)job;
+  return bundle_cache_fetch(f->bid_hex,f->servald_server,f->credential,
+			    &f->manifest,&f->manifest_len,&f->body,&f->body_len);
+}
+
+static int bundle_fetch_done(struct servald_job *job)
+{
+  struct bundle_fetch *f=(struct bundle_fetch *)job;
+  for(struct bundle_fetch **l=&bundle_fetches;*l;l=&(*l)->next)
+    if (*l==f) { *l=f->next; bundle_fetch_count--; break; }
+
+  // Unless the bundle has moved on while we waited
+  int n=f->bundle_number;
+  if ((!job->result)&&(n<bundle_count)
+      &&(bundles[n].bid_id==f->bid_id)
+      &&(bundles[n].version==f->version)) {
+    bundle_cache_install(n,f->manifest,f->manifest_len,f->body,f->body_len);
+    f->manifest=NULL; f->body=NULL;
+  }
+  free(f->manifest);
+  free(f->body);
+  free(f->bid_hex);
+  free(f);
+  return 0;
+}
+
+static int bundle_cache_fetch_async(int bundle_number,char *servald_server,char *credential)
+{
+  for(struct bundle_fetch *f=bundle_fetches;f;f=f->next)
+    if ((f->version==bundles[bundle_number].version)
+	&&(f->bid_id==bundles[bundle_number].bid_id))
+      // Already on its way
+      return -1;
+  if (bundle_fetch_count>=BUNDLE_CACHE_MAX_FETCHES) return -1;
+
+  struct bundle_fetch *f=calloc(1,sizeof(struct bundle_fetch));
+  if (!f) return -1;
+  f->job.run=bundle_fetch_run;
+  f->job.done=bundle_fetch_done;
+  f->bundle_number=bundle_number;
+  f->bid_id=bundles[bundle_number].bid_id;
+  f->bid_hex=strdup(bundles[bundle_number].bid_hex);
+  f->version=bundles[bundle_number].version;
+  f->servald_server=servald_server;
+  f->credential=credential;
+  if (servald_submit(&f->job)) {
+    free(f->bid_hex);
+    free(f);
+    return -1;
+  }
+  f->next=bundle_fetches;
+  bundle_fetches=f;
+  bundle_fetch_count++;
+  return -1;
+}
+
+static int bundle_cache_load(int bundle_number,char *sid_prefix_hex,
+			     char *servald_server,char *credential,int wait)
 {
   if (bundle_number<0) return -1;
 
@@ -80,132 +368,34 @@ int prime_bundle_cache(int bundle_number,char *sid_prefix_hex,
     }
   }
   
-  if ((!bid_of_cached_bundle)
-      ||strcasecmp(bundles[bundle_number].bid_hex,bid_of_cached_bundle)
-      ||(cached_version!=bundles[bundle_number].version)
-      ) {
-    // Cache is invalid - release
-    if (bid_of_cached_bundle) {
-      free(bid_of_cached_bundle); bid_of_cached_bundle=NULL;
-      free(cached_manifest); cached_manifest=NULL;
-      free(cached_manifest_encoded); cached_manifest_encoded=NULL;
-      free(cached_body); cached_body=NULL;
-    }
-
-    // Load bundle into cache
-    char path[8192];
-    char filename[1024];
-    
-    snprintf(path,8192,"/restful/rhizome/%s.rhm",
-	     bundles[bundle_number].bid_hex);
-
-    long long t1=gettime_ms();
-
-    char pathbuf[1024];
-    snprintf(filename,1024,"%s/%d.%s.manifest",getcwd(pathbuf,1024),getpid(),
-	     sid_prefix_hex);
-      
-    unlink(filename);
-    FILE *f=fopen(filename,"w");
-    if (!f) {
-      fprintf(stderr,"could not open output file '%s'.\n",filename);
-      perror("fopen");
-      return -1;
-    }
-    int result_code=http_get_simple(servald_server,
-				    credential,path,f,5000,NULL,0);
-    fclose(f);
-    if(result_code!=200) {
-      fprintf(stderr,"http request failed (%d). URLPATH:%s\n",result_code,path);
-      return -1;
-    }
-    long long t2=gettime_ms();
-    f=fopen(filename,"r");
-    if (!f) {
-      fprintf(stderr,"ERROR: Could not open '%s' to read bundle manifest in prime_bundle_cache() call for bundle #%d\n",
-	      filename,bundle_number);
-      perror("fopen");
-      return -1;
-    }
-    if (cached_manifest) free(cached_manifest);
-    cached_manifest=malloc(8192);
-    assert(cached_manifest);
-    cached_manifest_len=fread(cached_manifest,1,8192,f);
-    cached_manifest=realloc(cached_manifest,cached_manifest_len);
-    assert(cached_manifest);
-    fclose(f);
-    unlink(filename);
-    if (0) fprintf(stderr,"  manifest is %d bytes long.\n",cached_manifest_len);
+  if ((cached_bid_id)
+      &&(bundles[bundle_number].bid_id==cached_bid_id)
+      &&(cached_version==bundles[bundle_number].version))
+    return 0;
 
-    // Reject over-length manifests
-    if (cached_manifest_len>1024) return -1;
-    
-    // Generate binary encoded manifest from plain text version
-    if (cached_manifest_encoded) free(cached_manifest_encoded);
-    cached_manifest_encoded=malloc(1024);
-    assert(cached_manifest_encoded);
-    cached_manifest_encoded_len=0;
-    if (manifest_text_to_binary(cached_manifest,cached_manifest_len,
-				cached_manifest_encoded,
-				&cached_manifest_encoded_len)) {
-      // Failed to binary encode manifest, so just copy it
-      bcopy(cached_manifest,cached_manifest_encoded,cached_manifest_len);
-      cached_manifest_encoded_len = cached_manifest_len;	
-    }        
-    
-    snprintf(path,8192,"/restful/rhizome/%s/raw.bin",
-	     bundles[bundle_number].bid_hex);
-    snprintf(filename,1024,"%d.%s.raw",getpid(),sid_prefix_hex);
-    unlink(filename);
-    f=fopen(filename,"w");
-    if (!f) {
-      fprintf(stderr,"could not open output file '%s'.\n",filename);
-      perror("fopen");
-      return -1;
-    }
-    result_code=http_get_simple(servald_server,
-				credential,path,f,5000,NULL,0);
-    fclose(f); f=NULL;
-    if(result_code!=200) {
-      fprintf(stderr,"http request failed (%d). URLPATH:%s\n",result_code,path);
-      return -1;
-    }
-    long long t3=gettime_ms();
+  if ((!wait)&&threads_servald_async())
+    return bundle_cache_fetch_async(bundle_number,servald_server,credential);
 
-    if (0)
-      fprintf(stderr,"  HTTP pre-fetching of next bundle to send took %lldms + %lldms\n",
-	      t2-t1,t3-t2);
-    
-    // XXX - This transport only allows bundles upto 5MB!
-    // (and that is probably pushing it a bit for a mesh extender with only 32MB RAM
-    // for everything!)
-    f=fopen(filename,"r");
-    if (!f) {
-      fprintf(stderr,"could read file '%s'.\n",filename);
-      perror("fopen");
-      return -1;
-    }
-    if (cached_body) free(cached_body);
-    cached_body=malloc(5*1024*1024);
-    assert(cached_body);
-    // XXX - Should check that we read all the bytes
-    cached_body_len=fread(cached_body,1,5*1024*1024,f);    
-    cached_body=realloc(cached_body,cached_body_len);
-    if (cached_body_len) assert(cached_body); else fprintf(stderr,"WARNING:Body len = 0 bytes!\n");
-    fclose(f);
-    unlink(filename);
-    if (1)
-      fprintf(stderr,"  body is %d bytes long. result_code=%d\n",
-	      cached_body_len,result_code);
+  // Cache is invalid - release, and load bundle into cache
+  bundle_cache_release();
 
-    bid_of_cached_bundle=strdup(bundles[bundle_number].bid_hex);
+  unsigned char *manifest,*body;
+  int manifest_len,body_len;
+  if (bundle_cache_fetch(bundles[bundle_number].bid_hex,servald_server,credential,
+			 &manifest,&manifest_len,&body,&body_len))
+    return -1;
+  return bundle_cache_install(bundle_number,manifest,manifest_len,body,body_len);
+}
 
-    cached_version=bundles[bundle_number].version;
+int prime_bundle_cache(int bundle_number,char *sid_prefix_hex,
+		       char *servald_server, char *credential)
+{
+  return bundle_cache_load(bundle_number,sid_prefix_hex,servald_server,credential,0);
+}
 
-    if (0)
-      fprintf(stderr,"Cached manifest and body for %s\n",
-	      bundles[bundle_number].bid_hex);
-  }
-  
-  return 0;
+// As prime_bundle_cache(), but waits for servald even in threaded mode
+int prime_bundle_cache_now(int bundle_number,char *sid_prefix_hex,
+			   char *servald_server, char *credential)
+{
+  return bundle_cache_load(bundle_number,sid_prefix_hex,servald_server,credential,1);
 }
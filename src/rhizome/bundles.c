@@ -45,44 +45,50 @@ extern char *my_sid_hex;
 #include "lbard.h"
 
 #define MAX_SENDERS 16384
-char *senders[MAX_SENDERS];
+// Interned SIDs of the senders, each bound (ID_SENDER) to its index here
+int senders[MAX_SENDERS];
 char *sender_names[MAX_SENDERS];
 int sender_count=0;
 
+static int sender_by_id(int sender_id)
+{
+  int i=id_bound(sender_id,ID_SENDER);
+  if ((i<0)||(i>=sender_count)||(senders[i]!=sender_id)) return -1;
+  return i;
+}
+
 char *find_sender_name(char *sender)
 {
-  // XXX - Linear search! Will be very slow with many senders.
-  // XXX - Replace with more efficient search strategy.
-  for(int i=0;i<sender_count;i++)
-    if (!strcasecmp(sender,senders[i]))
-      return sender_names[i];
-  return "";
+  int i=sender_by_id(id_find_hex(sender,32));
+  if (i<0) return "";
+  return sender_names[i];
 }
 
 int register_sender(char *sender,char *feedname)
 {
-  // XXX - See above: Replace with more efficiently searchable list format.
-  int i;
-  for(i=0;i<sender_count;i++) {
-    if (!strcasecmp(sender,senders[i])) {
-      // It is this sender
-      if (strcmp(sender_names[i],feedname)) {
-	free(sender_names[i]); sender_names[i]=strdup(feedname);
-      }
-      return 0;
+  int i=sender_by_id(id_find_hex(sender,32));
+  if (i>=0) {
+    // It is this sender
+    if (strcmp(sender_names[i],feedname)) {
+      free(sender_names[i]); sender_names[i]=strdup(feedname);
     }
+    return 0;
   }
-  if (i>=MAX_SENDERS) {
+  // (held for as long as we remember the sender)
+  int sender_id=id_intern_hex(sender,32);
+  if (!sender_id) return -1;
+  if (sender_count>=MAX_SENDERS) {
     // Too many senders.  Random replace.
     i=random()%MAX_SENDERS;
-    free(senders[i]); free(sender_names[i]);
-    senders[i]=strdup(sender);
-    sender_names[i]=strdup(feedname);
-    return 0;
-  }
+    id_bind(senders[i],ID_SENDER,-1);
+    id_release(senders[i]);
+    free(sender_names[i]);
+  } else
+    i=sender_count++;
 
-  senders[sender_count]=strdup(sender);
-  sender_names[sender_count++]=strdup(feedname);
+  senders[i]=sender_id;
+  sender_names[i]=strdup(feedname);
+  id_bind(sender_id,ID_SENDER,i);
 
   return 0;
 }
@@ -102,6 +108,28 @@ struct bundle_record bundles[MAX_BUNDLES];
 int bundle_count=0;
 int ignored_bundles=0;
 
+// The bundle we hold with this interned BID, or BID prefix, or -1
+int bundle_by_id(int bid_id)
+{
+  int b=id_bound(bid_id,ID_BUNDLE);
+  if ((b<0)||(b>=bundle_count)) return -1;
+  // (Bundles are dropped and replaced without unbinding their IDs)
+  if ((bundles[b].bid_id!=bid_id)&&(bundles[b].bid_prefix_id!=bid_id)) return -1;
+  return b;
+}
+
+// For a hex BID prefix of any length
+int bundle_by_bid_prefix_hex(char *bid_prefix)
+{
+  int len=strlen(bid_prefix)/2;
+  if ((len==ID_BID_PREFIX_BYTES)||(len==32))
+    return bundle_by_id(id_find_hex(bid_prefix,len));
+  unsigned char bin[32];
+  if ((len<1)||(len>32)) return -1;
+  for(int i=0;i<len;i++) bin[i]=hex_byte_value(&bid_prefix[i*2]);
+  return lookup_bundle_by_prefix(bin,len);
+}
+
 int register_bundle(char *service,
 		    char *bid,
 		    char *version,
@@ -168,35 +196,23 @@ int register_bundle(char *service,
     return 0;
   }
   
+  // (The IDs are only interned if the bundle is new to us, see below)
+  int bid_id=id_find_hex(bid,32);
+  int bid_prefix_id=id_find_hex(bid,ID_BID_PREFIX_BYTES);
+
   // Remove bundle from partial lists of all peers if we have other transmissions
   // to us in progress of this bundle
-  // XXX - Linear searches! Replace with hash table etc
-  for(i=0;i<MAX_BUNDLES_IN_FLIGHT;i++) {
-    if (partials[i].bid_prefix) {
-      // Here is a bundle in flight
-      char *bid_prefix=partials[i].bid_prefix;
-      long long bid_version=partials[i].bundle_version;
-      
-      if (versionll>=bid_version)
-	if (!strncasecmp(bid,bid_prefix,strlen(bid_prefix)))
-	  {
-	    fprintf(stderr,"--- Culling in-progress transfer for bundle that has shown up in Rhizome.\n");
-	    clear_partial(&partials[i]);
-	    break;
-	  }
+  for(i=0;bid_prefix_id&&(i<MAX_BUNDLES_IN_FLIGHT);i++) {
+    if ((partials[i].bid_id==bid_prefix_id)
+	&&(versionll>=partials[i].bundle_version)) {
+      fprintf(stderr,"--- Culling in-progress transfer for bundle that has shown up in Rhizome.\n");
+      clear_partial(&partials[i]);
+      break;
     }
   }
   
-  // XXX - Linear search through bundles!
-  // Use a hash table or something so that it doesn't cost O(n^2) with number
-  // of bundles.
-  int bundle_number=bundle_count;
-  for(i=0;i<bundle_count;i++) {
-    if (!strcmp(bundles[i].bid_hex,bid)) {
-      // Updating an existing bundle
-      bundle_number=i; break;
-    }
-  }
+  int bundle_number=bundle_by_id(bid_id);
+  if (bundle_number<0) bundle_number=bundle_count;
 
   if (bundle_number>=MAX_BUNDLES) return -1;
   
@@ -215,23 +231,25 @@ int register_bundle(char *service,
     bundles[bundle_number].author=NULL;
     free(bundles[bundle_number].filehash);
     bundles[bundle_number].filehash=NULL;
-    free(bundles[bundle_number].sender);
-    bundles[bundle_number].sender=NULL;
-    free(bundles[bundle_number].recipient);
-    bundles[bundle_number].recipient=NULL;
 
     fprintf(stderr,">>> %s We have updated bundle %s/%lld\n",
 	    timestamp_str(),bid,versionll);
 
   } else {    
-    // New bundle
-    bundles[bundle_number].bid_hex=strdup(bid);
-    {
-      for(int i=0;i<32;i++) {
-	char hex[3]={bid[i*2+0],bid[i*2+1],0};
-	bundles[bundle_number].bid_bin[i]=strtoll(hex,NULL,16);
-      }
-    }
+    // New bundle, which holds its BID and BID prefix.  (The record may have
+    // been dropped by lowering bundle_count, as xferbench does.)
+    bid_id=id_intern_hex(bid,32);
+    if (!bid_id) return -1;
+    bid_prefix_id=id_prefix(bid_id,ID_BID_PREFIX_BYTES);
+    id_release(bundles[bundle_number].bid_id);
+    id_release(bundles[bundle_number].bid_prefix_id);
+    bundles[bundle_number].bid_id=bid_id;
+    bundles[bundle_number].bid_prefix_id=bid_prefix_id;
+    bundles[bundle_number].bid_hex=id_hex(bid_id);
+    bcopy(id_bin(bid_id),bundles[bundle_number].bid_bin,32);
+    // (A prefix shared with a bundle we already hold goes to the newer one)
+    id_bind(bid_id,ID_BUNDLE,bundle_number);
+    id_bind(bid_prefix_id,ID_BUNDLE,bundle_number);
     // Never announced
     bundles[bundle_number].last_offset_announced=0;
     bundles[bundle_number].last_version_of_manifest_announced=0;
@@ -256,13 +274,27 @@ int register_bundle(char *service,
   bundles[bundle_number].originated_here_p=atoi(originated_here);
   bundles[bundle_number].length=length;
   bundles[bundle_number].filehash=strdup(filehash);
-  bundles[bundle_number].sender=strdup(sender);
-  bundles[bundle_number].recipient=strdup(recipient);
+  // (the new IDs are taken before the old are given back, as they are
+  // usually the same)
+  int sender_id=id_intern_hex(sender,32);
+  int recipient_id=id_intern_hex(recipient,32);
+  int recipient_prefix_id=id_prefix(recipient_id,ID_SID_PREFIX_BYTES);
+  id_release(bundles[bundle_number].sender_id);
+  id_release(bundles[bundle_number].recipient_id);
+  id_release(bundles[bundle_number].recipient_prefix_id);
+  bundles[bundle_number].sender_id=sender_id;
+  bundles[bundle_number].sender=id_hex(sender_id);
+  bundles[bundle_number].recipient_id=recipient_id;
+  bundles[bundle_number].recipient=id_hex(recipient_id);
+  bundles[bundle_number].recipient_prefix_id=recipient_prefix_id;
   bundles[bundle_number].sync_key=bundle_sync_key;
   
   bundles[bundle_number].index=bundle_number;
   
   // Add bundle to the sync tree 
+  if (debug_sync)
+    printf("sync_add_key() inserting %02X%02X*\n",
+	   bundle_sync_key.key[0],bundle_sync_key.key[1]);
   sync_add_key(sync_state,&bundle_sync_key,&bundles[bundle_number]);
   if (debug_sync_keys) {
     char filename[1024];
@@ -302,17 +334,9 @@ int register_bundle(char *service,
 
 int we_have_this_bundle_or_newer(char *bid_prefix, long long version)
 {
-  int i;
-  for(i=0;i<bundle_count;i++) {
-    if (!strncasecmp(bundles[i].bid_hex,bid_prefix,strlen(bid_prefix))) {
-      // We have this bundle, but do we have this version?
-      if (bundles[i].version>=version) {
-	// Ok, we have this already
-	return 1;
-	break;
-      }
-    }
-  }
+  int i=bundle_by_bid_prefix_hex(bid_prefix);
+  // We have this bundle, but do we have this version?
+  if ((i>=0)&&(bundles[i].version>=version)) return 1;
   return 0;
 }
 
@@ -323,13 +347,8 @@ int we_have_this_bundle_or_newer(char *bid_prefix, long long version)
 // then use the recipient from there.
 char *bundle_recipient_if_known(char *bid_prefix)
 {
-  int i;
-  for(i=0;i<bundle_count;i++) {
-    if (!strncasecmp(bundles[i].bid_hex,bid_prefix,strlen(bid_prefix))) {
-      return bundles[i].recipient;
-    }
-  }
-
+  int i=bundle_by_bid_prefix_hex(bid_prefix);
+  if (i>=0) return bundles[i].recipient;
   return NULL;
 }
   
@@ -0,0 +1,281 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2018 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  The SIDs and BIDs we hear of, and the prefixes of them that go over the air,
+  used to be kept as hex strings, and compared with strcasecmp() in linear
+  searches on every piece we hear.  Now each is interned here once, as binary,
+  and everything else compares and looks up the handles.  Its hex is made
+  once, when it is interned, for the logs and the HTTP interface.
+
+  The handles index a table in chunks that never move, so that id_bin() and
+  id_hex() stay valid.  They are found by an open addressed hash table, kept
+  at most half full.  An ID and its prefixes are separate entries:
+  id_prefix() finds or makes the prefix of an ID.
+
+  We hear of far more IDs than we keep, so each handle is counted: whoever
+  gets one from id_intern() or id_prefix(), or keeps one with id_hold(),
+  gives it back with id_release(), and once nobody has it, its entry is
+  freed for the next ID to be interned.  Whatever is only looked up, such as
+  the sender of each piece we hear, uses id_find(), which counts nothing.
+
+  Each ID can have a value bound to it for each of a few uses (ID_BUNDLE and
+  so on), so that, e.g., the bundle with a given BID prefix is found with one
+  hash lookup.  Whoever binds a value must check it is still current when
+  they look it up, as records get replaced without unbinding.
+
+  Only the main loop may use this (see src/xfer/threads.c).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ids.h"
+
+#define ID_CHUNK_BITS 10
+#define ID_CHUNK (1<<ID_CHUNK_BITS)
+
+struct interned_id {
+  unsigned char bin[ID_MAX_BYTES];
+  int len;
+  char hex[ID_MAX_BYTES*2+1];
+  int bound[ID_BINDINGS];
+  // Holders of the handle, or if there are none, the next free handle
+  int refs;
+  int next_free;
+};
+
+static struct interned_id **id_chunks=NULL;
+static int id_chunk_count=0;
+// The next handle to give out (0 is no ID)
+static int id_next=1;
+// Handles given back, to give out again before new ones
+static int id_free=0;
+static int id_live=0;
+
+static int *id_table=NULL;
+static unsigned int id_table_mask=0;
+
+static struct interned_id *id_entry(int id)
+{
+  return &id_chunks[id>>ID_CHUNK_BITS][id&(ID_CHUNK-1)];
+}
+
+static unsigned int id_hash(unsigned char *bin,int len)
+{
+  // FNV-1a, so that prefixes of the same ID land apart
+  unsigned int h=2166136261U^len;
+  for(int i=0;i<len;i++) { h^=bin[i]; h*=16777619U; }
+  return h;
+}
+
+// Returns the handle, or 0 with *slot set to where it would go
+static int id_lookup(unsigned char *bin,int len,unsigned int *slot)
+{
+  unsigned int s=id_hash(bin,len)&id_table_mask;
+  while(id_table[s]) {
+    struct interned_id *e=id_entry(id_table[s]);
+    if ((e->len==len)&&(!memcmp(e->bin,bin,len))) return id_table[s];
+    s=(s+1)&id_table_mask;
+  }
+  *slot=s;
+  return 0;
+}
+
+static int id_grow_table(void)
+{
+  unsigned int size=id_table?(id_table_mask+1)*2:1024;
+  int *t=calloc(size,sizeof(int));
+  if (!t) return -1;
+  for(int id=1;id<id_next;id++) {
+    struct interned_id *e=id_entry(id);
+    if (!e->refs) continue;
+    unsigned int s=id_hash(e->bin,e->len)&(size-1);
+    while(t[s]) s=(s+1)&(size-1);
+    t[s]=id;
+  }
+  free(id_table);
+  id_table=t;
+  id_table_mask=size-1;
+  return 0;
+}
+
+// Returns the handle of the ID, or 0 if it has never been interned
+int id_find(unsigned char *bin,int len)
+{
+  unsigned int slot;
+  if ((len<1)||(len>ID_MAX_BYTES)||(!id_table)) return 0;
+  return id_lookup(bin,len,&slot);
+}
+
+/*
+  Returns the handle of the ID, interning it if need be, or 0 if it can't be.
+  The caller holds the handle until it calls id_release().
+*/
+int id_intern(unsigned char *bin,int len)
+{
+  if ((len<1)||(len>ID_MAX_BYTES)) return 0;
+  if ((!id_table)||((unsigned int)id_next*2>id_table_mask))
+    if (id_grow_table()) return 0;
+
+  unsigned int slot;
+  int id=id_lookup(bin,len,&slot);
+  if (id) return id_hold(id);
+
+  if (id_free) {
+    id=id_free;
+    id_free=id_entry(id)->next_free;
+  } else id=id_next;
+  if ((id>>ID_CHUNK_BITS)>=id_chunk_count) {
+    struct interned_id **c=realloc(id_chunks,(id_chunk_count+1)*sizeof(*c));
+    if (!c) return 0;
+    id_chunks=c;
+    id_chunks[id_chunk_count]=malloc(ID_CHUNK*sizeof(struct interned_id));
+    if (!id_chunks[id_chunk_count]) return 0;
+    id_chunk_count++;
+  }
+  if (id==id_next) id_next++;
+
+  struct interned_id *e=id_entry(id);
+  memcpy(e->bin,bin,len);
+  e->len=len;
+  for(int i=0;i<len;i++) snprintf(&e->hex[i*2],3,"%02X",bin[i]);
+  for(int i=0;i<ID_BINDINGS;i++) e->bound[i]=-1;
+  e->refs=1;
+  id_table[slot]=id;
+  id_live++;
+  return id;
+}
+
+// Keeps a handle we already have, e.g., from id_find(), until id_release()
+int id_hold(int id)
+{
+  if ((id<1)||(id>=id_next)||(!id_entry(id)->refs)) return 0;
+  id_entry(id)->refs++;
+  return id;
+}
+
+// Gives back a handle, freeing its entry if nobody else has it (0 is ignored)
+void id_release(int id)
+{
+  if ((id<1)||(id>=id_next)) return;
+  struct interned_id *e=id_entry(id);
+  if ((!e->refs)||(--e->refs)) return;
+
+  // Take it out of the hash table, moving up any entry after it that could
+  // not then be found past the gap
+  unsigned int s=id_hash(e->bin,e->len)&id_table_mask;
+  while(id_table[s]!=id) s=(s+1)&id_table_mask;
+  unsigned int next=s;
+  for(;;) {
+    next=(next+1)&id_table_mask;
+    if (!id_table[next]) break;
+    struct interned_id *n=id_entry(id_table[next]);
+    unsigned int home=id_hash(n->bin,n->len)&id_table_mask;
+    // (one whose home slot lies after the gap, cyclically, can stay)
+    if ((s<next)?((home>s)&&(home<=next)):((home>s)||(home<=next))) continue;
+    id_table[s]=id_table[next];
+    s=next;
+  }
+  id_table[s]=0;
+
+  e->next_free=id_free;
+  id_free=id;
+  id_live--;
+}
+
+// The first len bytes of hex, which need not be terminated there
+static int id_parse_hex(char *hex,int len,unsigned char *bin)
+{
+  if ((!hex)||(len<1)||(len>ID_MAX_BYTES)) return -1;
+  for(int i=0;i<len*2;i++) {
+    int c=hex[i],v;
+    if ((c>='0')&&(c<='9')) v=c-'0';
+    else if ((c>='A')&&(c<='F')) v=c-'A'+10;
+    else if ((c>='a')&&(c<='f')) v=c-'a'+10;
+    else return -1;
+    if (i&1) bin[i>>1]|=v; else bin[i>>1]=v<<4;
+  }
+  return 0;
+}
+
+// Interns the first len bytes of a hex ID, or returns 0 if there aren't that many
+int id_intern_hex(char *hex,int len)
+{
+  unsigned char bin[ID_MAX_BYTES];
+  if (id_parse_hex(hex,len,bin)) return 0;
+  return id_intern(bin,len);
+}
+
+int id_find_hex(char *hex,int len)
+{
+  unsigned char bin[ID_MAX_BYTES];
+  if (id_parse_hex(hex,len,bin)) return 0;
+  return id_find(bin,len);
+}
+
+// The handle of the first len bytes of an ID, which the caller holds as for id_intern()
+int id_prefix(int id,int len)
+{
+  if ((id<1)||(id>=id_next)) return 0;
+  struct interned_id *e=id_entry(id);
+  if (len>=e->len) return id_hold(id);
+  return id_intern(e->bin,len);
+}
+
+int id_len(int id)
+{
+  if ((id<1)||(id>=id_next)) return 0;
+  return id_entry(id)->len;
+}
+
+unsigned char *id_bin(int id)
+{
+  static unsigned char none[ID_MAX_BYTES];
+  if ((id<1)||(id>=id_next)) return none;
+  return id_entry(id)->bin;
+}
+
+// Upper case hex, or an empty string for no ID
+char *id_hex(int id)
+{
+  if ((id<1)||(id>=id_next)) return "";
+  return id_entry(id)->hex;
+}
+
+int id_bind(int id,int binding,int value)
+{
+  if ((id<1)||(id>=id_next)||(binding<0)||(binding>=ID_BINDINGS)) return -1;
+  id_entry(id)->bound[binding]=value;
+  return 0;
+}
+
+// The value bound to the ID, or -1 if none
+int id_bound(int id,int binding)
+{
+  if ((id<1)||(id>=id_next)||(binding<0)||(binding>=ID_BINDINGS)) return -1;
+  return id_entry(id)->bound[binding];
+}
+
+// The IDs held by anyone
+int id_count(void)
+{
+  return id_live;
+}
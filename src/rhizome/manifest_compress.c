@@ -37,6 +37,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <assert.h>
+#include <sys/time.h>
 
 #include "sync.h"
 #include "lbard.h"
@@ -45,6 +46,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #ifdef TEST
 // Only present to satisfy the timestamp_str() function
 char *my_sid_hex="NOT VALID";
+unsigned int option_flags=0;
+// The corpus benchmark encodes thousands of manifests, so it turns this off
+int manifest_test_verbose=1;
 #endif
 
 // Table of fields and transformations
@@ -103,7 +107,7 @@ int field_encode(int field_number,unsigned char *key,unsigned char *value,
     if (fields[field_number].int_bytes==0xff) {
       // Variable length encoding: 7-bits per byte has
       // value. MSB set indicates another bit follows
-      long long v=strtoll((char *)value,NULL,10);
+      unsigned long long v=strtoll((char *)value,NULL,10);
       do {
 	bin_out[offset]=v&0x7f;
 	v=v>>7;
@@ -218,8 +222,8 @@ int field_decode(int field_number,unsigned char *bin_in,int *in_offset,
   for tokens except at the start of lines, so that values can contain
   UTF-8 encoding.
  */
-int manifest_binary_to_text(unsigned char *bin_in, int len_in,
-			    unsigned char *text_out, int *len_out)
+static int manifest_binary_to_text_v1(unsigned char *bin_in, int len_in,
+				      unsigned char *text_out, int *len_out)
 {
   int offset=0;
   int out_offset=0;
@@ -274,8 +278,8 @@ int manifest_binary_to_text(unsigned char *bin_in, int len_in,
 
 // Produce a more compact manifest representation
 // XXX - doesn't currently compress free-text fields
-int manifest_text_to_binary(unsigned char *text_in, int len_in,
-			    unsigned char *bin_out, int *len_out)
+static int manifest_text_to_binary_v1(unsigned char *text_in, int len_in,
+				      unsigned char *bin_out, int *len_out)
 {
   // Manifests must be <1KB
   if (len_in>1024) return -1;
@@ -324,24 +328,24 @@ int manifest_text_to_binary(unsigned char *text_in, int len_in,
   }
 
 #ifdef TEST
-  {
+  if (manifest_test_verbose) {
     FILE *f=fopen("test.bmanifest","w");
     fwrite(bin_out,out_offset,1,f);
     fclose(f);
-  }
 
-  printf("Text input length = %d, binary version length = %d\n",
-	 len_in,out_offset);
+    printf("Text input length = %d, binary version length = %d\n",
+	   len_in,out_offset);
+  }
 #endif
 
   // Now verify that we can decode it correctly (otherwise signatures will
   // fail)
   unsigned char verify_out[1024];
   int verify_length=0;
-  manifest_binary_to_text(bin_out,out_offset,verify_out,&verify_length);
+  manifest_binary_to_text_v1(bin_out,out_offset,verify_out,&verify_length);
 
 #ifdef TEST
-  {
+  if (manifest_test_verbose) {
     FILE *f=fopen("verify.manifest","w");
     fwrite(verify_out,verify_length,1,f);
     fclose(f);
@@ -352,9 +356,11 @@ int manifest_text_to_binary(unsigned char *text_in, int len_in,
   if ((verify_length!=len_in)
       ||bcmp(text_in,verify_out,len_in)) {
 #ifdef TEST
-    printf("Verify error with binary manifest: reverting to plain text.\n");
-    printf("  decoded to %d bytes (should be %d)\n",
-	   verify_length,len_in);
+    if (manifest_test_verbose) {
+      printf("Verify error with binary manifest: reverting to plain text.\n");
+      printf("  decoded to %d bytes (should be %d)\n",
+	     verify_length,len_in);
+    }
 #endif
     bcopy(text_in,bin_out,len_in);
     *len_out=len_in;
@@ -367,12 +373,750 @@ int manifest_text_to_binary(unsigned char *text_in, int len_in,
 
 }
 
+/*
+  Second generation manifest encoding.
+
+  The first byte is MANIFEST_CODEC_V2, which can never begin a plain text or
+  first generation binary manifest, so the receiver can tell which decoder to
+  use.  Senders fall back to the first generation encoding if the second
+  generation one is not smaller, and flags=16 turns it off altogether while
+  peers still run versions of lbard that cannot decode it.
+
+  The text part is a sequence of lines, each introduced by a token byte, and
+  each ending in an implied newline.  The low five bits of a token select an
+  entry in the field dictionary below, and the top three bits say how its
+  value is encoded:
+
+    MV2_PLAIN     hex as bytes, numbers as varints, enums as an index.
+    MV2_RELATIVE  hex: one byte naming an earlier hex value that is the same;
+                  numbers: a zig-zag varint difference from the previous
+                  number (a bundle's version is very often its date).
+    MV2_TEXT      the value as Huffman coded text.
+
+  Lines that are not in the dictionary are sent with the MV2_LINE token,
+  Huffman coded whole.  Huffman coded text is a varint character count
+  followed by the code bits, padded to a whole byte.  The code is static: it
+  is built the same way at both ends from the character frequencies of
+  typical manifest text, so nothing about it goes over the air.
+
+  A zero token ends the text, and is followed by a byte that describes the
+  signature block:
+
+    MV2_SIG_NONE      there is no signature block.
+    MV2_SIG_VERBATIM  the rest of the encoding is the signature block, less
+                      its leading zero byte.
+    MV2_SIG_SELF      the block starts with a signature by the bundle's own
+                      key, whose public key is therefore the id field: only
+                      the 64 signature bytes are sent.  Anything after it is
+                      copied verbatim.
+*/
+#define MANIFEST_CODEC_V2 0x02
+
+#define MV2_PLAIN 0x00
+#define MV2_RELATIVE 0x20
+#define MV2_TEXT 0x40
+#define MV2_VARIANT_MASK 0xe0
+#define MV2_FIELD_MASK 0x1f
+#define MV2_END 0x00
+#define MV2_LINE 0x1f
+
+#define MV2_SIG_NONE 0
+#define MV2_SIG_VERBATIM 1
+#define MV2_SIG_SELF 2
+// Rhizome signature block entry: type, 64 byte signature, 32 byte public key
+#define MV2_SIGNATURE_TYPE 0x17
+#define MV2_SIGNATURE_BYTES 64
+
+#define MV2_MAX_HEX_VALUES 16
+#define MV2_MAX_CODE_LEN 24
+
+struct manifest_field_v2 {
+  char *name;
+  unsigned char hex_bytes; // 0 = non-hex
+  unsigned char is_number;
+  char *enum_options; // (CASE SENSITIVE, and ends with a comma)
+};
+
+// The position in this table is the token, so entries may only be appended,
+// and there may be no more than 30 of them.
+struct manifest_field_v2 fields_v2[]={
+  {NULL,0,0,NULL}, // MV2_END
+  {"id",0x20,0,NULL},
+  {"version",0,1,NULL},
+  {"filesize",0,1,NULL},
+  {"filehash",0x40,0,NULL},
+  {"service",0,0,"file,MeshMS1,MeshMS2,MeshMB1,"},
+  {"date",0,1,NULL},
+  {"name",0,0,NULL},
+  {"sender",0x20,0,NULL},
+  {"recipient",0x20,0,NULL},
+  {"BK",0x20,0,NULL},
+  {"crypt",0,1,NULL},
+  {"tail",0,1,NULL},
+};
+#define MV2_FIELD_COUNT ((int)(sizeof(fields_v2)/sizeof(fields_v2[0])))
+
+/*
+  Sample of the manifest text that the field dictionary does not already
+  cover: file names and MeshMB feed names, mostly.  Its character counts set
+  the Huffman code lengths.  Changing it changes the code, so, like the field
+  table, it is part of the wire format.
+*/
+static char *manifest_text_training=
+  "IMG_20180315_104512.jpg\nphoto.jpg\nServal Mesh.apk\nmap of the area.pdf\n"
+  "notes.txt\nreport-2018-03-15.doc\nWeather forecast\nVillage health clinic\n"
+  "radio_log.txt\nDCIM_0042.JPG\nemergency contacts.txt\nwater supply.png\n"
+  "Red Cross field team\nsituation report.pdf\nmeeting notes 2018-04-02.txt\n"
+  "recording_20180402_0930.amr\nvideo.mp4\nsurvey results.csv\nupdate.zip\n"
+  "shelter locations.kml\nPort Vila\nteam status\nmessage from base camp\n"
+  "author=\nmanifestversion=\nkeywords=\ncomment=\nmime-type=\n";
+
+static unsigned int mv2_code[256];
+static unsigned char mv2_code_len[256];
+static unsigned int mv2_first_code[MV2_MAX_CODE_LEN+1];
+static int mv2_first_symbol[MV2_MAX_CODE_LEN+1];
+static int mv2_length_count[MV2_MAX_CODE_LEN+1];
+static unsigned char mv2_symbols[256];
+static int mv2_code_ready=0;
+
+// Plain Huffman construction, which is fine as it only runs once.
+// Returns the longest code length.
+static int mv2_code_lengths(unsigned int *weight)
+{
+  unsigned int node_weight[512];
+  int parent[512];
+  unsigned char live[512];
+  int nodes=256;
+  for(int i=0;i<256;i++) { node_weight[i]=weight[i]; parent[i]=-1; live[i]=1; }
+  for(int merge=0;merge<255;merge++) {
+    int a=-1,b=-1;
+    for(int n=0;n<nodes;n++) {
+      if (!live[n]) continue;
+      if (a<0||node_weight[n]<node_weight[a]) { b=a; a=n; }
+      else if (b<0||node_weight[n]<node_weight[b]) b=n;
+    }
+    node_weight[nodes]=node_weight[a]+node_weight[b];
+    parent[nodes]=-1; live[nodes]=1;
+    parent[a]=nodes; parent[b]=nodes;
+    live[a]=0; live[b]=0;
+    nodes++;
+  }
+  int longest=0;
+  for(int s=0;s<256;s++) {
+    int len=0;
+    for(int n=s;parent[n]>=0;n=parent[n]) len++;
+    mv2_code_len[s]=len;
+    if (len>longest) longest=len;
+  }
+  return longest;
+}
+
+static void mv2_build_code(void)
+{
+  // Every byte value must have a code, so that any text can be encoded.
+  unsigned int weight[256];
+  for(int i=0;i<256;i++) weight[i]=1;
+  for(int i=0;manifest_text_training[i];i++)
+    weight[(unsigned char)manifest_text_training[i]]+=16;
+  // Flatten the weights until no code is too long for the decoder
+  while(mv2_code_lengths(weight)>MV2_MAX_CODE_LEN)
+    for(int i=0;i<256;i++) weight[i]=(weight[i]>>1)+1;
+
+  // Assign canonical codes: shorter codes first, then in order of byte value
+  unsigned int code=0;
+  int symbol=0;
+  for(int len=1;len<=MV2_MAX_CODE_LEN;len++) {
+    mv2_first_code[len]=code;
+    mv2_first_symbol[len]=symbol;
+    mv2_length_count[len]=0;
+    for(int s=0;s<256;s++)
+      if (mv2_code_len[s]==len) {
+	mv2_code[s]=code++;
+	mv2_symbols[symbol++]=s;
+	mv2_length_count[len]++;
+      }
+    code<<=1;
+  }
+  mv2_code_ready=1;
+}
+
+static int mv2_varint_len(unsigned long long v)
+{
+  int len=1;
+  while(v>>=7) len++;
+  return len;
+}
+
+static int mv2_put_varint(unsigned char *out,int *offset,int limit,unsigned long long v)
+{
+  do {
+    if (*offset>=limit) return -1;
+    out[*offset]=v&0x7f;
+    v=v>>7;
+    if (v) out[*offset]|=0x80;
+    (*offset)++;
+  } while(v);
+  return 0;
+}
+
+static int mv2_get_varint(unsigned char *in,int *offset,int len_in,unsigned long long *v)
+{
+  *v=0;
+  for(int shift=0;shift<64;shift+=7) {
+    if (*offset>=len_in) return -1;
+    int b=in[(*offset)++];
+    *v|=((unsigned long long)(b&0x7f))<<shift;
+    if (!(b&0x80)) return 0;
+  }
+  return -1;
+}
+
+static int mv2_put_text(unsigned char *out,int *offset,int limit,
+			unsigned char *text,int len)
+{
+  if (mv2_put_varint(out,offset,limit,len)) return -1;
+  int o=*offset;
+  unsigned long long bits=0;
+  int bit_count=0;
+  for(int i=0;i<len;i++) {
+    bits=(bits<<mv2_code_len[text[i]])|mv2_code[text[i]];
+    bit_count+=mv2_code_len[text[i]];
+    while(bit_count>=8) {
+      if (o>=limit) return -1;
+      out[o++]=bits>>(bit_count-8);
+      bit_count-=8;
+    }
+    bits&=(1<<bit_count)-1;
+  }
+  if (bit_count) {
+    if (o>=limit) return -1;
+    out[o++]=bits<<(8-bit_count);
+  }
+  *offset=o;
+  return 0;
+}
+
+static int mv2_get_text(unsigned char *in,int *offset,int len_in,
+			unsigned char *text_out,int *out_offset,int out_limit)
+{
+  unsigned long long count;
+  if (mv2_get_varint(in,offset,len_in,&count)) return -1;
+  if (count>(unsigned long long)(out_limit-*out_offset)) return -1;
+  int o=*offset;
+  int bit=0;
+  for(unsigned long long n=0;n<count;n++) {
+    unsigned int code=0;
+    int len;
+    for(len=1;len<=MV2_MAX_CODE_LEN;len++) {
+      if (o>=len_in) return -1;
+      code=(code<<1)|((in[o]>>(7-bit))&1);
+      if (++bit==8) { bit=0; o++; }
+      if (code-mv2_first_code[len]<(unsigned int)mv2_length_count[len]) break;
+    }
+    if (len>MV2_MAX_CODE_LEN) return -1;
+    text_out[(*out_offset)++]=mv2_symbols[mv2_first_symbol[len]+code-mv2_first_code[len]];
+  }
+  if (bit) o++;
+  *offset=o;
+  return 0;
+}
+
+static int mv2_hex_value(int c)
+{
+  // Only upper case survives the trip, as the decoder writes upper case
+  if ((c>='0')&&(c<='9')) return c-'0';
+  if ((c>='A')&&(c<='F')) return c-'A'+10;
+  return -1;
+}
+
+static int mv2_is_hex(unsigned char *value,int value_len,int hex_bytes)
+{
+  if (value_len!=hex_bytes*2) return 0;
+  for(int i=0;i<value_len;i++) if (mv2_hex_value(value[i])<0) return 0;
+  return 1;
+}
+
+static int mv2_enum_option(char *options,unsigned char *value,int value_len)
+{
+  int option_number=0;
+  char *option=options;
+  for(char *o=options;*o;o++)
+    if (*o==',') {
+      if ((o-option==value_len)&&!strncmp(option,(char *)value,value_len))
+	return option_number;
+      option=o+1;
+      option_number++;
+    }
+  return -1;
+}
+
+/*
+  Encode one dictionary field's value, choosing the shortest applicable
+  form, and falling back to Huffman coded text.
+*/
+static int mv2_encode_value(int f,unsigned char *value,int value_len,
+			    unsigned char *hex_values[],int *hex_value_count,
+			    long long *previous_number,
+			    unsigned char *bin_out,int *out_offset,int limit)
+{
+  if (fields_v2[f].hex_bytes) {
+    if (mv2_is_hex(value,value_len,fields_v2[f].hex_bytes)) {
+      for(int i=0;i<*hex_value_count;i++)
+	if (!strncmp((char *)hex_values[i],(char *)value,value_len)
+	    &&hex_values[i][value_len]=='\n') {
+	  if (*out_offset+2>limit) return -1;
+	  bin_out[(*out_offset)++]=MV2_RELATIVE|f;
+	  bin_out[(*out_offset)++]=i;
+	  return 0;
+	}
+      if (*hex_value_count<MV2_MAX_HEX_VALUES) hex_values[(*hex_value_count)++]=value;
+      if (*out_offset+1+fields_v2[f].hex_bytes>limit) return -1;
+      bin_out[(*out_offset)++]=MV2_PLAIN|f;
+      for(int i=0;i<fields_v2[f].hex_bytes;i++)
+	bin_out[(*out_offset)++]=(mv2_hex_value(value[i*2])<<4)|mv2_hex_value(value[i*2+1]);
+      return 0;
+    }
+  } else if (fields_v2[f].is_number&&value_len>0&&value_len<20) {
+    // Only numbers that print back exactly the same can be encoded as such
+    char number[32];
+    long long v=strtoll((char *)value,NULL,10);
+    if ((v>=0)&&(snprintf(number,sizeof(number),"%lld",v)==value_len)
+	&&!strncmp(number,(char *)value,value_len)) {
+      long long delta=v-*previous_number;
+      unsigned long long zigzag=delta<0?((~(unsigned long long)delta)<<1)|1:((unsigned long long)delta)<<1;
+      *previous_number=v;
+      if (mv2_varint_len(zigzag)<mv2_varint_len(v)) {
+	if (*out_offset>=limit) return -1;
+	bin_out[(*out_offset)++]=MV2_RELATIVE|f;
+	return mv2_put_varint(bin_out,out_offset,limit,zigzag);
+      }
+      if (*out_offset>=limit) return -1;
+      bin_out[(*out_offset)++]=MV2_PLAIN|f;
+      return mv2_put_varint(bin_out,out_offset,limit,v);
+    }
+  } else if (fields_v2[f].enum_options) {
+    int option=mv2_enum_option(fields_v2[f].enum_options,value,value_len);
+    if (option>=0) {
+      if (*out_offset+2>limit) return -1;
+      bin_out[(*out_offset)++]=MV2_PLAIN|f;
+      bin_out[(*out_offset)++]=option;
+      return 0;
+    }
+  }
+  if (*out_offset>=limit) return -1;
+  bin_out[(*out_offset)++]=MV2_TEXT|f;
+  return mv2_put_text(bin_out,out_offset,limit,value,value_len);
+}
+
+static int manifest_binary_to_text_v2(unsigned char *bin_in, int len_in,
+				      unsigned char *text_out, int *len_out)
+{
+  if (!mv2_code_ready) mv2_build_code();
+  int offset=1;
+  int out_offset=0;
+  int limit=1024;
+  // Where each hex value that might be referred to again begins in text_out
+  int hex_values[MV2_MAX_HEX_VALUES];
+  int hex_value_count=0;
+  long long previous_number=0;
+  int id_value=-1;
+
+  while(1) {
+    if (offset>=len_in) return -1;
+    int token=bin_in[offset++];
+    if (token==MV2_END) break;
+    int f=token&MV2_FIELD_MASK;
+    int variant=token&MV2_VARIANT_MASK;
+
+    if (f==MV2_LINE) {
+      if (variant!=MV2_PLAIN) return -1;
+      if (mv2_get_text(bin_in,&offset,len_in,text_out,&out_offset,limit-1)) return -1;
+      text_out[out_offset++]='\n';
+      continue;
+    }
+    if ((f==MV2_END)||(f>=MV2_FIELD_COUNT)) return -1;
+
+    int name_len=strlen(fields_v2[f].name);
+    if (out_offset+name_len+1+fields_v2[f].hex_bytes*2+1>limit) return -1;
+    bcopy(fields_v2[f].name,&text_out[out_offset],name_len);
+    out_offset+=name_len;
+    text_out[out_offset++]='=';
+    int value_start=out_offset;
+
+    if (variant==MV2_TEXT) {
+      if (mv2_get_text(bin_in,&offset,len_in,text_out,&out_offset,limit-1)) return -1;
+    } else if (fields_v2[f].hex_bytes) {
+      if (variant==MV2_RELATIVE) {
+	if (offset>=len_in) return -1;
+	int earlier=bin_in[offset++];
+	if (earlier>=hex_value_count) return -1;
+	bcopy(&text_out[hex_values[earlier]],&text_out[out_offset],fields_v2[f].hex_bytes*2);
+	out_offset+=fields_v2[f].hex_bytes*2;
+      } else if (variant==MV2_PLAIN) {
+	if (offset+fields_v2[f].hex_bytes>len_in) return -1;
+	if (hex_value_count<MV2_MAX_HEX_VALUES) hex_values[hex_value_count++]=value_start;
+	for(int i=0;i<fields_v2[f].hex_bytes;i++) {
+	  int v=bin_in[offset++];
+	  text_out[out_offset++]=hextochar(v>>4);
+	  text_out[out_offset++]=hextochar(v&0xf);
+	}
+      } else return -1;
+      if (f==1) id_value=value_start;
+    } else if (fields_v2[f].is_number) {
+      unsigned long long v;
+      if (variant!=MV2_PLAIN&&variant!=MV2_RELATIVE) return -1;
+      if (mv2_get_varint(bin_in,&offset,len_in,&v)) return -1;
+      if (variant==MV2_RELATIVE)
+	v=previous_number+((v&1)?~(v>>1):(v>>1));
+      previous_number=v;
+      char number[32];
+      int number_len=snprintf(number,sizeof(number),"%lld",(long long)v);
+      if (out_offset+number_len+1>limit) return -1;
+      bcopy(number,&text_out[out_offset],number_len);
+      out_offset+=number_len;
+    } else if (fields_v2[f].enum_options) {
+      if (variant!=MV2_PLAIN||offset>=len_in) return -1;
+      int selected_option=bin_in[offset++];
+      char *option=fields_v2[f].enum_options;
+      for(int i=0;i<selected_option&&option;i++) {
+	option=strchr(option,',');
+	if (option) option++;
+      }
+      if (!option||!*option) return -1;
+      int option_len=strchr(option,',')-option;
+      if (out_offset+option_len+1>limit) return -1;
+      bcopy(option,&text_out[out_offset],option_len);
+      out_offset+=option_len;
+    } else return -1;
+    text_out[out_offset++]='\n';
+  }
+
+  // Now the signature block
+  if (offset>=len_in) return -1;
+  int signature_form=bin_in[offset++];
+  if (signature_form==MV2_SIG_NONE) {
+    if (offset!=len_in) return -1;
+  } else {
+    if (out_offset>=limit) return -1;
+    text_out[out_offset++]=0x00;
+    if (signature_form==MV2_SIG_SELF) {
+      if (id_value<0) return -1;
+      if (offset+MV2_SIGNATURE_BYTES>len_in) return -1;
+      if (out_offset+1+MV2_SIGNATURE_BYTES+32>limit) return -1;
+      text_out[out_offset++]=MV2_SIGNATURE_TYPE;
+      bcopy(&bin_in[offset],&text_out[out_offset],MV2_SIGNATURE_BYTES);
+      offset+=MV2_SIGNATURE_BYTES;
+      out_offset+=MV2_SIGNATURE_BYTES;
+      for(int i=0;i<32;i++)
+	text_out[out_offset++]=(mv2_hex_value(text_out[id_value+i*2])<<4)
+	  |mv2_hex_value(text_out[id_value+i*2+1]);
+    } else if (signature_form!=MV2_SIG_VERBATIM) return -1;
+    if (out_offset+len_in-offset>limit) return -1;
+    bcopy(&bin_in[offset],&text_out[out_offset],len_in-offset);
+    out_offset+=len_in-offset;
+  }
+
+  *len_out=out_offset;
+  return 0;
+}
+
+static int manifest_text_to_binary_v2(unsigned char *text_in, int len_in,
+				      unsigned char *bin_out, int *len_out)
+{
+  if (!mv2_code_ready) mv2_build_code();
+  if (len_in>1024) return -1;
+  int limit=1024;
+  int out_offset=0;
+  unsigned char *hex_values[MV2_MAX_HEX_VALUES];
+  int hex_value_count=0;
+  long long previous_number=0;
+  unsigned char *id_value=NULL;
+
+  bin_out[out_offset++]=MANIFEST_CODEC_V2;
+
+  // The text part ends at the zero byte that begins the signature block
+  unsigned char *text_end=memchr(text_in,0,len_in);
+  int text_len=text_end?text_end-text_in:len_in;
+  int offset=0;
+  while(offset<text_len) {
+    unsigned char *line_end=memchr(&text_in[offset],'\n',text_len-offset);
+    // A last line without a newline can't be represented
+    if (!line_end) return -1;
+    int line_len=line_end-&text_in[offset];
+    unsigned char *equals=memchr(&text_in[offset],'=',line_len);
+    int f=0;
+    if (equals) {
+      int key_len=equals-&text_in[offset];
+      for(f=1;f<MV2_FIELD_COUNT;f++)
+	if (((int)strlen(fields_v2[f].name)==key_len)
+	    &&!strncmp(fields_v2[f].name,(char *)&text_in[offset],key_len))
+	  break;
+      if (f==MV2_FIELD_COUNT) f=0;
+    }
+    if (f) {
+      unsigned char *value=equals+1;
+      int value_len=line_end-value;
+      // A valid id is always sent as hex, so the decoder will know it too
+      if ((f==1)&&mv2_is_hex(value,value_len,fields_v2[f].hex_bytes)) id_value=value;
+      if (mv2_encode_value(f,value,value_len,hex_values,&hex_value_count,
+			   &previous_number,bin_out,&out_offset,limit))
+	return -1;
+    } else {
+      if (out_offset>=limit) return -1;
+      bin_out[out_offset++]=MV2_LINE;
+      if (mv2_put_text(bin_out,&out_offset,limit,&text_in[offset],line_len)) return -1;
+    }
+    offset+=line_len+1;
+  }
+  if (out_offset>=limit) return -1;
+  bin_out[out_offset++]=MV2_END;
+
+  // Signature block
+  if (out_offset>=limit) return -1;
+  if (!text_end) bin_out[out_offset++]=MV2_SIG_NONE;
+  else {
+    offset=text_len+1;
+    int self_signed=0;
+    if (id_value&&(len_in-offset>=1+MV2_SIGNATURE_BYTES+32)
+	&&(text_in[offset]==MV2_SIGNATURE_TYPE)) {
+      self_signed=1;
+      unsigned char *key=&text_in[offset+1+MV2_SIGNATURE_BYTES];
+      for(int i=0;i<32;i++)
+	if (key[i]!=((mv2_hex_value(id_value[i*2])<<4)|mv2_hex_value(id_value[i*2+1])))
+	  self_signed=0;
+    }
+    if (self_signed) {
+      bin_out[out_offset++]=MV2_SIG_SELF;
+      if (out_offset+MV2_SIGNATURE_BYTES>limit) return -1;
+      bcopy(&text_in[offset+1],&bin_out[out_offset],MV2_SIGNATURE_BYTES);
+      out_offset+=MV2_SIGNATURE_BYTES;
+      offset+=1+MV2_SIGNATURE_BYTES+32;
+    } else
+      bin_out[out_offset++]=MV2_SIG_VERBATIM;
+    if (out_offset+len_in-offset>limit) return -1;
+    bcopy(&text_in[offset],&bin_out[out_offset],len_in-offset);
+    out_offset+=len_in-offset;
+  }
+
+  // As for the first generation encoding, make sure it decodes exactly,
+  // otherwise the signature will fail.
+  unsigned char verify_out[1024];
+  int verify_length=0;
+  if (manifest_binary_to_text_v2(bin_out,out_offset,verify_out,&verify_length)
+      ||(verify_length!=len_in)||bcmp(text_in,verify_out,len_in))
+    return -1;
+  *len_out=out_offset;
+  return 0;
+}
+
+/*
+  Decode either generation of binary manifest (or a plain text one).
+*/
+int manifest_binary_to_text(unsigned char *bin_in, int len_in,
+			    unsigned char *text_out, int *len_out)
+{
+  if ((len_in>0)&&(bin_in[0]==MANIFEST_CODEC_V2))
+    return manifest_binary_to_text_v2(bin_in,len_in,text_out,len_out);
+  return manifest_binary_to_text_v1(bin_in,len_in,text_out,len_out);
+}
+
+/*
+  Encode a manifest with whichever generation of encoding, up to
+  max_generation, is smaller.  Like the first generation encoder, on failure
+  it leaves the plain text in bin_out, and returns -1.
+*/
+int manifest_text_to_binary_generation(unsigned char *text_in, int len_in,
+				       unsigned char *bin_out, int *len_out,
+				       int max_generation)
+{
+  unsigned char v2_out[1024];
+  int v2_len=0;
+  int v2_failed=1;
+  if ((max_generation>=2)&&!(option_flags&FLAG_NO_MANIFEST_V2))
+    v2_failed=manifest_text_to_binary_v2(text_in,len_in,v2_out,&v2_len);
+  int r=manifest_text_to_binary_v1(text_in,len_in,bin_out,len_out);
+  if ((!v2_failed)&&(r||(v2_len<*len_out))) {
+    bcopy(v2_out,bin_out,v2_len);
+    *len_out=v2_len;
+    return 0;
+  }
+  return r;
+}
+
+int manifest_text_to_binary(unsigned char *text_in, int len_in,
+			    unsigned char *bin_out, int *len_out)
+{
+  return manifest_text_to_binary_generation(text_in,len_in,bin_out,len_out,2);
+}
+
 #ifdef TEST
+/*
+  Corpus benchmark: the size and speed of each generation of the encoding,
+  over either a directory of *.manifest files, or a synthetic corpus of
+  manifests laid out the way servald writes them, in roughly the mix of
+  bundles that lbard carries (mostly MeshMS conversations).
+*/
+#define CORPUS_MAX_MANIFESTS 100000
+
+struct corpus_manifest {
+  int len;
+  unsigned char text[1024];
+};
+
+static void corpus_hex(char *out,int bytes)
+{
+  for(int i=0;i<bytes;i++) snprintf(&out[i*2],3,"%02X",(unsigned char)random());
+}
+
+static int corpus_synthesise(int n,unsigned char *out)
+{
+  char id[65],sender[65],recipient[65],bk[65],filehash[129],name[64];
+  corpus_hex(id,32); corpus_hex(sender,32); corpus_hex(recipient,32);
+  corpus_hex(bk,32); corpus_hex(filehash,64);
+  long long date=1500000000000LL+((long long)random())*50LL;
+  long long tail=(random()%4)?0:random()%20000;
+  long long filesize=20+random()%(n%10<6?2000:200000);
+  int len;
+  switch(n%10) {
+  case 0: case 1: case 2: case 3: case 4: case 5:
+    // MeshMS2 conversation journal
+    len=snprintf((char *)out,1024,
+		 "service=MeshMS2\nsender=%s\nrecipient=%s\ntail=%lld\n"
+		 "filesize=%lld\nversion=%lld\nfilehash=%s\ndate=%lld\ncrypt=1\nid=%s\n",
+		 sender,recipient,tail,filesize,tail+filesize,filehash,date,id);
+    break;
+  case 6: case 7:
+    // MeshMB1 feed
+    snprintf(name,sizeof(name),"%s %ld",
+	     (n%3)?"Community notices":"Rescue coordination",random()%100);
+    len=snprintf((char *)out,1024,
+		 "service=MeshMB1\nname=%s\nsender=%s\ntail=%lld\nfilesize=%lld\n"
+		 "version=%lld\nfilehash=%s\ndate=%lld\ncrypt=0\nid=%s\n",
+		 name,sender,tail,filesize,tail+filesize,filehash,date,id);
+    break;
+  default:
+    // Plain file, with an extra field that the dictionary does not know
+    snprintf(name,sizeof(name),(n%3)?"DSC_%04ld.JPG":"field report %ld.txt",
+	     random()%10000);
+    len=snprintf((char *)out,1024,
+		 "service=file\nname=%s\ndate=%lld\nversion=%lld\nfilesize=%lld\n"
+		 "filehash=%s\nid=%s\nBK=%s\ncrypt=0\nauthor=%s\n",
+		 name,date,date,filesize,filehash,id,bk,sender);
+  }
+  // Signature block: one signature by the bundle's key
+  out[len++]=0x00;
+  out[len++]=MV2_SIGNATURE_TYPE;
+  for(int i=0;i<MV2_SIGNATURE_BYTES;i++) out[len++]=random();
+  for(int i=0;i<32;i++) out[len++]=(chartohex(id[i*2])<<4)|chartohex(id[i*2+1]);
+  return len;
+}
+
+static int corpus_load(char *directory,struct corpus_manifest *corpus)
+{
+  DIR *d=opendir(directory);
+  if (!d) return -1;
+  int count=0;
+  struct dirent *de;
+  while((de=readdir(d))&&count<CORPUS_MAX_MANIFESTS) {
+    int name_len=strlen(de->d_name);
+    if (name_len<9||strcmp(&de->d_name[name_len-9],".manifest")) continue;
+    char path[1024];
+    snprintf(path,sizeof(path),"%s/%s",directory,de->d_name);
+    FILE *f=fopen(path,"r");
+    if (!f) continue;
+    unsigned char text[2048];
+    int len=fread(text,1,sizeof(text),f);
+    fclose(f);
+    if (len<1||len>1024) continue;
+    bcopy(text,corpus[count].text,len);
+    corpus[count++].len=len;
+  }
+  closedir(d);
+  return count;
+}
+
+static double corpus_seconds(struct timeval *start)
+{
+  struct timeval now;
+  gettimeofday(&now,NULL);
+  return (now.tv_sec-start->tv_sec)+(now.tv_usec-start->tv_usec)/1000000.0;
+}
+
+static void corpus_measure(char *label,
+			   int (*encode)(unsigned char *,int,unsigned char *,int *),
+			   struct corpus_manifest *corpus,int count,long long text_bytes)
+{
+  static unsigned char encoded[CORPUS_MAX_MANIFESTS][1024];
+  static int encoded_len[CORPUS_MAX_MANIFESTS];
+  int passes=1+500000/count;
+  long long encoded_bytes=0;
+  int unencoded=0,mismatches=0;
+  struct timeval start;
+
+  gettimeofday(&start,NULL);
+  for(int pass=0;pass<passes;pass++)
+    for(int i=0;i<count;i++)
+      if (encode(corpus[i].text,corpus[i].len,encoded[i],&encoded_len[i])) {
+	// Sent as plain text
+	bcopy(corpus[i].text,encoded[i],corpus[i].len);
+	encoded_len[i]=corpus[i].len;
+	if (!pass) unencoded++;
+      }
+  double encode_seconds=corpus_seconds(&start);
+
+  unsigned char text[1024];
+  int text_len=0;
+  gettimeofday(&start,NULL);
+  for(int pass=0;pass<passes;pass++)
+    for(int i=0;i<count;i++)
+      if (manifest_binary_to_text(encoded[i],encoded_len[i],text,&text_len)
+	  ||(!pass&&(text_len!=corpus[i].len||bcmp(text,corpus[i].text,text_len))))
+	if (!pass) mismatches++;
+  double decode_seconds=corpus_seconds(&start);
+
+  for(int i=0;i<count;i++) encoded_bytes+=encoded_len[i];
+  printf("%-8s %12lld %7.3f %8.1f %10d %10d %11.1f %11.1f\n",
+	 label,encoded_bytes,encoded_bytes*1.0/text_bytes,encoded_bytes*1.0/count,
+	 unencoded,mismatches,
+	 text_bytes*passes/encode_seconds/1000000.0,
+	 text_bytes*passes/decode_seconds/1000000.0);
+}
+
+static int corpus_benchmark(char *source)
+{
+  static struct corpus_manifest corpus[CORPUS_MAX_MANIFESTS];
+  int count=source?corpus_load(source,corpus):-1;
+  if (count<0) {
+    count=source?atoi(source):10000;
+    if (count<1||count>CORPUS_MAX_MANIFESTS) count=10000;
+    srandom(1);
+    for(int i=0;i<count;i++) corpus[i].len=corpus_synthesise(i,corpus[i].text);
+    printf("Synthetic corpus of %d manifests",count);
+  } else
+    printf("Corpus of %d manifests from %s",count,source);
+  if (!count) { printf("\n"); return -1; }
+  long long text_bytes=0;
+  for(int i=0;i<count;i++) text_bytes+=corpus[i].len;
+  printf(", %lld bytes (%.1f per manifest)\n",text_bytes,text_bytes*1.0/count);
+
+  manifest_test_verbose=0;
+  printf("%-8s %12s %7s %8s %10s %10s %11s %11s\n",
+	 "codec","bytes","ratio","mean","plaintext","mismatches","encode MB/s","decode MB/s");
+  corpus_measure("v1",manifest_text_to_binary_v1,corpus,count,text_bytes);
+  corpus_measure("v2",manifest_text_to_binary_v2,corpus,count,text_bytes);
+  corpus_measure("sent",manifest_text_to_binary,corpus,count,text_bytes);
+  return 0;
+}
+
 int main(int argc,char **argv)
 {
+  if (argc>=2&&!strcmp(argv[1],"corpus"))
+    return corpus_benchmark(argc>2?argv[2]:NULL)?1:0;
+
   if (argc!=2) {
     fprintf(stderr,"Test manifest binary representation conversion code.\n");
     fprintf(stderr,"usage: manifesttest <manifest>\n");
+    fprintf(stderr,"       manifesttest corpus [directory of *.manifest files | count]\n");
     exit(-1);
   }
 
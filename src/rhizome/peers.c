@@ -40,11 +40,16 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include "sync.h"
 #include "lbard.h"
+#include "metrics.h"
 
 
 int free_peer(struct peer_state *p)
 {
+  if (p->sid_prefix) metrics_forget_labels(metric_peer_label(p->sid_prefix));
   if (p->sid_prefix) { free(p->sid_prefix); } p->sid_prefix=NULL;
+  if (find_peer_by_id(p->sid_id)>=0) id_bind(p->sid_id,ID_PEER,-1);
+  id_release(p->sid_id);
+  p->sid_id=0;
   for(int i=0;i<4;i++) p->sid_prefix_bin[i]=0;
 #ifdef SYNC_BY_BAR
   for(int i=0;i<p->bundle_count;i++) {
@@ -55,6 +60,7 @@ int free_peer(struct peer_state *p)
   free(p->size_bytes); p->size_bytes=NULL;
   free(p->insert_failures); p->insert_failures=NULL;
 #endif
+  progress_bitmap_free(&p->request_progress);
   sync_free_peer_state(sync_state, p);
   free(p);
   return 0;
@@ -127,13 +133,25 @@ int peer_note_bar(struct peer_state *p,
 struct peer_state *peer_records[MAX_PEERS];
 int peer_count=0;
 
+// The peer with this interned SID prefix, or -1
+int find_peer_by_id(int sid_id)
+{
+  int i=id_bound(sid_id,ID_PEER);
+  if ((i<0)||(i>=peer_count)||(peer_records[i]->sid_id!=sid_id)) return -1;
+  return i;
+}
+
 int find_peer_by_prefix(char *peer_prefix)
 {
-  for(int i=0;i<peer_count;i++)
-    if (!strcasecmp(peer_records[i]->sid_prefix,peer_prefix))
-      return i;
-  
-  return -1;
+  return find_peer_by_id(id_find_hex(peer_prefix,ID_SID_PREFIX_BYTES));
+}
+
+// Puts a peer in peer_records[i], which the caller has emptied if need be
+int peer_set_record(int i,struct peer_state *p)
+{
+  peer_records[i]=p;
+  id_bind(p->sid_id,ID_PEER,i);
+  return 0;
 }
 
 #ifdef SYNC_BY_BAR
@@ -173,11 +191,12 @@ int peers_most_interesting_bundle(int peer)
       char *service = "file";
       if (peer_records[peer]->size_bytes[bundle]&0x80) service="MeshMS2";
       char *recipient = bundle_recipient_if_known(bid);
+      int recipient_prefix_id = recipient?id_find_hex(recipient,ID_SID_PREFIX_BYTES):0;
       int insert_failures = peer_records[peer]->insert_failures[bundle];
 
       long long this_priority =
 	calculate_bundle_intrinsic_priority(bid,size_estimate,version,service,
-					    recipient,insert_failures);
+					    recipient_prefix_id,insert_failures);
       
       // Bundle is more interesting if it is smaller or meshms and the best so far is
       // not. We do this by comparing size_bytes first, which will put all meshms to
@@ -205,6 +224,13 @@ int hex_to_val(int c)
 }
 
 
+// Heard from recently, over the radio we are working with
+int peer_is_active(struct peer_state *p)
+{
+  return (gettime_s()-p->interface_last_message_time[radio_interface->index])
+    <=peer_keepalive_interval;
+}
+
 int last_peer_requested=0;
 
 int random_active_peer()
@@ -221,7 +247,7 @@ int random_active_peer()
   for(;peer<peer_count;peer++)
     {
       if (!peer_records[peer]) continue;
-      if ((time(0)-peer_records[peer]->last_message_time)>peer_keepalive_interval) {
+      if (!peer_is_active(peer_records[peer])) {
 	continue;
       }
       the_peer=peer;
@@ -231,7 +257,7 @@ int random_active_peer()
     for(peer=0;(peer<=last_peer_requested)&&(peer<peer_count);peer++)
       {
 	if (!peer_records[peer]) continue;
-	if ((time(0)-peer_records[peer]->last_message_time)>peer_keepalive_interval) {
+	if (!peer_is_active(peer_records[peer])) {
 	  continue;
 	}
 	the_peer=peer;
@@ -244,7 +270,7 @@ int random_active_peer()
   for(peer=0;(peer<peer_count);peer++)
     {
       if (!peer_records[peer]) continue;
-      if ((time(0)-peer_records[peer]->last_message_time)>peer_keepalive_interval)
+      if ((gettime_s()-peer_records[peer]->last_message_time)>peer_keepalive_interval)
 	continue;
       snprintf(&active_peers[apl],1024-apl,"%d, ",peer);
       apl=strlen(active_peers);
@@ -265,11 +291,22 @@ int active_peer_count()
 {
   int count=0;
   for(int peer=0;peer<peer_count;peer++)
-    if ((time(0)-peer_records[peer]->last_message_time)<=peer_keepalive_interval)
+    if (peer_is_active(peer_records[peer]))
       count++;
   return count;
 }
 
+// True if every active peer has told us that it has this capability
+int active_peers_have_capability(int capability)
+{
+  for(int peer=0;peer<peer_count;peer++)
+    if (peer_records[peer]
+	&&peer_is_active(peer_records[peer])
+	&&((peer_records[peer]->capabilities&capability)!=capability))
+      return 0;
+  return 1;
+}
+
 
 #ifdef SYNC_BY_BAR
 int request_wanted_content_from_peers(int *offset,int mtu, unsigned char *msg_out)
@@ -297,7 +334,7 @@ int request_wanted_content_from_peers(int *offset,int mtu, unsigned char *msg_ou
       // int most_complete_manifest_or_body=-1;
 
       // Don't request anything from a peer that we haven't heard from for a while
-      if ((time(0)-peer_records[peer]->last_message_time)>peer_keepalive_interval)
+      if ((gettime_s()-peer_records[peer]->last_message_time)>peer_keepalive_interval)
 	continue;
 
       // If we got here, the peer is not currently sending us anything interesting.
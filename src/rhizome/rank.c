@@ -112,7 +112,7 @@ long long calculate_bundle_intrinsic_priority(char *bid,
 					      long long length,
 					      long long version,
 					      char *service,
-					      char *recipient,
+					      int recipient_prefix_id,
 					      int insert_failures)
 {
 
@@ -136,11 +136,9 @@ long long calculate_bundle_intrinsic_priority(char *bid,
   // Is bundle addressed to a peer?
   int j;
   int addressed_to_peer=0;
-  if (recipient) {
+  if (recipient_prefix_id) {
     for(j=0;j<peer_count;j++) {
-      if (!strncmp(recipient,
-		   peer_records[j]->sid_prefix,
-		   (8*2))) {
+      if (peer_records[j]->sid_id==recipient_prefix_id) {
 	// Bundle is addressed to a peer.
 	// Increase priority if we do not have positive confirmation that peer
 	// has this version of this bundle.
@@ -205,7 +203,7 @@ int calculate_stored_bundle_priority(int i,int versus)
 					bundles[i].length,
 					bundles[i].version,
 					bundles[i].service,
-					bundles[i].recipient,
+					bundles[i].recipient_prefix_id,
 					0 /* it is a bundle in rhizome, so
 					     insert_failures is meaningless here. */
 					);
@@ -220,7 +218,7 @@ int calculate_stored_bundle_priority(int i,int versus)
 
 #ifdef SYNC_BY_BAR
   if (bundles[i].transmit_now)
-    if (bundles[i].transmit_now>=time(0)) {
+    if (bundles[i].transmit_now>=gettime_s()) {
       this_bundle_priority+=BUNDLE_PRIORITY_TRANSMIT_NOW;
     }
 #endif
@@ -228,7 +226,7 @@ int calculate_stored_bundle_priority(int i,int versus)
   int num_peers_that_dont_have_it=0;
 #ifdef SYNC_BY_BAR
   int peer;
-  time_t peer_observation_time_cutoff=time(0)-peer_keepalive_interval;
+  time_t peer_observation_time_cutoff=gettime_s()-peer_keepalive_interval;
   for(peer=0;peer<peer_count;peer++) {
     if (peer_records[peer]->last_message_time>=peer_observation_time_cutoff)
       if (!peer_has_this_bundle_or_newer(peer,
@@ -256,7 +254,7 @@ int calculate_stored_bundle_priority(int i,int versus)
   if (0)
     fprintf(stderr,"  bundle %s was last announced %ld seconds ago.  "
 	    "Priority = 0x%llx, %d peers don't have it.\n",
-	    bundles[i].bid_hex,time(0)-bundles[i].last_announced_time,
+	    bundles[i].bid_hex,gettime_s()-bundles[i].last_announced_time,
 	    this_bundle_priority,num_peers_that_dont_have_it);
   
   // Add to priority according to the number of peers that don't have the bundle
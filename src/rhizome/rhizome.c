@@ -65,7 +65,7 @@ int rhizome_log(char *service,
   if (debug_insert) {
     FILE *f=fopen("/tmp/lbard-rhizome.log","w+");
     if (!f) return -1;
-    time_t now = time(0);
+    time_t now = gettime_s();
     fprintf(f,"--------------------\n%sservice=%s, bid=%s,\nversion=%s, author=%s,\noriginated_here=%s, length=%lld,\nfilehash=%s,\nsender=%s, recipient=%s:\n\n%s\n\n",
 	    ctime(&now),
 	    service,bid,version,author,originated_here,length,filehash,sender,recipient,
@@ -188,6 +188,113 @@ int rhizome_update_bundle(unsigned char *manifest_data,int manifest_length,
 			  unsigned char *body_data,int body_length,
 			  char *servald_server,char *credential)
 {
+  return rhizome_update_bundle_parts(manifest_data,manifest_length,
+				     body_data,body_length,NULL,0,
+				     servald_server,credential);
+}
+
+/*
+  In threaded mode, inserts are made by the servald workers, on a copy of the
+  manifest and on a body they are given (see rhizome_update_bundle_given()),
+  and the main loop carries on as though the insert worked.  If it didn't,
+  the sender will try again (see below).
+*/
+struct bundle_insert {
+  struct servald_job job;
+  unsigned char *manifest;
+  int manifest_length;
+  unsigned char *body;
+  int body_length;
+  void (*release)(void *context);
+  void *context;
+  char *servald_server;
+  char *credential;
+};
+
+static int bundle_insert_run(struct servald_job *job)
+{
+  struct bundle_insert *b=(struct bundle_insert *)job;
+  return rhizome_update_bundle_parts(b->manifest,b->manifest_length,
+				     b->body,b->body_length,NULL,0,
+				     b->servald_server,b->credential);
+}
+
+static int bundle_insert_done(struct servald_job *job)
+{
+  struct bundle_insert *b=(struct bundle_insert *)job;
+  if (!job->result) last_servald_contact=gettime_ms();
+  else fprintf(stderr,"Failed to insert bundle (result=%d)\n",job->result);
+  b->release(b->context);
+  free(b->manifest);
+  free(b);
+  return 0;
+}
+
+// Returns -1 if no worker could take the body, which the caller then still owns
+static int rhizome_update_bundle_async(unsigned char *manifest_data,int manifest_length,
+				       unsigned char *body_data,int body_length,
+				       void (*release)(void *context),void *context,
+				       char *servald_server,char *credential)
+{
+  struct bundle_insert *b=calloc(1,sizeof(struct bundle_insert));
+  if (!b) return -1;
+  b->job.run=bundle_insert_run;
+  b->job.done=bundle_insert_done;
+  b->manifest=malloc(manifest_length+1);
+  if (!b->manifest) {
+    free(b);
+    return -1;
+  }
+  bcopy(manifest_data,b->manifest,manifest_length);
+  b->manifest_length=manifest_length;
+  b->body=body_data;
+  b->body_length=body_length;
+  b->release=release;
+  b->context=context;
+  b->servald_server=servald_server;
+  b->credential=credential;
+  if (servald_submit(&b->job)) {
+    free(b->manifest); free(b);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+  As rhizome_update_bundle(), but the caller hands the body over, and
+  release(context) is called on the main loop once the insert is done with
+  it.  A servald worker can then insert the body where it lies, which matters
+  for the large ones that outernet reassembles in a spill file, instead of
+  from a copy.
+*/
+int rhizome_update_bundle_given(unsigned char *manifest_data,int manifest_length,
+				unsigned char *body_data,int body_length,
+				void (*release)(void *context),void *context,
+				char *servald_server,char *credential)
+{
+  if (threads_servald_async()
+      &&(!rhizome_update_bundle_async(manifest_data,manifest_length,
+				      body_data,body_length,release,context,
+				      servald_server,credential)))
+    return 0;
+  int r=rhizome_update_bundle_parts(manifest_data,manifest_length,
+				    body_data,body_length,NULL,0,
+				    servald_server,credential);
+  release(context);
+  return r;
+}
+
+/*
+  As rhizome_update_bundle(), but with the payload in two parts, so that a
+  journal can be inserted from the old version we hold and the new bytes we
+  received, without joining them first.
+*/
+int rhizome_update_bundle_parts(unsigned char *manifest_data,int manifest_length,
+				unsigned char *body_head,int head_length,
+				unsigned char *body_tail,int tail_length,
+				char *servald_server,char *credential)
+{
+  int body_length=head_length+tail_length;
   /* Push to rhizome.
 
      We don't need to mark the associated bundle as needing immediate announcement,
@@ -198,27 +305,44 @@ int rhizome_update_bundle(unsigned char *manifest_data,int manifest_length,
 
   printf("CHECKPOINT: %s:%d %s()\n",__FILE__,__LINE__,__FUNCTION__);
 
+  // (if the workers are all busy, we wait for servald ourselves)
+  if (threads_servald_async()) {
+    // The worker needs its own copy, as the caller keeps the body
+    unsigned char *body=malloc(body_length+1);
+    if (body) {
+      if (head_length) bcopy(body_head,body,head_length);
+      if (tail_length) bcopy(body_tail,&body[head_length],tail_length);
+      if (!rhizome_update_bundle_async(manifest_data,manifest_length,
+				       body,body_length,free,body,
+				       servald_server,credential))
+	return 0;
+      free(body);
+    }
+  }
+
 #ifdef NOT_DEFINED
   char filename[1024];
-  snprintf(filename,1024,"%08lx.manifest",time(0));
+  snprintf(filename,1024,"%08lx.manifest",gettime_s());
   printf(">>> %s Writing manifest to %s\n",timestamp_str(),filename);
   FILE *f=fopen(filename,"w");
   fwrite(manifest_data,manifest_length,1,f);
   fclose(f);
-  snprintf(filename,1024,"%08lx.payload",time(0));
+  snprintf(filename,1024,"%08lx.payload",gettime_s());
   f=fopen(filename,"w");
-  fwrite(body_data,body_length,1,f);
+  fwrite(body_head,head_length,1,f);
+  fwrite(body_tail,tail_length,1,f);
   fclose(f);
 #endif
   
   printf("Submitting rhizome bundle: manifest len=%d, body len=%d\n",
 	  manifest_length,body_length);
 
-  int result_code=http_post_bundle(servald_server,credential,
-				   "/rhizome/import",
-				   manifest_data,manifest_length,
-				   body_data,body_length,
-				   15000);  
+  int result_code=http_post_bundle_parts(servald_server,credential,
+					 "/rhizome/import",
+					 manifest_data,manifest_length,
+					 body_head,head_length,
+					 body_tail,tail_length,
+					 15000);  
   
   if(result_code<200||result_code>202) {
     printf("POST bundle to rhizome failed: http result = %d\n",result_code);
@@ -230,7 +354,11 @@ int rhizome_update_bundle(unsigned char *manifest_data,int manifest_length,
       if (f) { fwrite(manifest_data,manifest_length,1,f); fclose(f); }
       snprintf(filename,1024,"/tmp/lbard.rejected.body");
       f=fopen(filename,"w");
-      if (f) { fwrite(body_data,body_length,1,f); fclose(f); }
+      if (f) {
+	fwrite(body_head,head_length,1,f);
+	fwrite(body_tail,tail_length,1,f);
+	fclose(f);
+      }
       snprintf(filename,1024,"/tmp/lbard.rejected.result");
       f=fopen(filename,"w");
       if (f) {
@@ -243,12 +371,134 @@ int rhizome_update_bundle(unsigned char *manifest_data,int manifest_length,
   else
     printf("http result code = %d\n",result_code);
 
-  last_servald_contact=gettime_ms();
+  // (the main loop notes that for the workers)
+  if (!threads_on_servald_worker()) last_servald_contact=gettime_ms();
   
   return 0;
 }
 
 
+/*
+  Insert a new version of a journal, whose first old_length bytes are those of
+  the version servald already holds, followed by the new bytes we received.
+  The old bytes go from servald to a temporary file, and from there into the
+  insert, so that they are never all in memory.  This touches nothing but its
+  arguments, so that the servald workers can call it.
+*/
+static int rhizome_append_journal_now(unsigned char *manifest_data,int manifest_length,
+				      char *bid_hex,int old_length,
+				      unsigned char *new_bytes,int new_length,
+				      char *servald_server,char *credential)
+{
+  char path[8192];
+  snprintf(path,8192,"/restful/rhizome/%s/raw.bin",bid_hex);
+  FILE *f=tmpfile();
+  if (!f) {
+    perror("tmpfile");
+    return -1;
+  }
+  int result_code=http_get_simple(servald_server,credential,path,f,5000,NULL,0);
+  fseek(f,0,SEEK_END);
+  long held=ftell(f);
+  if ((result_code!=200)||(held<old_length)) {
+    printf(">>> %s Could not fetch the %d bytes of %s we already had (http result = %d,"
+	   " %ld bytes).  Not inserting\n",
+	   timestamp_str(),old_length,bid_hex,result_code,held);
+    fclose(f);
+    return -1;
+  }
+  rewind(f);
+
+  printf("Submitting rhizome journal: manifest len=%d, body len=%d+%d\n",
+	 manifest_length,old_length,new_length);
+
+  result_code=http_post_bundle_file_parts(servald_server,credential,
+					  "/rhizome/import",
+					  manifest_data,manifest_length,
+					  f,old_length,
+					  new_bytes,new_length,
+					  15000);
+  fclose(f);
+  if(result_code<200||result_code>202) {
+    printf("POST journal to rhizome failed: http result = %d\n",result_code);
+    return result_code;
+  }
+  printf("http result code = %d\n",result_code);
+
+  // (the main loop notes that for the workers)
+  if (!threads_on_servald_worker()) last_servald_contact=gettime_ms();
+
+  return 0;
+}
+
+struct journal_append {
+  struct servald_job job;
+  unsigned char *manifest;
+  int manifest_length;
+  char *bid_hex;
+  int old_length;
+  unsigned char *new_bytes;
+  int new_length;
+  char *servald_server;
+  char *credential;
+};
+
+static int journal_append_run(struct servald_job *job)
+{
+  struct journal_append *j=(struct journal_append *)job;
+  return rhizome_append_journal_now(j->manifest,j->manifest_length,
+				    j->bid_hex,j->old_length,
+				    j->new_bytes,j->new_length,
+				    j->servald_server,j->credential);
+}
+
+static void journal_append_free(struct journal_append *j)
+{
+  free(j->manifest);
+  free(j->bid_hex);
+  free(j->new_bytes);
+  free(j);
+}
+
+static int journal_append_done(struct servald_job *job)
+{
+  if (!job->result) last_servald_contact=gettime_ms();
+  else fprintf(stderr,"Failed to insert journal (result=%d)\n",job->result);
+  journal_append_free((struct journal_append *)job);
+  return 0;
+}
+
+int rhizome_append_journal(unsigned char *manifest_data,int manifest_length,
+			   char *bid_hex,int old_length,
+			   unsigned char *new_bytes,int new_length,
+			   char *servald_server,char *credential)
+{
+  // (if the workers are all busy, we wait for servald ourselves)
+  if (threads_servald_async()) {
+    struct journal_append *j=calloc(1,sizeof(struct journal_append));
+    if (j) {
+      j->job.run=journal_append_run;
+      j->job.done=journal_append_done;
+      j->manifest=malloc(manifest_length+1);
+      j->bid_hex=strdup(bid_hex);
+      j->new_bytes=malloc(new_length+1);
+      if (j->manifest&&j->bid_hex&&j->new_bytes) {
+	bcopy(manifest_data,j->manifest,manifest_length);
+	j->manifest_length=manifest_length;
+	j->old_length=old_length;
+	if (new_length) bcopy(new_bytes,j->new_bytes,new_length);
+	j->new_length=new_length;
+	j->servald_server=servald_server;
+	j->credential=credential;
+	if (!servald_submit(&j->job)) return 0;
+      }
+      journal_append_free(j);
+    }
+  }
+  return rhizome_append_journal_now(manifest_data,manifest_length,bid_hex,old_length,
+				    new_bytes,new_length,servald_server,credential);
+}
+
 int manifest_extract_bid(unsigned char *manifest_data,char *bid_hex)
 {
   // Find ID= at start of manifest and return the BID
@@ -0,0 +1,390 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2015 Serval Project Inc.
+
+Metrics registry: counters, gauges and histograms that the radio, sync and
+peer code update as things happen, so that fleet monitoring can scrape
+throughput, sync efficiency and link quality from every node via /metrics.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <time.h>
+
+#include "sync.h"
+#include "lbard.h"
+#include "radios.h"
+#include "metrics.h"
+
+struct metric_family {
+  char *name;
+  char *help;
+  int type;
+};
+
+struct metric_series {
+  int family;
+  char labels[MAX_METRIC_LABELS_LEN];
+  long long value;
+  struct latency_histogram *histogram;
+  // Next series in the same hash chain, or -1
+  int next;
+};
+
+int metric_family_count=0;
+struct metric_family metric_families[MAX_METRIC_FAMILIES];
+
+// Series are allocated on first use, as most nodes only ever see a few peers.
+#define METRIC_HASH_SIZE 1024
+struct metric_series *metric_series[MAX_METRIC_SERIES];
+int metric_series_high_water=0;
+int metric_hash[METRIC_HASH_SIZE];
+int metric_hash_initialised=0;
+
+unsigned int metric_hash_of(char *name,char *labels)
+{
+  // FNV-1a over name and labels
+  unsigned int h=2166136261U;
+  for(;*name;name++) { h^=(unsigned char)*name; h*=16777619U; }
+  h^=0xff; h*=16777619U;
+  if (labels) for(;*labels;labels++) { h^=(unsigned char)*labels; h*=16777619U; }
+  return h%METRIC_HASH_SIZE;
+}
+
+int metric_family_lookup(char *name,int type)
+{
+  for(int i=0;i<metric_family_count;i++)
+    if (!strcmp(metric_families[i].name,name)) return i;
+  if (metric_family_count>=MAX_METRIC_FAMILIES) return -1;
+  metric_families[metric_family_count].name=strdup(name);
+  metric_families[metric_family_count].help=NULL;
+  metric_families[metric_family_count].type=type;
+  return metric_family_count++;
+}
+
+int metric_describe(char *name,int type,char *help)
+{
+  int f=metric_family_lookup(name,type);
+  if (f<0) return -1;
+  metric_families[f].type=type;
+  if (!metric_families[f].help&&help) metric_families[f].help=strdup(help);
+  return 0;
+}
+
+struct metric_series *metric_series_lookup(char *name,char *labels,int type)
+{
+  if (!labels) labels="";
+
+  if (!metric_hash_initialised) {
+    for(int i=0;i<METRIC_HASH_SIZE;i++) metric_hash[i]=-1;
+    metric_hash_initialised=1;
+  }
+
+  unsigned int h=metric_hash_of(name,labels);
+  for(int s=metric_hash[h];s>=0;s=metric_series[s]->next) {
+    struct metric_series *ms=metric_series[s];
+    if ((!strcmp(ms->labels,labels))
+	&&(!strcmp(metric_families[ms->family].name,name)))
+      return ms;
+  }
+
+  // New series
+  int f=metric_family_lookup(name,type);
+  if (f<0) return NULL;
+  if (metric_families[f].type!=type) return NULL;
+  if (strlen(labels)>=MAX_METRIC_LABELS_LEN) return NULL;
+
+  int slot;
+  for(slot=0;slot<metric_series_high_water;slot++)
+    if (!metric_series[slot]) break;
+  if (slot>=MAX_METRIC_SERIES) return NULL;
+
+  struct metric_series *ms=calloc(1,sizeof(struct metric_series));
+  if (!ms) return NULL;
+  ms->family=f;
+  strcpy(ms->labels,labels);
+  if (type==METRIC_HISTOGRAM) {
+    ms->histogram=calloc(1,sizeof(struct latency_histogram));
+    if (!ms->histogram) { free(ms); return NULL; }
+  }
+  ms->next=metric_hash[h];
+  metric_hash[h]=slot;
+  metric_series[slot]=ms;
+  if (slot>=metric_series_high_water) metric_series_high_water=slot+1;
+
+  return ms;
+}
+
+int metric_counter_add(char *name,char *labels,long long delta)
+{
+  struct metric_series *ms=metric_series_lookup(name,labels,METRIC_COUNTER);
+  if (!ms) return -1;
+  ms->value+=delta;
+  return 0;
+}
+
+// For counters maintained elsewhere (e.g., inside the sync library), that we
+// copy into the registry when the metrics are requested.
+int metric_counter_set(char *name,char *labels,long long value)
+{
+  struct metric_series *ms=metric_series_lookup(name,labels,METRIC_COUNTER);
+  if (!ms) return -1;
+  ms->value=value;
+  return 0;
+}
+
+int metric_gauge_set(char *name,char *labels,long long value)
+{
+  struct metric_series *ms=metric_series_lookup(name,labels,METRIC_GAUGE);
+  if (!ms) return -1;
+  ms->value=value;
+  return 0;
+}
+
+int metric_histogram_observe(char *name,char *labels,long long value)
+{
+  struct metric_series *ms=metric_series_lookup(name,labels,METRIC_HISTOGRAM);
+  if (!ms) return -1;
+  latency_histogram_record(ms->histogram,value);
+  return 0;
+}
+
+// Drop every series with exactly this label string, e.g., when a peer record
+// is freed, so that the registry doesn't fill up with departed peers.
+int metrics_forget_labels(char *labels)
+{
+  if (!labels||!metric_hash_initialised) return 0;
+  int forgotten=0;
+  for(int h=0;h<METRIC_HASH_SIZE;h++) {
+    int *link=&metric_hash[h];
+    while(*link>=0) {
+      struct metric_series *ms=metric_series[*link];
+      if (!strcmp(ms->labels,labels)) {
+	int slot=*link;
+	*link=ms->next;
+	if (ms->histogram) free(ms->histogram);
+	free(ms);
+	metric_series[slot]=NULL;
+	forgotten++;
+      } else link=&ms->next;
+    }
+  }
+  return forgotten;
+}
+
+char metric_label_buffer[MAX_METRIC_LABELS_LEN];
+
+char *metric_radio_label(void)
+{
+  int t=radio_get_type();
+  snprintf(metric_label_buffer,sizeof(metric_label_buffer),"radio=\"%s\"",
+	   (t>=0&&radio_types[t].name)?radio_types[t].name:"unknown");
+  return metric_label_buffer;
+}
+
+char *metric_peer_label(char *sid_prefix)
+{
+  snprintf(metric_label_buffer,sizeof(metric_label_buffer),"peer=\"%s\"",
+	   sid_prefix?sid_prefix:"unknown");
+  return metric_label_buffer;
+}
+
+/* Copy in the values that are owned by other modules and only need to be
+   looked at when someone asks. */
+int metrics_collect(void)
+{
+  struct sync_stats st;
+  if (sync_state) {
+    sync_get_stats(sync_state,&st);
+    metric_gauge_set("lbard_sync_keys",NULL,st.key_count);
+    metric_gauge_set("lbard_sync_peer_trees",NULL,st.peer_count);
+    metric_gauge_set("lbard_sync_peer_tree_bytes",NULL,st.peer_bytes);
+    metric_counter_set("lbard_sync_peer_evictions_total",NULL,st.peer_evictions);
+    metric_counter_set("lbard_sync_messages_sent_total",NULL,st.sent_messages);
+    metric_counter_set("lbard_sync_roots_sent_total",NULL,st.sent_root);
+    metric_counter_set("lbard_sync_records_sent_total",NULL,st.sent_record_count);
+    metric_counter_set("lbard_sync_records_received_total",NULL,st.received_record_count);
+    metric_counter_set("lbard_sync_records_uninteresting_total",NULL,
+		       st.received_uninteresting);
+  }
+
+  metric_gauge_set("lbard_peers",NULL,peer_count);
+  metric_gauge_set("lbard_peers_active",NULL,active_peer_count());
+  metric_gauge_set("lbard_bundles",NULL,bundle_count);
+  metric_gauge_set("lbard_serial_consecutive_errors",metric_radio_label(),serial_errors);
+  metric_gauge_set("lbard_radio_tx_interval_ms",metric_radio_label(),
+		   message_update_interval);
+  metric_gauge_set("lbard_uptime_seconds",NULL,(gettime_ms()-start_time)/1000);
+
+  return 0;
+}
+
+int metrics_describe_all(void)
+{
+  static int done=0;
+  if (done) return 0;
+  done=1;
+
+  metric_describe("lbard_radio_frames_sent_total",METRIC_COUNTER,
+		  "LBARD frames handed to the radio for transmission.");
+  metric_describe("lbard_radio_bytes_sent_total",METRIC_COUNTER,
+		  "Bytes (including FEC) handed to the radio for transmission.");
+  metric_describe("lbard_radio_frames_received_total",METRIC_COUNTER,
+		  "Frames received from the radio, by FEC outcome.");
+  metric_describe("lbard_peer_frames_received_total",METRIC_COUNTER,
+		  "Frames successfully received from each peer.");
+  metric_describe("lbard_peer_frames_missed_total",METRIC_COUNTER,
+		  "Frames from each peer inferred lost from message number gaps.");
+  metric_describe("lbard_peer_rssi",METRIC_HISTOGRAM,
+		  "Received signal strength of frames from each peer.");
+  metric_describe("lbard_bundle_bytes_sent_total",METRIC_COUNTER,
+		  "Bundle manifest and body bytes sent.");
+  metric_describe("lbard_bundle_bytes_received_total",METRIC_COUNTER,
+		  "Bundle manifest and body bytes received, and how many were new.");
+  metric_describe("lbard_bundles_received_total",METRIC_COUNTER,
+		  "Complete bundles received, by insertion outcome.");
+  metric_describe("lbard_sync_keys",METRIC_GAUGE,
+		  "Keys in our sync tree.");
+  metric_describe("lbard_sync_peer_trees",METRIC_GAUGE,
+		  "Peers for which we hold sync tree state.");
+  metric_describe("lbard_sync_peer_tree_bytes",METRIC_GAUGE,
+		  "Bytes of sync tree state held for all peers.");
+  metric_describe("lbard_sync_peer_evictions_total",METRIC_COUNTER,
+		  "Peers whose sync tree state was thrown away, for being idle or over budget.");
+  metric_describe("lbard_sync_messages_sent_total",METRIC_COUNTER,
+		  "Sync tree messages built for transmission.");
+  metric_describe("lbard_sync_roots_sent_total",METRIC_COUNTER,
+		  "Sync tree messages that only carried our root node.");
+  metric_describe("lbard_sync_records_sent_total",METRIC_COUNTER,
+		  "Sync tree records sent.");
+  metric_describe("lbard_sync_records_received_total",METRIC_COUNTER,
+		  "Sync tree records received.");
+  metric_describe("lbard_sync_records_uninteresting_total",METRIC_COUNTER,
+		  "Sync tree records received that told us nothing new.");
+  metric_describe("lbard_peers",METRIC_GAUGE,"Peer records held.");
+  metric_describe("lbard_peers_active",METRIC_GAUGE,"Peers heard from recently.");
+  metric_describe("lbard_bundles",METRIC_GAUGE,"Bundles known to LBARD.");
+  metric_describe("lbard_serial_consecutive_errors",METRIC_GAUGE,
+		  "Consecutive failed writes to the radio serial port.");
+  metric_describe("lbard_radio_tx_interval_ms",METRIC_GAUGE,
+		  "Current interval between our radio transmissions.");
+  metric_describe("lbard_uptime_seconds",METRIC_GAUGE,"Seconds since LBARD started.");
+  metric_describe("lbard_outernet_uplink_packets_total",METRIC_COUNTER,
+		  "Packets uplinked to Outernet, by lane.");
+  metric_describe("lbard_outernet_uplink_bytes_total",METRIC_COUNTER,
+		  "Bytes (including parity) uplinked to Outernet, by lane.");
+  metric_describe("lbard_outernet_uplink_passes_total",METRIC_COUNTER,
+		  "Complete uplinks of a bundle to Outernet, by lane.");
+  metric_describe("lbard_outernet_uplink_lane_bundles",METRIC_GAUGE,
+		  "Bundles in the carousel of each Outernet uplink lane.");
+  metric_describe("lbard_outernet_uplink_revisit_ms",METRIC_HISTOGRAM,
+		  "Time between successive uplinks of the same bundle, by lane.");
+  metric_describe("lbard_hf_burst_frames_total",METRIC_COUNTER,
+		  "Frames sent in HF bursts, by whether the other side acknowledged them.");
+  metric_describe("lbard_hf_burst_window",METRIC_GAUGE,
+		  "Frames we will send in our next HF burst.");
+  metric_describe("lbard_hf_turn_response_ms",METRIC_HISTOGRAM,
+		  "Time the HF link partner took to respond at the end of our turn.");
+  metric_describe("lbard_hf_frames_received_total",METRIC_COUNTER,
+		  "Frames reassembled from HF messages, by whether every piece arrived.");
+  return 0;
+}
+
+char *metric_type_name(int type)
+{
+  switch(type) {
+  case METRIC_COUNTER: return "counter";
+  case METRIC_GAUGE: return "gauge";
+  case METRIC_HISTOGRAM: return "histogram";
+  }
+  return "untyped";
+}
+
+int metric_write_histogram(FILE *f,char *name,struct metric_series *ms)
+{
+  struct latency_histogram *h=ms->histogram;
+  char *sep=ms->labels[0]?",":"";
+  long long cumulative=0;
+
+  // Only emit the bucket boundaries at whole powers of two, up to the largest
+  // value seen, to keep the output a sensible size.
+  for(int b=0;b<LATENCY_HISTOGRAM_BUCKETS;b++) {
+    cumulative+=h->buckets[b];
+    long long limit=latency_histogram_bucket_limit(b);
+    if ((limit+1)&limit) continue;
+    fprintf(f,"%s_bucket{%s%sle=\"%lld\"} %lld\n",name,ms->labels,sep,limit,cumulative);
+    if (limit>=h->max) break;
+  }
+  fprintf(f,"%s_bucket{%s%sle=\"+Inf\"} %lld\n",name,ms->labels,sep,h->count);
+  if (ms->labels[0]) {
+    fprintf(f,"%s_sum{%s} %lld\n",name,ms->labels,h->sum);
+    fprintf(f,"%s_count{%s} %lld\n",name,ms->labels,h->count);
+  } else {
+    fprintf(f,"%s_sum %lld\n",name,h->sum);
+    fprintf(f,"%s_count %lld\n",name,h->count);
+  }
+  return 0;
+}
+
+int metrics_write_text(FILE *f)
+{
+  metrics_describe_all();
+  metrics_collect();
+
+  for(int fam=0;fam<metric_family_count;fam++) {
+    struct metric_family *mf=&metric_families[fam];
+    int header=0;
+    for(int s=0;s<metric_series_high_water;s++) {
+      struct metric_series *ms=metric_series[s];
+      if (!ms||ms->family!=fam) continue;
+      if (!header) {
+	if (mf->help) fprintf(f,"# HELP %s %s\n",mf->name,mf->help);
+	fprintf(f,"# TYPE %s %s\n",mf->name,metric_type_name(mf->type));
+	header=1;
+      }
+      if (mf->type==METRIC_HISTOGRAM)
+	metric_write_histogram(f,mf->name,ms);
+      else if (ms->labels[0])
+	fprintf(f,"%s{%s} %lld\n",mf->name,ms->labels,ms->value);
+      else
+	fprintf(f,"%s %lld\n",mf->name,ms->value);
+    }
+  }
+
+  // And the main loop timing from timeaccount.c
+  show_time_accounting_text(f);
+
+  return 0;
+}
+
+int http_report_metrics(int socket)
+{
+  FILE *f=fopen("/tmp/metrics.txt","w");
+  if (!f) {
+    char *m="HTTP/1.0 500 Couldn't create temporary file\nServer: Serval LBARD\n\nCould not create temporariy file";
+    write_all(socket,m,strlen(m));
+    return -1;
+  }
+  metrics_write_text(f);
+  fclose(f);
+  return http_send_file(socket,"/tmp/metrics.txt","text/plain; version=0.0.4");
+}
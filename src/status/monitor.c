@@ -36,7 +36,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 int monitor_log_message(char *log,
 			char *sender_prefix, char *recipient_prefix,char *msg)
 {
-  time_t current_time=(long long)time(0);
+  time_t current_time=(long long)gettime_s();
   long long now_usec=gettime_us();
   struct tm tm;
   localtime_r(&current_time,&tm);
@@ -44,6 +44,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "serial.h"
 #include "version.h"
 #include "radio_type.h"
+#include "hf.h"
 
 
 #define TMPDIR "/tmp"
@@ -251,6 +252,7 @@ char *home_page="\n"
 "        refreshDiv('bundlelist'); iterations=0;\n"
 "        }\n"
 "        refreshDiv('radioinfo');\n"
+"        refreshDiv('hfplan');\n"
 "        refreshDiv('diags');\n"
 "      }\n"
 "\n"
@@ -277,6 +279,7 @@ char *home_page="\n"
 "      <button onClick=\"toggleElement('bundlerx')\">Receive Progress</button>\n"
 "      <button onClick=\"toggleElement('bundlelist')\">Stored Bundles</button>\n"
 "      <button onClick=\"toggleElement('radioinfo')\">Radio Configuration</button>\n"
+"      <button onClick=\"toggleElement('hfplan')\">HF Call Plan</button>\n"
 "      <button onClick=\"toggleElement('diags')\">Diagnostic Information</button>\n"
 "    </div>\n"
 "    \n"
@@ -294,6 +297,8 @@ char *home_page="\n"
 "    <div style=\"display:none\" id=bundlelist>Loading...</div>\n"
 "    <h2 class=section><a href=\"javascript:toggleElement('radioinfo');\">Radio Configuration Information</a></h2>\n"
 "    <div style=\"display:none\" id=radioinfo>Loading...</div>\n"
+"    <h2 class=section><a href=\"javascript:toggleElement('hfplan');\">HF Station Call Plan</a></h2>\n"
+"    <div style=\"display:none\" id=hfplan>Loading...</div>\n"
 "    <h2 class=section><a href=\"javascript:toggleElement('diags');\">Mesh Extender Diagnostics</a></h2>\n"
 "    <div style=\"display:none\" id=diags>Loading...</div>\n"
 "  </body>\n"
@@ -330,13 +335,13 @@ int status_dump()
 {
   int i;
   
-  if (last_peer_log>time(0)) last_peer_log=time(0);
+  if (last_peer_log>gettime_s()) last_peer_log=gettime_s();
   
   // Periodically record list of peers in bundle log, if we are maintaining one
   FILE *bundlelogfile=NULL;
   if (debug_bundlelog) {
-    if ((time(0)-last_peer_log)>=300) {
-      last_peer_log=time(0);	
+    if ((gettime_s()-last_peer_log)>=300) {
+      last_peer_log=gettime_s();	
       bundlelogfile=fopen(bundlelog_filename,"a");
       if (bundlelogfile) {
 	fprintf(bundlelogfile,"%lld:T+%lldms:PEERREPORT:%s",
@@ -347,14 +352,14 @@ int status_dump()
   }
 
   for (i=0;i<peer_count;i++) {
-    long long age=(time(0)-peer_records[i]->last_message_time);
+    long long age=(gettime_s()-peer_records[i]->last_message_time);
     float mean_rssi=-1;
     if (peer_records[i]->rssi_counter) mean_rssi=peer_records[i]->rssi_accumulator*1.0/peer_records[i]->rssi_counter;
     int missed_packets=peer_records[i]->missed_packet_count;
     int received_packets=peer_records[i]->rssi_counter;
     
     if (age<=30) {
-      time_t now=time(0);
+      time_t now=gettime_s();
 
       if (bundlelogfile) {
 	fprintf(bundlelogfile,"%lld:T+%lldms:PEERSTATUS:%s*:%lld:%d/%d:%.0f:%s",
@@ -393,10 +398,15 @@ int status_dump_meinfo(FILE *f,char *topic)
 int status_dump_radioinfo(FILE *f, char *topic)
 {
   fprintf(f,"Radio detected as '%s'.\n",radio_types[radio_get_type()].name);
-  if (radio_last_heartbeat_time)
-    fprintf(f,"Last heartbeat received at T-%lld.\n",radio_last_heartbeat_time);
-  if (radio_temperature!=9999)
-    fprintf(f," Radio temperature %dC\n",radio_temperature);
+  // (the radio thread sets these, in threaded mode)
+  radio_lock();
+  long long heartbeat_time=radio_last_heartbeat_time;
+  int temperature=radio_temperature;
+  radio_unlock();
+  if (heartbeat_time)
+    fprintf(f,"Last heartbeat received at T-%lld.\n",heartbeat_time);
+  if (temperature!=9999)
+    fprintf(f," Radio temperature %dC\n",temperature);
 
   // And EEPROM data (copy from /tmp/eeprom.data)
   char buffer[16384];
@@ -412,6 +422,11 @@ int status_dump_radioinfo(FILE *f, char *topic)
   return 0;
 }
 
+int status_dump_hfplan(FILE *f, char *topic)
+{
+  return hf_schedule_dump(f);
+}
+
 int status_dump_radiolinks(FILE *f, char *topic)
 {
   int i;
@@ -419,7 +434,7 @@ int status_dump_radiolinks(FILE *f, char *topic)
   // Show peer reachability with indication of activity
   fprintf(f,"<table border=1 padding=2 spacing=2><tr><th>Mesh Extender ID</th><th>Performance</th><th>Receive Signal Strength (RSSI)</th><th>Sending</th></tr>\n");
   for (i=0;i<peer_count;i++) {
-    long long age=(time(0)-peer_records[i]->last_message_time);
+    long long age=(gettime_s()-peer_records[i]->last_message_time);
     float mean_rssi=-1;
     if (peer_records[i]->rssi_counter) mean_rssi=peer_records[i]->rssi_accumulator*1.0/peer_records[i]->rssi_counter;
     int missed_packets=peer_records[i]->missed_packet_count;
@@ -506,7 +521,7 @@ int status_dump_txqueue(FILE *f, char *topic)
   int i;
   fprintf(f,"<table border=1 padding=2 spacing=2><tr><th>Bundle</th></tr>\n");
   for (i=0;i<peer_count;i++) {
-    long long age=(time(0)-peer_records[i]->last_message_time);
+    long long age=(gettime_s()-peer_records[i]->last_message_time);
     
     if (age<=30) {
       fprintf(f,"<tr><td><b>Peer %s*</b></td></tr>\n",peer_records[i]->sid_prefix);
@@ -704,6 +719,7 @@ struct topic_report topics[]={
   {"bundlerx",0,2000,status_dump_bundlerx},
   {"bundlelist",0,10000,status_dump_bundlelist},
   {"radioinfo",0,5000,status_dump_radioinfo},
+  {"hfplan",0,2000,status_dump_hfplan},
   {"diags",0,2000,status_dump_diags},
   {"",-1,-1}
 };
@@ -776,10 +792,10 @@ int http_report_network_status(int socket,char *topic)
 time_t last_json_network_status_call=0;
 int http_report_network_status_json(int socket)
 {
-  if (((time(0)-last_json_network_status_call)>1)||
-      ((time(0)-last_json_network_status_call)<0))
+  if (((gettime_s()-last_json_network_status_call)>1)||
+      ((gettime_s()-last_json_network_status_call)<0))
     {
-      last_json_network_status_call=time(0);
+      last_json_network_status_call=gettime_s();
       FILE *f=fopen("/tmp/networkstatus.json","w");
       if (!f) {
 	char *m="HTTP/1.0 500 Couldn't create temporary file\nServer: Serval LBARD\n\nCould not create temporariy file";
@@ -794,7 +810,7 @@ int http_report_network_status_json(int socket)
       int i;
       int count=0;
       for (i=0;i<peer_count;i++) {
-	long long age=(time(0)-peer_records[i]->last_message_time);
+	long long age=(gettime_s()-peer_records[i]->last_message_time);
 	if (age<20) {
 	  if (count) fprintf(f,",");
 	  fprintf(f,"{ \"id\": \"%s\", \"time-since-last\": %lld }\n",
@@ -815,3 +831,20 @@ int http_report_network_status_json(int socket)
   return http_send_file(socket,"/tmp/networkstatus.json","application/json");
 }
 
+
+int http_report_time_accounting(int socket,int json)
+{
+  char *filename=json?"/tmp/timeaccount.json":"/tmp/timeaccount.txt";
+  FILE *f=fopen(filename,"w");
+  if (!f) {
+    char *m="HTTP/1.0 500 Couldn't create temporary file\nServer: Serval LBARD\n\nCould not create temporariy file";
+    write_all(socket,m,strlen(m));
+    return -1;
+  }
+  if (json) show_time_accounting_json(f);
+  else show_time_accounting_text(f);
+  fclose(f);
+
+  return http_send_file(socket,filename,
+			json?"application/json":"text/plain; version=0.0.4");
+}
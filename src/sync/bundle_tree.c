@@ -213,14 +213,15 @@ int sync_announce_bundle_piece(int peer,int *offset,int mtu,
 	 ||(peer_records[peer]->tx_bundle_body_offset
 	    ==peer_records[peer]->tx_bundle_body_offset_hard_lower_bound)
 	 )
-	||(peer_records[peer]->tx_bundle_body_offset>=cached_body_len))
+	||(peer_records[peer]->tx_bundle_body_offset>=cached_body_wire_len))
       {
 	fprintf(stderr,"T+%lldms : Sending length of bundle %s (bundle #%d, version %lld, cached_version %lld)\n",
 		gettime_ms()-start_time,
 		bundles[bundle_number].bid_hex,
 		bundle_number,bundles[bundle_number].version,
 		cached_version);
-	announce_bundle_length(mtu,msg,offset,bundles[bundle_number].bid_bin,cached_version,bundles[bundle_number].length);
+	announce_bundle_length(mtu,msg,offset,bundles[bundle_number].bid_bin,cached_version,
+			       cached_body_codec,cached_body_wire_len);
       }
   }
   {
@@ -242,15 +243,15 @@ int sync_announce_bundle_piece(int peer,int *offset,int mtu,
     if (debug_ack)
       fprintf(stderr,"HARDLOWER: Sending body piece with body_offset=%d, body_len=%d (hard lower limit = %d/%d\n",
 	      peer_records[peer]->tx_bundle_body_offset,
-	      cached_body_len,
+	      cached_body_wire_len,
 	      peer_records[peer]->tx_bundle_manifest_offset_hard_lower_bound,
 	      peer_records[peer]->tx_bundle_body_offset_hard_lower_bound
 	      );
     int start_offset=peer_records[peer]->tx_bundle_body_offset;
     
     int bytes =
-      sync_append_some_bundle_bytes(bundle_number,start_offset,cached_body_len,
-				    &cached_body[start_offset],0,
+      sync_append_some_bundle_bytes(bundle_number,start_offset,cached_body_wire_len,
+				    &cached_body_wire[start_offset],0,
 				    offset,mtu,msg,peer);
     
     if (bytes>0)
@@ -263,7 +264,7 @@ int sync_announce_bundle_piece(int peer,int *offset,int mtu,
   // (the _hard_lower_bound values are used to advance the loop-back point from the
   // beginning of the bundle to the appropriate place, if partial reception has been
   // acknowledged.
-  if ((peer_records[peer]->tx_bundle_body_offset>=bundles[bundle_number].length)
+  if ((peer_records[peer]->tx_bundle_body_offset>=cached_body_wire_len)
       &&(peer_records[peer]->tx_bundle_manifest_offset>=cached_manifest_encoded_len))
     {
       peer_records[peer]->tx_bundle_body_offset=0;
@@ -287,7 +288,8 @@ int sync_tree_send_data(int *offset,int mtu, unsigned char *msg_out,int peer,
     to advance to the next bundle.)
 
   */
-  if (peer_records[peer]->tx_bundle>-1)
+  if ((peer_records[peer]->tx_bundle>-1)
+      &&radio_interface_carries_bundle(peer_records[peer],peer_records[peer]->tx_bundle))
     {
       // Try to also send a piece of body, even if we have already stuffed some
       // manifest in, because we might still have space.      
@@ -297,6 +299,36 @@ int sync_tree_send_data(int *offset,int mtu, unsigned char *msg_out,int peer,
   return 0;
 }
 
+/*
+  With more than one radio, a report can only go over a radio its peer is
+  listening on.  Move the last such report to the end of the queue, and
+  return how many reports there are up to and including it.
+*/
+static int report_queue_for_this_radio(void)
+{
+  if (radio_interface_count<2) return report_queue_length;
+  int i;
+  for(i=report_queue_length-1;i>=0;i--)
+    if ((!report_queue_peers[i])||peer_is_active(report_queue_peers[i])) break;
+  if (i<0) return 0;
+  int last=report_queue_length-1;
+  if (i<last) {
+    uint8_t report[MAX_REPORT_LEN];
+    bcopy(report_queue[i],report,MAX_REPORT_LEN);
+    bcopy(report_queue[last],report_queue[i],MAX_REPORT_LEN);
+    bcopy(report,report_queue[last],MAX_REPORT_LEN);
+    uint8_t length=report_lengths[i];
+    report_lengths[i]=report_lengths[last]; report_lengths[last]=length;
+    struct peer_state *p=report_queue_peers[i];
+    report_queue_peers[i]=report_queue_peers[last]; report_queue_peers[last]=p;
+    int partial=report_queue_partials[i];
+    report_queue_partials[i]=report_queue_partials[last]; report_queue_partials[last]=partial;
+    char *message=report_queue_message[i];
+    report_queue_message[i]=report_queue_message[last]; report_queue_message[last]=message;
+  }
+  return report_queue_length;
+}
+
 int sync_by_tree_stuff_packet(int *offset,int mtu, unsigned char *msg_out,
 			      char *sid_prefix_hex,
 			      char *servald_server,char *credential)
@@ -306,7 +338,7 @@ int sync_by_tree_stuff_packet(int *offset,int mtu, unsigned char *msg_out,
   // waste a packet if we have something we can stuff in.
 
   // First of all, tell any peers any acknowledgement messages that are required.
-  while (report_queue_length&&((*offset)<(mtu-MAX_REPORT_LEN))) {
+  while (report_queue_for_this_radio()&&((*offset)<(mtu-MAX_REPORT_LEN))) {
     report_queue_length--;
     if (append_bytes(offset,mtu,msg_out,report_queue[report_queue_length],
 		     report_lengths[report_queue_length])) {
@@ -415,28 +447,27 @@ int sync_tell_peer_we_have_bundle_by_id(int peer,unsigned char *bid,long long ve
   return 0;
 }
 
-unsigned char bin_prefix[8];
-unsigned char *bid_prefix_hex_to_bin(char *hex)
-{
-  for(int i=0;i<8;i++) {
-    char h[3]={hex[i*2+0],hex[i*2+1],0};
-    bin_prefix[i]=strtoll(h,NULL,16);
-  }
-  return bin_prefix;
-}
-
 int sync_tell_peer_we_have_the_bundle_of_this_partial(int peer, int partial)
 {
 
   return sync_tell_peer_we_have_bundle_by_id
-    (peer,bid_prefix_hex_to_bin(partials[partial].bid_prefix),
+    (peer,id_bin(partials[partial].bid_id),
      partials[partial].bundle_version);  
 }
 
 
+// The bundle we hold with this BID prefix.  The usual 8 byte prefixes are
+// interned, and shorter ones searched for.
+static int lookup_bundle_by_prefix_bin(unsigned char *prefix)
+{
+  return bundle_by_id(id_find(prefix,ID_BID_PREFIX_BYTES));
+}
+
 int lookup_bundle_by_prefix(const unsigned char *prefix,int len)
 {
   if (len>8) len=8;
+  if (len==ID_BID_PREFIX_BYTES)
+    return lookup_bundle_by_prefix_bin((unsigned char *)prefix);
   
   int best_bundle=-1;
   int bundle;
@@ -457,56 +488,26 @@ int lookup_bundle_by_prefix(const unsigned char *prefix,int len)
   return best_bundle;
 }
 
+// (We hold only one version of each bundle)
 int lookup_bundle_by_prefix_bin_and_version_exact(unsigned char *prefix, long long version)
 {
-  int bundle;
-  int i;
-  for(bundle=0;bundle<bundle_count;bundle++) {
-    for(i=0;i<8;i++) {
-      if (prefix[i]!=bundles[bundle].bid_bin[i]) break;
-    }
-    if (i==8) {
-      if (bundles[bundle].version==version)
-	return bundle;
-    }
-  }
+  int bundle=lookup_bundle_by_prefix_bin(prefix);
+  if ((bundle>=0)&&(bundles[bundle].version==version)) return bundle;
   return -1;
 }
 
 // Returns newest bundle version of relevance
 int lookup_bundle_by_prefix_bin_and_version_or_newer(unsigned char *prefix, long long version)
 {
-  int best_bundle=-1;
-  int bundle;
-  int i;
-  for(bundle=0;bundle<bundle_count;bundle++) {
-    for(i=0;i<8;i++) {
-      if (prefix[i]!=bundles[bundle].bid_bin[i]) break;
-    }
-    if (i==8) {
-      if (bundles[bundle].version>=version) {
-	if ((best_bundle==-1)||(bundles[bundle].version>bundles[best_bundle].version))
-	  best_bundle=bundle;
-      }
-      
-    }
-  }
-  return best_bundle;
+  int bundle=lookup_bundle_by_prefix_bin(prefix);
+  if ((bundle>=0)&&(bundles[bundle].version>=version)) return bundle;
+  return -1;
 }
 
 int lookup_bundle_by_prefix_bin_and_version_or_older(unsigned char *prefix, long long version)
 {
-  int bundle;
-  int i;
-  for(bundle=0;bundle<bundle_count;bundle++) {
-    for(i=0;i<8;i++) {
-      if (prefix[i]!=bundles[bundle].bid_bin[i]) break;
-    }
-    if (i==8) {
-      if (bundles[bundle].version<=version)
-	return bundle;
-    }
-  }
+  int bundle=lookup_bundle_by_prefix_bin(prefix);
+  if ((bundle>=0)&&(bundles[bundle].version<=version)) return bundle;
   return -1;
 }
 
@@ -519,7 +520,7 @@ int sync_queue_bundle(struct peer_state *p,int bundle)
 						   b->length,
 						   b->version,
 						   b->service,
-						   b->recipient,
+						   b->recipient_prefix_id,
 						   0);
 
   // TX queue has something in it.
@@ -574,15 +575,16 @@ int sync_queue_bundle(struct peer_state *p,int bundle)
     }
     p->tx_bundle_manifest_offset_hard_lower_bound=0;
     p->tx_bundle_body_offset_hard_lower_bound=0;
-    if (bundles[bundle].length)
-      p->tx_bundle_body_offset=(random()%bundles[bundle].length)&0xffffff00;
+    prime_bundle_cache(bundle,p->sid_prefix,servald_server,credential);
+    int wire_length=bundle_wire_length(bundle);
+    if (wire_length)
+      p->tx_bundle_body_offset=(random()%wire_length)&0xffffff00;
     else
       p->tx_bundle_body_offset=0;
     if (option_flags&FLAG_NO_RANDOMIZE_START_OFFSET)
       p->tx_bundle_body_offset=0;
     // ... but start from the beginning if it will take only one packet
-    if (bundles[bundle].length<150) p->tx_bundle_body_offset=0;
-    prime_bundle_cache(bundle,p->sid_prefix,servald_server,credential);
+    if (wire_length<150) p->tx_bundle_body_offset=0;
     if (cached_manifest_encoded_len)
       p->tx_bundle_manifest_offset=(random()%cached_manifest_encoded_len)&0xffffff80;
     if (option_flags&FLAG_NO_RANDOMIZE_START_OFFSET)
@@ -770,54 +772,82 @@ int sync_setup()
 				peer_has_this_key,
 				peer_does_not_have_this_key,
 				peer_now_has_this_key);
+  sync_set_peer_budget(sync_state,(size_t)SYNC_DEFAULT_PEER_BUDGET_KB*1024);
   return 0;
 }
 
+static int sync_peer_is_idle(void *peer_context)
+{
+  struct peer_state *p=(struct peer_state *)peer_context;
+  return (gettime_s()-p->last_message_time)>SYNC_PEER_IDLE_SECONDS;
+}
+
+/*
+  Throw away the sync trees of peers we haven't heard from for a long while.
+  Should we hear from one again, it starts again from our root, as a new peer
+  would.  Peers we still hear from are only evicted if the trees grow past
+  their budget (see sync_set_peer_budget()).
+*/
+int sync_evict_idle_peers(void)
+{
+  static time_t last_check=0;
+  if ((gettime_s()-last_check)<SYNC_PEER_IDLE_SECONDS/10) return 0;
+  last_check=gettime_s();
+
+  int count=sync_evict_peers(sync_state,sync_peer_is_idle);
+  if (count)
+    printf(">>> %s Evicted sync tree state of %d idle peer(s).\n",
+	   timestamp_str(),count);
+  return count;
+}
+
 #define MAX_RECENT_BUNDLES 128
 #define RECENT_BUNDLE_TIMEOUT (4*60)
 struct recent_bundle recent_bundles[MAX_RECENT_BUNDLES];
 int recent_bundle_count=0;
 
-int sync_remember_recently_received_bundle(char *bid_prefix, long long version)
+int sync_remember_recently_received_bundle(int bid_id, long long version)
 {
   int first_timed_out=-1;
   int i;
   for(i=0;i<recent_bundle_count;i++)
-    if (!strcasecmp(bid_prefix,recent_bundles[i].bid_prefix)) {
+    if (recent_bundles[i].bid_id==bid_id) {
       if (version>=recent_bundles[i].bundle_version)
 	recent_bundles[i].bundle_version=version;
-      recent_bundles[i].timeout=time(0)+RECENT_BUNDLE_TIMEOUT;
+      recent_bundles[i].timeout=gettime_s()+RECENT_BUNDLE_TIMEOUT;
       return 0;
     } else {
-      if (recent_bundles[i].timeout<time(0)) first_timed_out=i;
+      if (recent_bundles[i].timeout<gettime_s()) first_timed_out=i;
     }
   if (recent_bundle_count>=MAX_RECENT_BUNDLES) {
     if (first_timed_out==-1) i=random()%MAX_RECENT_BUNDLES;
     else i=first_timed_out;
-    free(recent_bundles[i].bid_prefix); recent_bundles[i].bid_prefix=NULL;
+    id_release(recent_bundles[i].bid_id);
   } else {
     i=recent_bundle_count;
     recent_bundle_count++;
   }
 
-  recent_bundles[i].bid_prefix=strdup(bid_prefix);
+  // (held for as long as we remember it, as the partial that had it is gone)
+  recent_bundles[i].bid_id=id_hold(bid_id);
   recent_bundles[i].bundle_version=version;
-  recent_bundles[i].timeout=time(0)+RECENT_BUNDLE_TIMEOUT;
+  recent_bundles[i].timeout=gettime_s()+RECENT_BUNDLE_TIMEOUT;
 
   fprintf(stderr,"recent_bundle_count now %d\n",recent_bundle_count);
   return 0;
 }
 
-int sync_is_bundle_recently_received(char *bid_prefix, long long version)
+int sync_is_bundle_recently_received(int bid_id, long long version)
 {
+  if (!bid_id) return 0;
   for(int i=0;i<recent_bundle_count;i++) {
     
-    if (!strcasecmp(bid_prefix,recent_bundles[i].bid_prefix)) {
+    if (recent_bundles[i].bid_id==bid_id) {
       if (version<=recent_bundles[i].bundle_version)
-	if (recent_bundles[i].timeout>=time(0)) {
+	if (recent_bundles[i].timeout>=gettime_s()) {
 	  printf("Ignoring %s*/%lld because we recently received %s*/%lld\n",
-		 bid_prefix,version,
-		 recent_bundles[i].bid_prefix,
+		 id_hex(bid_id),version,
+		 id_hex(recent_bundles[i].bid_id),
 		 recent_bundles[i].bundle_version);
 	  return 1;
 	} else
@@ -50,21 +50,47 @@ typedef struct {
 #define QUEUED 2
 #define DONT_SEND 3
 
+// node flags
+#define NODE_QUEUEABLE 1 // has transmit_next and transmit_prev
+#define NODE_REFERENCE 2 // a leaf in a peer tree, for a key we have, that refers to our leaf
+
+/*
+  Peer trees can hold a node for every key that we differ from every peer by,
+  so nodes are only as big as they need to be.  Only our own nodes, and the
+  leaves a peer tells us about, are ever queued for transmission, so only they
+  have the transmit links on the end.  Leaves don't have children, and the
+  leaves a peer lacks refer to our own leaf for the key's context.
+*/
 struct node{
-  struct node *transmit_next;
-  struct node *transmit_prev;
   key_message_t message;
   uint8_t send_state;
   uint8_t sent_count;
-  void *context;
-  struct node *children[NODE_CHILDREN];
+  uint8_t flags;
+  union{
+    // leaf nodes
+    void *context;
+    // leaf nodes with NODE_REFERENCE
+    const struct node *ours;
+    // all other nodes
+    struct node *children[NODE_CHILDREN];
+  };
+  // only with NODE_QUEUEABLE
+  struct node *transmit_next;
+  struct node *transmit_prev;
 };
 
+#define NODE_LEAF_BYTES (offsetof(struct node, children) + sizeof(void *))
+#define NODE_BRANCH_BYTES offsetof(struct node, transmit_next)
+
 struct sync_peer_state{
   struct sync_peer_state *next;
   void *peer_context;
   unsigned send_count;
   unsigned recv_count;
+  // bytes of nodes in this peer's tree
+  size_t bytes;
+  // state->recv_clock when we last heard from this peer
+  unsigned last_recv;
   struct node *root;
 };
 
@@ -80,6 +106,12 @@ struct sync_state{
   unsigned received_record_count;
   unsigned received_uninteresting;
   unsigned progress;
+  // bytes of nodes in all peer trees, and how many we allow before evicting peers
+  size_t peer_bytes;
+  size_t peer_budget;
+  unsigned peer_evictions;
+  // counts calls to sync_recv_message
+  unsigned recv_clock;
   struct sync_peer_state *peers;
   struct node *root;
   struct node *transmit_ptr;
@@ -168,8 +200,34 @@ static void xor_children(struct node *node, key_message_t *dest)
   }
 }
 
-// Add a new key into the state tree, XOR'ing the key into each parent node
-static struct node *add_key(struct node **root, const sync_key_t *key, void *context, uint8_t stored)
+static size_t node_bytes(uint8_t flags, uint8_t leaf)
+{
+  if (flags & NODE_QUEUEABLE)
+    return sizeof(struct node);
+  return leaf ? NODE_LEAF_BYTES : NODE_BRANCH_BYTES;
+}
+
+// allocate a node for our tree (peer == NULL) or a peer's tree, and account for it
+static struct node *alloc_node(struct sync_state *state, struct sync_peer_state *peer, uint8_t flags, uint8_t leaf)
+{
+  size_t bytes = node_bytes(flags, leaf);
+  struct node *node = allocate(bytes);
+  node->flags = flags;
+  if (peer){
+    peer->bytes += bytes;
+    state->peer_bytes += bytes;
+  }
+  return node;
+}
+
+static void *leaf_context(const struct node *node)
+{
+  return (node->flags & NODE_REFERENCE) ? node->ours->context : node->context;
+}
+
+// Add a new key into our tree (peer == NULL) or a peer's tree, XOR'ing the key into each parent node.
+// A stored key in a peer tree is one we have, and context must be our leaf node for it.
+static struct node *add_key(struct sync_state *state, struct sync_peer_state *peer, struct node **root, const sync_key_t *key, void *context, uint8_t stored)
 {
   uint8_t prefix_len = 0;
   struct node **node = root;
@@ -205,7 +263,7 @@ static struct node *add_key(struct node **root, const sync_key_t *key, void *con
     }
     
     // if there is a mismatch in the range of prefix bits, we need to create a new node to represent the new range.
-    struct node *parent = allocate(sizeof(struct node));
+    struct node *parent = alloc_node(state, peer, peer ? 0 : NODE_QUEUEABLE, 0);
     parent->message.min_prefix_len = min_prefix_len;
     parent->message.prefix_len = prefix_len;
     parent->message.stored = stored;
@@ -223,25 +281,37 @@ static struct node *add_key(struct node **root, const sync_key_t *key, void *con
     *node = parent;
   }
   // create final leaf node
-  *node = allocate(sizeof(struct node));
+  uint8_t flags = (peer && stored) ? NODE_REFERENCE : NODE_QUEUEABLE;
+  *node = alloc_node(state, peer, flags, 1);
   (*node)->message.key = *key;
   (*node)->message.min_prefix_len = min_prefix_len;
   (*node)->message.prefix_len = KEY_LEN_BITS;
   (*node)->message.stored = stored;
-  (*node)->context = context;
+  if (flags & NODE_REFERENCE)
+    (*node)->ours = context;
+  else
+    (*node)->context = context;
   return (*node);
 }
 
-// Recursively free the memory used by this tree
-static void free_node(struct sync_state *state, struct node *node)
+// Recursively free the memory used by this tree, which is our tree if peer is NULL
+static void free_node(struct sync_state *state, struct sync_peer_state *peer, struct node *node)
 {
   if (!node)
     return;
   
-  for (unsigned i=0;i<NODE_CHILDREN;i++)
-    free_node(state, node->children[i]);
+  uint8_t leaf = node->message.prefix_len == KEY_LEN_BITS;
+  if (!leaf)
+    for (unsigned i=0;i<NODE_CHILDREN;i++)
+      free_node(state, peer, node->children[i]);
   
-  if (node->transmit_next){
+  if (peer && state){
+    size_t bytes = node_bytes(node->flags, leaf);
+    peer->bytes -= bytes;
+    state->peer_bytes -= bytes;
+  }
+  
+  if ((node->flags & NODE_QUEUEABLE) && node->transmit_next){
     assert(state);
     assert(node->transmit_prev);
     
@@ -259,7 +329,7 @@ static void free_node(struct sync_state *state, struct node *node)
   free(node);
 }
 
-static void remove_key(struct sync_state *state, struct node **root, const sync_key_t *key)
+static void remove_key(struct sync_state *state, struct sync_peer_state *peer, struct node **root, const sync_key_t *key)
 {
   uint8_t prefix_len = 0;
   struct node **node = root;
@@ -291,7 +361,7 @@ static void remove_key(struct sync_state *state, struct node **root, const sync_
     prefix_len += PREFIX_STEP_BITS;
   }
   
-  free_node(state, (*node));
+  free_node(state, peer, (*node));
   *node = NULL;
   
   if (!parent)
@@ -314,7 +384,7 @@ static void remove_key(struct sync_state *state, struct node **root, const sync_
   *node = NULL;
   c->message.min_prefix_len = (*parent)->message.min_prefix_len;
   
-  free_node(state, *parent);
+  free_node(state, peer, *parent);
   
   *parent = c;
 }
@@ -360,20 +430,16 @@ int sync_has_transmit_queued(const struct sync_state *state)
 }
 
 // returns NULL if the node already exists
-static struct node * add_key_if_missing(struct node **root, const key_message_t *message, uint8_t stored)
+static struct node * add_key_if_missing(struct sync_state *state, struct sync_peer_state *peer, const key_message_t *message)
 {
   assert(message->prefix_len == KEY_LEN_BITS);
-  if (find_message(*root, message)!=NULL)
+  if (find_message(peer->root, message)!=NULL)
     return NULL;
-  return add_key(root, &message->key, NULL, stored);
+  return add_key(state, peer, &peer->root, &message->key, NULL, 0);
 }
 
 void sync_add_key(struct sync_state *state, const sync_key_t *key, void *context)
 {
-
-  printf("sync_add_key() inserting %02X%02X*\n",
-	 ((unsigned char *)key)[0],((unsigned char *)key)[1]);
-  
   key_message_t message = MESSAGE_FROM_KEY(key);
   struct node *node = (struct node *)find_message(state->root, &message);
   if (node){
@@ -384,32 +450,100 @@ void sync_add_key(struct sync_state *state, const sync_key_t *key, void *context
   
   state->key_count++;
   state->progress=0;
-  add_key(&state->root, key, context, 1);
+  add_key(state, NULL, &state->root, key, context, 1);
   
   struct sync_peer_state *peer_state = state->peers;
   while(peer_state){
     if (find_message(peer_state->root, &message)){
-      remove_key(state, &peer_state->root, key);
+      remove_key(state, peer_state, &peer_state->root, key);
       peer_state->recv_count--;
     }
     peer_state = peer_state->next;
   }
 }
 
+static void free_peer_state(struct sync_state *state, struct sync_peer_state **peer_state)
+{
+  struct sync_peer_state *free_peer = (*peer_state);
+  free_node(state, free_peer, free_peer->root);
+  *peer_state = free_peer->next;
+  free(free_peer);
+}
+
 void sync_free_peer_state(struct sync_state *state, void *peer_context){
   struct sync_peer_state **peer_state = &state->peers;
   while(*peer_state){
     if ((*peer_state)->peer_context == peer_context){
-      struct sync_peer_state *free_peer = (*peer_state);
-      free_node(state, free_peer->root);
-      *peer_state = free_peer->next;
-      free(free_peer);
+      free_peer_state(state, peer_state);
       return;
     }
     peer_state= &(*peer_state)->next;
   }
 }
 
+unsigned sync_evict_peers(struct sync_state *state, int (*evict)(void *peer_context))
+{
+  unsigned count=0;
+  struct sync_peer_state **peer_state = &state->peers;
+  while(*peer_state){
+    if (evict((*peer_state)->peer_context)){
+      free_peer_state(state, peer_state);
+      count++;
+    }else
+      peer_state= &(*peer_state)->next;
+  }
+  state->peer_evictions+=count;
+  return count;
+}
+
+void sync_set_peer_budget(struct sync_state *state, size_t bytes)
+{
+  state->peer_budget = bytes;
+}
+
+/*
+  While the peer trees are over budget, throw away the tree of the peer we
+  have gone longest without hearing from.  Its tree is likely the stalest, and
+  the peer the least likely to still be in range to use it.  If we do hear from
+  it again, it starts again from an empty tree, as a new peer would.  The peer
+  we just heard from is never evicted, even if its tree alone is over budget.
+*/
+static void enforce_peer_budget(struct sync_state *state, const struct sync_peer_state *keep)
+{
+  while(state->peer_budget && state->peer_bytes > state->peer_budget){
+    struct sync_peer_state **oldest = NULL;
+    for (struct sync_peer_state **p = &state->peers; *p; p = &(*p)->next){
+      if (*p == keep)
+        continue;
+      // clock wrap safe comparison
+      if (!oldest || (int)((*p)->last_recv - (*oldest)->last_recv) < 0)
+        oldest = p;
+    }
+    if (!oldest)
+      return;
+    free_peer_state(state, oldest);
+    state->peer_evictions++;
+  }
+}
+
+void sync_get_stats(const struct sync_state *state, struct sync_stats *stats)
+{
+  bzero(stats, sizeof(struct sync_stats));
+  stats->key_count = state->key_count;
+  stats->sent_root = state->sent_root;
+  stats->sent_messages = state->sent_messages;
+  stats->sent_record_count = state->sent_record_count;
+  stats->received_record_count = state->received_record_count;
+  stats->received_uninteresting = state->received_uninteresting;
+  stats->peer_bytes = state->peer_bytes;
+  stats->peer_evictions = state->peer_evictions;
+  for (const struct sync_peer_state *peer_state = state->peers; peer_state; peer_state = peer_state->next){
+    stats->peer_count++;
+    if (peer_state->bytes > stats->peer_bytes_max)
+      stats->peer_bytes_max = peer_state->bytes;
+  }
+}
+
 struct sync_state* sync_alloc_state(void *context, peer_has has, peer_does_not_have has_not, peer_now_has now_has){
   struct sync_state *state = allocate(sizeof (struct sync_state));
   state->context = context;
@@ -428,12 +562,12 @@ void sync_free_state(struct sync_state *state){
     p->transmit_prev=NULL;
   }
   
-  free_node(NULL, state->root);
+  free_node(NULL, NULL, state->root);
     
   while(state->peers){
     struct sync_peer_state *peer_state = state->peers;
     
-    free_node(NULL, peer_state->root);
+    free_node(NULL, peer_state, peer_state->root);
     
     state->peers = peer_state->next;
     free(peer_state);
@@ -519,6 +653,7 @@ size_t sync_build_message(struct sync_state *state, uint8_t *buff, size_t len)
 // the node can be added to the head or tail of the list.
 static void queue_node(struct sync_state *state, struct node *node, uint8_t head)
 {
+  assert(node->flags & NODE_QUEUEABLE);
   node->send_state = QUEUED;
   if (node->transmit_next)
     return;
@@ -552,14 +687,14 @@ static unsigned peer_is_missing(struct sync_state *state, struct sync_peer_state
       // peer has now received this key?
       if (state->now_has)
 	state->now_has(state->context, peer->peer_context, node->context, &node->message.key);
-      remove_key(state, &peer->root, &node->message.key);
+      remove_key(state, peer, &peer->root, &node->message.key);
       peer->send_count --;
       return 1;
     }
     return 0;
   }
   
-  add_key(&peer->root, &node->message.key, node->context, 1);
+  add_key(state, peer, &peer->root, &node->message.key, (void *)node, 1);
   peer->send_count ++;
   state->progress=0;
   if (state->has_not)
@@ -589,7 +724,7 @@ static void peer_add_key(struct sync_state *state, struct sync_peer_state *peer_
   if (message->prefix_len != KEY_LEN_BITS || !message->stored)
     return;
     
-  struct node *node = add_key_if_missing(&peer_state->root, message, 0);
+  struct node *node = add_key_if_missing(state, peer_state, message);
   
   if (node){
     //Yay, they told us something we didn't know.
@@ -620,8 +755,8 @@ static unsigned peer_has_received_all(struct sync_state *state, struct sync_peer
   if (peer_node->message.prefix_len == KEY_LEN_BITS){
     if (peer_node->message.stored){
       if (state->now_has)
-	state->now_has(state->context, peer_state->peer_context, peer_node->context, &peer_node->message.key);
-      remove_key(state, &peer_state->root, &peer_node->message.key);
+	state->now_has(state->context, peer_state->peer_context, leaf_context(peer_node), &peer_node->message.key);
+      remove_key(state, peer_state, &peer_state->root, &peer_node->message.key);
       peer_state->send_count --;
       ret=1;
     }
@@ -883,7 +1018,11 @@ int sync_recv_message(struct sync_state *state, void *peer_context, const uint8_
     peer_state->peer_context = peer_context;
     peer_state->next = state->peers;
     state->peers = peer_state;
+    // a new peer, or one we evicted, starts from our root
+    if (state->root)
+      queue_node(state, state->root, 0);
   }
+  peer_state->last_recv = ++state->recv_clock;
   
   size_t offset=0;
   if (len%MESSAGE_BYTES)
@@ -903,6 +1042,7 @@ int sync_recv_message(struct sync_state *state, void *peer_context, const uint8_
       
     offset+=MESSAGE_BYTES;
   }
+  enforce_peer_budget(state, peer_state);
   return 0;
 }
 
@@ -0,0 +1,241 @@
+/*
+Serval Low-Bandwidth Rhizome Transport
+Copyright (C) 2018 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Sync tree memory benchmark: how much we hold for each peer in a dense mesh.
+
+  We have the given number of keys.  Each peer in turn lacks a random
+  missing_percent of them, and has a tenth as many again of its own, and syncs
+  with us over LINK_MTU sized messages until neither of us has anything left
+  to say.  No bundles are transferred, so the differences stay in our tree of
+  the peer, as they do while a radio link slowly works through them.
+
+  This is done once with no budget for the peer trees, and once with the
+  given budget.  Each time, the first peer, which we heard from longest ago,
+  then syncs with us again.  If we still have its tree, there is nothing new
+  to find.  If we evicted it, the peer forgets what it told us as well, as it
+  will when our instance ID next changes (see main.c), and we must find every
+  difference again.  For each,
+  we report the bytes held for all peers and for the largest peer, the bytes
+  per difference, how many of the differences were found, and the evictions.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/time.h>
+
+#include "sync.h"
+#include "lbard.h"
+
+#define SYNCBENCH_MAX_ROUNDS 100000
+
+struct syncbench_peer {
+  unsigned seed;
+  int lacks;
+  int extras;
+  // differences found, by our peer_does_not_have and peer_has callbacks
+  int found_lacks;
+  int found_extras;
+};
+
+static struct syncbench_peer *syncbench_peers=NULL;
+// The peer context the remote peers know us by
+static int syncbench_me;
+
+static void syncbench_peer_has(void *context,void *peer_context,const sync_key_t *key)
+{
+  ((struct syncbench_peer *)peer_context)->found_extras++;
+}
+
+static void syncbench_peer_does_not_have(void *context,void *peer_context,void *key_context,
+					 const sync_key_t *key)
+{
+  ((struct syncbench_peer *)peer_context)->found_lacks++;
+}
+
+static void syncbench_ignore_now_has(void *context,void *peer_context,void *key_context,
+				     const sync_key_t *key) { }
+static void syncbench_ignore_has(void *context,void *peer_context,const sync_key_t *key) { }
+static void syncbench_ignore_does_not_have(void *context,void *peer_context,void *key_context,
+					   const sync_key_t *key) { }
+
+static long long syncbench_time_us(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return tv.tv_sec*1000000LL+tv.tv_usec;
+}
+
+static void syncbench_random_key(sync_key_t *key,unsigned *seed)
+{
+  for(int i=0;i<KEY_LEN;i++) key->key[i]=rand_r(seed);
+}
+
+static struct sync_state *syncbench_remote(struct syncbench_peer *peer,
+					   sync_key_t *keys,int key_count,int missing_percent)
+{
+  struct sync_state *remote=sync_alloc_state(NULL,syncbench_ignore_has,
+					      syncbench_ignore_does_not_have,
+					      syncbench_ignore_now_has);
+  // The same peer always has the same keys
+  unsigned seed=peer->seed;
+  peer->lacks=0;
+  for(int i=0;i<key_count;i++) {
+    if ((rand_r(&seed)%100)<missing_percent) peer->lacks++;
+    else sync_add_key(remote,&keys[i],NULL);
+  }
+  peer->extras=key_count*missing_percent/1000;
+  for(int i=0;i<peer->extras;i++) {
+    sync_key_t key;
+    syncbench_random_key(&key,&seed);
+    sync_add_key(remote,&key,NULL);
+  }
+  return remote;
+}
+
+// Sync the peer with us, returning the number of rounds it took, or -1 if we never finish
+static int syncbench_sync_peer(struct sync_state *us,struct syncbench_peer *peer,
+			       struct sync_state *remote)
+{
+  peer->found_lacks=0;
+  peer->found_extras=0;
+
+  uint8_t msg[LINK_MTU];
+  int round;
+  for(round=0;round<SYNCBENCH_MAX_ROUNDS;round++) {
+    size_t used=sync_build_message(remote,msg,sizeof(msg));
+    if (used) sync_recv_message(us,peer,msg,used);
+    used=sync_build_message(us,msg,sizeof(msg));
+    if (used) sync_recv_message(remote,&syncbench_me,msg,used);
+    if (!sync_has_transmit_queued(remote)&&!sync_has_transmit_queued(us))
+      return round+1;
+  }
+  return -1;
+}
+
+static void syncbench_report(char *name,struct sync_state *us,int peers,int synced,
+			     long long lacks,long long found_lacks,
+			     long long extras,long long found_extras,
+			     long long rounds,long long elapsed_us)
+{
+  struct sync_stats st;
+  sync_get_stats(us,&st);
+  long long held=found_lacks+found_extras;
+  fprintf(stderr,"%-12s %5d/%-5d %10.1f %10.1f %8.1f %6.1f%% %6.1f%% %9u %9.1f %8.1f\n",
+	  name,st.peer_count,peers,
+	  st.peer_bytes/1024.0,st.peer_bytes_max/1024.0,
+	  (st.peer_evictions||!held)?0:(double)st.peer_bytes/held,
+	  lacks?found_lacks*100.0/lacks:100.0,
+	  extras?found_extras*100.0/extras:100.0,
+	  st.peer_evictions,
+	  (double)rounds/synced,
+	  elapsed_us/1000.0);
+}
+
+static int syncbench_run(char *name,int peers,sync_key_t *keys,int key_count,
+			 int missing_percent,size_t budget)
+{
+  struct sync_state *us=sync_alloc_state(NULL,syncbench_peer_has,
+					  syncbench_peer_does_not_have,
+					  syncbench_ignore_now_has);
+  sync_set_peer_budget(us,budget);
+  for(int i=0;i<key_count;i++) sync_add_key(us,&keys[i],&keys[i]);
+
+  long long lacks=0,found_lacks=0,extras=0,found_extras=0,rounds=0;
+  int failed=0;
+  struct sync_state *first_remote=NULL;
+  long long start=syncbench_time_us();
+  for(int p=0;p<peers;p++) {
+    struct sync_state *remote=syncbench_remote(&syncbench_peers[p],keys,key_count,
+					       missing_percent);
+    int r=syncbench_sync_peer(us,&syncbench_peers[p],remote);
+    if (r<0) failed=1;
+    rounds+=r;
+    if (p) sync_free_state(remote);
+    else first_remote=remote;
+    lacks+=syncbench_peers[p].lacks;
+    found_lacks+=syncbench_peers[p].found_lacks;
+    extras+=syncbench_peers[p].extras;
+    found_extras+=syncbench_peers[p].found_extras;
+  }
+  syncbench_report(name,us,peers,peers,lacks,found_lacks,extras,found_extras,
+		   rounds,syncbench_time_us()-start);
+
+  if ((found_lacks<lacks)||(found_extras<extras)) failed=1;
+
+  // Peers are evicted oldest first, so the first is gone if any are
+  struct sync_stats st;
+  sync_get_stats(us,&st);
+  int evicted=st.peer_count<peers;
+  if (evicted) sync_free_peer_state(first_remote,&syncbench_me);
+
+  struct syncbench_peer *first=&syncbench_peers[0];
+  start=syncbench_time_us();
+  rounds=syncbench_sync_peer(us,first,first_remote);
+  if ((!evicted)&&(first->found_lacks||first->found_extras)) failed=1;
+  syncbench_report(evicted?"  0 back, new":"  0 back, kept",us,peers,1,
+		   evicted?first->lacks:0,first->found_lacks,
+		   evicted?first->extras:0,first->found_extras,
+		   rounds,syncbench_time_us()-start);
+  if ((rounds<0)
+      ||(evicted&&((first->found_lacks<first->lacks)||(first->found_extras<first->extras))))
+    failed=1;
+
+  sync_free_state(first_remote);
+  sync_free_state(us);
+  return failed;
+}
+
+int sync_memory_benchmark(int peers,int key_count,int missing_percent,int budget_kb)
+{
+  if ((peers<1)||(key_count<1)||(missing_percent<0)||(missing_percent>100)
+      ||(budget_kb<0)) {
+    fprintf(stderr,"syncbench: bad arguments\n");
+    return -1;
+  }
+
+  sync_key_t *keys=calloc(key_count,sizeof(sync_key_t));
+  syncbench_peers=calloc(peers,sizeof(struct syncbench_peer));
+  if ((!keys)||(!syncbench_peers)) {
+    fprintf(stderr,"syncbench: out of memory\n");
+    return -1;
+  }
+  unsigned seed=1;
+  for(int i=0;i<key_count;i++) syncbench_random_key(&keys[i],&seed);
+  for(int p=0;p<peers;p++) syncbench_peers[p].seed=1000+p;
+
+  fprintf(stderr,"Sync tree memory: %d peers, %d keys, peers lack %d%% of ours, budget %dKB\n",
+	  peers,key_count,missing_percent,budget_kb);
+  fprintf(stderr,"%-12s %11s %10s %10s %8s %7s %7s %9s %9s %8s\n",
+	  "budget","peers held","total KB","max KB","B/diff","lacks","extras",
+	  "evictions","rounds","ms");
+
+  int failed=syncbench_run("none",peers,keys,key_count,missing_percent,0);
+  char name[32];
+  snprintf(name,sizeof(name),"%dKB",budget_kb);
+  failed|=syncbench_run(name,peers,keys,key_count,missing_percent,(size_t)budget_kb*1024);
+
+  free(keys);
+  free(syncbench_peers);
+  syncbench_peers=NULL;
+  if (failed) fprintf(stderr,"syncbench: a sync did not finish, or missed differences\n");
+  return failed?-1:0;
+}
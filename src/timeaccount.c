@@ -55,14 +55,122 @@ struct time_excursion {
 
 #define MAX_TIME_EXCURSIONS 16
 #define TIME_EXCURSION_THRESHOLD 250
+// The recent list is a ring, so that recording an excursion doesn't have to
+// shuffle the whole list down.  recent_head is the slot of the newest entry.
 int recent_count = 0;
+int recent_head = 0;
 struct time_excursion recent[MAX_TIME_EXCURSIONS];
 int alltime_count = 0;
 struct time_excursion alltime[MAX_TIME_EXCURSIONS];
 
+/* Every section named in a call to account_time() gets its own latency
+   histogram, so that we can see the steady-state cost and tail latency of
+   each part of the main loop, not just the occasional excursion. */
+#define MAX_TIME_SECTIONS 64
+struct time_section {
+  char *source;     // pointer that was passed to account_time()
+  char name[32];
+  struct latency_histogram histogram;
+};
+int time_section_count = 0;
+struct time_section time_sections[MAX_TIME_SECTIONS];
+int last_time_section = -1;
+
 long long accumulated_time = 0;
 long long current_interval_start = 0;
 char current_interval_source[32] = "(none)";
+int current_interval_section = -1;
+
+/* Bucket n covers values up to latency_histogram_bucket_limit(n).
+   The first LATENCY_HISTOGRAM_LINEAR buckets are 1us wide, after which each
+   power of two is split into LATENCY_HISTOGRAM_SUBBUCKETS equal parts, which
+   keeps the error on the reported percentiles below 25%. */
+int latency_histogram_bucket(long long value)
+{
+  if (value < 0) value = 0;
+  if (value < LATENCY_HISTOGRAM_LINEAR) return value;
+
+  int octave = 63 - __builtin_clzll((unsigned long long)value);
+  int sub = (value >> (octave - 2)) & (LATENCY_HISTOGRAM_SUBBUCKETS - 1);
+  int bucket = LATENCY_HISTOGRAM_LINEAR
+    + (octave - 4) * LATENCY_HISTOGRAM_SUBBUCKETS + sub;
+  if (bucket >= LATENCY_HISTOGRAM_BUCKETS) bucket = LATENCY_HISTOGRAM_BUCKETS - 1;
+  return bucket;
+}
+
+long long latency_histogram_bucket_limit(int bucket)
+{
+  if (bucket < LATENCY_HISTOGRAM_LINEAR) return bucket;
+
+  int octave = 4 + (bucket - LATENCY_HISTOGRAM_LINEAR) / LATENCY_HISTOGRAM_SUBBUCKETS;
+  int sub = (bucket - LATENCY_HISTOGRAM_LINEAR) % LATENCY_HISTOGRAM_SUBBUCKETS;
+  return (1LL << octave) + ((long long)(sub + 1) << (octave - 2)) - 1;
+}
+
+int latency_histogram_record(struct latency_histogram *h, long long value)
+{
+  if (! h) return -1;
+  if (value < 0) value = 0;
+
+  h->buckets[latency_histogram_bucket(value)]++;
+  h->count++;
+  h->sum += value;
+  if (value > h->max) h->max = value;
+
+  return 0;
+}
+
+// Returns the upper bound of the bucket that holds the requested percentile,
+// clamped to the largest value actually seen.
+long long latency_histogram_percentile(struct latency_histogram *h, int percent)
+{
+  if ((! h) || (! h->count)) return 0;
+
+  long long rank = (h->count * percent + 99) / 100;
+  if (rank < 1) rank = 1;
+
+  long long seen = 0;
+  for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank) {
+      long long limit = latency_histogram_bucket_limit(i);
+      return (limit < h->max) ? limit : h->max;
+    }
+  }
+
+  return h->max;
+}
+
+int time_section_lookup(char *source)
+{
+  // The main loop visits its sections in the same order every time, so the
+  // entry after the previous one is nearly always the one we want.
+  int guess = last_time_section + 1;
+  if ((guess < time_section_count) && (time_sections[guess].source == source)) {
+    return guess;
+  }
+
+  for (int i = 0; i < time_section_count; i++) {
+    if (time_sections[i].source == source) return i;
+  }
+
+  for (int i = 0; i < time_section_count; i++) {
+    if (! strncmp(time_sections[i].name, source, sizeof(time_sections[i].name) - 1)) {
+      return i;
+    }
+  }
+
+  if (time_section_count >= MAX_TIME_SECTIONS) {
+    return -1;
+  }
+
+  int n = time_section_count++;
+  bzero(&time_sections[n], sizeof(struct time_section));
+  time_sections[n].source = source;
+  strncpy(time_sections[n].name, source, sizeof(time_sections[n].name) - 1);
+
+  return n;
+}
 
 int log_time(long long interval, char *source)
 {
@@ -77,51 +185,55 @@ int log_time(long long interval, char *source)
       break;
     }
 
+    // Excursions are kept in milliseconds
+    interval = interval / 1000;
+
     if (interval < TIME_EXCURSION_THRESHOLD) {
       retVal = 0;
       break;
     }
 
-    // Shuffle down recent time excursions
-    int i;
-    for (i = MAX_TIME_EXCURSIONS; i > 0; i--) {
-      recent[i]=recent[i-1];
-    }
+    long long now = gettime_ms();
 
-    strncpy(recent[0].source, source, sizeof(recent[0].source));
-
-    recent[0].duration = interval;
-    recent[0].when = gettime_ms();
+    // Record in the ring of recent time excursions
+    recent_head = (recent_head + MAX_TIME_EXCURSIONS - 1) % MAX_TIME_EXCURSIONS;
+    strncpy(recent[recent_head].source, source, sizeof(recent[recent_head].source) - 1);
+    recent[recent_head].source[sizeof(recent[recent_head].source) - 1] = 0;
+    recent[recent_head].duration = interval;
+    recent[recent_head].when = now;
     if (recent_count < MAX_TIME_EXCURSIONS) {
       recent_count++;
     }
 
-    // Insert into all time list
-    int insert = -1;
-    for (i = 0; i < MAX_TIME_EXCURSIONS; i++) {
-      if (i < alltime_count) {
-        if (alltime[i].duration <= interval) {
-          insert=i;
-          break; // for
-        }
+    // Insert into all time list, if it is long enough to make the list
+    int insert = alltime_count;
+    int i;
+    for (i = 0; i < alltime_count; i++) {
+      if (alltime[i].duration <= interval) {
+        insert = i;
+        break; // for
       }
     }
 
-    if (insert < 0) {
-      insert = 0;
+    if (insert >= MAX_TIME_EXCURSIONS) {
+      retVal = 0;
+      break;
     }
 
-    for (i = MAX_TIME_EXCURSIONS; i > insert; i--) {
+    if (alltime_count < MAX_TIME_EXCURSIONS) {
+      alltime_count++;
+    }
+
+    for (i = alltime_count - 1; i > insert; i--) {
       alltime[i] = alltime[i-1];
     }
 
-    strncpy(alltime[insert].source,source, sizeof(alltime[insert].source));
+    strncpy(alltime[insert].source, source, sizeof(alltime[insert].source) - 1);
+    alltime[insert].source[sizeof(alltime[insert].source) - 1] = 0;
     alltime[insert].duration = interval;
-    alltime[insert].when = gettime_ms();
-    if (alltime_count < MAX_TIME_EXCURSIONS) {
-      alltime_count++;
-    }
+    alltime[insert].when = now;
 
+    retVal = 0;
   }
   while (0);
 
@@ -134,7 +246,7 @@ int account_time_pause()
 {  
   LOG_ENTRY;
 
-  accumulated_time += (gettime_ms() - current_interval_start);
+  accumulated_time += (gettime_us() - current_interval_start);
 
   LOG_EXIT;
 
@@ -145,7 +257,7 @@ int account_time_resume()
 {
   LOG_ENTRY;
 
-  current_interval_start = gettime_ms();
+  current_interval_start = gettime_us();
 
   LOG_EXIT;
 
@@ -157,18 +269,28 @@ int account_time(char *source)
 
   LOG_ENTRY;
 
+  long long now = gettime_us();
+
   if (current_interval_start) {
     // Close of current interval
-    long long interval_duration = gettime_ms() - current_interval_start;
+    long long interval_duration = now - current_interval_start;
     interval_duration += accumulated_time;
     accumulated_time = 0;
 
+    if (current_interval_section >= 0) {
+      latency_histogram_record(&time_sections[current_interval_section].histogram,
+                               interval_duration);
+    }
     log_time(interval_duration, current_interval_source);
   }
 
-  current_interval_start = gettime_ms();
+  current_interval_start = now;
   accumulated_time = 0;
-  strncpy(current_interval_source, source, sizeof(current_interval_source));
+  strncpy(current_interval_source, source, sizeof(current_interval_source) - 1);
+  current_interval_section = time_section_lookup(source);
+  if (current_interval_section >= 0) {
+    last_time_section = current_interval_section;
+  }
 
   LOG_EXIT;
 
@@ -195,7 +317,8 @@ int show_time_accounting(FILE *f)
       "<table border=1 padding=2>\n"
       "<tr><th>Function</th><th>Duration</th><th>Time ago</th></tr>\n");
 
-    for(int i = 0; i < recent_count; i++) {
+    for(int n = 0; n < recent_count; n++) {
+      int i = (recent_head + n) % MAX_TIME_EXCURSIONS;
       // KC: QUESTION: should this not be *recent[i].source ? AFAIK, the test below is always true
       if (*recent[i].source) {
         fprintf(f,"<tr><td>%s</td><td>%lld ms</td><td> T-%lldms</td></tr>\n",
@@ -223,6 +346,122 @@ int show_time_accounting(FILE *f)
 
     fprintf(f,"</table></td></tr></table>\n");
 
+    fprintf(f,
+      "<h2>Time spent per section</h2>\n"
+      "<table border=1 padding=2>\n"
+      "<tr><th>Section</th><th>Count</th><th>Mean</th><th>p50</th><th>p90</th>"
+      "<th>p99</th><th>Max</th></tr>\n");
+
+    for(int i = 0; i < time_section_count; i++) {
+      struct latency_histogram *h = &time_sections[i].histogram;
+      if (! h->count) continue;
+      fprintf(f,"<tr><td>%s</td><td>%lld</td><td>%lld us</td><td>%lld us</td>"
+        "<td>%lld us</td><td>%lld us</td><td>%lld us</td></tr>\n",
+        time_sections[i].name,
+        h->count,
+        h->sum / h->count,
+        latency_histogram_percentile(h, 50),
+        latency_histogram_percentile(h, 90),
+        latency_histogram_percentile(h, 99),
+        h->max);
+    }
+
+    fprintf(f,"</table>\n");
+
+  }
+  while (0);
+
+  LOG_EXIT;
+
+  return 0;
+}
+
+// Prometheus label values may not contain raw quotes, backslashes or newlines
+int time_accounting_escape_label(FILE *f, char *s)
+{
+  for (; *s; s++) {
+    switch (*s) {
+    case '\\': fprintf(f, "\\\\"); break;
+    case '"': fprintf(f, "\\\""); break;
+    case '\n': fprintf(f, "\\n"); break;
+    default: fputc(*s, f);
+    }
+  }
+  return 0;
+}
+
+int show_time_accounting_text(FILE *f)
+{
+  LOG_ENTRY;
+
+  do {
+
+    if (! f) {
+      LOG_ERROR("f is null");
+      break;
+    }
+
+    fprintf(f,
+      "# HELP lbard_section_duration_microseconds Time spent in each account_time() section of the main loop.\n"
+      "# TYPE lbard_section_duration_microseconds summary\n");
+
+    for(int i = 0; i < time_section_count; i++) {
+      struct latency_histogram *h = &time_sections[i].histogram;
+      int quantiles[3] = { 50, 90, 99 };
+
+      for(int q = 0; q < 3; q++) {
+        fprintf(f, "lbard_section_duration_microseconds{section=\"");
+        time_accounting_escape_label(f, time_sections[i].name);
+        fprintf(f, "\",quantile=\"%g\"} %lld\n",
+          quantiles[q] / 100.0, latency_histogram_percentile(h, quantiles[q]));
+      }
+      fprintf(f, "lbard_section_duration_microseconds_sum{section=\"");
+      time_accounting_escape_label(f, time_sections[i].name);
+      fprintf(f, "\"} %lld\n", h->sum);
+      fprintf(f, "lbard_section_duration_microseconds_count{section=\"");
+      time_accounting_escape_label(f, time_sections[i].name);
+      fprintf(f, "\"} %lld\n", h->count);
+    }
+
+  }
+  while (0);
+
+  LOG_EXIT;
+
+  return 0;
+}
+
+int show_time_accounting_json(FILE *f)
+{
+  LOG_ENTRY;
+
+  do {
+
+    if (! f) {
+      LOG_ERROR("f is null");
+      break;
+    }
+
+    fprintf(f, "{\n\"sections\": [\n");
+
+    for(int i = 0; i < time_section_count; i++) {
+      struct latency_histogram *h = &time_sections[i].histogram;
+      fprintf(f, "%s  { \"section\": \"", i ? ",\n" : "");
+      // Section names are string literals from our own code, but play it safe
+      for(char *c = time_sections[i].name; *c; c++) {
+        if ((*c == '"') || (*c == '\\')) fputc('\\', f);
+        if (*c >= ' ') fputc(*c, f);
+      }
+      fprintf(f, "\", \"count\": %lld, \"sum_us\": %lld, \"max_us\": %lld,"
+        " \"p50_us\": %lld, \"p90_us\": %lld, \"p99_us\": %lld }",
+        h->count, h->sum, h->max,
+        latency_histogram_percentile(h, 50),
+        latency_histogram_percentile(h, 90),
+        latency_histogram_percentile(h, 99));
+    }
+
+    fprintf(f, "\n]\n}\n");
+
   }
   while (0);
 
@@ -16,6 +16,7 @@
 #include "lbard.h"
 #include "radios.h"
 #include "code_instrumentation.h"
+#include "virtualtime.h"
 
 #ifdef WIN32
 #include <windows.h>
@@ -56,6 +57,12 @@ long long gettime_us()
 
   do 
   {
+    if (virtual_clock)
+    {
+      retVal = virtual_clock_now_us();
+      break;
+    }
+
     struct timeval nowtv;
 
     // If gettimeofday() fails or returns an invalid value, all else is lost!
@@ -89,6 +96,12 @@ long long gettime_ms()
 
   do
   {
+    if (virtual_clock)
+    {
+      retVal = virtual_clock_now_us() / 1000;
+      break;
+    }
+
     struct timeval nowtv;
 
     // If gettimeofday() fails or returns an invalid value, all else is lost!
@@ -113,6 +126,13 @@ long long gettime_ms()
   return retVal;
 }
 
+// Wall-clock seconds, i.e., time(0), unless we are running on a virtual clock
+time_t gettime_s()
+{
+  if (virtual_clock) return virtual_clock_now_us() / 1000000LL;
+  return time(0);
+}
+
 int chartohex(int c)
 {
   int retVal = -1;
@@ -294,280 +314,6 @@ int chartohexnybl(int c)
 }
 
 
-int hex_encode(unsigned char *in, char *out, int in_len, int radio_type)
-{
-  int retVal = -1;
-
-  LOG_ENTRY;
-
-  do
-  {    
-#if COMPILE_TEST_LEVEL >= TEST_LEVEL_LIGHT
-    if (! in) 
-    {
-      LOG_ERROR("in is null");
-      break;
-    }
-    if (! out) 
-    {
-      LOG_ERROR("out is null");
-      break;
-    }
-    if (in_len > SENSIBLE_MEMORY_BLOCK_SIZE)
-    {
-      LOG_WARN("out_len seems a bit large: %d", in_len);
-    }
-    if (radio_type < RADIOTYPE_MIN || radio_type > RADIOTYPE_MAX)
-    {
-      LOG_WARN("radio_type out of range %d", radio_type);
-    }
-#endif
-
-    int out_ofs=0;
-    int i;
-
-    for (i = 0; i < in_len; i++) {
-
-      out[out_ofs++] = nybltohexchar(in[i]>>4);
-      out[out_ofs++] = nybltohexchar(in[i]&0xf);
-
-    }
-
-    out[out_ofs]=0;
-
-    retVal = out_ofs;
-
-  }
-  while (0);
-
-  LOG_EXIT;
-
-  return retVal;
-}
-
-int hex_decode(char *in, unsigned char *out, int out_len, int radio_type)
-{
-  int retVal = -1;
-
-  LOG_ENTRY;
-
-  do 
-  {
-#if COMPILE_TEST_LEVEL >= TEST_LEVEL_LIGHT
-    if (! in) 
-    {
-      LOG_ERROR("in is null");
-      break;
-    }
-    if (! out) 
-    {
-      LOG_ERROR("out is null");
-      break;
-    }
-    if (out_len > SENSIBLE_MEMORY_BLOCK_SIZE)
-    {
-      LOG_WARN("out_len seems a bit large: %d", out_len);
-    }
-    if (radio_type < RADIOTYPE_MIN || radio_type > RADIOTYPE_MAX)
-    {
-      LOG_WARN("radio_type out of range %d", radio_type);
-    }
-#endif
-
-    int i;
-    int out_count=0;
-
-    int inLen = strlen(in);
-
-    for (i = 0; i < inLen; i+=2) {
-      int v = hextochar(in[i+0]) << 4;
-      v |= hextochar(in[i+1]);
-      out[out_count++] = v;
-      if (out_count >= out_len) 
-      {
-       LOG_ERROR("trying to write more than out_len chars");
-       break;//for
-      }
-    }
-    out[out_count] = 0;
-    retVal = out_count;
-  }
-  while (0);
-
-  LOG_EXIT;
-
-  return retVal;
-}
-
-int ascii64_encode(unsigned char *in, char *out, int in_len, int radio_type)
-{
-  int retVal = -1;
-
-  LOG_ENTRY;
-
-  // ASCII-64 is use by HF ALE radio links. It is just ASCII codes 0x20 - 0x5f
-  // On Barrett, nothing is escaped.
-  // On Codan, spaces must be escaped
-
-  do 
-  {
-#if COMPILE_TEST_LEVEL >= TEST_LEVEL_LIGHT
-    if (! in) 
-    {
-      LOG_ERROR("in is null");
-      break;
-    }
-    if (! out) 
-    {
-      LOG_ERROR("out is null");
-      break;
-    }
-    if (in_len > SENSIBLE_MEMORY_BLOCK_SIZE)
-    {
-      LOG_WARN("in_len seems a bit large: %d", in_len);
-    }
-    if (radio_type < RADIOTYPE_MIN || radio_type > RADIOTYPE_MAX)
-    {
-      LOG_WARN("radio_type out of range %d", radio_type);
-    }
-#endif
-
-    int out_ofs=0;
-    int i,j;
-    for(i = 0; i < in_len; i+=3) {
-
-      // Encode 3 bytes using 4
-      unsigned char ob[4];
-      ob[0] = 0x20 +  (in[i+0] & 0x3f);
-      ob[1] = 0x20 + ((in[i+0] & 0xc0) >> 6) + ((in[i+1] & 0x0f) << 2);
-      ob[2] = 0x20 + ((in[i+1] & 0xf0) >> 4) + ((in[i+2] & 0x03) << 4);
-      ob[3] = 0x20 + ((in[i+2] & 0xfc) >> 2);
-
-      // XXX - Character escaping policy should be set in radio driver
-      // not in here!
-      for(j = 0; j < 4; j++) 
-      {
-        if ((ob[j] == ' ') && (radio_type == RADIOTYPE_HFCODAN)) 
-        {
-  	      out[out_ofs++] = '\\';
-        }
-        out[out_ofs++] = ob[j];
-      }
-    }
-
-    out[out_ofs]=0;
-
-    retVal = 0;
-
-  }
-  while (0);
-
-  LOG_EXIT;
-
-  return retVal;
-}
-
-int ascii64_decode(char *in, unsigned char *out, int out_len, int radio_type)
-{
-  int retVal = -1;
-
-  LOG_ENTRY;
-
-  do
-  {
-#if COMPILE_TEST_LEVEL >= TEST_LEVEL_LIGHT
-    if (! in) 
-    {
-      LOG_ERROR("in is null");
-      break;
-    }
-    if (! out) 
-    {
-      LOG_ERROR("out is null");
-      break;
-    }
-    if (out_len > SENSIBLE_MEMORY_BLOCK_SIZE)
-    {
-      LOG_WARN("out_len seems a bit large: %d", out_len);
-    }
-    if (radio_type < RADIOTYPE_MIN || radio_type > RADIOTYPE_MAX)
-    {
-      LOG_WARN("radio_type out of range %d", radio_type);
-    }
-#endif
-
-    int out_ofs = 0;
-
-    // Makes sure to check for premature string ends (e.g. garbled input data)
-
-    while (*in && out_ofs+3 < out_len) {
-
-      *out = (*in - 0x20) & 0x3f;
-      in++;
-
-      if (! *in) 
-      {
-        LOG_ERROR("premature string end");
-        break; //while
-      }
-
-      *out |= (((*in - 0x20) & 0x03) << 6);
-      in++;
-      out++;
-      out_ofs++;
-
-      if (! *in) 
-      {
-        LOG_ERROR("premature string end");
-        break; //while
-      }
-
-      *out = (((*in - 0x20) & 0x3c) >> 2);
-      in++;
-
-      if (! *in) 
-      {
-        LOG_ERROR("premature string end");
-        break; //while
-      }
-
-      *out |= (((*in - 0x20) & 0x0f) << 4);
-      in++;
-      out++;
-      out_ofs++;
-
-      if (! *in) 
-      {
-        LOG_ERROR("premature string end");
-        break; //while
-      }
-
-      *out = (((*in - 0x20) & 0x30) >> 4);
-      in++;
-
-      if (! *in) 
-      {
-        LOG_ERROR("premature string end");
-        break; //while
-      }
-
-      *out |= (((*in - 0x20) & 0x3f) << 2);
-      in++;
-      out++;
-      out_ofs++;
-
-    }
-
-    retVal = out_ofs;
-
-  }
-  while (0);
-
-  LOG_EXIT;
-  
-  return retVal;  
-}
-
 int dump_bytes(FILE *f,char *msg, unsigned char *bytes, int length)
 {
   int retVal = -1;
@@ -633,12 +379,11 @@ char *timestamp_str(void)
   LOG_ENTRY;
 
   struct tm tm;
-  time_t now=time(0);
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
+  long long now_ms=gettime_ms();
+  time_t now=now_ms/1000;
   localtime_r(&now,&tm);
   snprintf(timestamp_str_out,1024,"[%02d:%02d.%02d.%03d %c%c%c%c*]",
-          tm.tm_hour,tm.tm_min,tm.tm_sec,(int)tv.tv_usec/1000,
+          tm.tm_hour,tm.tm_min,tm.tm_sec,(int)(now_ms%1000),
           my_sid_hex[0],my_sid_hex[1],my_sid_hex[2],my_sid_hex[3]);
 
   LOG_EXIT;
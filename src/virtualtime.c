@@ -0,0 +1,176 @@
+/*
+  Shared virtual clock used to run fakecsmaradio and a set of lbard
+  instances as a discrete-event simulation.  See virtualtime.h for the
+  protocol between the controller and the participants.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "virtualtime.h"
+
+struct virtual_clock *virtual_clock=NULL;
+static int my_participant=-1;
+
+static struct virtual_clock *virtual_clock_map(char *path,int create)
+{
+  int fd=open(path,create?(O_RDWR|O_CREAT|O_TRUNC):O_RDWR,0644);
+  if (fd<0) { perror("open(virtual clock)"); return NULL; }
+  if (create&&ftruncate(fd,sizeof(struct virtual_clock))) {
+    perror("ftruncate(virtual clock)"); close(fd); return NULL;
+  }
+  struct virtual_clock *c=mmap(NULL,sizeof(struct virtual_clock),
+			       PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+  close(fd);
+  if (c==MAP_FAILED) { perror("mmap(virtual clock)"); return NULL; }
+  return c;
+}
+
+int virtual_clock_create(char *path,int expected_participants,unsigned int seed)
+{
+  struct virtual_clock *c=virtual_clock_map(path,1);
+  if (!c) return -1;
+  bzero(c,sizeof(struct virtual_clock));
+  c->seed=seed;
+  c->now_us=VIRTUAL_CLOCK_START_US;
+  c->expected_participants=expected_participants;
+  __sync_synchronize();
+  // Participants refuse to attach until the magic is valid
+  c->magic=VIRTUAL_CLOCK_MAGIC;
+  __sync_synchronize();
+  virtual_clock=c;
+  fprintf(stderr,"Virtual clock created in %s, waiting for %d participants.\n",
+	  path,expected_participants);
+  return 0;
+}
+
+int virtual_clock_attach(char *path,char *identity)
+{
+  struct virtual_clock *c=NULL;
+  // fakecsmaradio may still be starting up, so give it a few seconds
+  for(int tries=0;tries<500;tries++) {
+    if (!c&&!access(path,R_OK|W_OK)) c=virtual_clock_map(path,0);
+    if (c&&c->magic==VIRTUAL_CLOCK_MAGIC) break;
+    usleep(10000);
+  }
+  if (!c||c->magic!=VIRTUAL_CLOCK_MAGIC) {
+    fprintf(stderr,"Could not attach to virtual clock in %s\n",path);
+    return -1;
+  }
+
+  int pid=getpid();
+  for(int i=0;i<VIRTUAL_CLOCK_MAX_PARTICIPANTS;i++)
+    if (__sync_bool_compare_and_swap(&c->participants[i].pid,0,pid)) {
+      c->participants[i].idle=0;
+      my_participant=i;
+      break;
+    }
+  if (my_participant<0) {
+    fprintf(stderr,"Virtual clock has no free participant slots.\n");
+    return -1;
+  }
+
+  // Derive our random seed from the run's seed and a stable identity (our
+  // SID), rather than from the order in which we happened to attach.
+  unsigned int seed=c->seed;
+  if (identity) for(int i=0;identity[i];i++) seed=(seed*33)^(unsigned char)identity[i];
+  srandom(seed);
+
+  virtual_clock=c;
+  fprintf(stderr,"Attached to virtual clock in %s as participant #%d\n",
+	  path,my_participant);
+  return 0;
+}
+
+void virtual_clock_detach(void)
+{
+  if (virtual_clock&&my_participant>=0) {
+    virtual_clock->participants[my_participant].idle=0;
+    __sync_synchronize();
+    virtual_clock->participants[my_participant].pid=0;
+  }
+  my_participant=-1;
+}
+
+long long virtual_clock_now_us(void)
+{
+  return virtual_clock->now_us;
+}
+
+int virtual_clock_sleep_us(long long duration_us,int *fds,int fd_count)
+{
+  struct virtual_clock_participant *p=&virtual_clock->participants[my_participant];
+  p->wake_time_us=virtual_clock->now_us+duration_us;
+  while(1) {
+    unsigned int epoch=virtual_clock->epoch;
+    __sync_synchronize();
+    if (virtual_clock->now_us>=p->wake_time_us) break;
+    struct pollfd pfds[fd_count>0?fd_count:1];
+    for(int i=0;i<fd_count;i++) { pfds[i].fd=fds[i]; pfds[i].events=POLLIN; }
+    if (fd_count>0&&poll(pfds,fd_count,0)>0) break;
+    p->idle_epoch=epoch;
+    __sync_synchronize();
+    p->idle=1;
+    // Real time only matters here as a polling interval, so keep it short:
+    // every step of the simulation costs one of these.
+    usleep(20);
+  }
+  p->idle=0;
+  __sync_synchronize();
+  return 0;
+}
+
+int virtual_clock_note_activity(void)
+{
+  __sync_synchronize();
+  __sync_fetch_and_add(&virtual_clock->epoch,1);
+  return 0;
+}
+
+/*
+  Returns true if every participant is waiting on the clock, and has been
+  since the last activity.  next_wake_us is lowered to the earliest
+  participant wake-up time.
+*/
+int virtual_clock_all_idle(long long *next_wake_us)
+{
+  int attached=0;
+  unsigned int epoch=virtual_clock->epoch;
+  __sync_synchronize();
+  for(int i=0;i<VIRTUAL_CLOCK_MAX_PARTICIPANTS;i++) {
+    struct virtual_clock_participant *p=&virtual_clock->participants[i];
+    if (!p->pid) continue;
+    if (kill(p->pid,0)&&errno==ESRCH) {
+      // Participant died without detaching
+      fprintf(stderr,"Virtual clock participant #%d (pid %d) has gone away.\n",
+	      i,p->pid);
+      p->idle=0; p->pid=0;
+      continue;
+    }
+    attached++;
+    if (!p->idle) return 0;
+    if (p->idle_epoch!=epoch) return 0;
+    if (p->wake_time_us<=virtual_clock->now_us) return 0;
+    if (p->wake_time_us<*next_wake_us) *next_wake_us=p->wake_time_us;
+  }
+  // Hold the clock until everyone has turned up
+  if (attached<virtual_clock->expected_participants) return 0;
+  return 1;
+}
+
+int virtual_clock_advance_to(long long when_us)
+{
+  if (when_us<=virtual_clock->now_us) return 0;
+  virtual_clock->now_us=when_us;
+  __sync_synchronize();
+  return 1;
+}
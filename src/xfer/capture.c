@@ -0,0 +1,81 @@
+/*
+  Reading and writing of air-traffic capture files.  See capture.h for the
+  format.  This file is shared by lbard and fakecsmaradio, so must not
+  depend on anything else in lbard.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "capture.h"
+
+static void put16(unsigned char *b,int v) { b[0]=v; b[1]=v>>8; }
+static int get16(unsigned char *b) { return b[0]|(b[1]<<8); }
+
+FILE *capture_open_write(char *filename)
+{
+  FILE *f=fopen(filename,"w");
+  if (!f) { perror("fopen(capture)"); return NULL; }
+  unsigned char header[16];
+  memset(header,0,sizeof(header));
+  memcpy(header,CAPTURE_MAGIC,8);
+  put16(&header[8],CAPTURE_VERSION);
+  fwrite(header,sizeof(header),1,f);
+  fflush(f);
+  return f;
+}
+
+int capture_write(FILE *f,long long timestamp_us,int sender,int rssi,
+		  unsigned char *frame,int length)
+{
+  if (!f) return -1;
+  if (length<0||length>CAPTURE_MAX_FRAME) return -1;
+  unsigned char header[16];
+  for(int i=0;i<8;i++) header[i]=(timestamp_us>>(i*8))&0xff;
+  put16(&header[8],sender);
+  put16(&header[10],rssi);
+  put16(&header[12],length);
+  put16(&header[14],0);
+  if (fwrite(header,sizeof(header),1,f)!=1) return -1;
+  if (fwrite(frame,length,1,f)!=1) return -1;
+  // Captures are often cut short by the process being killed, so don't
+  // leave frames sitting in the buffer.
+  fflush(f);
+  return 0;
+}
+
+FILE *capture_open_read(char *filename)
+{
+  FILE *f=fopen(filename,"r");
+  if (!f) { perror("fopen(capture)"); return NULL; }
+  unsigned char header[16];
+  if ((fread(header,sizeof(header),1,f)!=1)||memcmp(header,CAPTURE_MAGIC,8)) {
+    fprintf(stderr,"'%s' is not an LBARD capture file\n",filename);
+    fclose(f);
+    return NULL;
+  }
+  if (get16(&header[8])!=CAPTURE_VERSION) {
+    fprintf(stderr,"'%s' is capture format version %d, but I only understand version %d\n",
+	    filename,get16(&header[8]),CAPTURE_VERSION);
+    fclose(f);
+    return NULL;
+  }
+  return f;
+}
+
+// Returns 1 if a record was read, 0 at the end of the file, or -1 on error
+int capture_read(FILE *f,struct capture_record *r)
+{
+  unsigned char header[16];
+  int n=fread(header,1,sizeof(header),f);
+  if (!n) return 0;
+  if (n!=sizeof(header)) return -1;
+  r->timestamp_us=0;
+  for(int i=0;i<8;i++) r->timestamp_us|=((long long)header[i])<<(i*8);
+  r->sender=(short)get16(&header[8]);
+  r->rssi=(short)get16(&header[10]);
+  r->length=get16(&header[12]);
+  if (r->length>CAPTURE_MAX_FRAME) return -1;
+  if (r->length&&(fread(r->frame,r->length,1,f)!=1)) return -1;
+  return 1;
+}
@@ -0,0 +1,254 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2018 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Driving several radios at once, e.g., a UHF radio for the people nearby
+  and an HF radio for the next town, from the one bundle store.
+
+  Each radio is given as one of a comma separated list of serial ports.
+  The main loop selects each in turn to read from it, run its driver and
+  send its next frame, and radio_interface_select() swaps that radio's
+  state into the globals the drivers and the transmit path use.  State that
+  drivers keep to themselves is not swapped, so there can be only one radio
+  of each kind, and only one HF radio, as the HF drivers share theirs.
+  Every radio sends frames of LINK_MTU, as they all carry the same LBARD
+  frames; none of them needs another size yet.
+
+  Peers are tracked per radio (see peer_is_active()), as are message
+  numbers, so that frames sent over one radio don't look like frames
+  missed on the other.  A bundle queued for a peer is sent only over the
+  radios that suit it: see radio_interface_carries_bundle().  What we are
+  sending a peer (tx_bundle, its offsets and piece slot) is not per radio:
+  there is one transfer per peer, and the radios that carry its bundle each
+  send the next piece of it when their turn comes, while the others send
+  that peer nothing but reports until it is done.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "sync.h"
+#include "lbard.h"
+#include "radios.h"
+#include "interface.h"
+
+extern int serialfd;
+extern char *serial_port;
+extern int radio_mode;
+extern int radio_features;
+extern int message_counter;
+extern unsigned char my_sid[32];
+extern char *my_sid_hex;
+extern char *servald_server;
+extern char *credential;
+
+struct radio_interface radio_interfaces[MAX_RADIO_INTERFACES];
+int radio_interface_count=0;
+struct radio_interface *radio_interface=&radio_interfaces[0];
+
+/*
+  How fast each kind of radio moves bundles, roughly, once shared with
+  everyone else on the channel, and the largest bundle worth sending that
+  way when there is another way to reach the peer.  An ALE message carries a
+  few dozen bytes and takes ten seconds or more.
+*/
+struct radio_interface_profile {
+  char *name;
+  int bytes_per_second;
+  long long max_bundle_bytes;
+};
+
+static struct radio_interface_profile radio_interface_profiles[]={
+  {"rfd900",2000,0},
+  {"hf2020",200,1024*1024},
+  {"hfcodan",5,16*1024},
+  {"hfbarrett",5,16*1024},
+  {"outernet",1000,0},
+  {NULL,1,0}
+};
+
+// MeshMS conversations, and anything this small, go every way they can
+#define RADIO_INTERFACE_URGENT_BYTES 1024
+
+static void radio_interface_save(struct radio_interface *i)
+{
+  i->fd=serialfd;
+  i->port=serial_port;
+  i->type=radio_mode;
+  i->features=radio_features;
+  i->message_counter=message_counter;
+  i->message_update_interval=message_update_interval;
+  i->message_update_interval_randomness=message_update_interval_randomness;
+  i->next_message_update_time=next_message_update_time;
+  i->congestion_update_time=congestion_update_time;
+  i->transmissions_seen=radio_transmissions_seen;
+  i->transmissions_byus=radio_transmissions_byus;
+  i->frames_missed=radio_frames_missed;
+  i->bytes_sent=radio_bytes_sent;
+  i->bytes_heard=radio_bytes_heard;
+  i->silence_count=radio_silence_count;
+  i->serial_errors=serial_errors;
+}
+
+static void radio_interface_restore(struct radio_interface *i)
+{
+  serialfd=i->fd;
+  serial_port=i->port;
+  radio_mode=i->type;
+  radio_features=i->features;
+  message_counter=i->message_counter;
+  message_update_interval=i->message_update_interval;
+  message_update_interval_randomness=i->message_update_interval_randomness;
+  next_message_update_time=i->next_message_update_time;
+  congestion_update_time=i->congestion_update_time;
+  radio_transmissions_seen=i->transmissions_seen;
+  radio_transmissions_byus=i->transmissions_byus;
+  radio_frames_missed=i->frames_missed;
+  radio_bytes_sent=i->bytes_sent;
+  radio_bytes_heard=i->bytes_heard;
+  radio_silence_count=i->silence_count;
+  serial_errors=i->serial_errors;
+}
+
+static int radio_interface_add(char *port)
+{
+  if (radio_interface_count>=MAX_RADIO_INTERFACES) {
+    fprintf(stderr,"Too many radios: at most %d are supported.\n",MAX_RADIO_INTERFACES);
+    return -1;
+  }
+  struct radio_interface *i=&radio_interfaces[radio_interface_count];
+  radio_interface_save(i);
+  i->index=radio_interface_count;
+  i->port=port;
+  if (!radio_interface_count) serial_port=port;
+  radio_interface_count++;
+  return 0;
+}
+
+// Called before any radio is opened, so each starts from the same state
+int radio_interface_add_ports(char *ports)
+{
+  char *list=strdup(ports);
+  for(char *port=strtok(list,",");port;port=strtok(NULL,","))
+    if (radio_interface_add(port)) return -1;
+  if (!radio_interface_count) {
+    fprintf(stderr,"No serial port given.\n");
+    return -1;
+  }
+  return 0;
+}
+
+int radio_interface_select(int n)
+{
+  if ((n<0)||(n>=radio_interface_count)) return -1;
+  if (&radio_interfaces[n]==radio_interface) return 0;
+  radio_interface_save(radio_interface);
+  radio_interface=&radio_interfaces[n];
+  radio_interface_restore(radio_interface);
+  return 0;
+}
+
+static int radio_type_is_hf(int type)
+{
+  return (type>=0)&&(!strncmp(radio_types[type].name,"hf",2));
+}
+
+// Once the selected radio's type is known
+int radio_interface_detected(void)
+{
+  radio_interface->type=radio_mode;
+  radio_interface->bytes_per_second=1;
+  radio_interface->max_bundle_bytes=0;
+  // (the main loop complains about radios it couldn't identify)
+  if (radio_mode<0) return 0;
+  for(int p=0;radio_interface_profiles[p].name;p++)
+    if (!strcmp(radio_interface_profiles[p].name,radio_types[radio_mode].name)) {
+      radio_interface->bytes_per_second=radio_interface_profiles[p].bytes_per_second;
+      radio_interface->max_bundle_bytes=radio_interface_profiles[p].max_bundle_bytes;
+    }
+
+  for(int i=0;i<radio_interface->index;i++) {
+    if ((radio_interfaces[i].type==radio_mode)
+	||(radio_type_is_hf(radio_interfaces[i].type)&&radio_type_is_hf(radio_mode))) {
+      fprintf(stderr,"Radios on %s and %s are both %s: only one of each kind (and one HF radio) is supported.\n",
+	      radio_interfaces[i].port,radio_interface->port,radio_types[radio_mode].name);
+      return -1;
+    }
+  }
+  if (radio_interface_count>1)
+    fprintf(stderr,"Radio #%d on %s is a %s (routing for %d bytes/sec)\n",
+	    radio_interface->index,radio_interface->port,radio_types[radio_mode].name,
+	    radio_interface->bytes_per_second);
+  return 0;
+}
+
+// Build and send the selected radio's next frame, and work out when the
+// one after should go
+int radio_interface_send_frame(unsigned char *msg_out)
+{
+  update_my_message(serialfd,my_sid,my_sid_hex,LINK_MTU,msg_out,
+		    servald_server,credential);
+
+  // Vary next update time by upto 250ms, to prevent radios getting lock-stepped.
+  if (message_update_interval_randomness)
+    next_message_update_time=gettime_ms()+(random()%message_update_interval_randomness)
+      +message_update_interval;
+  else
+    next_message_update_time=gettime_ms()+message_update_interval;
+  return 0;
+}
+
+static int radio_interface_can_carry(struct radio_interface *i,long long length)
+{
+  return (!i->max_bundle_bytes)||(length<=i->max_bundle_bytes);
+}
+
+/*
+  Whether to send pieces of this bundle to this peer over the selected radio.
+  Urgent bundles, i.e., MeshMS and anything small, go over every radio we
+  have heard the peer on, for the lowest latency.  Other bundles go over
+  just the fastest of those, and not over a radio at all if they are too
+  big for it, so that a big file doesn't hold up the HF link for days.
+*/
+int radio_interface_carries_bundle(struct peer_state *p,int bundle)
+{
+  if (radio_interface_count<2) return 1;
+  if ((bundle<0)||(bundle>=bundle_count)) return 0;
+
+  long long length=bundles[bundle].length;
+  if (!radio_interface_can_carry(radio_interface,length)) return 0;
+  if ((length<=RADIO_INTERFACE_URGENT_BYTES)
+      ||(bundles[bundle].service&&!strncasecmp(bundles[bundle].service,"MeshMS",6)))
+    return 1;
+
+  time_t now=gettime_s();
+  for(int i=0;i<radio_interface_count;i++) {
+    struct radio_interface *other=&radio_interfaces[i];
+    if (other==radio_interface) continue;
+    if ((now-p->interface_last_message_time[i])>peer_keepalive_interval) continue;
+    if (!radio_interface_can_carry(other,length)) continue;
+    if ((other->bytes_per_second>radio_interface->bytes_per_second)
+	||((other->bytes_per_second==radio_interface->bytes_per_second)
+	   &&(i<radio_interface->index)))
+      return 0;
+  }
+  return 1;
+}
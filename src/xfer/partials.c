@@ -68,7 +68,7 @@ int partial_recent_sender_report(struct partial_bundle *p)
       p->bundle_version);
 
     int i;
-    time_t t = time(0);
+    time_t t = gettime_s();
     for (i = 0; i < MAX_RECENT_SENDERS; i++)
     {
       if ((t - p->senders.r[i].last_time) < 10)
@@ -124,7 +124,7 @@ int partial_update_recent_senders(struct partial_bundle *p,char *sender_prefix_h
 
     int free_slot = random() % MAX_RECENT_SENDERS;
     int index = 0;
-    time_t t = time(0);
+    time_t t = gettime_s();
     for (index=0;index<MAX_RECENT_SENDERS;index++)
     {
       if 
@@ -150,7 +150,7 @@ int partial_update_recent_senders(struct partial_bundle *p,char *sender_prefix_h
     // Update record
     p->senders.r[index].sid_prefix[0] = sender_prefix_bin[0];
     p->senders.r[index].sid_prefix[1] = sender_prefix_bin[1];
-    p->senders.r[index].last_time = time(0);
+    p->senders.r[index].last_time = gettime_s();
 
     partial_recent_sender_report(p);
 
@@ -221,6 +221,8 @@ int clear_partial(struct partial_bundle *p)
       s = NULL;
     }
 
+    progress_bitmap_free(&p->body_progress);
+    id_release(p->bid_id);
     bzero(p, sizeof(struct partial_bundle));
 
   }
@@ -231,6 +233,53 @@ int clear_partial(struct partial_bundle *p)
   return retVal;
 }
 
+/*
+  Check that body bytes sent with this codec can go into this partial.  A
+  body can reach us both as it is and compressed, from senders that chose
+  differently, and the two can't be mixed.  The compressed form is shorter,
+  so we switch to it, dropping what we have of the uncompressed body, but
+  never switch back.
+*/
+int partial_accept_body_codec(struct partial_bundle *p,int body_codec)
+{
+  int retVal = -1;
+
+  LOG_ENTRY;
+
+  do
+  {
+    if (body_codec == p->body_codec)
+    {
+      retVal = 0;
+      break;
+    }
+
+    // Only switch from an uncompressed body to one we can decompress
+    if ((p->body_codec != BODY_CODEC_NONE) || (body_codec != BODY_CODEC_DEFLATE))
+      break;
+
+    // Journals are sent as deltas, so are never compressed
+    if (p->bundle_version < 0x100000000LL)
+      break;
+
+    while (p->body_segments)
+    {
+      struct segment_list *s = p->body_segments;
+      p->body_segments = s->next;
+      free(s->data);
+      free(s);
+    }
+    p->body_length = -1;
+    p->body_codec = body_codec;
+    retVal = 0;
+  }
+  while (0);
+
+  LOG_EXIT;
+
+  return retVal;
+}
+
 int dump_segment_list(struct segment_list *s)
 {
   int retVal = -1;
@@ -288,28 +337,9 @@ int dump_partial(struct partial_bundle *p)
       p->request_manifest_bitmap[0],
       p->request_manifest_bitmap[1],
       p->body_length,
-      p->request_bitmap_start);
-
-    int max_block = 256;
-    if (p->body_length > -1) 
-    {
-      max_block = (p->body_length - p->request_bitmap_start);
-      if (max_block & 0x3f)
-      {
-        max_block = 1 + max_block/64;
-      }
-      else
-      {
-        max_block = 0 + max_block/64;    
-      }
-    }
-
-    if (max_block > 256) 
-    {
-      max_block=256;
-    }
+      p->body_progress.first_missing*PROGRESS_BLOCK_SIZE);
 
-    dump_progress_bitmap(stdout,p->request_bitmap,max_block);
+    dump_progress_bitmap(stdout,&p->body_progress);
 
     if (0) 
     {
@@ -319,8 +349,8 @@ int dump_partial(struct partial_bundle *p)
       dump_segment_list(p->body_segments);
       fprintf(
         stderr,
-        "  Request bitmap: start=%d, bits=\n    ",
-        p->request_bitmap_start);
+        "  Request bitmap: first missing=%d, bits=\n    ",
+        p->body_progress.first_missing*PROGRESS_BLOCK_SIZE);
     }
 
     retVal = 0;
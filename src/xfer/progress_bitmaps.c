@@ -41,83 +41,232 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "sync.h"
 #include "lbard.h"
 
-int dump_progress_bitmap(FILE *f, unsigned char *b,int blocks)
+/*
+  Whole-bundle progress bitmaps.  One bit per 64 byte block, held in 64-bit
+  words, so that finding the next missing (or held) block can skip over a word
+  at a time.  1MiB of body needs 16384 bits = 2KiB.
+*/
+int progress_bitmap_resize(struct progress_bitmap *b,int blocks)
 {
-  for(int i=0;i<(32*8)&&(i<blocks);i++) {
-    if (b[i>>3]&(1<<(i&7)))
-      fprintf(f,"."); else fprintf(f,"Y");
-    //    if (((i&63)==63)&&(i!=255)) fprintf(f,"\n    ");
+  if (blocks<0) blocks=0;
+  int words=(blocks+63)>>6;
+  int old_words=(b->blocks+63)>>6;
+  if (!b->words||words!=old_words) {
+    uint64_t *w=realloc(b->words,(words?words:1)*sizeof(uint64_t));
+    if (!w) return -1;
+    if (words>old_words) bzero(&w[old_words],(words-old_words)*sizeof(uint64_t));
+    b->words=w;
   }
-  fprintf(f,"\n");
+  // Never leave bits set beyond the end, so that growing again finds them clear
+  if (blocks<b->blocks&&(blocks&63)) b->words[blocks>>6]&=(1ULL<<(blocks&63))-1;
+  b->blocks=blocks;
+  if (b->first_missing>blocks) b->first_missing=blocks;
+  return 0;
+}
+
+int progress_bitmap_free(struct progress_bitmap *b)
+{
+  free(b->words);
+  b->words=NULL;
+  b->blocks=0;
+  b->first_missing=0;
+  return 0;
+}
+
+static uint64_t progress_bitmap_mask(int bit,int count)
+{
+  if (count>=64) return ~0ULL;
+  return ((1ULL<<count)-1)<<bit;
+}
+
+int progress_bitmap_set_range(struct progress_bitmap *b,int first,int count)
+{
+  int end=first+count;
+  if (first<0) first=0;
+  if (end>b->blocks) end=b->blocks;
+  if (first>=end) return 0;
+  int range_start=first;
+  while(first<end) {
+    int bit=first&63;
+    int n=64-bit;
+    if (n>end-first) n=end-first;
+    b->words[first>>6]|=progress_bitmap_mask(bit,n);
+    first+=n;
+  }
+  if (range_start<=b->first_missing&&end>b->first_missing)
+    b->first_missing=progress_bitmap_next_missing(b,end);
   return 0;
 }
 
+int progress_bitmap_clear_range(struct progress_bitmap *b,int first,int count)
+{
+  int end=first+count;
+  if (first<0) first=0;
+  if (end>b->blocks) end=b->blocks;
+  if (first>=end) return 0;
+  if (first<b->first_missing) b->first_missing=first;
+  while(first<end) {
+    int bit=first&63;
+    int n=64-bit;
+    if (n>end-first) n=end-first;
+    b->words[first>>6]&=~progress_bitmap_mask(bit,n);
+    first+=n;
+  }
+  return 0;
+}
+
+int progress_bitmap_test(struct progress_bitmap *b,int block)
+{
+  // There is nothing to fetch beyond the end, so treat it as held
+  if (block<0||block>=b->blocks) return 1;
+  return (b->words[block>>6]>>(block&63))&1;
+}
+
+// Returns the first block at or after from that is missing, or b->blocks if none.
+int progress_bitmap_next_missing(struct progress_bitmap *b,int from)
+{
+  if (from<b->first_missing) from=b->first_missing;
+  while(from<b->blocks) {
+    uint64_t missing=(~b->words[from>>6])>>(from&63);
+    if (missing) { from+=__builtin_ctzll(missing); break; }
+    from=(from|63)+1;
+  }
+  if (from>b->blocks) from=b->blocks;
+  return from;
+}
+
+// Returns the first block at or after from that is held, or b->blocks if none.
+static int progress_bitmap_next_held(struct progress_bitmap *b,int from)
+{
+  while(from<b->blocks) {
+    uint64_t held=b->words[from>>6]>>(from&63);
+    if (held) { from+=__builtin_ctzll(held); break; }
+    from=(from|63)+1;
+  }
+  if (from>b->blocks) from=b->blocks;
+  return from;
+}
+
+static int varint_length(unsigned int v)
+{
+  int len=1;
+  while(v>=0x80) { v>>=7; len++; }
+  return len;
+}
 
 /*
-  Generate the starting offset and bitmap of 64 byte segments that we need
-  relative to that point in the payload stream.  The purpose is to provide a list
-  with enough pending 64 byte segments so that all our current senders know where they
-  should next send from.
-
-  The bitmap is based on the absolute first hole in the stream that we are missing.
-
-  The segment list is arranged in reverse order, so we start by getting the last
-  piece in the segment list. If it starts at 0, then our starting point is the end
-  of the first segment. If not, then our starting point is 0. We then mark the bitmap
-  as requiring all pieces.  Then the segment list is retraversed, and any 64 byte
-  region that we have in its entirety is marked as already held.
+  Encode the bitmap from the first missing block as alternating run lengths of
+  missing and held blocks (starting with missing), each as a little-endian
+  base-128 varint.  A zero run length ends the list, and means everything from
+  there to the end of the bundle is missing.  If the runs do not fit in max_len
+  bytes, the list is cut short without the terminator, and the receiver of the
+  report keeps whatever it knew about the blocks beyond what was encoded.
+  Returns the number of bytes written.
 */
-int partial_update_request_bitmap(struct partial_bundle *p)
+int progress_bitmap_encode(struct progress_bitmap *b,unsigned char *out,int max_len)
 {
-  // Get starting point
-  int starting_position=0;
-  // 32*8*64= 16KiB of data, enough for several seconds, even with 16 senders.
-  unsigned char bitmap[32];
-  bzero(&bitmap[0],32);
-  struct segment_list *l=p->body_segments;
-  while(l&&l->next) l=l->next;
-  if (l) {
-    if (!l->start_offset) starting_position=l->length;
+  int len=0;
+  int pos=b->first_missing;
+  int missing=1;
+  while(pos<b->blocks) {
+    int next=missing?progress_bitmap_next_held(b,pos):progress_bitmap_next_missing(b,pos);
+    // A missing run to the end is implied by the terminator
+    if (missing&&next>=b->blocks) break;
+    unsigned int run=next-pos;
+    // Leave room for the terminator
+    if (len+varint_length(run)+1>max_len) return len;
+    while(run>=0x80) { out[len++]=0x80|(run&0x7f); run>>=7; }
+    out[len++]=run;
+    pos=next;
+    missing=!missing;
   }
+  if (len<max_len) out[len++]=0;
+  return len;
+}
 
-  l=p->body_segments;
-  while(l) {
-    if ((l->start_offset>=starting_position)
-	&&(l->start_offset<=(starting_position+32*8*64))) {
-      int start=l->start_offset;
-      int length=l->length;
-      // Ignore any first partial 
-      if (start&63) {
-	int trim=64-(start&63);
-	start+=trim;
-	length-=trim;
-      }
-      // Work out first block number
-      int block=(start-starting_position)>>6; //  divide by 64
-      // Then mark as received all those we already have
-      while (length>=64&&(block<32*8)) {
-	bitmap[block>>3]|=(1<<(block&7));
-	block++; length-=64;
-      }
+int progress_bitmap_decode(struct progress_bitmap *b,int first_missing,
+			   unsigned char *in,int len)
+{
+  if (first_missing>b->blocks) first_missing=b->blocks;
+  progress_bitmap_set_range(b,0,first_missing);
+  int pos=first_missing;
+  int missing=1;
+  int i=0;
+  while(i<len) {
+    unsigned int run=0;
+    int shift=0;
+    while(i<len&&(in[i]&0x80)&&shift<28) { run|=(in[i++]&0x7f)<<shift; shift+=7; }
+    // Ignore a varint cut off by the end of the message
+    if (i>=len) break;
+    run|=in[i++]<<shift;
+    if (!run) {
+      progress_bitmap_clear_range(b,pos,b->blocks-pos);
+      return 0;
     }
+    if (run>(unsigned int)(b->blocks-pos)) run=b->blocks-pos;
+    if (missing) progress_bitmap_clear_range(b,pos,run);
+    else progress_bitmap_set_range(b,pos,run);
+    pos+=run;
+    missing=!missing;
+  }
+  return 0;
+}
 
-    l=l->next;
+int dump_progress_bitmap(FILE *f,struct progress_bitmap *b)
+{
+  // Show up to 256 blocks, from the first missing one
+  fprintf(f,"@%d ",b->first_missing*PROGRESS_BLOCK_SIZE);
+  for(int i=b->first_missing;i<(b->first_missing+256)&&(i<b->blocks);i++) {
+    if (progress_bitmap_test(b,i))
+      fprintf(f,"."); else fprintf(f,"Y");
   }
+  fprintf(f,"\n");
+  return 0;
+}
+
+
+/*
+  Rebuild the bitmap of 64 byte blocks of the body that we hold, from the
+  segment list.  The bitmap covers the whole body, so that senders can see
+  every hole, not just those near the first one.  If we don't know the body
+  length yet, it covers as far as we have received.
 
-  // Save request bitmap
-  p->request_bitmap_start=starting_position;
-  memcpy(p->request_bitmap,bitmap,32);
+  A block is only marked as held if we have all of it, except for the last
+  block of the body, which may be short.
+*/
+int partial_update_request_bitmap(struct partial_bundle *p)
+{
+  int body_blocks=0;
+  struct segment_list *l;
+  if (p->body_length>=0)
+    body_blocks=(p->body_length+PROGRESS_BLOCK_SIZE-1)/PROGRESS_BLOCK_SIZE;
+  else
+    for(l=p->body_segments;l;l=l->next) {
+      int end_block=(l->start_offset+l->length)/PROGRESS_BLOCK_SIZE;
+      if (end_block>body_blocks) body_blocks=end_block;
+    }
+  progress_bitmap_resize(&p->body_progress,body_blocks);
+  progress_bitmap_clear_range(&p->body_progress,0,body_blocks);
+
+  // We have all of a journal's old version, even though we hold none of it here
+  progress_bitmap_set_range(&p->body_progress,0,p->journal_base/PROGRESS_BLOCK_SIZE);
+
+  for(l=p->body_segments;l;l=l->next) {
+    int start=l->start_offset;
+    int end=l->start_offset+l->length;
+    if (start<=p->journal_base) start=0;
+    // Ignore any first partial block
+    int first_block=(start+PROGRESS_BLOCK_SIZE-1)/PROGRESS_BLOCK_SIZE;
+    int end_block=end/PROGRESS_BLOCK_SIZE;
+    if (end==p->body_length) end_block=body_blocks;
+    progress_bitmap_set_range(&p->body_progress,first_block,end_block-first_block);
+  }
 
+  // The manifest can only be 1KiB, so its bitmap is a fixed 16 bits
   // Now do the same for the manifest (which can have only a 16 bit long bitmap
   unsigned char manifest_bitmap[2];
   bzero(&manifest_bitmap[0],2);
 
-  l=p->manifest_segments;
-  while(l&&l->next) l=l->next;
-  if (l) {
-    if (!l->start_offset) starting_position=l->length;
-  }
-
   l=p->manifest_segments;
   while(l) {
     if ((l->start_offset>=0)
@@ -183,60 +332,45 @@ int partial_update_request_bitmap(struct partial_bundle *p)
 }
 
 
-int progress_bitmap_translate(struct peer_state *p,int new_body_offset)
+/*
+  Start tracking what a peer holds of a bundle we are (or might be) sending it.
+*/
+int peer_reset_request_progress(struct peer_state *p,int bundle_number)
 {
-
-  // First, check if the translation requires us to discard our bitmap,
-  // or whether we can keep all or part of it.
-  
-  // Start with an empty bitmap
-  unsigned char new_request_bitmap[32];
-  bzero(new_request_bitmap,32);
-
-  int bit_delta=(new_body_offset-p->request_bitmap_offset)/64;
-  
-  // Copy in any bits from the pre-translation bitmap
-  // We start at bit 1, not bit 0, since we assume that the reason we
-  // are advancing to this point, is that the piece at this position
-  // requires retransmission.
-  for(int bit=1;bit<256;bit++) {
-    int the_bit=0;
-    int old_bit=bit+bit_delta;
-    if (old_bit>=0&&old_bit<256)
-      the_bit=p->request_bitmap[old_bit>>3]&(1<<(old_bit&7));
-    if (the_bit)
-      new_request_bitmap[bit>>3]|=(1<<(bit&7));
-  }
-  
-  p->request_bitmap_offset=new_body_offset;
-  memcpy(p->request_bitmap,new_request_bitmap,32);
-
+  int blocks=(bundle_wire_length(bundle_number)+PROGRESS_BLOCK_SIZE-1)/PROGRESS_BLOCK_SIZE;
+  progress_bitmap_resize(&p->request_progress,blocks);
+  progress_bitmap_clear_range(&p->request_progress,0,blocks);
+  bzero(p->request_manifest_bitmap,2);
+  p->request_progress_acked=0;
+  p->request_bitmap_bundle=bundle_number;
+  p->request_bitmap_version=bundles[bundle_number].version;
   return 0;
 }
 
+/*
+  A new version of a bundle replaces the old one in the same slot, so check the
+  version too, or we would think a peer already has most of the new version.
+*/
+int peer_request_progress_is_current(struct peer_state *p,int bundle_number)
+{
+  if (bundle_number<0||p->request_bitmap_bundle!=bundle_number) return 0;
+  if (p->request_bitmap_version!=bundles[bundle_number].version) return 0;
+  // If we have changed how we send the body (see bundle_cache_choose_body_codec())
+  // the map is of the wrong bytes.
+  return p->request_progress.blocks
+    ==(bundle_wire_length(bundle_number)+PROGRESS_BLOCK_SIZE-1)/PROGRESS_BLOCK_SIZE;
+}
+
 int dump_peer_tx_bitmap(int peer)
 {
-  if (debug_bitmap)
-    printf(">>> %s TX bitmap for %s* : bundle:%-2d/%-2d, m:%4d, p:%4d : ",
-	   timestamp_str(),peer_records[peer]->sid_prefix,
-	   
-	   peer_records[peer]->tx_bundle,
-	   peer_records[peer]->request_bitmap_bundle,
-	   
-	   peer_records[peer]->tx_bundle_manifest_offset,
-	   peer_records[peer]->request_bitmap_offset);
-  // Keep all bitmaps in line, by padding front with - characters where the bitmap starts later
-  for(int i=0;i<peer_records[peer]->request_bitmap_offset;i+=64) printf("-");
-  int max_block=256;
-  if (peer_records[peer]->tx_bundle>-1) {    
-    max_block=(bundles[peer_records[peer]->tx_bundle].length-peer_records[peer]->request_bitmap_offset);
-    if (max_block&0x3f)
-      max_block=1+max_block/64;
-    else
-      max_block=0+max_block/64;
-  }
-  if (max_block>256) max_block=256;
-  if (debug_bitmap) dump_progress_bitmap(stdout,peer_records[peer]->request_bitmap,max_block);
+  if (!debug_bitmap) return 0;
+  printf(">>> %s TX bitmap for %s* : bundle:%-2d/%-2d, m:%4d, acked:%4d : ",
+	 timestamp_str(),peer_records[peer]->sid_prefix,
+	 peer_records[peer]->tx_bundle,
+	 peer_records[peer]->request_bitmap_bundle,
+	 peer_records[peer]->tx_bundle_manifest_offset,
+	 peer_records[peer]->request_progress_acked*PROGRESS_BLOCK_SIZE);
+  dump_progress_bitmap(stdout,&peer_records[peer]->request_progress);
 
   return 0;
 }
@@ -247,12 +381,14 @@ int dump_peer_tx_bitmap(int peer)
  */
 int peer_update_send_point(int peer)
 {
+  struct peer_state *p=peer_records[peer];
+
   // Only update if the bundle ID of the bitmap and the bundle being sent match
-  if (peer_records[peer]->request_bitmap_bundle!=peer_records[peer]->tx_bundle)
+  if (!peer_request_progress_is_current(p,p->tx_bundle))
     {
       if (debug_bitmap)
 	printf(">>> %s BITMAP : No updating send point because request_bitmap_bundle != tx_bundle (%d vs %d)\n",
-	       timestamp_str(),peer_records[peer]->request_bitmap_bundle,peer_records[peer]->tx_bundle);
+	       timestamp_str(),p->request_bitmap_bundle,p->tx_bundle);
       return 0;
     }
 
@@ -262,45 +398,50 @@ int peer_update_send_point(int peer)
 #define MAX_CANDIDATES 32
   int candidates[MAX_CANDIDATES];
   int candidate_count=0;
+  struct progress_bitmap *b=&p->request_progress;
 
   // But limit send point to the valid range of the bundle
-  int max_bit=(cached_body_len-peer_records[peer]->request_bitmap_offset)>>6; // = /64
-  // (make sure we don't leave out the last piece at the tail)
-  if ((cached_body_len-peer_records[peer]->request_bitmap_offset)&63) max_bit++;
-  if (max_bit>=32*8*64) max_bit=32*8*64-1; 
+  int max_block=(cached_body_wire_len+PROGRESS_BLOCK_SIZE-1)/PROGRESS_BLOCK_SIZE;
+  if (max_block>b->blocks) max_block=b->blocks;
+
+  if (progress_bitmap_next_missing(b,0)>=max_block
+      &&p->request_progress_acked<max_block) {
+    // We believe everything has been sent, but the receiver has not yet said
+    // that it has it all, so go back over whatever it has not confirmed.
+    if (debug_bitmap)
+      printf(">>> %s BITMAP: Resending unconfirmed blocks from %d\n",
+	     timestamp_str(),p->request_progress_acked*PROGRESS_BLOCK_SIZE);
+    progress_bitmap_clear_range(b,p->request_progress_acked,
+				max_block-p->request_progress_acked);
+  }
 
   // Search on even boundaries first
-  int i=0; if (peer_records[peer]->request_bitmap_offset&0x40) i=1;
-  for(;i<max_bit;i+=2)
-    if (!(peer_records[peer]->request_bitmap[i>>3]&(1<<(i&7)))) {
-      // If the entire bundle has an odd number of pieces, then the last piece
-      // is not eligible to be an even boundary.
-      if (i!=(max_bit-1))
-	if (candidate_count<MAX_CANDIDATES) candidates[candidate_count++]=i;
-    }
+  for(int i=progress_bitmap_next_missing(b,0);
+      i<max_block&&candidate_count<MAX_CANDIDATES;
+      i=progress_bitmap_next_missing(b,i+1)) {
+    // If the entire bundle has an odd number of pieces, then the last piece
+    // is not eligible to be an even boundary.
+    if (!(i&1)&&i!=(max_block-1)) candidates[candidate_count++]=i;
+  }
   if (!candidate_count) {
     // No evenly aligned candidates, so include all
-    for(i=0;i<max_bit;i++)
-      if (!(peer_records[peer]->request_bitmap[i>>3]&(1<<(i&7))))
-      if (candidate_count<MAX_CANDIDATES) candidates[candidate_count++]=i;
+    for(int i=progress_bitmap_next_missing(b,0);
+	i<max_block&&candidate_count<MAX_CANDIDATES;
+	i=progress_bitmap_next_missing(b,i+1))
+      candidates[candidate_count++]=i;
   }
   
   if (!candidate_count) {
-    // No candidates, so keep sending from end of region
-    if (peer_records[peer]->tx_bundle_body_offset
-	<=(peer_records[peer]->request_bitmap_offset+(32*8*64))) {
-      peer_records[peer]->tx_bundle_body_offset
-	=(peer_records[peer]->request_bitmap_offset+(32*8*64));
-    }
+    // No candidates, so send from the end of the body
+    p->tx_bundle_body_offset=cached_body_wire_len;
   } else {
     int candidate=random()%candidate_count;
     int selection=candidates[candidate];
-    peer_records[peer]->tx_bundle_body_offset
-      =(peer_records[peer]->request_bitmap_offset+(selection*64));
+    p->tx_bundle_body_offset=selection*PROGRESS_BLOCK_SIZE;
       if (debug_bitmap)
 	printf(">>> %s BITMAP based send point for peer #%d(%s*) = %d (candidate %d/%d = block %d)\n",
-	       timestamp_str(),peer,peer_records[peer]->sid_prefix,
-	       peer_records[peer]->tx_bundle_body_offset,
+	       timestamp_str(),peer,p->sid_prefix,
+	       p->tx_bundle_body_offset,
 	       candidate,candidate_count,selection);
       
   }
@@ -308,22 +449,22 @@ int peer_update_send_point(int peer)
   // For the manifest, we just have our simple bitmap to go through
   candidate_count=0;
   for(int i=0;i<(1024/64);i++) {
-    if (!(peer_records[peer]->request_manifest_bitmap[i>>3]&(1<<(i&7)))) {
+    if (!(p->request_manifest_bitmap[i>>3]&(1<<(i&7)))) {
       if (candidate_count<MAX_CANDIDATES)
-	candidates[candidate_count++]=peer_records[peer]->tx_bundle_manifest_offset=i*64;
+	candidates[candidate_count++]=p->tx_bundle_manifest_offset=i*64;
     }
   }
   if (!candidate_count)
     // All send, so set send point to end
-    peer_records[peer]->tx_bundle_manifest_offset=1024;
+    p->tx_bundle_manifest_offset=1024;
   else {
     int candidate=random()%candidate_count;
     int selection=candidates[candidate];
-    peer_records[peer]->tx_bundle_manifest_offset=selection;
+    p->tx_bundle_manifest_offset=selection;
     if (debug_bitmap)
       printf(">>> %s BITMAP based manifest send point for peer #%d(%s*) = %d (candidate %d/%d = block %d)\n",
-	     timestamp_str(),peer,peer_records[peer]->sid_prefix,
-	     peer_records[peer]->tx_bundle_manifest_offset,
+	     timestamp_str(),peer,p->sid_prefix,
+	     p->tx_bundle_manifest_offset,
 	     candidate,candidate_count,selection>>6);
   }
   
@@ -355,7 +496,7 @@ int peer_update_request_bitmaps_due_to_transmitted_piece(int bundle_number,
 	   &&
 	   (peer_records[i]->tx_bundle==bundle_number)
 	   &&
-	   (peer_records[i]->request_bitmap_bundle!=peer_records[i]->tx_bundle)
+	   (!peer_request_progress_is_current(peer_records[i],bundle_number))
 	   )
 	  )
 	{
@@ -364,84 +505,41 @@ int peer_update_request_bitmaps_due_to_transmitted_piece(int bundle_number,
 		   timestamp_str(),i,peer_records[i]->sid_prefix,
 		   peer_records[i]->tx_bundle,bundle_number,
 		   peer_records[i]->request_bitmap_bundle);
-
-	  if (is_manifest) {
-	    // Manifest progress is easier to update, as the bitmap is a fixed 16 bits
-	    for(int j=0;j<16;j++)
-	      if ((start_offset<=(64*j))
-		  &&(start_offset+bytes>=(64+64*j)))
-		peer_records[i]->request_manifest_bitmap[j>>3]|=1<<(j&7);
-	    
-	  } else {	  
-	    // Reset bitmap and start accumulating
-	    bzero(peer_records[i]->request_bitmap,32);
-	    bzero(peer_records[i]->request_manifest_bitmap,2);
-	    peer_records[i]->request_bitmap_bundle=bundle_number;
-	    // The only tricky part is working out the start offset for the bitmap.
-	    // If the offset of the piece is near the start, we will assume we have
-	    // joined the conversation recently, and that the bitmap start is still
-	    // at zero.
-	    // XXX - We could lookup the bundle size to work out the size, and clamp
-	    // the offset on the basis of that.
-	    // XXX - If we are not currently transmitting anything to this peer, we
-	    // could begin speculative transmission, since the bundle is apparently
-	    // interesting to SOMEONE.  This would help to slightly reduce latency
-	    // when the network is otherwise quiescent.
-	    if (start_offset>16384)
-	      peer_records[i]->request_bitmap_offset=start_offset;
-	    else
-	      peer_records[i]->request_bitmap_offset=0;
-	  }
-	  if (peer_records[i]->request_bitmap_bundle==bundle_number) {
-	    if (start_offset>=peer_records[i]->request_bitmap_offset)
-	      {
-		int offset=start_offset-peer_records[i]->request_bitmap_offset;
-		int block_offset=start_offset;
-		int trim=offset&64;
-		int bytes_remaining=bytes;
-		// Trim final partial piece from length, but only if it isn't
-		// the last few bytes of the bundle.
-		if (trim&&((start_offset+bytes)<(bundles[bundle_number].length)))
-		  { offset+=64-trim; bytes_remaining-=trim; }
-		int bit=offset/64;
-		if (bit>=0)
-		  while((bytes_remaining>=64)&&(bit<(32*8*64))) {
-		    if (debug_bitmap)
-		      printf(">>> %s Marking [%d,%d) sent to peer #%d(%s*) due to transmitted piece.\n",
-			     timestamp_str(),block_offset,block_offset+64,i,peer_records[i]->sid_prefix);
-		    if (!(peer_records[i]->request_bitmap[bit>>3]&(1<<(bit&7))))
-		      {
-			if (debug_bitmap)
-			  printf(">>> %s BITMAP: Setting bit %d due to transmitted piece.\n",
-				 timestamp_str(),bit);
-		      }
-		    else
-		      if (debug_bitmap)
-			printf(">>> %s BITMAP: Bit %d already set!\n",timestamp_str(),bit);
-		    
-		    peer_records[i]->request_bitmap[bit>>3]|=(1<<(bit&7));
-		    bit++; bytes_remaining-=64; block_offset+=64;
-		  }
-	      } else {
-	      if (debug_bitmap)
-		printf(">>> %s NOT Marking [%d,%d) sent (start_offset<bitmap offset).\n",
-		       timestamp_str(),start_offset,start_offset+bytes);
-	    }
-	  } else {
-	    if (peer_records[i]) {
-	      if (debug_bitmap) printf(">>> %s NOT Marking [%d,%d) sent to peer #%d(%s*) (no matching bitmap: %d vs %d).\n",
-			    timestamp_str(),start_offset,start_offset+bytes,
-			    i,peer_records[i]->sid_prefix,
-			    peer_records[i]->request_bitmap_bundle,bundle_number);
-	      if (peer_records[i]->tx_bundle==bundle_number)
-		if (debug_bitmap) printf(">>> %s ... but I should care about marking it, because it matches the bundle I am sending.\n",timestamp_str());
-	      if (peer_records[i]->tx_bundle==-1)
-		// In fact, if we see someone sending a bundle to someone, and we don't yet know if we can send it yet, we should probably start on a speculative basis
-		if (debug_bitmap)
-		  printf(">>> %s ... but I could care about marking it, because I am not sending a bundle to them yet.\n",timestamp_str());
-	    }
-	  }
+	  // The bitmap covers the whole bundle, so unlike the old 16KiB window,
+	  // there is no need to guess where the receiver has got up to.
+	  // XXX - If we are not currently transmitting anything to this peer, we
+	  // could begin speculative transmission, since the bundle is apparently
+	  // interesting to SOMEONE.  This would help to slightly reduce latency
+	  // when the network is otherwise quiescent.
+	  peer_reset_request_progress(peer_records[i],bundle_number);
 	}
+
+      if (!peer_request_progress_is_current(peer_records[i],bundle_number)) {
+	if (debug_bitmap) printf(">>> %s NOT Marking [%d,%d) sent to peer #%d(%s*) (no matching bitmap: %d vs %d).\n",
+				 timestamp_str(),start_offset,start_offset+bytes,
+				 i,peer_records[i]->sid_prefix,
+				 peer_records[i]->request_bitmap_bundle,bundle_number);
+	continue;
+      }
+
+      if (is_manifest) {
+	// Manifest progress is easier to update, as the bitmap is a fixed 16 bits
+	for(int j=0;j<16;j++)
+	  if ((start_offset<=(64*j))
+	      &&(start_offset+bytes>=(64+64*j)))
+	    peer_records[i]->request_manifest_bitmap[j>>3]|=1<<(j&7);
+      } else {
+	// Mark the whole blocks in the piece, and the final short block of the body
+	int first_block=(start_offset+PROGRESS_BLOCK_SIZE-1)/PROGRESS_BLOCK_SIZE;
+	int end_block=(start_offset+bytes)/PROGRESS_BLOCK_SIZE;
+	if ((start_offset+bytes)>=bundle_wire_length(bundle_number))
+	  end_block=peer_records[i]->request_progress.blocks;
+	if (debug_bitmap)
+	  printf(">>> %s Marking blocks [%d,%d) sent to peer #%d(%s*) due to transmitted piece.\n",
+		 timestamp_str(),first_block,end_block,i,peer_records[i]->sid_prefix);
+	progress_bitmap_set_range(&peer_records[i]->request_progress,
+				  first_block,end_block-first_block);
+      }
     }
   return 0;
 }
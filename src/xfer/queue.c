@@ -0,0 +1,137 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2018 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  The single producer queue is a ring whose head only the consumer moves
+  and whose tail only the producer moves, so each need only see the
+  other's index, in order.  The multiple producer queue is the bounded
+  queue of Dmitry Vyukov: producers claim a slot by moving the tail with a
+  compare and swap, and each slot's sequence number says whether it has
+  been filled (or emptied) on the current lap of the ring.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue.h"
+
+static int queue_slots(int slots)
+{
+  int n=1;
+  while(n<slots) n<<=1;
+  return n;
+}
+
+int spsc_queue_init(struct spsc_queue *q,int slots,int item_bytes)
+{
+  memset(q,0,sizeof(struct spsc_queue));
+  slots=queue_slots(slots);
+  q->items=malloc((size_t)slots*item_bytes);
+  if (!q->items) return -1;
+  q->mask=slots-1;
+  q->item_bytes=item_bytes;
+  return 0;
+}
+
+int spsc_queue_free(struct spsc_queue *q)
+{
+  free(q->items);
+  q->items=NULL;
+  return 0;
+}
+
+int spsc_queue_push(struct spsc_queue *q,void *item)
+{
+  unsigned int tail=__atomic_load_n(&q->tail,__ATOMIC_RELAXED);
+  unsigned int head=__atomic_load_n(&q->head,__ATOMIC_ACQUIRE);
+  if (tail-head>q->mask) return -1;
+  memcpy(&q->items[(size_t)(tail&q->mask)*q->item_bytes],item,q->item_bytes);
+  __atomic_store_n(&q->tail,tail+1,__ATOMIC_RELEASE);
+  return 0;
+}
+
+int spsc_queue_pop(struct spsc_queue *q,void *item)
+{
+  unsigned int head=__atomic_load_n(&q->head,__ATOMIC_RELAXED);
+  unsigned int tail=__atomic_load_n(&q->tail,__ATOMIC_ACQUIRE);
+  if (head==tail) return -1;
+  memcpy(item,&q->items[(size_t)(head&q->mask)*q->item_bytes],q->item_bytes);
+  __atomic_store_n(&q->head,head+1,__ATOMIC_RELEASE);
+  return 0;
+}
+
+int spsc_queue_length(struct spsc_queue *q)
+{
+  return __atomic_load_n(&q->tail,__ATOMIC_ACQUIRE)
+    -__atomic_load_n(&q->head,__ATOMIC_ACQUIRE);
+}
+
+int mpsc_queue_init(struct mpsc_queue *q,int slots,int item_bytes)
+{
+  memset(q,0,sizeof(struct mpsc_queue));
+  slots=queue_slots(slots);
+  q->items=malloc((size_t)slots*item_bytes);
+  q->sequence=malloc(slots*sizeof(unsigned int));
+  if ((!q->items)||(!q->sequence)) { mpsc_queue_free(q); return -1; }
+  for(int i=0;i<slots;i++) q->sequence[i]=i;
+  q->mask=slots-1;
+  q->item_bytes=item_bytes;
+  return 0;
+}
+
+int mpsc_queue_free(struct mpsc_queue *q)
+{
+  free(q->items); q->items=NULL;
+  free(q->sequence); q->sequence=NULL;
+  return 0;
+}
+
+int mpsc_queue_push(struct mpsc_queue *q,void *item)
+{
+  unsigned int pos=__atomic_load_n(&q->tail,__ATOMIC_RELAXED);
+  while(1) {
+    unsigned int seq=__atomic_load_n(&q->sequence[pos&q->mask],__ATOMIC_ACQUIRE);
+    int diff=(int)(seq-pos);
+    if (!diff) {
+      if (__atomic_compare_exchange_n(&q->tail,&pos,pos+1,1,
+				      __ATOMIC_RELAXED,__ATOMIC_RELAXED))
+	break;
+      // (pos now holds the tail someone else moved it to)
+    } else if (diff<0)
+      // Not yet emptied since the last lap: full
+      return -1;
+    else
+      pos=__atomic_load_n(&q->tail,__ATOMIC_RELAXED);
+  }
+  memcpy(&q->items[(size_t)(pos&q->mask)*q->item_bytes],item,q->item_bytes);
+  __atomic_store_n(&q->sequence[pos&q->mask],pos+1,__ATOMIC_RELEASE);
+  return 0;
+}
+
+int mpsc_queue_pop(struct mpsc_queue *q,void *item)
+{
+  unsigned int pos=q->head;
+  unsigned int seq=__atomic_load_n(&q->sequence[pos&q->mask],__ATOMIC_ACQUIRE);
+  if ((int)(seq-(pos+1))<0) return -1;
+  memcpy(item,&q->items[(size_t)(pos&q->mask)*q->item_bytes],q->item_bytes);
+  __atomic_store_n(&q->sequence[pos&q->mask],pos+q->mask+1,__ATOMIC_RELEASE);
+  q->head=pos+1;
+  return 0;
+}
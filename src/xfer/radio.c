@@ -34,6 +34,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "lbard.h"
 #include "hf.h"
 #include "radios.h"
+#include "metrics.h"
+#include "capture.h"
 
 #include "golay.h"
 #include "fec-3.0.1/fixed.h"
@@ -56,6 +58,11 @@ int serial_errors=0;
 // rate based on an estimate of channel congestion.
 int radio_transmissions_seen=0;
 int radio_transmissions_byus=0;
+// And how many of our peers' frames we missed, and how big they all were,
+// so that we can estimate how busy the channel is (see rate_control.c).
+int radio_frames_missed=0;
+long long radio_bytes_sent=0;
+long long radio_bytes_heard=0;
 
 int radio_mode=-1;
 int radio_features=0;
@@ -83,6 +90,11 @@ int radio_set_feature(int bitmask)
   return 0;
 }
 
+int radio_has_feature(int bitmask)
+{
+  return (radio_features&bitmask)==bitmask;
+}
+
 int radio_read_bytes(int serialfd,int monitor_mode)
 {
   unsigned char buf[8192];
@@ -136,6 +148,7 @@ int radio_send_message(int serialfd, unsigned char *buffer,int length)
   
   assert( offset <= (FEC_MAX_BYTES+FEC_LENGTH) );
 
+  radio_lock();
   if (radio_get_type()>=0) {
     int result=radio_types[radio_get_type()].send_packet(serialfd,out,offset);
     if (result) fprintf(stderr,"Transmission of packet failed.\n");
@@ -143,6 +156,10 @@ int radio_send_message(int serialfd, unsigned char *buffer,int length)
   
   // Don't forget to count our own transmissions
   radio_transmissions_byus++;
+  radio_bytes_sent+=offset;
+  radio_unlock();
+  metric_counter_add("lbard_radio_frames_sent_total",metric_radio_label(),1);
+  metric_counter_add("lbard_radio_bytes_sent_total",metric_radio_label(),offset);
 
   return 0;
 }
@@ -181,6 +198,9 @@ int saw_packet(unsigned char *packet_data,int packet_bytes,int rssi,
 	       char *my_sid_hex,char *prefix,
 	       char *servald_server,char *credential)
 {
+  if (capture_file)
+    capture_write(capture_file,gettime_us(),-1,rssi,packet_data,packet_bytes);
+
   if (debug_radio) dump_bytes(stdout,"packet before decode_rs",packet_data,packet_bytes);
   
   int rs_error_count = decode_rs_8(packet_data,NULL,0,
@@ -188,6 +208,18 @@ int saw_packet(unsigned char *packet_data,int packet_bytes,int rssi,
   
   if (debug_radio) dump_bytes(stdout,"received packet",packet_data,packet_bytes);
 
+  if (threads_on_radio_thread())
+    // The rest is for the main loop (see threads.c)
+    return threads_queue_frame(packet_data,packet_bytes,rssi,rs_error_count);
+
+  return saw_decoded_packet(packet_data,packet_bytes,rssi,rs_error_count,
+			    my_sid_hex,prefix,servald_server,credential);
+}
+
+int saw_decoded_packet(unsigned char *packet_data,int packet_bytes,int rssi,
+		       int rs_error_count,char *my_sid_hex,char *prefix,
+		       char *servald_server,char *credential)
+{
   char sender_prefix[128];
   bytes_to_prefix(&packet_data[0],sender_prefix);
 
@@ -197,6 +229,11 @@ int saw_packet(unsigned char *packet_data,int packet_bytes,int rssi,
     return -1;
   }
   
+  char labels[MAX_METRIC_LABELS_LEN];
+  snprintf(labels,sizeof(labels),"%s,fec=\"%s\"",metric_radio_label(),
+	   (rs_error_count>=0&&rs_error_count<8)?"ok":"fail");
+  metric_counter_add("lbard_radio_frames_received_total",labels,1);
+
   if (rs_error_count>=0&&rs_error_count<8) {
     if (0) printf("CHECKPOINT: %s:%d %s() error counts = %d for packet of %d bytes.\n",
 		  __FILE__,__LINE__,__FUNCTION__,
@@ -0,0 +1,177 @@
+/*
+Serval Low-Bandwidth Rhizome Transport
+Copyright (C) 2015 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  How often to transmit on a shared CSMA channel.
+
+  Every few seconds we estimate how much of the channel's airtime was in
+  use, from the frames we sent and heard (and the frames we missed, going
+  by the gaps in our peers' message numbers, which were on the air too),
+  and what share of our peers' frames we missed.  Then, AIMD: while both
+  are below target, each node sends a little more often; once either is
+  above, each sends a fraction less often, in proportion to how far over
+  target the channel is.  Nodes that hear each other see the same channel,
+  so they back off together, and the additive increase brings them to
+  equal shares.  Two nodes end up sending as fast as the duty cycle limit
+  allows, and fifty back off until they stop trampling each other.
+
+  This is also used by fakecsmaradio, to simulate many nodes at once
+  (see channel_simulation() there), so it must not depend on the rest of
+  lbard.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "rate_control.h"
+
+#define RATE_CONTROL_AIR_BITRATE 128000
+// Preamble and sync word, in bytes
+#define RATE_CONTROL_FRAME_OVERHEAD 8
+// Assumed size of frames we have no better idea of
+#define RATE_CONTROL_TYPICAL_FRAME 232
+
+// Keeps our duty cycle below about 10%
+#define RATE_CONTROL_MIN_INTERVAL 150
+#define RATE_CONTROL_MAX_INTERVAL 10000
+// Until we hear someone, there is no point hurrying
+#define RATE_CONTROL_LONELY_INTERVAL 1000
+
+#define RATE_CONTROL_DEFAULT_OCCUPANCY 25
+// Some loss is the price of using the channel at all: with a quarter of the
+// airtime in use, about 40% of frames collide if no one listens before
+// talking.  More than half is what hidden senders look like.
+#define RATE_CONTROL_LOSS_LIMIT 0.5
+// Frames per second added each window, and the most we cut by at once
+#define RATE_CONTROL_INCREASE 0.25
+#define RATE_CONTROL_MAX_DECREASE 0.5
+#define RATE_CONTROL_LOSS_DECREASE 0.75
+
+int rate_control_init(struct rate_control *rc,int fixed_target,int target_occupancy)
+{
+  bzero(rc,sizeof(struct rate_control));
+  rc->fixed_target=fixed_target;
+  rc->target_occupancy=target_occupancy>0?target_occupancy:RATE_CONTROL_DEFAULT_OCCUPANCY;
+  rc->rate=1000.0/RATE_CONTROL_LONELY_INTERVAL;
+  rc->interval_ms=RATE_CONTROL_LONELY_INTERVAL*8/9;
+  rc->randomness_ms=rc->interval_ms>>2;
+  return 0;
+}
+
+/*
+  The old scheme, for packetrate=: aim for a fixed number of frames per 4
+  seconds on the channel, however big they are and whoever sends them.
+*/
+static int rate_control_fixed(struct rate_control *rc,struct rate_control_window *w)
+{
+  int interval=rc->interval_ms;
+  double ratio=(w->frames_heard+w->frames_sent)*1.0/rc->fixed_target;
+  if (ratio<0.95) {
+    // Speed up: If we are way too slow, then double our rate
+    // If not too slow, then just trim 10ms from our interval
+    if (ratio<0.25) interval/=2;
+    else {
+      int adjust=10;
+      if ((ratio<0.80)&&(interval>300)) adjust=20;
+      if ((ratio<0.50)&&(interval>300)) adjust=50;
+      if (ratio>0.90) adjust=3;
+      // Only increase our packet rate, if we are not already hogging the channel
+      // i.e., we are allowed to send at most 1/n of the packets.
+      float max_packets_per_second=1;
+      if (w->active_peers)
+	max_packets_per_second=(rc->fixed_target/w->active_peers)/4.0;
+      // (which with more peers than that target, is no limit at all)
+      int minimum_interval=0;
+      if (max_packets_per_second>0) minimum_interval=1000.0/max_packets_per_second;
+      if (w->frames_sent<=w->frames_heard) interval-=adjust;
+      if (interval<minimum_interval) interval=minimum_interval;
+    }
+  } else if (ratio>1.0) {
+    // Slow down!  We slow down quickly, so as to try to avoid causing
+    // too many colissions.
+    interval*=(ratio+0.4);
+    if (!interval) interval=50;
+    if (interval>4000) interval=4000;
+  }
+  if (!w->frames_heard) interval=RATE_CONTROL_LONELY_INTERVAL;
+  rc->interval_ms=interval;
+  return 0;
+}
+
+// How busy the channel was, and how much of it we missed
+static int rate_control_estimate(struct rate_control *rc,struct rate_control_window *w)
+{
+  long long heard_frame=w->frames_heard?w->bytes_heard/w->frames_heard:
+    RATE_CONTROL_TYPICAL_FRAME;
+  long long busy_bytes=w->bytes_sent+w->bytes_heard+w->frames_missed*heard_frame
+    +(w->frames_sent+w->frames_heard+w->frames_missed)*RATE_CONTROL_FRAME_OVERHEAD;
+  double occupancy=busy_bytes*8.0*1000/RATE_CONTROL_AIR_BITRATE/w->window_ms;
+  double loss=(w->frames_heard+w->frames_missed)?
+    w->frames_missed*1.0/(w->frames_heard+w->frames_missed):0;
+  rc->occupancy=(rc->occupancy+occupancy)/2;
+  rc->loss=(rc->loss+loss)/2;
+  return 0;
+}
+
+static int rate_control_adapt(struct rate_control *rc,struct rate_control_window *w)
+{
+  double target=rc->target_occupancy/100.0;
+  if (!w->frames_heard)
+    rc->rate=1000.0/RATE_CONTROL_LONELY_INTERVAL;
+  else if (rc->occupancy>target) {
+    double cut=target/rc->occupancy;
+    if (cut<RATE_CONTROL_MAX_DECREASE) cut=RATE_CONTROL_MAX_DECREASE;
+    rc->rate*=cut;
+  } else if (rc->loss>RATE_CONTROL_LOSS_LIMIT)
+    rc->rate*=RATE_CONTROL_LOSS_DECREASE;
+  else if (rc->occupancy<target/4)
+    // Nowhere near: don't take minutes to get there
+    rc->rate*=2;
+  else
+    rc->rate+=RATE_CONTROL_INCREASE;
+
+  if (rc->rate>1000.0/RATE_CONTROL_MIN_INTERVAL) rc->rate=1000.0/RATE_CONTROL_MIN_INTERVAL;
+  if (rc->rate<1000.0/RATE_CONTROL_MAX_INTERVAL) rc->rate=1000.0/RATE_CONTROL_MAX_INTERVAL;
+  // The random part adds an eighth on average
+  rc->interval_ms=1000.0/rc->rate*8/9;
+  return 0;
+}
+
+int rate_control_update(struct rate_control *rc,struct rate_control_window *w)
+{
+  if (w->window_ms<1) return -1;
+  rate_control_estimate(rc,w);
+  if (rc->fixed_target) rate_control_fixed(rc,w);
+  else rate_control_adapt(rc,w);
+
+  // Make randomness 1/4 of interval, or 25ms, whichever is greater.
+  // The addition of the randomness means that we should never actually reach
+  // our target capacity.
+  rc->randomness_ms=rc->interval_ms>>2;
+  if (rc->randomness_ms<25) rc->randomness_ms=25;
+
+  // Force message interval to be at least 150ms + randomness
+  // This keeps duty cycle < about 10% always.
+  // 4 - 5 packets per second is therefore the fastest that we will go
+  // (256 byte packet @ 128kbit/sec takes ~20ms)
+  if (rc->interval_ms<RATE_CONTROL_MIN_INTERVAL) rc->interval_ms=RATE_CONTROL_MIN_INTERVAL;
+  return 0;
+}
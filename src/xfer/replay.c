@@ -0,0 +1,95 @@
+/*
+Serval Low-Bandwidth Rhizome Transport
+Copyright (C) 2015 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Replay an air-traffic capture through the receive path (FEC decode,
+  saw_message() and the message handlers) as fast as possible, and report
+  how much CPU time each frame costs.  This lets traffic recorded in the
+  field, or from fakecsmaradio, be used to catch receive path regressions.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include "sync.h"
+#include "lbard.h"
+#include "capture.h"
+
+static long long cpu_time_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID,&ts);
+  return ts.tv_sec*1000000000LL+ts.tv_nsec;
+}
+
+int replay_capture(char *filename,int passes)
+{
+  struct capture_record *r=malloc(sizeof(struct capture_record));
+  struct latency_histogram h;
+  bzero(&h,sizeof(h));
+  long long frames=0,fec_failures=0,bytes=0;
+  long long first_timestamp=-1,last_timestamp=-1;
+
+  if (!r) return -1;
+  for(int pass=0;pass<passes;pass++) {
+    FILE *f=capture_open_read(filename);
+    if (!f) { free(r); return -1; }
+    int result;
+    while((result=capture_read(f,r))==1) {
+      if (first_timestamp<0) first_timestamp=r->timestamp_us;
+      last_timestamp=r->timestamp_us;
+      long long start=cpu_time_ns();
+      if (saw_packet(r->frame,r->length,r->rssi,
+		     my_sid_hex,prefix,servald_server,credential))
+	fec_failures++;
+      latency_histogram_record(&h,cpu_time_ns()-start);
+      frames++;
+      bytes+=r->length;
+    }
+    fclose(f);
+    if (result<0) {
+      fprintf(stderr,"Capture file '%s' is truncated or corrupt after %lld frames\n",
+	      filename,frames);
+      break;
+    }
+  }
+  free(r);
+
+  fprintf(stderr,"Replayed %lld frames (%lld bytes, %lld rejected) from '%s' in %d passes\n",
+	  frames,bytes,fec_failures,filename,passes);
+  if (frames)
+    fprintf(stderr,"Capture covers %.1f seconds of air time per pass\n",
+	    (last_timestamp-first_timestamp)/1000000.0);
+  if (h.count) {
+    fprintf(stderr,"Receive CPU per frame: mean %lldns, p50 %lldns, p90 %lldns, p99 %lldns, max %lldns\n",
+	    h.sum/h.count,
+	    latency_histogram_percentile(&h,50),
+	    latency_histogram_percentile(&h,90),
+	    latency_histogram_percentile(&h,99),
+	    h.max);
+    fprintf(stderr,"Receive CPU total %.3fs, %.0f frames per CPU second\n",
+	    h.sum/1000000000.0,h.count*1000000000.0/(h.sum?h.sum:1));
+  }
+  return 0;
+}
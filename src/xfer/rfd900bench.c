@@ -0,0 +1,218 @@
+/*
+Serval Low-Bandwidth Rhizome Transport
+Copyright (C) 2015 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  RFD900 serial receive benchmark.  The frames of an air-traffic capture
+  (or random frames, if none is given) are wrapped in the CSMA envelope the
+  radio firmware puts around them, mixed with the radio's status reports of
+  both kinds, and fed in reads of the given size through the receive
+  scanner in drv_rfd900.c, and through the shift-register scanner it
+  replaced.  Each must find every frame and report, at the same place, and
+  the throughput of each is reported in serial bytes per second.  Frames
+  are only counted and checksummed, not passed to saw_packet(), so this
+  measures the framing alone.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include "sync.h"
+#include "lbard.h"
+#include "radios.h"
+#include "capture.h"
+
+#define RFD900BENCH_STREAM_BYTES (2*1024*1024)
+#define RFD900BENCH_MAX_FRAME 255
+
+struct rfd900bench_tally {
+  long long trailers[RFD900_RX_ENVELOPE+1];
+  long long frame_bytes;
+  unsigned int checksum;
+};
+
+static struct rfd900bench_tally rfd900bench_tally;
+
+static long long rfd900bench_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1000000000LL+ts.tv_nsec;
+}
+
+static int rfd900bench_saw_trailer(struct rfd900_rx *rx,int kind,unsigned char *end)
+{
+  rfd900bench_tally.trailers[kind]++;
+  if (kind==RFD900_RX_ENVELOPE) {
+    int len=end[-4];
+    unsigned char *frame=end-9-len;
+    rfd900bench_tally.frame_bytes+=len;
+    for(int i=0;i<len;i++)
+      rfd900bench_tally.checksum=rfd900bench_tally.checksum*31+frame[i];
+  }
+  return 0;
+}
+
+/*
+  The scanner as it was: the whole buffer moves down a byte for each byte
+  received, and the trailers are looked for at its end.
+*/
+#define RFD900BENCH_LEGACY_SIZE RFD900_RX_HISTORY
+static unsigned char rfd900bench_legacy_buffer[RFD900BENCH_LEGACY_SIZE];
+
+static int rfd900bench_legacy_scan(unsigned char *bytes,int count)
+{
+  const int template[22]={
+    0xf0,0x9f,0x93,0xa5,-1,-1,-1,-1,0xc2,0xb0,-1,-1,-1,-1,-1,-1,-1,-1,
+    0xf0,0x9f,0x93,0xa4};
+  unsigned char *b=rfd900bench_legacy_buffer;
+  unsigned char *end=&b[RFD900BENCH_LEGACY_SIZE];
+  for(int i=0;i<count;i++) {
+    bcopy(&b[1],&b[0],RFD900BENCH_LEGACY_SIZE-1);
+    b[RFD900BENCH_LEGACY_SIZE-1]=bytes[i];
+    int isReport=1;
+    for(int j=0;j<22;j++)
+      if ((template[j]!=-1)&&(end[j-22]!=template[j])) { isReport=0; break; }
+    if (isReport)
+      rfd900bench_saw_trailer(NULL,RFD900_RX_REPORT,end);
+    else if ((end[-1]==0xdd)&&(end[-8]==0xec)&&(end[-9]==0xce))
+      rfd900bench_saw_trailer(NULL,RFD900_RX_OLD_REPORT,end);
+    else if ((end[-1]==0x55)&&(end[-8]==0x55)&&(end[-9]==0xaa))
+      rfd900bench_saw_trailer(NULL,RFD900_RX_ENVELOPE,end);
+  }
+  return 0;
+}
+
+static int rfd900bench_append(unsigned char *stream,int *len,unsigned char *bytes,int n)
+{
+  if (*len+n>RFD900BENCH_STREAM_BYTES) return -1;
+  memcpy(&stream[*len],bytes,n);
+  *len+=n;
+  return 0;
+}
+
+// The serial stream the radio would send us for these frames
+static int rfd900bench_build_stream(unsigned char *stream,char *capture_file,int *frames)
+{
+  struct capture_record *r=malloc(sizeof(struct capture_record));
+  FILE *f=NULL;
+  int len=0;
+  *frames=0;
+  if (!r) return -1;
+  srandom(1);
+  if (capture_file&&!(f=capture_open_read(capture_file))) { free(r); return -1; }
+
+  while(1) {
+    if (f) {
+      int result=capture_read(f,r);
+      if (result!=1) {
+	if (!*frames) break;
+	// Go round again until the stream is full
+	fclose(f);
+	f=capture_open_read(capture_file);
+	if (!f||capture_read(f,r)!=1) break;
+      }
+      if ((r->length<1)||(r->length>RFD900BENCH_MAX_FRAME)) continue;
+    } else {
+      r->length=1+random()%RFD900BENCH_MAX_FRAME;
+      for(int i=0;i<r->length;i++) r->frame[i]=random();
+    }
+    unsigned char envelope[9]={0xaa,0x55,200,100,28,r->length,0xff,0x0f,0x55};
+    unsigned char old_report[9]={0xce,0xec,0xff,0xff,0xff,0xff,0xff,0xff,0xdd};
+    unsigned char report[22]={0xf0,0x9f,0x93,0xa5,'+','0','2','8',0xc2,0xb0,
+			      '0','1','X','x','0','1','9','1',0xf0,0x9f,0x93,0xa4};
+    if ((!(*frames%10))&&rfd900bench_append(stream,&len,old_report,sizeof(old_report))) break;
+    if ((!(*frames%50))&&rfd900bench_append(stream,&len,report,sizeof(report))) break;
+    if (rfd900bench_append(stream,&len,r->frame,r->length)) break;
+    if (rfd900bench_append(stream,&len,envelope,sizeof(envelope))) break;
+    (*frames)++;
+  }
+  if (f) fclose(f);
+  free(r);
+  return len;
+}
+
+static double rfd900bench_run(char *name,unsigned char *stream,int len,int read_bytes,
+			      struct rfd900_rx *rx,struct rfd900bench_tally *tally)
+{
+  long long passes=0;
+  long long start=rfd900bench_ns(),elapsed;
+  do {
+    bzero(&rfd900bench_tally,sizeof(rfd900bench_tally));
+    if (rx) rfd900_rx_init(rx,rfd900bench_saw_trailer);
+    else bzero(rfd900bench_legacy_buffer,sizeof(rfd900bench_legacy_buffer));
+    for(int i=0;i<len;i+=read_bytes) {
+      int n=(len-i<read_bytes)?len-i:read_bytes;
+      if (rx) rfd900_rx_scan(rx,&stream[i],n);
+      else rfd900bench_legacy_scan(&stream[i],n);
+    }
+    passes++;
+    elapsed=rfd900bench_ns()-start;
+  } while(elapsed<500000000LL);
+  *tally=rfd900bench_tally;
+  double rate=passes*len*1000000000.0/elapsed;
+  printf("%-15s %12.0f bytes/sec (%lld frames, %lld reports, %lld old reports)\n",
+	 name,rate,tally->trailers[RFD900_RX_ENVELOPE],
+	 tally->trailers[RFD900_RX_REPORT],tally->trailers[RFD900_RX_OLD_REPORT]);
+  return rate;
+}
+
+int rfd900_benchmark(char *capture_file,int read_bytes)
+{
+  if (read_bytes<1) {
+    fprintf(stderr,"Reads must be at least one byte\n");
+    return -1;
+  }
+  unsigned char *stream=malloc(RFD900BENCH_STREAM_BYTES);
+  struct rfd900_rx *rx=malloc(sizeof(struct rfd900_rx));
+  int frames=0;
+  int len=stream?rfd900bench_build_stream(stream,capture_file,&frames):-1;
+  if ((len<=0)||!rx) {
+    fprintf(stderr,"Could not build a stream of frames%s%s\n",
+	    capture_file?" from ":"",capture_file?capture_file:"");
+    free(stream); free(rx);
+    return -1;
+  }
+
+  printf("RFD900 receive framing, %d frames in %d serial bytes, read %d bytes at a time\n",
+	 frames,len,read_bytes);
+  struct rfd900bench_tally legacy,current;
+  double legacy_rate=rfd900bench_run("shift register",stream,len,read_bytes,NULL,&legacy);
+  double current_rate=rfd900bench_run("window",stream,len,read_bytes,rx,&current);
+  printf("%.1fx faster\n",current_rate/legacy_rate);
+
+  int failed=0;
+  if (memcmp(legacy.trailers,current.trailers,sizeof(current.trailers))
+      ||(legacy.frame_bytes!=current.frame_bytes)
+      ||(legacy.checksum!=current.checksum)) {
+    printf("FAIL: the two scanners found different frames or reports\n");
+    failed=1;
+  }
+  if (current.trailers[RFD900_RX_ENVELOPE]<frames) {
+    printf("FAIL: only %lld of %d frames were found\n",
+	   current.trailers[RFD900_RX_ENVELOPE],frames);
+    failed=1;
+  }
+  free(stream); free(rx);
+  return failed?-1:0;
+}
@@ -0,0 +1,480 @@
+/*
+Serval Low-Bandwidth Rhizome Transport
+Copyright (C) 2015 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Receive path microbenchmark.  For each message type that saw_message()
+  dispatches, build a stream of synthetic but valid frames from a single
+  peer, feed them through saw_message() and the real message handler, and
+  report the time and number of heap allocations per message.
+
+  servald is stubbed out (see connect_to_port()), so that a handler that
+  would talk to it fails fast, and the number of requests it tried to make
+  is reported instead.  Message types that should never need servald have
+  a budget below: the benchmark fails if one of them makes a request, or
+  (when allocations are being counted) allocates more than it used to.
+
+  Allocations are only counted in the lbard-rxbench binary ("make rxbench"),
+  which is built with COUNT_ALLOCATIONS so that malloc() and friends are
+  wrapped.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include "sync.h"
+#include "lbard.h"
+#include "message_handlers.h"
+
+#ifdef COUNT_ALLOCATIONS
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb,size_t size);
+extern void *__libc_realloc(void *ptr,size_t size);
+
+static long long allocation_count=0;
+
+void *malloc(size_t size)
+{
+  allocation_count++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb,size_t size)
+{
+  allocation_count++;
+  return __libc_calloc(nmemb,size);
+}
+
+void *realloc(void *ptr,size_t size)
+{
+  allocation_count++;
+  return __libc_realloc(ptr,size);
+}
+#endif
+
+int status_dump_bundlerx(FILE *f,char *topic);
+extern int servald_stubbed;
+extern long long servald_stubbed_requests;
+
+#define RXBENCH_BUNDLES 1000
+#define RXBENCH_MTU 200
+#define RXBENCH_MAX_SYNC_MESSAGES 1024
+// Messages of each type processed before measuring starts
+#define RXBENCH_WARMUP 256
+
+// The peer all of the frames come from
+static unsigned char sender_sid[6]={0xa1,0xb2,0xc3,0xd4,0xe5,0xf6};
+
+// The bundle we hold an older version of, for the journal piece case
+static int journal_bundle=-1;
+
+static unsigned char sync_messages[RXBENCH_MAX_SYNC_MESSAGES][256];
+static int sync_message_count=0;
+
+static void rxbench_bid(int n,char *bid)
+{
+  snprintf(bid,65,"%08X%056X",n*0x9e3779b1U,n);
+}
+
+static int register_test_bundles(int count)
+{
+  char bid[65],filehash[129],author[65],version[32];
+  for(int i=0;i<count;i++) {
+    rxbench_bid(i,bid);
+    snprintf(filehash,129,"%064X%064X",i,i*7);
+    snprintf(author,65,"%064X",i%17);
+    snprintf(version,32,"%lld",1500000000000LL+i);
+    register_bundle("file",bid,version,author,"0",1000+i*100,filehash,
+		    author,"",NULL);
+  }
+
+  // A MeshMS2 journal that the peer will offer us a newer version of
+  rxbench_bid(count,bid);
+  snprintf(filehash,129,"%0128X",count);
+  register_bundle("MeshMS2",bid,"1000",bid,"0",1000,filehash,bid,bid,NULL);
+  journal_bundle=bundle_count-1;
+  return 0;
+}
+
+static int build_ack(int n,unsigned char *msg)
+{
+  int b=n%RXBENCH_BUNDLES;
+  int len=0;
+  msg[len++]='A';
+  for(int i=0;i<8;i++) msg[len++]=bundles[b].bid_bin[i];
+  msg[len++]=0xff; msg[len++]=0xff;
+  for(int i=0;i<4;i++) msg[len++]=((n*64)>>(i*8))&0xff;
+  msg[len++]=my_sid[0]; msg[len++]=my_sid[1];
+  return len;
+}
+
+static int build_bar(int n,unsigned char *msg)
+{
+  int b=n%RXBENCH_BUNDLES;
+  int len=0;
+  msg[len++]='B';
+  for(int i=0;i<8;i++) msg[len++]=bundles[b].bid_bin[i];
+  for(int i=0;i<8;i++) msg[len++]=(bundles[b].version>>(i*8))&0xff;
+  for(int i=0;i<4;i++) msg[len++]=0;
+  msg[len++]=log2ish(bundles[b].length)|0x80;
+  return len;
+}
+
+static int build_generation_id(int n,unsigned char *msg)
+{
+  int len=0;
+  msg[len++]='G';
+  for(int i=0;i<4;i++) msg[len++]=(0x1234567>>(i*8))&0xff;
+  return len;
+}
+
+static int build_capabilities(int n,unsigned char *msg)
+{
+  int len=0;
+  append_capabilities(msg,&len);
+  return len;
+}
+
+static int build_timestamp(int n,unsigned char *msg)
+{
+  int len=0;
+  append_timestamp(msg,&len);
+  // Claim the worst stratum, so that we never try to set the clock
+  msg[1]=0xff;
+  return len;
+}
+
+static int build_length(int n,unsigned char *msg)
+{
+  int offset=0;
+  unsigned char bid_bin[8];
+  for(int i=0;i<8;i++) bid_bin[i]=(n*0x9e3779b1U)>>(i*4);
+  announce_bundle_length(RXBENCH_MTU,msg,&offset,bid_bin,1LL<<40,BODY_CODEC_NONE,n*64);
+  return offset;
+}
+
+static int build_progress_bitmap(int n,unsigned char *msg)
+{
+  int b=n%RXBENCH_BUNDLES;
+  int len=0;
+  // Both the run-length form, and the fixed bitmap for older peers
+  int runs=n&1;
+  msg[len++]=runs?'m':'M';
+  if (runs) msg[len++]=0;
+  for(int i=0;i<8;i++) msg[len++]=bundles[b].bid_bin[i];
+  msg[len++]=0xff; msg[len++]=0x0f;
+  for(int i=0;i<4;i++) msg[len++]=((n*64)>>(i*8))&0xff;
+  if (runs) {
+    // A few holes, then the rest missing
+    for(int i=0;i<16;i++) msg[len++]=1+((n+i)&0x3f);
+    msg[len++]=0;
+    msg[1]=len;
+  } else
+    for(int i=0;i<32;i++) msg[len++]=(n+i)*0x25;
+  return len;
+}
+
+static int build_segment_request(int n,unsigned char *msg)
+{
+  int b=n%RXBENCH_BUNDLES;
+  int len=0;
+  msg[len++]='R';
+  msg[len++]=my_sid[0]; msg[len++]=my_sid[1];
+  for(int i=0;i<8;i++) msg[len++]=bundles[b].bid_bin[i];
+  for(int i=0;i<3;i++) msg[len++]=((n*64)>>(i*8))&0x7f;
+  return len;
+}
+
+static int build_piece_common(unsigned char *msg,unsigned char *bid_bin,
+			      long long version,int offset,int bytes)
+{
+  int len=0;
+  msg[len++]='q';
+  msg[len++]=my_sid[0]; msg[len++]=my_sid[1];
+  for(int i=0;i<8;i++) msg[len++]=bid_bin[i];
+  for(int i=0;i<8;i++) msg[len++]=(version>>(i*8))&0xff;
+  unsigned int offset_compound=(offset&0xfffff)|((bytes&0x7ff)<<20);
+  for(int i=0;i<4;i++) msg[len++]=(offset_compound>>(i*8))&0xff;
+  for(int i=0;i<bytes;i++) msg[len++]=i;
+  return len;
+}
+
+static int build_piece(int n,unsigned char *msg)
+{
+  // Successive 64 byte body pieces of bundles we do not have, moving to a
+  // new bundle after each 1MB, so that every piece carries new data.
+  unsigned char bid_bin[8];
+  int bundle=n/16384;
+  for(int i=0;i<8;i++) bid_bin[i]=0xc0+((bundle>>(i*8))&0xff);
+  return build_piece_common(msg,bid_bin,1LL<<40,(n%16384)*64,64);
+}
+
+static int build_compact_piece(int n,unsigned char *msg)
+{
+  // As for build_piece(), but with a piece slot, bound at the start of each
+  // bundle.
+  int len=0;
+  int bundle=n/16384;
+  unsigned char slot=1+(bundle%255);
+  if (!(n%16384)) {
+    msg[len++]='K';
+    msg[len++]=slot;
+    msg[len++]=my_sid[0]; msg[len++]=my_sid[1];
+    for(int i=0;i<8;i++) msg[len++]=0xe0+((bundle>>(i*8))&0xff);
+    for(int i=0;i<8;i++) msg[len++]=((1LL<<40)>>(i*8))&0xff;
+  }
+  msg[len++]='i';
+  msg[len++]=slot;
+  unsigned int offset_compound=(((n%16384)*64)&0xfffff)|(64<<20);
+  for(int i=0;i<4;i++) msg[len++]=(offset_compound>>(i*8))&0xff;
+  for(int i=0;i<64;i++) msg[len++]=i;
+  return len;
+}
+
+static int build_journal_piece(int n,unsigned char *msg)
+{
+  // A newer version of a journal we hold.  Only the bytes past the end of our
+  // version are kept, so this needs nothing from servald.
+  return build_piece_common(msg,bundles[journal_bundle].bid_bin,
+			    bundles[journal_bundle].version+1000,
+			    bundles[journal_bundle].version,64);
+}
+
+static void ignore_peer_has(void *context,void *peer_context,const sync_key_t *key) { }
+static void ignore_peer_does_not_have(void *context,void *peer_context,void *key_context,
+				      const sync_key_t *key) { }
+static void ignore_peer_now_has(void *context,void *peer_context,void *key_context,
+				const sync_key_t *key) { }
+
+/*
+  Record the sync tree messages a peer sends us while the two of us work out
+  which bundles we differ by.  The peer shares 90% of our bundles, and has
+  some of its own.
+*/
+static int record_sync_messages(struct peer_state *p)
+{
+  struct sync_state *remote=sync_alloc_state(NULL,ignore_peer_has,
+					      ignore_peer_does_not_have,
+					      ignore_peer_now_has);
+  for(int i=0;i<RXBENCH_BUNDLES;i++)
+    if (i%10) sync_add_key(remote,&bundles[i].sync_key,NULL);
+  for(int i=0;i<RXBENCH_BUNDLES/10;i++) {
+    sync_key_t key;
+    for(int j=0;j<KEY_LEN;j++) key.key[j]=random();
+    sync_add_key(remote,&key,NULL);
+  }
+
+  int us;
+  uint8_t reply[256];
+  for(int round=0;round<RXBENCH_MAX_SYNC_MESSAGES;round++) {
+    unsigned char *msg=sync_messages[sync_message_count];
+    msg[0]='S';
+    int used=sync_build_message(remote,&msg[SYNC_MSG_HEADER_LEN],
+				RXBENCH_MTU-SYNC_MSG_HEADER_LEN);
+    if (used>0) {
+      msg[1]=SYNC_MSG_HEADER_LEN+used;
+      message_parser_53(p,p->sid_prefix,servald_server,credential,msg,msg[1]);
+      sync_message_count++;
+    }
+    used=sync_build_message(sync_state,reply,RXBENCH_MTU-SYNC_MSG_HEADER_LEN);
+    if (used>0) sync_recv_message(remote,&us,reply,used);
+    // Stop once the trees have converged
+    if (!sync_has_transmit_queued(remote)&&!sync_has_transmit_queued(sync_state))
+      break;
+  }
+  sync_free_state(remote);
+  return sync_message_count;
+}
+
+static int build_sync(int n,unsigned char *msg)
+{
+  unsigned char *m=sync_messages[n%sync_message_count];
+  bcopy(m,msg,m[1]);
+  return m[1];
+}
+
+static int build_nothing(int n,unsigned char *msg)
+{
+  return 0;
+}
+
+struct rxbench_case {
+  char *name;
+  int (*build)(int n,unsigned char *msg);
+  // Most allocations per message allowed, or -1 if the message may need servald
+  double allocation_budget;
+};
+
+struct rxbench_case rxbench_cases[]={
+  {"frame header only",build_nothing,0},
+  {"G generation ID",build_generation_id,0},
+  {"T timestamp",build_timestamp,0},
+  {"C capabilities",build_capabilities,0},
+  {"B BAR",build_bar,0},
+  {"A ack",build_ack,0},
+  {"M/m progress bitmap",build_progress_bitmap,0},
+  // status_log() keeps a copy of each request for the status page
+  {"R segment request",build_segment_request,1},
+  {"L bundle length",build_length,0},
+  {"S sync tree",build_sync,14},
+  // Each piece is copied into the partial's segment list
+  {"q body piece",build_piece,3.1},
+  {"q journal piece",build_journal_piece,2.1},
+  {"i compact piece",build_compact_piece,3.1},
+  {NULL,NULL,0}
+};
+
+static long long monotonic_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1000000000LL+ts.tv_nsec;
+}
+
+int rx_benchmark(int iterations)
+{
+  int failed=0;
+
+  // The handlers log a lot.  Send that to /dev/null, and keep the real
+  // stdout for the results.
+  fflush(stdout); fflush(stderr);
+  int saved_stdout=dup(1);
+  int saved_stderr=dup(2);
+  int devnull=open("/dev/null",O_WRONLY);
+  dup2(devnull,1); dup2(devnull,2);
+  close(devnull);
+
+  // Anything the handlers write goes in a scratch directory
+  char scratch_dir[]="/tmp/lbard-rxbench.XXXXXX";
+  char old_dir[1024];
+  if (!getcwd(old_dir,sizeof(old_dir))) old_dir[0]=0;
+  if (mkdtemp(scratch_dir)&&!chdir(scratch_dir)) {} else scratch_dir[0]=0;
+
+  // Same peer, bundles and sync exchange every run
+  srandom(1);
+  servald_stubbed=1;
+  register_test_bundles(RXBENCH_BUNDLES);
+
+  unsigned char frame[512];
+  for(int i=0;i<6;i++) frame[i]=sender_sid[i];
+  frame[6]=0; frame[7]=0;
+  saw_message(frame,8,-60,my_sid_hex,prefix,servald_server,credential);
+  struct peer_state *p=peer_records[peer_count-1];
+  record_sync_messages(p);
+
+  FILE *results=fdopen(dup(saved_stdout),"w");
+  FILE *status_page=fopen("/dev/null","w");
+  long long timer_overhead=monotonic_ns();
+  for(int i=0;i<1000;i++) monotonic_ns();
+  timer_overhead=(monotonic_ns()-timer_overhead)/1001;
+
+  fprintf(results,"Receive path: %d messages per type, %d bundles held,"
+	  " %d recorded sync messages, timer overhead %lldns\n",
+	  iterations,bundle_count,sync_message_count,timer_overhead);
+#ifndef COUNT_ALLOCATIONS
+  fprintf(results,"(allocations are only counted by lbard-rxbench, see \"make rxbench\")\n");
+#endif
+  fprintf(results,"%-20s %5s %8s %8s %8s %9s %10s %11s\n",
+	  "message","bytes","mean ns","p50 ns","p99 ns","max ns",
+	  "allocs/msg","servald/msg");
+
+  for(int c=0;rxbench_cases[c].name;c++) {
+    struct rxbench_case *t=&rxbench_cases[c];
+    struct latency_histogram h;
+    bzero(&h,sizeof(h));
+    long long bytes=0;
+    long long servald_requests=0;
+#ifdef COUNT_ALLOCATIONS
+    long long allocations=0;
+#endif
+
+    for(int n=0;n<RXBENCH_WARMUP+iterations;n++) {
+      // Between messages, do the untimed housekeeping that lbard would
+      if (t->build==build_sync&&!(n%sync_message_count))
+	sync_free_peer_state(sync_state,p);
+      if (!(n%256)) status_dump_bundlerx(status_page,NULL);
+      if (n==RXBENCH_WARMUP) servald_requests=servald_stubbed_requests;
+
+      int len=8+t->build(n,&frame[8]);
+      int msg_number=c*(RXBENCH_WARMUP+iterations)+n+1;
+      frame[6]=msg_number&0xff; frame[7]=(msg_number>>8)&0x7f;
+
+#ifdef COUNT_ALLOCATIONS
+      long long allocations_before=allocation_count;
+#endif
+      long long start=monotonic_ns();
+      saw_message(frame,len,-60,my_sid_hex,prefix,servald_server,credential);
+      long long elapsed=monotonic_ns()-start;
+      if (n<RXBENCH_WARMUP) continue;
+      latency_histogram_record(&h,elapsed);
+      bytes+=len-8;
+#ifdef COUNT_ALLOCATIONS
+      allocations+=allocation_count-allocations_before;
+#endif
+    }
+    servald_requests=servald_stubbed_requests-servald_requests;
+
+    char allocs[16]="-";
+#ifdef COUNT_ALLOCATIONS
+    snprintf(allocs,sizeof(allocs),"%.2f",allocations*1.0/iterations);
+#endif
+    fprintf(results,"%-20s %5lld %8lld %8lld %8lld %9lld %10s %11.2f",
+	    t->name,bytes/iterations,h.sum/h.count,
+	    latency_histogram_percentile(&h,50),
+	    latency_histogram_percentile(&h,99),
+	    h.max,allocs,servald_requests*1.0/iterations);
+
+    if (t->allocation_budget>=0) {
+      if (servald_requests) {
+	fprintf(results,"  FAIL: should not need servald");
+	failed++;
+      }
+#ifdef COUNT_ALLOCATIONS
+      if (allocations>t->allocation_budget*iterations) {
+	fprintf(results,"  FAIL: over budget of %.2f allocs/msg",t->allocation_budget);
+	failed++;
+      }
+#endif
+    }
+    fprintf(results,"\n");
+  }
+  fclose(results);
+  fclose(status_page);
+
+  servald_stubbed=0;
+  if (scratch_dir[0]) {
+    DIR *d=opendir(".");
+    struct dirent *de;
+    while(d&&(de=readdir(d))) if (de->d_name[0]!='.') unlink(de->d_name);
+    if (d) closedir(d);
+    if (!chdir(old_dir)) rmdir(scratch_dir);
+  }
+  fflush(stdout); fflush(stderr);
+  dup2(saved_stdout,1); dup2(saved_stderr,2);
+  close(saved_stdout); close(saved_stderr);
+
+  return failed?-1:0;
+}
@@ -41,6 +41,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include "sync.h"
 #include "lbard.h"
+#include "metrics.h"
 
 extern char *my_sid_hex;
 extern int my_time_stratum;
@@ -74,39 +75,48 @@ int saw_message(unsigned char *msg,int len,int rssi,char *my_sid,
   
   // Find or create peer structure for this.
   struct peer_state *p=NULL;
-  for(int i=0;i<peer_count;i++) {
-    if (!strcasecmp(peer_records[i]->sid_prefix,peer_prefix)) {
-      p=peer_records[i]; peer_index=i; break;
-    }
-  }
+  int sid_id=id_find(msg,ID_SID_PREFIX_BYTES);
+  peer_index=find_peer_by_id(sid_id);
+  if (peer_index>=0) p=peer_records[peer_index];
   
   if (!p) {
+    // (held by the peer record, until free_peer())
+    sid_id=id_intern(msg,ID_SID_PREFIX_BYTES);
     p=calloc(1,sizeof(struct peer_state));
     for(int i=0;i<4;i++) p->sid_prefix_bin[i]=msg[i];
+    p->sid_id=sid_id;
     p->sid_prefix=strdup(peer_prefix);
-    p->last_message_number=-1;
+    for(int i=0;i<MAX_RADIO_INTERFACES;i++) p->last_message_number[i]=-1;
     p->tx_bundle=-1;
     p->request_bitmap_bundle=-1;
     printf("Registering peer %s*\n",p->sid_prefix);
     if (peer_count<MAX_PEERS) {
-      peer_records[peer_count++]=p;      
+      peer_index=peer_count++;
     } else {
       // Peer table full.  Do random replacement.
       peer_index=random()%MAX_PEERS;
       free_peer(peer_records[peer_index]);
-      peer_records[peer_index]=p;
     }
+    peer_set_record(peer_index,p);
   }
   
   // Update time stamp and most recent message from peer
-  if (msg_number>p->last_message_number) {
+  int *last_message_number=&p->last_message_number[radio_interface->index];
+  if (msg_number>*last_message_number) {
     // We probably have missed packets.
     // But only count if gap is <256, since more than that probably means
     // something more profound has happened.
-    p->missed_packet_count+=msg_number-p->last_message_number-1;
+    p->missed_packet_count+=msg_number-*last_message_number-1;
+    if (*last_message_number>=0) {
+      metric_counter_add("lbard_peer_frames_missed_total",metric_peer_label(p->sid_prefix),
+			 msg_number-*last_message_number-1);
+      if (msg_number-*last_message_number<256)
+	radio_frames_missed+=msg_number-*last_message_number-1;
+    }
   }
-  p->last_message_time=time(0);
-  if (!is_retransmission) p->last_message_number=msg_number;
+  p->last_message_time=gettime_s();
+  p->interface_last_message_time[radio_interface->index]=p->last_message_time;
+  if (!is_retransmission) *last_message_number=msg_number;
 
   // Update RSSI log for this sender
   p->rssi_accumulator+=rssi;
@@ -114,6 +124,8 @@ int saw_message(unsigned char *msg,int len,int rssi,char *my_sid,
 
   // Log recently received packets, so that we can show RSSI history for received packets
   log_rssi(p,rssi);	 
+  metric_counter_add("lbard_peer_frames_received_total",metric_peer_label(p->sid_prefix),1);
+  metric_histogram_observe("lbard_peer_rssi",metric_peer_label(p->sid_prefix),rssi);
   
   while(offset<len) {
     if (debug_pieces||debug_message_pieces) {
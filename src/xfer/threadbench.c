@@ -0,0 +1,373 @@
+/*
+Serval Low-Bandwidth Rhizome Transport
+Copyright (C) 2018 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Threaded mode benchmark: how long it takes from a frame arriving on the
+  serial port until we answer it, while servald is slow to answer us.
+
+  A peer thread plays the RFD900, sending a frame from a neighbour every
+  50ms, in the radio's envelope, down one end of a socket pair, and reads
+  what we send back.  A fake servald answers every request after the given
+  delay.  In between, a loop in the shape of lbard's main loop handles
+  whatever arrives, answers each new frame from the neighbour with one
+  acknowledging it, and every 100ms primes the bundle cache with another
+  bundle, as the transmit path does.  This runs once in the main loop alone,
+  and once in threaded mode with the given number of servald workers.  The
+  latency is from the peer writing a frame to it reading the answer.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sync.h"
+#include "lbard.h"
+#include "radios.h"
+#include "fec-3.0.1/fixed.h"
+void encode_rs_8(data_t *data, data_t *parity,int pad);
+#define FEC_LENGTH 32
+#define FEC_MAX_BYTES 223
+
+extern int serialfd;
+extern unsigned char my_sid[32];
+extern char *my_sid_hex;
+extern char *servald_server;
+extern char *credential;
+
+#define THREADBENCH_BUNDLES 8
+#define THREADBENCH_BODY_BYTES 1000
+#define THREADBENCH_FRAME_INTERVAL_MS 50
+#define THREADBENCH_FETCH_INTERVAL_MS 100
+// How long the peer waits for the last answers
+#define THREADBENCH_DRAIN_MS 3000
+
+static int threadbench_servald_delay_ms=0;
+static long long threadbench_servald_requests=0;
+static unsigned char threadbench_peer_sid[6]={0xbe,0xbe,0xbe,0xbe,0xbe,0xbe};
+static int threadbench_next_msg_number=0;
+
+static void *threadbench_servald_connection(void *arg)
+{
+  int s=(intptr_t)arg;
+  char request[4096];
+  int len=0;
+  while(len<(int)sizeof(request)-1) {
+    int r=read(s,&request[len],sizeof(request)-1-len);
+    if (r<1) break;
+    len+=r;
+    request[len]=0;
+    if (strstr(request,"\n\n")||strstr(request,"\r\n\r\n")) break;
+  }
+  request[len]=0;
+  usleep(threadbench_servald_delay_ms*1000);
+
+  char path[1024]="";
+  sscanf(request,"GET %1000s",path);
+  char body[THREADBENCH_BODY_BYTES+1];
+  int body_len;
+  char *ext=strstr(path,".rhm");
+  if (ext&&(ext-path>=64)) {
+    char bid[65];
+    memcpy(bid,ext-64,64); bid[64]=0;
+    body_len=snprintf(body,sizeof(body),
+		      "id=%s\nversion=1\nfilesize=%d\nservice=file\n",
+		      bid,THREADBENCH_BODY_BYTES);
+  } else {
+    memset(body,'x',THREADBENCH_BODY_BYTES);
+    body_len=THREADBENCH_BODY_BYTES;
+  }
+  char header[256];
+  int header_len=snprintf(header,sizeof(header),
+			  "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n",body_len);
+  write_all(s,header,header_len);
+  write_all(s,body,body_len);
+  close(s);
+  __atomic_add_fetch(&threadbench_servald_requests,1,__ATOMIC_RELAXED);
+  return NULL;
+}
+
+// Each request on a thread of its own, as a loaded servald still answers
+// several at once
+static void *threadbench_servald(void *arg)
+{
+  int listen_socket=(intptr_t)arg;
+  while(1) {
+    int s=accept(listen_socket,NULL,NULL);
+    if (s<0) break;
+    pthread_t t;
+    if (pthread_create(&t,NULL,threadbench_servald_connection,(void *)(intptr_t)s))
+      close(s);
+    else pthread_detach(t);
+  }
+  return NULL;
+}
+
+struct threadbench_peer {
+  int fd;
+  int frames;
+  int first_msg_number;
+  long long *sent_us;
+  long long *latency_us;
+  int done;
+};
+
+static int threadbench_send_frame(int fd,int msg_number)
+{
+  // Header only: the neighbour's SID prefix and message number
+  unsigned char frame[8+FEC_LENGTH+9];
+  int len=0;
+  for(int i=0;i<6;i++) frame[len++]=threadbench_peer_sid[i];
+  frame[len++]=msg_number&0xff;
+  frame[len++]=(msg_number>>8)&0x7f;
+  encode_rs_8(frame,&frame[len],FEC_MAX_BYTES-len);
+  len+=FEC_LENGTH;
+  // The radio's CSMA envelope
+  unsigned char envelope[9]={0xaa,0x55,0xc0,0xc0,25,8+FEC_LENGTH,0x00,0x10,0x55};
+  memcpy(&frame[len],envelope,9);
+  len+=9;
+  return write_all(fd,frame,len);
+}
+
+// Find our answers in what we were sent, and time the frames they answer
+static int threadbench_read_answers(struct threadbench_peer *p,unsigned char *buf,int *buf_len)
+{
+  int r=read(p->fd,&buf[*buf_len],65536-*buf_len);
+  if (r>0) *buf_len+=r;
+  long long now=gettime_us();
+  while(1) {
+    unsigned char *start=memmem(buf,*buf_len,"C!C",3);
+    if (!start) {
+      if (*buf_len>2) { memmove(buf,&buf[*buf_len-2],2); *buf_len=2; }
+      return 0;
+    }
+    unsigned char *end=memmem(start+3,*buf_len-(start+3-buf),"!!",2);
+    if (!end) return 0;
+    unsigned char packet[512];
+    int len=0;
+    for(unsigned char *c=start+3;(c<end)&&(len<(int)sizeof(packet));c++) {
+      packet[len++]=*c;
+      if ((*c=='!')&&(c[1]=='.')) c++;
+    }
+    if (len>=10) {
+      int acked=packet[8]+(packet[9]<<8);
+      for(int i=0;i<p->frames;i++)
+	if ((p->first_msg_number+i<=acked)&&p->sent_us[i]&&(!p->latency_us[i]))
+	  p->latency_us[i]=now-p->sent_us[i];
+    }
+    int used=end+2-buf;
+    memmove(buf,&buf[used],*buf_len-used);
+    *buf_len-=used;
+  }
+}
+
+static void *threadbench_peer_main(void *arg)
+{
+  struct threadbench_peer *p=arg;
+  unsigned char *buf=malloc(65536);
+  int buf_len=0;
+  long long next_send=gettime_ms();
+  long long give_up=0;
+  for(int sent=0;;) {
+    long long now=gettime_ms();
+    if ((sent<p->frames)&&(now>=next_send)) {
+      p->sent_us[sent]=gettime_us();
+      threadbench_send_frame(p->fd,p->first_msg_number+sent);
+      sent++;
+      next_send+=THREADBENCH_FRAME_INTERVAL_MS;
+      if (sent==p->frames) give_up=now+THREADBENCH_DRAIN_MS;
+    }
+    if ((sent==p->frames)&&((now>=give_up)||p->latency_us[p->frames-1])) break;
+    struct pollfd pfd={.fd=p->fd,.events=POLLIN};
+    int wait=(sent<p->frames)?next_send-now:give_up-now;
+    if (wait<0) wait=0;
+    if (poll(&pfd,1,wait)>0) threadbench_read_answers(p,buf,&buf_len);
+  }
+  free(buf);
+  __atomic_store_n(&p->done,1,__ATOMIC_RELEASE);
+  return NULL;
+}
+
+static int threadbench_compare(const void *a,const void *b)
+{
+  long long x=*(const long long *)a,y=*(const long long *)b;
+  return (x>y)-(x<y);
+}
+
+static struct peer_state *threadbench_find_peer(void)
+{
+  int peer=find_peer_by_id(id_find(threadbench_peer_sid,ID_SID_PREFIX_BYTES));
+  if (peer<0) return NULL;
+  return peer_records[peer];
+}
+
+static int threadbench_run(int frames,int workers,int fd,FILE *out)
+{
+  struct threadbench_peer p;
+  bzero(&p,sizeof(p));
+  p.fd=fd;
+  p.frames=frames;
+  p.first_msg_number=threadbench_next_msg_number;
+  threadbench_next_msg_number+=frames;
+  p.sent_us=calloc(frames,sizeof(long long));
+  p.latency_us=calloc(frames,sizeof(long long));
+  if ((!p.sent_us)||(!p.latency_us)) return -1;
+
+  if (workers&&threads_start(workers)) return -1;
+  long long requests_before=__atomic_load_n(&threadbench_servald_requests,__ATOMIC_RELAXED);
+
+  pthread_t peer_thread;
+  if (pthread_create(&peer_thread,NULL,threadbench_peer_main,&p)) return -1;
+
+  struct peer_state *peer=NULL;
+  int answered=p.first_msg_number-1;
+  int my_msg_number=0;
+  int bundle=0;
+  long long next_fetch=gettime_ms();
+  while(!__atomic_load_n(&p.done,__ATOMIC_ACQUIRE)) {
+    if (workers) threads_poll();
+    if (!threads_reading_radio()) radio_read_bytes(serialfd,0);
+
+    if (!peer) peer=threadbench_find_peer();
+    if (peer&&(peer->last_message_number[0]>answered)) {
+      answered=peer->last_message_number[0];
+      unsigned char answer[10];
+      for(int i=0;i<6;i++) answer[i]=my_sid[i];
+      answer[6]=my_msg_number&0xff; answer[7]=(my_msg_number>>8)&0x7f;
+      my_msg_number++;
+      answer[8]=answered&0xff; answer[9]=(answered>>8)&0xff;
+      radio_send_message(serialfd,answer,sizeof(answer));
+    }
+
+    if (gettime_ms()>=next_fetch) {
+      prime_bundle_cache(bundle,my_sid_hex,servald_server,credential);
+      bundle=(bundle+1)%THREADBENCH_BUNDLES;
+      next_fetch=gettime_ms()+THREADBENCH_FETCH_INTERVAL_MS;
+    }
+
+    if (workers) threads_wait_us(10000);
+    else usleep(10000);
+  }
+  pthread_join(peer_thread,NULL);
+  if (workers) threads_stop();
+
+  long long latencies[frames];
+  int answered_frames=0;
+  for(int i=0;i<frames;i++)
+    if (p.latency_us[i]) latencies[answered_frames++]=p.latency_us[i];
+  qsort(latencies,answered_frames,sizeof(long long),threadbench_compare);
+  if (workers)
+    fprintf(out,"Threaded, %d servald worker%s:",workers,workers==1?"":"s");
+  else
+    fprintf(out,"Main loop only:");
+  fprintf(out," %d of %d frames answered",answered_frames,frames);
+  if (answered_frames)
+    fprintf(out,", latency p50 %.1fms, p90 %.1fms, p99 %.1fms, max %.1fms",
+	    latencies[answered_frames/2]/1000.0,
+	    latencies[answered_frames*9/10]/1000.0,
+	    latencies[answered_frames*99/100]/1000.0,
+	    latencies[answered_frames-1]/1000.0);
+  fprintf(out,"; %lld servald requests answered\n",
+	  __atomic_load_n(&threadbench_servald_requests,__ATOMIC_RELAXED)-requests_before);
+  free(p.sent_us);
+  free(p.latency_us);
+  return 0;
+}
+
+int thread_benchmark(int frames,int servald_delay_ms,int workers)
+{
+  if (frames<1) frames=1;
+  if (frames>30000) frames=30000;
+  if (workers<1) workers=1;
+  threadbench_servald_delay_ms=servald_delay_ms;
+
+  int listen_socket=socket(AF_INET,SOCK_STREAM,0);
+  struct sockaddr_in addr;
+  socklen_t addr_len=sizeof(addr);
+  bzero(&addr,sizeof(addr));
+  addr.sin_family=AF_INET;
+  addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+  if ((listen_socket<0)
+      ||bind(listen_socket,(struct sockaddr *)&addr,sizeof(addr))
+      ||listen(listen_socket,64)
+      ||getsockname(listen_socket,(struct sockaddr *)&addr,&addr_len)) {
+    perror("threadbench: fake servald");
+    return -1;
+  }
+  static char server[64];
+  snprintf(server,sizeof(server),"127.0.0.1:%d",ntohs(addr.sin_port));
+  servald_server=server;
+  pthread_t servald_thread;
+  if (pthread_create(&servald_thread,NULL,threadbench_servald,(void *)(intptr_t)listen_socket))
+    return -1;
+
+  // Our end of the serial port is an RFD900
+  int sv[2];
+  if (socketpair(AF_UNIX,SOCK_STREAM,0,sv)) { perror("socketpair"); return -1; }
+  serialfd=sv[0];
+  set_nonblock(serialfd);
+  for(int i=0;radio_types[i].name;i++)
+    if (!strcmp(radio_types[i].name,"rfd900")) radio_set_type(i);
+
+  // lbard logs a lot.  Send that to /dev/null, and keep the real stdout for
+  // the results.
+  fflush(stdout); fflush(stderr);
+  int saved_stdout=dup(1);
+  int saved_stderr=dup(2);
+  FILE *out=fdopen(dup(1),"w");
+  int devnull=open("/dev/null",O_WRONLY);
+  dup2(devnull,1); dup2(devnull,2);
+  close(devnull);
+
+  char bid[65],filehash[129],author[65],version[32];
+  for(int i=0;i<THREADBENCH_BUNDLES;i++) {
+    snprintf(bid,65,"%08X%056X",i*0x9e3779b1U,i);
+    snprintf(filehash,129,"%0128X",i);
+    snprintf(author,65,"%064X",i);
+    snprintf(version,32,"%d",1);
+    register_bundle("file",bid,version,author,"0",THREADBENCH_BODY_BYTES,filehash,
+		    author,"",NULL);
+  }
+
+  fprintf(out,"%d frames %dms apart, servald answering after %dms, a bundle fetched every %dms\n",
+	  frames,THREADBENCH_FRAME_INTERVAL_MS,servald_delay_ms,THREADBENCH_FETCH_INTERVAL_MS);
+  fflush(out);
+  int r=threadbench_run(frames,0,sv[1],out);
+  fflush(out);
+  if (!r) r=threadbench_run(frames,workers,sv[1],out);
+  fflush(out);
+
+  fflush(stdout); fflush(stderr);
+  dup2(saved_stdout,1); dup2(saved_stderr,2);
+  close(saved_stdout); close(saved_stderr);
+  shutdown(listen_socket,SHUT_RDWR);
+  close(listen_socket);
+  pthread_join(servald_thread,NULL);
+  fclose(out);
+  return r;
+}
@@ -0,0 +1,308 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2018 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Threaded mode (the threads option).  Normally everything happens in the
+  main loop, so a servald request that takes seconds stops us hearing the
+  radio, or answering it, for those seconds.  In threaded mode:
+
+  - The radio thread reads the serial port, and runs the driver's framing
+    and the FEC decode, handing each frame to the main loop on a single
+    producer queue.
+  - The main loop, now the protocol thread, handles the frames, and does
+    everything else it did before, except that fetching bundles to send
+    and inserting the bundles we receive are handed to...
+  - ...the servald workers, each with its own single producer queue of
+    requests, which answer the main loop on one multiple producer queue.
+
+  The drivers were written for one thread, so the radio thread holds
+  radio_lock() while it reads, and the main loop takes it to run the
+  driver's service loop and to send, and to look at what the driver keeps
+  (e.g., the radio temperature).  Neither holds it for long.  Only one
+  radio, on a real clock, is supported this way.
+
+  Only the RFD900 driver stops at framing: the HF drivers reassemble
+  frames, answer bursts and track peers as they parse what the radio says,
+  all of which belongs to the main loop.  So with any other radio, only the
+  servald workers are started, and the main loop reads the radio as before.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+
+#include "sync.h"
+#include "lbard.h"
+#include "queue.h"
+#include "threads.h"
+#include "virtualtime.h"
+#include "radios.h"
+
+extern int serialfd;
+extern unsigned char my_sid[32];
+extern char *my_sid_hex;
+extern char *servald_server;
+extern char *credential;
+extern char *prefix;
+
+#define THREADS_RX_FRAMES 256
+#define THREADS_SERVALD_JOBS 16
+#define THREADS_RX_FRAME_BYTES 256
+
+int lbard_threads=0;
+
+struct threads_rx_frame {
+  int len;
+  int rssi;
+  int rs_errors;
+  unsigned char data[THREADS_RX_FRAME_BYTES];
+};
+
+struct servald_worker {
+  pthread_t thread;
+  sem_t wake;
+  struct spsc_queue jobs;
+};
+
+static int threads_running=0;
+static int threads_stopping=0;
+// (recursive, as some drivers send from their service loops)
+static pthread_mutex_t radio_mutex;
+static int radio_thread_running=0;
+static pthread_t radio_thread;
+static struct spsc_queue rx_frames;
+static long long rx_frames_dropped=0;
+
+static struct servald_worker servald_workers[THREADS_MAX_SERVALD_WORKERS];
+static int servald_worker_count=0;
+static int servald_next_worker=0;
+static struct mpsc_queue servald_done;
+
+// Frames, and answers from servald, wake the main loop early
+static sem_t main_loop_wake;
+
+#define THREAD_MAIN 0
+#define THREAD_RADIO 1
+#define THREAD_SERVALD 2
+static __thread int thread_role=THREAD_MAIN;
+
+int threads_on_radio_thread(void) { return thread_role==THREAD_RADIO; }
+int threads_reading_radio(void) { return radio_thread_running; }
+int threads_on_servald_worker(void) { return thread_role==THREAD_SERVALD; }
+
+// Whether a servald request from here should go to a worker
+int threads_servald_async(void)
+{
+  return servald_worker_count&&(thread_role==THREAD_MAIN);
+}
+
+int radio_lock(void)
+{
+  if (threads_running) pthread_mutex_lock(&radio_mutex);
+  return 0;
+}
+
+int radio_unlock(void)
+{
+  if (threads_running) pthread_mutex_unlock(&radio_mutex);
+  return 0;
+}
+
+long long threads_frames_dropped(void)
+{
+  return __atomic_load_n(&rx_frames_dropped,__ATOMIC_RELAXED);
+}
+
+static void *radio_thread_main(void *arg)
+{
+  thread_role=THREAD_RADIO;
+  while(!__atomic_load_n(&threads_stopping,__ATOMIC_ACQUIRE)) {
+    struct pollfd pfd={.fd=serialfd,.events=POLLIN};
+    if (poll(&pfd,1,10)<1) continue;
+    radio_lock();
+    radio_read_bytes(serialfd,0);
+    radio_unlock();
+  }
+  return NULL;
+}
+
+// Called on the radio thread by saw_packet(), once the FEC is checked
+int threads_queue_frame(unsigned char *packet,int len,int rssi,int rs_errors)
+{
+  struct threads_rx_frame f;
+  if ((len<0)||(len>THREADS_RX_FRAME_BYTES)) return -1;
+  f.len=len;
+  f.rssi=rssi;
+  f.rs_errors=rs_errors;
+  memcpy(f.data,packet,len);
+  if (spsc_queue_push(&rx_frames,&f)) {
+    // The main loop is badly behind: the frame is lost, as it would have
+    // been in the serial buffer
+    __atomic_add_fetch(&rx_frames_dropped,1,__ATOMIC_RELAXED);
+    return -1;
+  }
+  sem_post(&main_loop_wake);
+  return 0;
+}
+
+static void *servald_worker_main(void *arg)
+{
+  struct servald_worker *w=arg;
+  thread_role=THREAD_SERVALD;
+  while(!__atomic_load_n(&threads_stopping,__ATOMIC_ACQUIRE)) {
+    sem_wait(&w->wake);
+    struct servald_job *job;
+    while(!spsc_queue_pop(&w->jobs,&job)) {
+      job->result=job->run(job);
+      // (there is a slot for every job that can be in flight)
+      while(mpsc_queue_push(&servald_done,&job)) usleep(1000);
+      sem_post(&main_loop_wake);
+    }
+  }
+  return NULL;
+}
+
+// Returns -1 if every worker has a full queue, in which case the caller
+// still owns the job
+int servald_submit(struct servald_job *job)
+{
+  for(int i=0;i<servald_worker_count;i++) {
+    struct servald_worker *w=&servald_workers[(servald_next_worker+i)%servald_worker_count];
+    if (!spsc_queue_push(&w->jobs,&job)) {
+      servald_next_worker=(servald_next_worker+i+1)%servald_worker_count;
+      sem_post(&w->wake);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// The main loop's share of the work the other threads hand it
+int threads_poll(void)
+{
+  if (!threads_running) return 0;
+  struct threads_rx_frame f;
+  while(!spsc_queue_pop(&rx_frames,&f))
+    saw_decoded_packet(f.data,f.len,f.rssi,f.rs_errors,
+		       my_sid_hex,prefix,servald_server,credential);
+  struct servald_job *job;
+  while(!mpsc_queue_pop(&servald_done,&job))
+    job->done(job);
+  return 0;
+}
+
+// In place of the main loop's sleep
+int threads_wait_us(long long duration_us)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME,&ts);
+  ts.tv_nsec+=(duration_us%1000000)*1000;
+  ts.tv_sec+=duration_us/1000000+ts.tv_nsec/1000000000;
+  ts.tv_nsec%=1000000000;
+  while(sem_timedwait(&main_loop_wake,&ts)&&(errno==EINTR)) continue;
+  // One wake up is enough for everything waiting
+  while(!sem_trywait(&main_loop_wake)) continue;
+  return 0;
+}
+
+int threads_start(int workers)
+{
+  if (threads_running) return 0;
+  if (radio_interface_count>1) {
+    fprintf(stderr,"Threaded mode supports only one radio.\n");
+    return -1;
+  }
+  if (virtual_clock) {
+    fprintf(stderr,"Threaded mode cannot run on a virtual clock.\n");
+    return -1;
+  }
+  if (workers<0) workers=0;
+  if (workers>THREADS_MAX_SERVALD_WORKERS) workers=THREADS_MAX_SERVALD_WORKERS;
+
+  __atomic_store_n(&threads_stopping,0,__ATOMIC_RELEASE);
+  if (spsc_queue_init(&rx_frames,THREADS_RX_FRAMES,sizeof(struct threads_rx_frame)))
+    return -1;
+  if (mpsc_queue_init(&servald_done,(workers?workers:1)*THREADS_SERVALD_JOBS,
+		      sizeof(struct servald_job *)))
+    return -1;
+  sem_init(&main_loop_wake,0,0);
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr,PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&radio_mutex,&attr);
+  pthread_mutexattr_destroy(&attr);
+
+  // The radio lock is taken from here on
+  threads_running=1;
+  if (radio_get_type()==RADIOTYPE_RFD900) {
+    if (pthread_create(&radio_thread,NULL,radio_thread_main,NULL)) {
+      perror("pthread_create");
+      threads_running=0;
+      pthread_mutex_destroy(&radio_mutex);
+      return -1;
+    }
+    radio_thread_running=1;
+  }
+  for(int i=0;i<workers;i++) {
+    struct servald_worker *w=&servald_workers[i];
+    if (spsc_queue_init(&w->jobs,THREADS_SERVALD_JOBS,sizeof(struct servald_job *)))
+      break;
+    sem_init(&w->wake,0,0);
+    if (pthread_create(&w->thread,NULL,servald_worker_main,w)) {
+      perror("pthread_create");
+      break;
+    }
+    servald_worker_count++;
+  }
+  fprintf(stderr,"Threaded mode: %s%d servald worker(s) running.\n",
+	  radio_thread_running?"radio thread and ":"",servald_worker_count);
+  return 0;
+}
+
+// Waits for the workers to finish what they have, and hands the main loop
+// everything still queued for it
+int threads_stop(void)
+{
+  if (!threads_running) return 0;
+  __atomic_store_n(&threads_stopping,1,__ATOMIC_RELEASE);
+  if (radio_thread_running) pthread_join(radio_thread,NULL);
+  radio_thread_running=0;
+  for(int i=0;i<servald_worker_count;i++) {
+    sem_post(&servald_workers[i].wake);
+    pthread_join(servald_workers[i].thread,NULL);
+    spsc_queue_free(&servald_workers[i].jobs);
+    sem_destroy(&servald_workers[i].wake);
+  }
+  threads_poll();
+  servald_worker_count=0;
+  threads_running=0;
+  spsc_queue_free(&rx_frames);
+  mpsc_queue_free(&servald_done);
+  sem_destroy(&main_loop_wake);
+  pthread_mutex_destroy(&radio_mutex);
+  return 0;
+}
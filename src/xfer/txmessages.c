@@ -189,8 +189,14 @@ int update_my_message(int serialfd,
      Basically we need to iterate through the peers and pick who to respond to.
      We also need the sequence numbers to be recipient specific.
   */
-  sync_by_tree_stuff_packet(&offset,mtu,msg_out,
+  // Occasionally keep room to tell our peers what we can do.  It has to go
+  // at the end (see append_capabilities()), but will also fit there whenever
+  // the packet has space left over.
+  int capabilities_room=(!(random()%10))?CAPABILITIES_LEN:0;
+  sync_by_tree_stuff_packet(&offset,mtu-capabilities_room,msg_out,
 			    my_sid_hex,servald_server,credential);
+  if ((mtu-offset)>=CAPABILITIES_LEN)
+    append_capabilities(msg_out,&offset);
 #endif
 
   // Increment message counter
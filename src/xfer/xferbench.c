@@ -0,0 +1,294 @@
+/*
+Serval Low-Bandwidth Rhizome Transport
+Copyright (C) 2015 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Bundle transfer benchmark.  One process plays both ends of a transfer of a
+  single large bundle over a lossy link: the sender builds its packets with
+  sync_announce_bundle_piece(), the receiver handles them with saw_message(),
+  and the receiver's progress reports (ACKs and bitmaps) go back the other
+  way.  Each packet in either direction is lost with the given probability.
+
+  The two ends share lbard's global state, so we switch our SID for each
+  role, and hide the bundle from the receiver while it is handling a packet.
+  The result is the number of body bytes sent compared with the number the
+  receiver needed, how many of the bytes that arrived it already had, and
+  how many bytes went on piece headers (including piece slot bindings).
+
+  With journal_held set, the bundle is a journal, and the receiver already
+  has its first journal_held bytes as an older version: while the receiver
+  is handling a packet, that older version takes the new one's slot.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include "sync.h"
+#include "lbard.h"
+
+extern int servald_stubbed;
+
+#define XFERBENCH_MAX_PACKETS 200000
+
+static unsigned char sender_sid[32];
+static unsigned char receiver_sid[32];
+static char sender_sid_hex[65];
+static char receiver_sid_hex[65];
+
+static void xferbench_become(unsigned char *sid,char *sid_hex)
+{
+  bcopy(sid,my_sid,32);
+  my_sid_hex=sid_hex;
+}
+
+static int xferbench_partial_exists(char *bid_hex)
+{
+  int bid_id=id_find_hex(bid_hex,ID_BID_PREFIX_BYTES);
+  for(int i=0;i<MAX_BUNDLES_IN_FLIGHT;i++)
+    if (bid_id&&(partials[i].bid_id==bid_id))
+      return 1;
+  return 0;
+}
+
+/*
+  Count the body bytes in a packet, and how many of them the receiver already
+  holds, marking them as held if the packet is going to arrive.
+*/
+static int xferbench_account_pieces(unsigned char *msg,int len,unsigned char *held,
+				    int delivered,long long *sent,long long *duplicates,
+				    long long *headers)
+{
+  int offset=8;
+  while(offset<len) {
+    int type=msg[offset];
+    if (type=='L') { offset+=1+8+8+4; continue; }
+    if (type=='K') {
+      (*headers)+=PIECE_SLOT_BINDING_LEN;
+      offset+=PIECE_SLOT_BINDING_LEN;
+      continue;
+    }
+    int compact=(type=='h'||type=='i'||type=='H'||type=='I');
+    if ((!compact)&&type!='p'&&type!='q'&&type!='P'&&type!='Q') break;
+    int above_1mb=!(type&0x20);
+    int header_len=compact?COMPACT_PIECE_HEADER_LEN:PIECE_HEADER_LEN;
+    long long offset_compound=0;
+    for(int i=0;i<(above_1mb?6:4);i++)
+      offset_compound|=((long long)msg[offset+header_len-4+i])<<(i*8LL);
+    if (above_1mb) header_len+=2;
+    (*headers)+=header_len;
+    long long piece_offset=(offset_compound&0xfffff)|((offset_compound>>12LL)&0xfff00000LL);
+    int piece_bytes=(offset_compound>>20)&0x7ff;
+    int is_manifest=offset_compound&0x80000000;
+    if (!is_manifest) {
+      (*sent)+=piece_bytes;
+      if (delivered)
+	for(int i=0;i<piece_bytes;i++) {
+	  if (held[piece_offset+i]) (*duplicates)++;
+	  held[piece_offset+i]=1;
+	}
+    }
+    offset+=header_len+piece_bytes;
+  }
+  return 0;
+}
+
+static int xferbench_run(int body_len,int loss_percent,int journal_held,
+			 long long *packets,long long *sent,long long *duplicates,
+			 long long *headers)
+{
+  char bid[65];
+  for(int i=0;i<32;i++) snprintf(&bid[i*2],3,"%02X",(unsigned char)random());
+
+  // The sender holds the bundle, and has it in the bundle cache already
+  xferbench_become(sender_sid,sender_sid_hex);
+  // Each run's bundle lands in the same slot, so give it a new version, as
+  // a new version of a real bundle would have.
+  // (A journal's version is its length.)
+  static long long file_version=1600000000000LL;
+  long long version=journal_held?body_len:++file_version;
+  char version_string[32];
+  snprintf(version_string,sizeof(version_string),"%lld",version);
+  char filehash[129];
+  snprintf(filehash,129,"%0128X",body_len);
+  register_bundle("file",bid,version_string,sender_sid_hex,"1",body_len,filehash,
+		  sender_sid_hex,"",NULL);
+  int bundle=bundle_count-1;
+  struct bundle_record old_version=bundles[bundle];
+  old_version.version=journal_held;
+  old_version.length=journal_held;
+
+  char manifest[1024];
+  int manifest_len=snprintf(manifest,1024,
+			    "service=file\nversion=%lld\nfilesize=%d\n"
+			    "filehash=%s\nname=xferbench\nid=%s\ncrypt=0\n",
+			    version,body_len,filehash,bid);
+  cached_bid_id=bundles[bundle].bid_id;
+  cached_version=bundles[bundle].version;
+  free(cached_manifest_encoded); cached_manifest_encoded=malloc(1024);
+  if (manifest_text_to_binary((unsigned char *)manifest,manifest_len,
+			      cached_manifest_encoded,&cached_manifest_encoded_len)) {
+    bcopy(manifest,cached_manifest_encoded,manifest_len);
+    cached_manifest_encoded_len=manifest_len;
+  }
+  free(cached_body); cached_body=malloc(body_len);
+  for(int i=0;i<body_len;i++) cached_body[i]=random();
+  cached_body_len=body_len;
+  bundle_cache_choose_body_codec(bundle);
+
+  unsigned char msg[LINK_MTU];
+  unsigned char *held=calloc(body_len,1);
+  memset(held,1,journal_held);
+  int started=0;
+
+  // Introduce the receiver, and queue the bundle to send to it
+  bzero(msg,8); bcopy(receiver_sid,msg,6);
+  saw_message(msg,8,-60,my_sid_hex,prefix,servald_server,credential);
+  char receiver_prefix[6*2+1];
+  snprintf(receiver_prefix,sizeof(receiver_prefix),"%.12s",receiver_sid_hex);
+  int peer=find_peer_by_prefix(receiver_prefix);
+  struct peer_state *p=peer_records[peer];
+  // Both ends are as current as each other.  (Both have peer records, as
+  // each end hears the other.)
+  p->capabilities=MY_CAPABILITIES;
+  bzero(msg,8); bcopy(sender_sid,msg,6);
+  saw_message(msg,8,-60,my_sid_hex,prefix,servald_server,credential);
+  char sender_prefix[6*2+1];
+  snprintf(sender_prefix,sizeof(sender_prefix),"%.12s",sender_sid_hex);
+  peer_records[find_peer_by_prefix(sender_prefix)]->capabilities=MY_CAPABILITIES;
+  p->tx_bundle=bundle;
+  p->tx_bundle_manifest_offset=0;
+  p->tx_bundle_body_offset=0;
+  p->tx_bundle_manifest_offset_hard_lower_bound=0;
+  p->tx_bundle_body_offset_hard_lower_bound=0;
+
+  for(*packets=0;*packets<XFERBENCH_MAX_PACKETS;(*packets)++) {
+    // Sender's turn
+    xferbench_become(sender_sid,sender_sid_hex);
+    int len=8;
+    bcopy(sender_sid,msg,6);
+    msg[6]=(*packets)&0xff; msg[7]=((*packets)>>8)&0x7f;
+    sync_announce_bundle_piece(peer,&len,LINK_MTU,msg,sender_sid_hex,
+			       servald_server,credential);
+    int delivered=(random()%100)>=loss_percent;
+    xferbench_account_pieces(msg,len,held,delivered,sent,duplicates,headers);
+    if (delivered) {
+      xferbench_become(receiver_sid,receiver_sid_hex);
+      int saved_bundle_count=bundle_count;
+      struct bundle_record new_version=bundles[bundle];
+      if (journal_held) {
+	bundles[bundle]=old_version;
+	bundle_count=bundle+1;
+      } else
+	bundle_count=0;
+      saw_message(msg,len,-60,my_sid_hex,prefix,servald_server,credential);
+      bundles[bundle]=new_version;
+      bundle_count=saved_bundle_count;
+      if (xferbench_partial_exists(bid)) started=1;
+      else if (started) break;
+    }
+
+    // Receiver's turn: send any progress reports it has queued
+    len=8;
+    bcopy(receiver_sid,msg,6);
+    msg[6]=(*packets)&0xff; msg[7]=((*packets)>>8)&0x7f;
+    while (report_queue_length&&(len<(LINK_MTU-MAX_REPORT_LEN))) {
+      report_queue_length--;
+      append_bytes(&len,LINK_MTU,msg,report_queue[report_queue_length],
+		   report_lengths[report_queue_length]);
+      free(report_queue_message[report_queue_length]);
+      report_queue_message[report_queue_length]=NULL;
+    }
+    if (len>8&&(random()%100)>=loss_percent) {
+      xferbench_become(sender_sid,sender_sid_hex);
+      saw_message(msg,len,-60,my_sid_hex,prefix,servald_server,credential);
+    }
+  }
+  free(held);
+
+  // Forget the bundle, so that the next run starts afresh
+  p->tx_bundle=-1;
+  bundle_count--;
+  return started&&!xferbench_partial_exists(bid)?0:-1;
+}
+
+int xfer_benchmark(int body_len,int loss_percent,int runs,int journal_held)
+{
+  if (journal_held<0||journal_held>=body_len) journal_held=0;
+  for(int i=0;i<32;i++) { sender_sid[i]=0x11+i; receiver_sid[i]=0x22+i; }
+  for(int i=0;i<32;i++) {
+    snprintf(&sender_sid_hex[i*2],3,"%02x",sender_sid[i]);
+    snprintf(&receiver_sid_hex[i*2],3,"%02x",receiver_sid[i]);
+  }
+  prefix="";
+
+  // The transfer logs every piece.  Send that to /dev/null.
+  fflush(stdout); fflush(stderr);
+  int saved_stdout=dup(1);
+  int saved_stderr=dup(2);
+  int devnull=open("/dev/null",O_WRONLY);
+  dup2(devnull,1); dup2(devnull,2);
+  close(devnull);
+  FILE *results=fdopen(dup(saved_stdout),"w");
+
+  srandom(1);
+  servald_stubbed=1;
+  if (journal_held)
+    fprintf(results,"Transfer of a %d byte journal to a receiver with the first %d bytes,"
+	    " %d%% packet loss in each direction, %d runs\n",
+	    body_len,journal_held,loss_percent,runs);
+  else
+    fprintf(results,"Transfer of a %d byte bundle, %d%% packet loss in each direction, %d runs\n",
+	    body_len,loss_percent,runs);
+  int needed=body_len-journal_held;
+  fprintf(results,"%4s %8s %12s %10s %12s %10s %12s %10s\n",
+	  "run","packets","body sent","sent/need","duplicates","dup/need",
+	  "header bytes","hdr/sent");
+  long long total_sent=0,total_duplicates=0,total_packets=0,total_headers=0;
+  int failed=0;
+  for(int run=0;run<runs;run++) {
+    long long packets=0,sent=0,duplicates=0,headers=0;
+    int result=xferbench_run(body_len,loss_percent,journal_held,
+			     &packets,&sent,&duplicates,&headers);
+    fprintf(results,"%4d %8lld %12lld %10.3f %12lld %10.3f %12lld %10.3f%s\n",
+	    run,packets,sent,sent*1.0/needed,duplicates,duplicates*1.0/needed,
+	    headers,headers*1.0/sent,
+	    result?"  (did not complete)":"");
+    if (result) failed++;
+    total_sent+=sent; total_duplicates+=duplicates; total_packets+=packets;
+    total_headers+=headers;
+  }
+  fprintf(results,"mean %8lld %12lld %10.3f %12lld %10.3f %12lld %10.3f\n",
+	  total_packets/runs,total_sent/runs,total_sent*1.0/runs/needed,
+	  total_duplicates/runs,total_duplicates*1.0/runs/needed,
+	  total_headers/runs,total_headers*1.0/total_sent);
+  fprintf(results,"(a perfect sender would send %.3f times what is needed, with no duplicates)\n",
+	  100.0/(100-loss_percent));
+  fclose(results);
+  servald_stubbed=0;
+
+  fflush(stdout); fflush(stderr);
+  dup2(saved_stdout,1); dup2(saved_stderr,2);
+  close(saved_stdout); close(saved_stderr);
+  return failed?-1:0;
+}